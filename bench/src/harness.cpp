@@ -0,0 +1,97 @@
+//-----------------------------------------------------------------------------
+// Copyright 2024 Igor Spichkin
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//-----------------------------------------------------------------------------
+
+#include "harness.hpp"
+#include <atomic>
+#include <cstdlib>
+#include <format>
+#include <iostream>
+#include <new>
+
+namespace
+{
+
+std::atomic<uint64_t> gAllocations = 0;
+
+void* Allocate( const size_t size )
+{
+    gAllocations.fetch_add( 1, std::memory_order_relaxed );
+
+    if ( auto* ptr = std::malloc( size == 0 ? 1 : size ) )
+    {
+        return ptr;
+    }
+
+    throw std::bad_alloc{};
+}
+
+} // namespace
+
+// Counts allocations of the whole process, the benchmarks run on one thread.
+void* operator new( const size_t size )
+{
+    return Allocate( size );
+}
+
+void* operator new[]( const size_t size )
+{
+    return Allocate( size );
+}
+
+void operator delete( void* ptr ) noexcept
+{
+    std::free( ptr );
+}
+
+void operator delete[]( void* ptr ) noexcept
+{
+    std::free( ptr );
+}
+
+void operator delete( void* ptr, size_t ) noexcept
+{
+    std::free( ptr );
+}
+
+void operator delete[]( void* ptr, size_t ) noexcept
+{
+    std::free( ptr );
+}
+
+namespace btbench
+{
+
+uint64_t Allocations() noexcept
+{
+    return gAllocations.load( std::memory_order_relaxed );
+}
+
+void PrintHeader() noexcept
+{
+    std::cout << std::format( "{:<32} {:>6} {:>12} {:>12} {:>10}\n",
+                              "benchmark", "size", "ns/op", "MB/s",
+                              "allocs/op" );
+}
+
+void PrintResult( const std::string& name, const size_t size,
+                  const Result& result ) noexcept
+{
+    std::cout << std::format( "{:<32} {:>6} {:>12.1f} {:>12.1f} {:>10.2f}\n",
+                              name, size, result.mNsPerOp,
+                              result.mBytesPerSecond / 1e6,
+                              result.mAllocationsPerOp );
+}
+
+} // namespace btbench
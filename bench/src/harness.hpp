@@ -0,0 +1,109 @@
+//-----------------------------------------------------------------------------
+// Copyright 2024 Igor Spichkin
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//-----------------------------------------------------------------------------
+
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <string>
+
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+
+namespace btbench
+{
+
+using Clock = std::chrono::steady_clock;
+
+struct Result final
+{
+    uint64_t mIterations = 0;
+    double mNsPerOp = 0;
+    double mBytesPerSecond = 0;
+    double mAllocationsPerOp = 0;
+};
+
+/// \returns how many times the global `operator new` was called so far.
+[[nodiscard]] uint64_t Allocations() noexcept;
+
+/// Keeps the compiler from optimizing away the computation of `value`.
+template <typename T> inline void DoNotOptimize( const T& value ) noexcept
+{
+#ifdef _MSC_VER
+    static const void* volatile sink;
+    sink = &value;
+    _ReadWriteBarrier();
+#else
+    asm volatile( "" : : "r,m"( value ) : "memory" );
+#endif
+}
+
+/// Runs `body` in growing batches until one batch takes at least `minTime`
+/// and reports that batch.
+/// \param bytes how many bytes one call of `body` processes.
+template <typename Body>
+[[nodiscard]] Result Measure( Body&& body, const size_t bytes,
+                              const std::chrono::nanoseconds minTime ) noexcept
+{
+    uint64_t iterations = 1;
+
+    while ( true )
+    {
+        const auto allocations = Allocations();
+        const auto start = Clock::now();
+
+        for ( uint64_t i = 0; i < iterations; i++ )
+        {
+            body();
+        }
+
+        const auto elapsed = Clock::now() - start;
+
+        if ( elapsed >= minTime )
+        {
+            const auto ns =
+                std::chrono::duration<double, std::nano>( elapsed ).count() /
+                static_cast<double>( iterations );
+
+            return Result{
+                .mIterations = iterations,
+                .mNsPerOp = ns,
+                .mBytesPerSecond = static_cast<double>( bytes ) * 1e9 / ns,
+                .mAllocationsPerOp =
+                    static_cast<double>( Allocations() - allocations ) /
+                    static_cast<double>( iterations ) };
+        }
+
+        // Aim a bit past `minTime`, but don't trust very short batches.
+        const auto scale = elapsed.count() == 0
+                               ? 10.0
+                               : 1.2 * static_cast<double>( minTime.count() ) /
+                                     static_cast<double>( elapsed.count() );
+
+        iterations = static_cast<uint64_t>(
+            static_cast<double>( iterations ) *
+            std::clamp( scale, 2.0, 10.0 ) );
+    }
+}
+
+/// Prints the header of the report table.
+void PrintHeader() noexcept;
+
+void PrintResult( const std::string& name, size_t size,
+                  const Result& result ) noexcept;
+
+} // namespace btbench
@@ -0,0 +1,543 @@
+//-----------------------------------------------------------------------------
+// Copyright 2024 Igor Spichkin
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//-----------------------------------------------------------------------------
+
+#include "bt/bt.hpp"
+#include "harness.hpp"
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <functional>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+struct Benchmark final
+{
+    std::string mName;
+    /// The payload size.
+    size_t mSize;
+    std::function<btbench::Result( std::chrono::nanoseconds )> mRun;
+};
+
+/// Payload sizes, from a short topic to the longest one `encode` accepts.
+inline constexpr std::array<uint16_t, 6> sizes_v{ 8,    64,   512,
+                                                  4096, 16384, 65529 };
+
+[[nodiscard]] std::string Payload( const size_t size )
+{
+    std::string payload( size, 'a' );
+
+    for ( size_t i = 0; i < size; i++ )
+    {
+        payload[i] = static_cast<char>( 'a' + i % 26 );
+    }
+
+    return payload;
+}
+
+void AddEncodeBenchmarks( std::vector<Benchmark>& benchmarks,
+                          const size_t size )
+{
+    // The payloads are shared by the closures and live until the end.
+    const auto payload = std::make_shared<const std::string>( Payload( size ) );
+
+    benchmarks.push_back(
+        { "encode(ptr, len)", size,
+          [payload]( const std::chrono::nanoseconds minTime )
+          {
+              return btbench::Measure(
+                  [&]
+                  {
+                      btbench::DoNotOptimize(
+                          bt::encode( payload->data(), payload->size() ) );
+                  },
+                  payload->size(), minTime );
+          } } );
+
+    benchmarks.push_back(
+        { "encode(range)", size,
+          [payload]( const std::chrono::nanoseconds minTime )
+          {
+              const std::string_view view{ *payload };
+
+              return btbench::Measure(
+                  [&] { btbench::DoNotOptimize( bt::encode( view ) ); },
+                  payload->size(), minTime );
+          } } );
+
+    benchmarks.push_back(
+        { "encode(c-string)", size,
+          [payload]( const std::chrono::nanoseconds minTime )
+          {
+              return btbench::Measure(
+                  [&]
+                  { btbench::DoNotOptimize( bt::encode( payload->c_str() ) ); },
+                  payload->size(), minTime );
+          } } );
+
+    benchmarks.push_back(
+        { "encode_into(ptr, len)", size,
+          [payload]( const std::chrono::nanoseconds minTime )
+          {
+              std::vector<char> buffer( bt::encoded_size( payload->size() ) );
+
+              return btbench::Measure(
+                  [&]
+                  {
+                      btbench::DoNotOptimize( bt::encode_into(
+                          buffer, payload->data(), payload->size() ) );
+                      btbench::DoNotOptimize( buffer );
+                  },
+                  payload->size(), minTime );
+          } } );
+}
+
+/// Topics in one sweep of the batch benchmarks.
+inline constexpr size_t batch_size_v = 1000;
+
+void AddBatchBenchmarks( std::vector<Benchmark>& benchmarks,
+                         const size_t size )
+{
+    const auto payload = std::make_shared<const std::string>( Payload( size ) );
+    const auto bytes = payload->size() * batch_size_v;
+
+    benchmarks.push_back(
+        { "encode(x1000)", size,
+          [payload, bytes]( const std::chrono::nanoseconds minTime )
+          {
+              std::vector<std::vector<char>> packets;
+              packets.reserve( batch_size_v );
+
+              return btbench::Measure(
+                  [&]
+                  {
+                      packets.clear();
+
+                      for ( size_t i = 0; i < batch_size_v; i++ )
+                      {
+                          packets.push_back(
+                              bt::encode( payload->data(), payload->size() )
+                                  .second );
+                      }
+
+                      btbench::DoNotOptimize( packets );
+                  },
+                  bytes, minTime );
+          } } );
+
+    benchmarks.push_back(
+        { "EncodedBatch(x1000)", size,
+          [payload, bytes]( const std::chrono::nanoseconds minTime )
+          {
+              bt::EncodedBatch batch;
+
+              return btbench::Measure(
+                  [&]
+                  {
+                      batch.reset();
+
+                      for ( size_t i = 0; i < batch_size_v; i++ )
+                      {
+                          btbench::DoNotOptimize( batch.add(
+                              payload->data(), payload->size() ) );
+                      }
+
+                      btbench::DoNotOptimize( batch );
+                  },
+                  bytes, minTime );
+          } } );
+}
+
+template <uint16_t Size>
+void AddEncodeArrayBenchmarks( std::vector<Benchmark>& benchmarks )
+{
+    static const auto payload = Payload( Size );
+
+    // Same as a string literal of `Size` characters.
+    static char literal[Size + 1]{};
+    std::copy_n( payload.data(), Size, literal );
+
+    static const auto array = []
+    {
+        std::array<char, Size> result{};
+        std::copy_n( payload.data(), Size, result.data() );
+
+        return result;
+    }();
+
+    benchmarks.push_back(
+        { "encode_array<N>(ptr)", Size,
+          []( const std::chrono::nanoseconds minTime )
+          {
+              return btbench::Measure(
+                  []
+                  {
+                      btbench::DoNotOptimize(
+                          bt::encode_array<Size>( payload.data() ) );
+                  },
+                  Size, minTime );
+          } } );
+
+    benchmarks.push_back(
+        { "encode_array(char[N])", Size,
+          []( const std::chrono::nanoseconds minTime )
+          {
+              return btbench::Measure(
+                  [] { btbench::DoNotOptimize( bt::encode_array( literal ) ); },
+                  Size, minTime );
+          } } );
+
+    benchmarks.push_back(
+        { "encode_array(std::array)", Size,
+          []( const std::chrono::nanoseconds minTime )
+          {
+              return btbench::Measure(
+                  [] { btbench::DoNotOptimize( bt::encode_array( array ) ); },
+                  Size, minTime );
+          } } );
+}
+
+/// \returns a reply as it arrives from the server.
+[[nodiscard]] std::vector<char> Reply( const bt::EReplyType type,
+                                       const std::string_view body )
+{
+    const auto length = static_cast<uint16_t>( body.size() + 1 );
+    const std::array header{ '\x00', '\x83', static_cast<char>( length >> 8 ),
+                             static_cast<char>( length ),
+                             static_cast<char>( type ) };
+
+    std::vector<char> reply( header.size() + body.size() );
+    std::copy( header.begin(), header.end(), reply.begin() );
+    std::copy( body.begin(), body.end(), reply.begin() + header.size() );
+
+    return reply;
+}
+
+void AddDecodeBenchmark( std::vector<Benchmark>& benchmarks, std::string name,
+                         const size_t size, std::vector<char> reply )
+{
+    benchmarks.push_back(
+        { std::move( name ), size,
+          [reply = std::move( reply )](
+              const std::chrono::nanoseconds minTime )
+          {
+              bt::Decoder decoder;
+
+              return btbench::Measure(
+                  [&]
+                  {
+                      btbench::DoNotOptimize( reply );
+                      btbench::DoNotOptimize( decoder.feed( reply ) );
+                      btbench::DoNotOptimize( decoder.reply() );
+                  },
+                  reply.size(), minTime );
+          } } );
+}
+
+void AddDecodeBenchmarks( std::vector<Benchmark>& benchmarks )
+{
+    AddDecodeBenchmark( benchmarks, "decode(null)", 0,
+                        Reply( bt::EReplyType::Null, {} ) );
+    AddDecodeBenchmark( benchmarks, "decode(float)", 4,
+                        Reply( bt::EReplyType::Float, { "\0\0\x2a\x42", 4 } ) );
+    AddDecodeBenchmark(
+        benchmarks, "decode(raw)", 64,
+        Reply( static_cast<bt::EReplyType>( 0x10 ), Payload( 64 ) ) );
+
+    for ( const auto size : sizes_v )
+    {
+        // The longest string body is UINT16_MAX - 1 bytes with the NUL.
+        auto body = Payload( size );
+        body.push_back( '\0' );
+
+        AddDecodeBenchmark( benchmarks, "decode(string)", size,
+                            Reply( bt::EReplyType::String, body ) );
+    }
+}
+
+/// \returns text where every `every`th character has to be escaped.
+[[nodiscard]] std::string Text( const size_t size, const size_t every )
+{
+    auto text = Payload( size );
+
+    for ( size_t i = every - 1; i < size; i += every )
+    {
+        text[i] = ' ';
+    }
+
+    return text;
+}
+
+void AddTopicBenchmarks( std::vector<Benchmark>& benchmarks,
+                         const size_t size )
+{
+    for ( const auto& [name, every] :
+          { std::pair{ "percent_encode_into(clean)", size + 1 },
+            std::pair{ "percent_encode_into(1/16)", size_t{ 16 } } } )
+    {
+        benchmarks.push_back(
+            { name, size,
+              [text = Text( size, every )](
+                  const std::chrono::nanoseconds minTime )
+              {
+                  std::vector<char> buffer( text.size() * 3 );
+
+                  return btbench::Measure(
+                      [&]
+                      {
+                          btbench::DoNotOptimize(
+                              bt::percent_encode_into( buffer, text ) );
+                          btbench::DoNotOptimize( buffer );
+                      },
+                      text.size(), minTime );
+              } } );
+    }
+
+    // Two parameters that share the payload, the way an admin command is
+    // built from its arguments.
+    const auto value = std::make_shared<const std::string>(
+        Text( std::max<size_t>( size / 2, 1 ), 16 ) );
+
+    benchmarks.push_back(
+        { "TopicBuilder", size,
+          [value]( const std::chrono::nanoseconds minTime )
+          {
+              std::vector<char> buffer(
+                  bt::encoded_size( value->size() * 6 + 32 ) );
+
+              return btbench::Measure(
+                  [&]
+                  {
+                      btbench::DoNotOptimize( bt::TopicBuilder{ buffer }
+                                                  .raw( "?ban" )
+                                                  .param( "ckey", *value )
+                                                  .param( "reason", *value )
+                                                  .finish() );
+                      btbench::DoNotOptimize( buffer );
+                  },
+                  value->size() * 2, minTime );
+          } } );
+
+    benchmarks.push_back(
+        { "TopicTemplate", size,
+          [value]( const std::chrono::nanoseconds minTime )
+          {
+              using Ban = bt::TopicTemplate<"?ban&ckey={}&reason={}">;
+
+              std::vector<char> buffer(
+                  bt::encoded_size( value->size() * 6 + 32 ) );
+
+              return btbench::Measure(
+                  [&]
+                  {
+                      btbench::DoNotOptimize(
+                          Ban::encode_into( buffer, *value, *value ) );
+                      btbench::DoNotOptimize( buffer );
+                  },
+                  value->size() * 2, minTime );
+          } } );
+
+    benchmarks.push_back(
+        { "concatenate + encode", size,
+          [value]( const std::chrono::nanoseconds minTime )
+          {
+              const auto escape = []( const std::string& text )
+              {
+                  std::string result;
+
+                  for ( const auto c : text )
+                  {
+                      if ( bt::detail::is_unreserved( c ) )
+                      {
+                          result += c;
+                      }
+                      else
+                      {
+                          const auto byte = static_cast<uint8_t>( c );
+
+                          result += '%';
+                          result += bt::detail::hex_digits_v[byte >> 4];
+                          result += bt::detail::hex_digits_v[byte & 0x0F];
+                      }
+                  }
+
+                  return result;
+              };
+
+              return btbench::Measure(
+                  [&]
+                  {
+                      const auto topic = "?ban&ckey=" + escape( *value ) +
+                                         "&reason=" + escape( *value );
+
+                      btbench::DoNotOptimize( bt::encode( topic ) );
+                  },
+                  value->size() * 2, minTime );
+          } } );
+}
+
+/// \returns a status reply with `count` parameters.
+[[nodiscard]] std::string StatusReply( const size_t count )
+{
+    std::string reply = "version=515.1614&mode=extended&map=Box+Station";
+
+    for ( size_t i = 3; i < count; i++ )
+    {
+        reply += "&player" + std::to_string( i ) + "=Some%20Player";
+    }
+
+    return reply + "&players=12&round_id=4242";
+}
+
+void AddParamsBenchmarks( std::vector<Benchmark>& benchmarks )
+{
+    for ( const size_t count : { 5, 50, 500 } )
+    {
+        auto reply =
+            std::make_shared<const std::string>( StatusReply( count ) );
+
+        benchmarks.push_back(
+            { "Params(split)", reply->size(),
+              [reply]( const std::chrono::nanoseconds minTime )
+              {
+                  return btbench::Measure(
+                      [&]
+                      {
+                          for ( const auto& param : bt::Params{ *reply } )
+                          {
+                              btbench::DoNotOptimize( param );
+                          }
+                      },
+                      reply->size(), minTime );
+              } } );
+
+        benchmarks.push_back(
+            { "Params::extract(3 keys)", reply->size(),
+              [reply]( const std::chrono::nanoseconds minTime )
+              {
+                  static constexpr bt::KeySet keys{ "map", "players",
+                                                    "round_id" };
+
+                  return btbench::Measure(
+                      [&]
+                      {
+                          btbench::DoNotOptimize(
+                              bt::Params{ *reply }.extract( keys ) );
+                      },
+                      reply->size(), minTime );
+              } } );
+
+        benchmarks.push_back(
+            { "Params(split + decode)", reply->size(),
+              [reply]( const std::chrono::nanoseconds minTime )
+              {
+                  std::vector<char> buffer( reply->size() );
+
+                  return btbench::Measure(
+                      [&]
+                      {
+                          for ( const auto& param : bt::Params{ *reply } )
+                          {
+                              btbench::DoNotOptimize( bt::percent_decode_into(
+                                  buffer, param.mValue ) );
+                          }
+                      },
+                      reply->size(), minTime );
+              } } );
+    }
+}
+
+template <size_t... Indices>
+void AddAllEncodeArrayBenchmarks( std::vector<Benchmark>& benchmarks,
+                                  std::index_sequence<Indices...> )
+{
+    ( AddEncodeArrayBenchmarks<sizes_v[Indices]>( benchmarks ), ... );
+}
+
+void PrintHelp() noexcept
+{
+    std::cout << "Usage: bt_bench [--min-time <MS>] [FILTER]\n"
+                 "\n"
+                 "Runs the benchmarks whose name contains FILTER, each for at "
+                 "least <MS>\n"
+                 "milliseconds (200 by default).\n";
+}
+
+int main( const int argc, const char* argv[] )
+{
+    std::chrono::nanoseconds minTime = std::chrono::milliseconds{ 200 };
+    std::string filter;
+
+    for ( int i = 1; i < argc; i++ )
+    {
+        const std::string_view arg = argv[i];
+
+        if ( arg == "--min-time" && i + 1 < argc )
+        {
+            minTime = std::chrono::milliseconds{ std::atoi( argv[++i] ) };
+        }
+        else if ( arg.starts_with( "-" ) )
+        {
+            PrintHelp();
+
+            return arg == "--help" ? 0 : -1;
+        }
+        else
+        {
+            filter = arg;
+        }
+    }
+
+    std::vector<Benchmark> benchmarks;
+
+    for ( const auto size : sizes_v )
+    {
+        AddEncodeBenchmarks( benchmarks, size );
+    }
+
+    for ( const size_t size : { 8, 64, 512 } )
+    {
+        AddBatchBenchmarks( benchmarks, size );
+    }
+
+    AddAllEncodeArrayBenchmarks(
+        benchmarks, std::make_index_sequence<sizes_v.size()>{} );
+    AddDecodeBenchmarks( benchmarks );
+
+    for ( const auto size : sizes_v )
+    {
+        AddTopicBenchmarks( benchmarks, size );
+    }
+
+    AddParamsBenchmarks( benchmarks );
+
+    btbench::PrintHeader();
+
+    for ( const auto& benchmark : benchmarks )
+    {
+        if ( benchmark.mName.find( filter ) == std::string::npos )
+        {
+            continue;
+        }
+
+        btbench::PrintResult( benchmark.mName, benchmark.mSize,
+                              benchmark.mRun( minTime ) );
+    }
+
+    return 0;
+}
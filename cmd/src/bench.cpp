@@ -0,0 +1,129 @@
+//-----------------------------------------------------------------------------
+// Copyright 2024 Igor Spichkin
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//-----------------------------------------------------------------------------
+
+#include "bench.hpp"
+#include "session.hpp"
+#include <algorithm>
+#include <cmath>
+#include <thread>
+#include <vector>
+
+namespace btcmd
+{
+
+CBench::CBench( BenchOptions options, CResolver& resolver ) noexcept
+    : mOptions( std::move( options ) ), mResolver( resolver ),
+      mInterval( 1e9 / mOptions.mRate ),
+      mScheduled( static_cast<uint64_t>( std::ceil(
+          std::chrono::duration<double, std::nano>( mOptions.mDuration ) /
+          mInterval ) ) )
+{
+}
+
+BenchReport CBench::Run() noexcept
+{
+    mNext = 0;
+
+    // Resolve before the clock starts, so the first topics don't include
+    // the lookup.
+    static_cast<void>( mResolver.Resolve(
+        mOptions.mNode, mOptions.mPort,
+        DeadlineAfter( mOptions.mTimeouts.mResolve, Clock::now() ) ) );
+
+    const auto connections = std::max<size_t>( mOptions.mConnections, 1 );
+    std::vector<BenchReport> reports( connections );
+    std::vector<std::thread> workers;
+    workers.reserve( connections );
+
+    const auto start = Clock::now();
+
+    for ( auto& report : reports )
+    {
+        workers.emplace_back( [this, start, &report]
+                              { Worker( start, report ); } );
+    }
+
+    for ( auto& worker : workers )
+    {
+        worker.join();
+    }
+
+    BenchReport total;
+    total.mElapsed = Clock::now() - start;
+
+    uint64_t done = 0;
+
+    for ( const auto& report : reports )
+    {
+        total.mLatency.Merge( report.mLatency );
+        done += report.mLatency.Count();
+
+        for ( const auto& [kind, count] : report.mErrors )
+        {
+            total.mErrors[kind] += count;
+            done += count;
+        }
+    }
+
+    total.mMissed = mScheduled - done;
+
+    return total;
+}
+
+void CBench::Worker( const Clock::time_point start,
+                     BenchReport& report ) noexcept
+{
+    const auto end = start + mOptions.mDuration;
+
+    CSession session{ mOptions.mNode, mOptions.mPort, mResolver,
+                      mOptions.mTimeouts, mOptions.mSocket };
+    bt::Decoder decoder;
+
+    // Once the run is over, the topics that are still due because every
+    // connection was busy are counted as missed.
+    while ( Clock::now() < end )
+    {
+        const auto index = mNext.fetch_add( 1, std::memory_order_relaxed );
+
+        if ( index >= mScheduled )
+        {
+            break;
+        }
+
+        const auto scheduled =
+            start + std::chrono::duration_cast<Clock::duration>(
+                        mInterval * static_cast<double>( index ) );
+
+        std::this_thread::sleep_until( scheduled );
+
+        const auto error = session.Query( mOptions.mMessage, decoder );
+
+        if ( mOptions.mMetrics != nullptr )
+        {
+            mOptions.mMetrics->Record( session.Timings(), error.Ok() );
+        }
+
+        if ( error.Ok() )
+        {
+            report.mLatency.Record( Clock::now() - scheduled );
+        }
+        else
+        {
+            report.mErrors[ToCode( error.mCode )]++;
+        }
+    }
+}
+
+} // namespace btcmd
@@ -0,0 +1,85 @@
+//-----------------------------------------------------------------------------
+// Copyright 2024 Igor Spichkin
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//-----------------------------------------------------------------------------
+
+#pragma once
+
+#include "histogram.hpp"
+#include "metrics.hpp"
+#include "resolver.hpp"
+#include "socket.hpp"
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <map>
+#include <string>
+#include <string_view>
+
+namespace btcmd
+{
+
+struct BenchOptions final
+{
+    std::string mNode;
+    std::string mPort;
+    std::string mMessage;
+    /// How many connections send topics at the same time.
+    size_t mConnections = 1;
+    /// Topics per second, all connections together.
+    double mRate = 100;
+    std::chrono::milliseconds mDuration{ 10000 };
+    Timeouts mTimeouts;
+    SocketOptions mSocket;
+    /// Receives the phase timings of every topic if set.
+    CMetrics* mMetrics = nullptr;
+};
+
+struct BenchReport final
+{
+    /// Latencies of the successful topics, counted from the time each topic
+    /// was scheduled to be sent rather than from the time it was sent.
+    CHistogram mLatency;
+    /// Failed topics by the error code, see `ToCode`.
+    std::map<std::string_view, uint64_t> mErrors;
+    /// Scheduled topics that were never sent because every connection was
+    /// busy until the end of the run.
+    uint64_t mMissed = 0;
+    std::chrono::nanoseconds mElapsed{ 0 };
+};
+
+/// An open-loop load generator: topics are sent at a fixed rate no matter how
+/// fast the server replies, so a slow server shows up in the latencies
+/// instead of lowering the rate.
+class CBench final
+{
+  public:
+    /// \param resolver must outlive the benchmark.
+    CBench( BenchOptions options, CResolver& resolver ) noexcept;
+
+    BenchReport Run() noexcept;
+
+  private:
+    void Worker( Clock::time_point start, BenchReport& report ) noexcept;
+
+    BenchOptions mOptions;
+    CResolver& mResolver;
+    /// Time between two scheduled topics.
+    std::chrono::duration<double, std::nano> mInterval;
+    /// How many topics are scheduled during the run.
+    uint64_t mScheduled;
+    /// The index of the next scheduled topic, shared by all connections.
+    std::atomic<uint64_t> mNext = 0;
+};
+
+} // namespace btcmd
@@ -0,0 +1,64 @@
+//-----------------------------------------------------------------------------
+// Copyright 2024 Igor Spichkin
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//-----------------------------------------------------------------------------
+
+#include "error.hpp"
+#include <format>
+
+namespace btcmd
+{
+
+std::string ToMessage( const Error& error )
+{
+    switch ( error.mCode )
+    {
+    case EError::None:
+        return "No error";
+    case EError::TooLong:
+        return "Fail to encode the message: data is too long";
+    case EError::InvalidAddress:
+        return "Invalid address";
+    case EError::ResolveFailed:
+        return std::format( "getaddrinfo error: {}", error.mSystemError );
+    case EError::ResolveTimeout:
+        return std::string{ ToString( ETimeout::Resolve ) };
+    case EError::SocketFailed:
+        return std::format( "Can't create a socket: error {}",
+                            error.mSystemError );
+    case EError::ConnectFailed:
+        return std::format( "connect error: {}", error.mSystemError );
+    case EError::ConnectTimeout:
+        return std::string{ ToString( ETimeout::Connect ) };
+    case EError::SendFailed:
+        return std::format( "send error: {}", error.mSystemError );
+    case EError::ConnectionClosed:
+        return "Connection closed";
+    case EError::RecvFailed:
+        return std::format( "recv error: {}", error.mSystemError );
+    case EError::FirstByteTimeout:
+        return std::string{ ToString( ETimeout::FirstByte ) };
+    case EError::ResponseTimeout:
+        return std::string{ ToString( ETimeout::Response ) };
+    case EError::UnexpectedEof:
+        return "Unexpected eof";
+    case EError::InvalidMagic:
+        return "Invalid magic";
+    case EError::InvalidLength:
+        return "Invalid length";
+    default:
+        return std::format( "System error: {}", error.mSystemError );
+    }
+}
+
+} // namespace btcmd
@@ -0,0 +1,235 @@
+//-----------------------------------------------------------------------------
+// Copyright 2024 Igor Spichkin
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//-----------------------------------------------------------------------------
+
+#pragma once
+
+#include "bt/bt.hpp"
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <variant>
+
+namespace btcmd
+{
+
+/// The phase that ran out of time.
+enum class ETimeout
+{
+    None,
+    Resolve,
+    Connect,
+    FirstByte,
+    Response
+};
+
+[[nodiscard]] constexpr std::string_view
+ToString( const ETimeout timeout ) noexcept
+{
+    switch ( timeout )
+    {
+    case ETimeout::Resolve:
+        return "Resolve timeout";
+    case ETimeout::Connect:
+        return "Connect timeout";
+    case ETimeout::FirstByte:
+        return "First byte timeout";
+    case ETimeout::Response:
+        return "Response timeout";
+    default:
+        return "No timeout";
+    }
+}
+
+/// Why a topic failed, reported as a stable code in machine-readable output.
+enum class EError
+{
+    None,
+    /// The message doesn't fit into a packet.
+    TooLong,
+    /// The target is not "<NODE>:<PORT>".
+    InvalidAddress,
+    ResolveFailed,
+    ResolveTimeout,
+    /// No socket could be created, e.g. out of descriptors.
+    SocketFailed,
+    ConnectFailed,
+    ConnectTimeout,
+    SendFailed,
+    /// The peer closed the connection while the topic was sent.
+    ConnectionClosed,
+    RecvFailed,
+    FirstByteTimeout,
+    ResponseTimeout,
+    UnexpectedEof,
+    InvalidMagic,
+    InvalidLength,
+    /// A local resource failed, like epoll.
+    System
+};
+
+[[nodiscard]] constexpr std::string_view ToCode( const EError error ) noexcept
+{
+    switch ( error )
+    {
+    case EError::None:
+        return "ok";
+    case EError::TooLong:
+        return "too_long";
+    case EError::InvalidAddress:
+        return "invalid_address";
+    case EError::ResolveFailed:
+        return "resolve_failed";
+    case EError::ResolveTimeout:
+        return "resolve_timeout";
+    case EError::SocketFailed:
+        return "socket_failed";
+    case EError::ConnectFailed:
+        return "connect_failed";
+    case EError::ConnectTimeout:
+        return "connect_timeout";
+    case EError::SendFailed:
+        return "send_failed";
+    case EError::ConnectionClosed:
+        return "connection_closed";
+    case EError::RecvFailed:
+        return "recv_failed";
+    case EError::FirstByteTimeout:
+        return "first_byte_timeout";
+    case EError::ResponseTimeout:
+        return "response_timeout";
+    case EError::UnexpectedEof:
+        return "unexpected_eof";
+    case EError::InvalidMagic:
+        return "invalid_magic";
+    case EError::InvalidLength:
+        return "invalid_length";
+    default:
+        return "system";
+    }
+}
+
+[[nodiscard]] constexpr EError FromTimeout( const ETimeout timeout ) noexcept
+{
+    switch ( timeout )
+    {
+    case ETimeout::Resolve:
+        return EError::ResolveTimeout;
+    case ETimeout::Connect:
+        return EError::ConnectTimeout;
+    case ETimeout::FirstByte:
+        return EError::FirstByteTimeout;
+    case ETimeout::Response:
+        return EError::ResponseTimeout;
+    default:
+        return EError::None;
+    }
+}
+
+/// \returns the error of a decode that didn't finish, eof for `NeedMore`.
+[[nodiscard]] constexpr EError
+FromDecodeStatus( const bt::EDecodeStatus status ) noexcept
+{
+    switch ( status )
+    {
+    case bt::EDecodeStatus::Done:
+        return EError::None;
+    case bt::EDecodeStatus::InvalidMagic:
+        return EError::InvalidMagic;
+    case bt::EDecodeStatus::InvalidLength:
+        return EError::InvalidLength;
+    default:
+        return EError::UnexpectedEof;
+    }
+}
+
+/// A failed operation: the phase it failed in and the system error behind it.
+struct Error final
+{
+    EError mCode = EError::None;
+    /// errno, WSAGetLastError() or the getaddrinfo error if there is one.
+    int mSystemError = 0;
+
+    [[nodiscard]] bool Ok() const noexcept
+    {
+        return mCode == EError::None;
+    }
+};
+
+/// \returns the error of a decode that didn't finish.
+[[nodiscard]] constexpr Error
+FromDecoder( const bt::EDecodeStatus status ) noexcept
+{
+    return Error{ .mCode = FromDecodeStatus( status ) };
+}
+
+/// \returns the message printed for the error, e.g. "connect error: 111".
+[[nodiscard]] std::string ToMessage( const Error& error );
+
+/// Either a value or the error that prevented it, in place of C++23's
+/// `std::expected`.
+template <typename T> class CExpected final
+{
+  public:
+    CExpected( T value ) : mValue( std::in_place_index<0>, std::move( value ) )
+    {
+    }
+
+    CExpected( const Error& error ) : mValue( std::in_place_index<1>, error )
+    {
+    }
+
+    [[nodiscard]] bool HasValue() const noexcept
+    {
+        return mValue.index() == 0;
+    }
+
+    [[nodiscard]] explicit operator bool() const noexcept
+    {
+        return HasValue();
+    }
+
+    /// Only if there is a value.
+    [[nodiscard]] T& Value() noexcept
+    {
+        return *std::get_if<0>( &mValue );
+    }
+
+    [[nodiscard]] const T& Value() const noexcept
+    {
+        return *std::get_if<0>( &mValue );
+    }
+
+    [[nodiscard]] T& operator*() noexcept
+    {
+        return Value();
+    }
+
+    [[nodiscard]] T* operator->() noexcept
+    {
+        return &Value();
+    }
+
+    /// Only if there is no value.
+    [[nodiscard]] const Error& GetError() const noexcept
+    {
+        return *std::get_if<1>( &mValue );
+    }
+
+  private:
+    std::variant<T, Error> mValue;
+};
+
+} // namespace btcmd
@@ -0,0 +1,172 @@
+//-----------------------------------------------------------------------------
+// Copyright 2024 Igor Spichkin
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//-----------------------------------------------------------------------------
+
+#include "fanout.hpp"
+#include <algorithm>
+#include <thread>
+#include <vector>
+
+namespace btcmd
+{
+
+namespace
+{
+
+/// Threads that resolve the names of the targets at the same time.
+constexpr size_t MaxResolverThreads = 16;
+
+} // namespace
+
+//-----------------------------------------------------------------------------
+// CFanout
+//-----------------------------------------------------------------------------
+
+CFanout::CFanout( const size_t maxInFlight, const Timeouts& timeouts,
+                  CResolver& resolver, const size_t threads,
+                  const SocketOptions& socketOptions ) noexcept
+    : mMaxInFlight( std::max( maxInFlight, static_cast<size_t>( 1 ) ) ),
+      mThreads( std::max( threads, static_cast<size_t>( 1 ) ) ),
+      mTimeouts( timeouts ), mSocketOptions( socketOptions ),
+      mResolver( resolver )
+{
+}
+
+void CFanout::Run( const std::span<const FanoutTarget> targets,
+                   const Callback& onResult ) noexcept
+{
+    if ( targets.empty() )
+    {
+        return;
+    }
+
+    // getaddrinfo blocks, the loops only take the addresses resolved here.
+    std::vector<CResolver::Name> names;
+    names.reserve( targets.size() );
+
+    for ( const auto& target : targets )
+    {
+        names.emplace_back( target.mNode, target.mPort );
+    }
+
+    const auto resolutions = mResolver.ResolveAll(
+        names, std::min( mMaxInFlight, MaxResolverThreads ),
+        mTimeouts.mResolve );
+
+    // No more threads than targets or in-flight slots.
+    const auto threads =
+        std::max( std::min( { mThreads, mMaxInFlight, targets.size() } ),
+                  static_cast<size_t>( 1 ) );
+    const auto maxInFlight = ( mMaxInFlight + threads - 1 ) / threads;
+
+    CWorkQueue queue{ targets.size(), threads };
+
+    if ( threads == 1 )
+    {
+        RunWorker( targets, queue, 0, resolutions, maxInFlight, onResult );
+
+        return;
+    }
+
+    std::vector<std::jthread> workers;
+    workers.reserve( threads );
+
+    for ( size_t worker = 0; worker < threads; worker++ )
+    {
+        workers.emplace_back(
+            [&, worker]
+            {
+                RunWorker( targets, queue, worker, resolutions, maxInFlight,
+                           onResult );
+            } );
+    }
+}
+
+void CFanout::RunWorker( const std::span<const FanoutTarget> targets,
+                         CWorkQueue& queue, const size_t worker,
+                         const Resolutions resolutions,
+                         const size_t maxInFlight,
+                         const Callback& onResult ) noexcept
+{
+#ifdef BTCMD_IO_URING
+    // The linked connect and send can't wait for a Fast Open handshake that
+    // the send itself starts.
+    if ( !mSocketOptions.mFastOpen &&
+         RunUring( targets, queue, worker, resolutions, maxInFlight,
+                   onResult ) )
+    {
+        return;
+    }
+#endif
+
+    RunEpoll( targets, queue, worker, resolutions, maxInFlight, onResult );
+}
+
+void FailQueued( CWorkQueue& queue, const size_t worker, const EError code,
+                 const std::string& error,
+                 const CFanout::Callback& onResult ) noexcept
+{
+    size_t index;
+
+    while ( queue.Pop( worker, index ) )
+    {
+        FanoutResult result{ .mIndex = index, .mCode = code, .mError = error };
+
+        result.mTimings.Start();
+
+        onResult( result );
+    }
+}
+
+//-----------------------------------------------------------------------------
+// CTargetDeadline
+//-----------------------------------------------------------------------------
+
+void CTargetDeadline::Start( const Timeouts& timeouts,
+                             const Clock::time_point now ) noexcept
+{
+    mTotal = DeadlineAfter( timeouts.mTotal, now );
+    mDeadline = mTotal;
+    mPhase = ETimeout::Response;
+}
+
+void CTargetDeadline::Enter( const ETimeout phase,
+                             const std::chrono::milliseconds budget,
+                             const Clock::time_point now ) noexcept
+{
+    const auto deadline = DeadlineAfter( budget, now );
+
+    if ( deadline < mTotal )
+    {
+        mDeadline = deadline;
+        mPhase = phase;
+    }
+    else
+    {
+        mDeadline = mTotal;
+        mPhase = ETimeout::Response;
+    }
+}
+
+Clock::time_point CTargetDeadline::Deadline() const noexcept
+{
+    return mDeadline;
+}
+
+ETimeout CTargetDeadline::Phase() const noexcept
+{
+    return mPhase;
+}
+
+} // namespace btcmd
@@ -0,0 +1,129 @@
+//-----------------------------------------------------------------------------
+// Copyright 2024 Igor Spichkin
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//-----------------------------------------------------------------------------
+
+#pragma once
+
+#include "bt/bt.hpp"
+#include "error.hpp"
+#include "resolver.hpp"
+#include "socket.hpp"
+#include "timings.hpp"
+#include "work_queue.hpp"
+#include <functional>
+#include <memory>
+#include <span>
+#include <string>
+
+namespace btcmd
+{
+
+struct FanoutTarget final
+{
+    std::string mNode;
+    std::string mPort;
+    std::string mMessage;
+};
+
+struct FanoutResult final
+{
+    /// Index of the target in the list passed to `Run`.
+    size_t mIndex = 0;
+    /// The reply is valid only inside the callback.
+    bt::Reply mReply;
+    /// `None` on success.
+    EError mCode = EError::None;
+    /// The details of the error, empty on success.
+    std::string mError;
+    /// When each phase of the target ended.
+    CTimings mTimings;
+};
+
+/// Queries many targets at once over non-blocking sockets, or over io_uring
+/// when it is enabled and the kernel supports it. With several threads each
+/// of them runs its own event loop over its share of the targets.
+class CFanout final
+{
+  public:
+    using Callback = std::function<void( const FanoutResult& )>;
+    /// The addresses of the targets, by their index.
+    using Resolutions = std::span<const CResolver::Resolved>;
+
+    /// \param maxInFlight how many targets may be queried at the same time,
+    /// split between the threads.
+    /// \param resolver must outlive the fan-out.
+    /// \param socketOptions Fast Open keeps the workers on epoll.
+    CFanout( size_t maxInFlight, const Timeouts& timeouts, CResolver& resolver,
+             size_t threads = 1,
+             const SocketOptions& socketOptions = {} ) noexcept;
+
+    /// Resolves the names of all targets up front, then queries them and
+    /// calls `onResult` as each of them completes, in the order of
+    /// completion. With several threads `onResult` is called on the worker
+    /// threads, concurrently.
+    void Run( std::span<const FanoutTarget> targets,
+              const Callback& onResult ) noexcept;
+
+  private:
+    void RunWorker( std::span<const FanoutTarget> targets, CWorkQueue& queue,
+                    size_t worker, Resolutions resolutions,
+                    size_t maxInFlight, const Callback& onResult ) noexcept;
+
+    void RunEpoll( std::span<const FanoutTarget> targets, CWorkQueue& queue,
+                   size_t worker, Resolutions resolutions, size_t maxInFlight,
+                   const Callback& onResult ) noexcept;
+
+#ifdef BTCMD_IO_URING
+    /// \returns false if io_uring is not available.
+    bool RunUring( std::span<const FanoutTarget> targets, CWorkQueue& queue,
+                   size_t worker, Resolutions resolutions, size_t maxInFlight,
+                   const Callback& onResult ) noexcept;
+#endif
+
+    size_t mMaxInFlight;
+    size_t mThreads;
+    Timeouts mTimeouts;
+    SocketOptions mSocketOptions;
+    CResolver& mResolver;
+};
+
+/// Fails every target the worker still takes from the queue, once its event
+/// loop can't go on.
+void FailQueued( CWorkQueue& queue, size_t worker, EError code,
+                 const std::string& error,
+                 const CFanout::Callback& onResult ) noexcept;
+
+/// The deadline of the phase a target is in, capped by its total budget.
+class CTargetDeadline final
+{
+  public:
+    /// Starts the total budget of a target.
+    void Start( const Timeouts& timeouts, Clock::time_point now ) noexcept;
+
+    /// Enters a phase with its own budget, zero leaves only the total one.
+    void Enter( ETimeout phase, std::chrono::milliseconds budget,
+                Clock::time_point now ) noexcept;
+
+    [[nodiscard]] Clock::time_point Deadline() const noexcept;
+
+    /// \returns the phase to report once the deadline passes.
+    [[nodiscard]] ETimeout Phase() const noexcept;
+
+  private:
+    Clock::time_point mTotal = NoDeadline;
+    Clock::time_point mDeadline = NoDeadline;
+    ETimeout mPhase = ETimeout::None;
+};
+
+} // namespace btcmd
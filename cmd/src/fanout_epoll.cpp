@@ -0,0 +1,599 @@
+//-----------------------------------------------------------------------------
+// Copyright 2024 Igor Spichkin
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//-----------------------------------------------------------------------------
+
+#include "fanout.hpp"
+#include "socket.hpp"
+#include <algorithm>
+#include <array>
+#include <cerrno>
+#include <format>
+#include <memory>
+#include <sys/epoll.h>
+#include <unistd.h>
+#include <vector>
+
+namespace btcmd
+{
+
+namespace
+{
+
+enum class EState
+{
+    Connecting,
+    Sending,
+    Receiving
+};
+
+struct Connection final
+{
+    size_t mIndex = 0;
+    EState mState = EState::Connecting;
+    /// The addresses of the target and the one being connected to.
+    std::shared_ptr<const Resolution> mResolution;
+    size_t mEndpoint = 0;
+    /// When to give up on the address and try the next one.
+    Clock::time_point mAttemptDeadline = NoDeadline;
+    std::unique_ptr<ISocket> mSocket;
+    /// The encoded packet and how much of it was sent.
+    std::vector<char> mPacket;
+    size_t mSent = 0;
+    /// Received bytes, the decoder has consumed `mParsed` of `mReceived`.
+    std::vector<char> mBuffer;
+    size_t mReceived = 0;
+    size_t mParsed = 0;
+    bt::Decoder mDecoder;
+    CTargetDeadline mDeadline;
+    CTimings mTimings;
+
+    [[nodiscard]] Clock::time_point Deadline() const noexcept
+    {
+        return mState == EState::Connecting
+                   ? std::min( mAttemptDeadline, mDeadline.Deadline() )
+                   : mDeadline.Deadline();
+    }
+};
+
+class CEpollLoop final
+{
+  public:
+    CEpollLoop( std::span<const FanoutTarget> targets, CWorkQueue& queue,
+                const size_t worker, const size_t maxInFlight,
+                const Timeouts& timeouts, const SocketOptions& socketOptions,
+                const CFanout::Resolutions resolutions,
+                const CFanout::Callback& onResult ) noexcept
+        : mTargets( targets ), mQueue( queue ), mWorker( worker ),
+          mTimeouts( timeouts ), mSocketOptions( socketOptions ),
+          mResolutions( resolutions ), mOnResult( onResult ),
+          mEpoll( epoll_create1( EPOLL_CLOEXEC ) )
+    {
+        if ( mEpoll == -1 )
+        {
+            mError = std::format( "epoll_create1 error: {}", errno );
+        }
+
+        mConnections.resize( std::min( maxInFlight, targets.size() ) );
+        mFree.reserve( mConnections.size() );
+
+        for ( size_t i = mConnections.size(); i > 0; i-- )
+        {
+            mFree.push_back( i - 1 );
+        }
+    }
+
+    CEpollLoop( CEpollLoop& other ) = delete;
+    CEpollLoop& operator=( CEpollLoop& other ) = delete;
+
+    ~CEpollLoop()
+    {
+        close( mEpoll );
+    }
+
+    void Run() noexcept
+    {
+        std::array<epoll_event, 256> events;
+
+        if ( !mError.empty() )
+        {
+            Abort();
+
+            return;
+        }
+
+        while ( mMore || mActive != 0 )
+        {
+            size_t index;
+
+            while ( mMore && !mFree.empty() )
+            {
+                if ( !mQueue.Pop( mWorker, index ) )
+                {
+                    mMore = false;
+
+                    break;
+                }
+
+                const auto slot = mFree.back();
+                mFree.pop_back();
+
+                Start( slot, index );
+            }
+
+            if ( mActive == 0 )
+            {
+                continue;
+            }
+
+            const auto count =
+                epoll_wait( mEpoll, events.data(),
+                            static_cast<int>( events.size() ),
+                            PollTimeout( NearestDeadline() ) );
+
+            if ( count == -1 )
+            {
+                if ( errno == EINTR )
+                {
+                    continue;
+                }
+
+                mError = std::format( "epoll_wait error: {}", errno );
+
+                Abort();
+
+                return;
+            }
+
+            for ( int i = 0; i < count; i++ )
+            {
+                Handle( events[i].data.u64, events[i].events );
+            }
+
+            Expire();
+        }
+    }
+
+  private:
+    /// Fails the targets in flight and the rest of the queue once epoll
+    /// itself fails.
+    void Abort() noexcept
+    {
+        for ( size_t slot = 0; slot < mConnections.size(); slot++ )
+        {
+            if ( mConnections[slot].mSocket != nullptr )
+            {
+                Fail( slot, EError::System, mError );
+            }
+        }
+
+        FailQueued( mQueue, mWorker, EError::System, mError, mOnResult );
+    }
+
+    [[nodiscard]] Clock::time_point NearestDeadline() const noexcept
+    {
+        auto deadline = NoDeadline;
+
+        for ( const auto& connection : mConnections )
+        {
+            if ( connection.mSocket != nullptr )
+            {
+                deadline = std::min( deadline, connection.Deadline() );
+            }
+        }
+
+        return deadline;
+    }
+
+    /// Fails the targets whose deadline passed and moves on to the next
+    /// address of the targets whose connection attempt took too long.
+    void Expire() noexcept
+    {
+        const auto now = Clock::now();
+
+        for ( size_t slot = 0; slot < mConnections.size(); slot++ )
+        {
+            const auto& connection = mConnections[slot];
+
+            if ( connection.mSocket == nullptr || connection.Deadline() > now )
+            {
+                continue;
+            }
+
+            const auto phase = connection.mDeadline.Phase();
+            auto error = std::string{ ToString( phase ) };
+
+            if ( connection.mDeadline.Deadline() <= now )
+            {
+                Fail( slot, FromTimeout( phase ), std::move( error ) );
+            }
+            else
+            {
+                Retry( slot, FromTimeout( phase ), std::move( error ) );
+            }
+        }
+    }
+
+    void Start( const size_t slot, const size_t index ) noexcept
+    {
+        auto& connection = mConnections[slot];
+        const auto& target = mTargets[index];
+
+        mActive++;
+
+        // The name was resolved before the sweep, the target counts from
+        // when its lookup started.
+        const auto& resolved = mResolutions[index];
+        const auto now = Clock::now();
+        const auto start = now - resolved.mElapsed;
+
+        connection.mIndex = index;
+        connection.mTimings.Start( start );
+        connection.mState = EState::Connecting;
+        connection.mSent = 0;
+        connection.mReceived = 0;
+        connection.mParsed = 0;
+        connection.mDecoder.reset();
+
+        // Buffers are kept between targets and only grow.
+        connection.mPacket.resize( bt::encoded_size( target.mMessage.size() ) );
+
+        if ( const auto [result, size] =
+                 bt::encode_into( connection.mPacket, target.mMessage );
+             result != bt::EResult::Ok )
+        {
+            Fail( slot, EError::TooLong,
+                  "Fail to encode the message: data is too long" );
+
+            return;
+        }
+
+        connection.mDeadline.Start( mTimeouts, start );
+        connection.mResolution = resolved.mResolution;
+
+        if ( connection.mResolution == nullptr )
+        {
+            Fail( slot, EError::ResolveTimeout,
+                  std::string{ ToString( ETimeout::Resolve ) } );
+
+            return;
+        }
+
+        if ( connection.mResolution->mError != 0 ||
+             connection.mResolution->mEndpoints.empty() )
+        {
+            Fail( slot, EError::ResolveFailed,
+                  std::format( "getaddrinfo error: {}",
+                               connection.mResolution->mError ) );
+
+            return;
+        }
+
+        connection.mTimings.Mark( EPhase::Resolve, now );
+        connection.mDeadline.Enter( ETimeout::Connect, mTimeouts.mConnect,
+                                    now );
+        connection.mEndpoint = 0;
+
+        Connect( slot );
+    }
+
+    /// Starts connecting to the current address of the target.
+    void Connect( const size_t slot ) noexcept
+    {
+        auto& connection = mConnections[slot];
+        const auto& endpoints = connection.mResolution->mEndpoints;
+
+        // Replacing the socket removes the previous attempt from the epoll
+        // set.
+        auto socket =
+            CreateSocket( endpoints[connection.mEndpoint], mSocketOptions );
+
+        if ( !socket )
+        {
+            connection.mSocket.reset();
+
+            Retry( slot, socket.GetError().mCode,
+                   ToMessage( socket.GetError() ) );
+
+            return;
+        }
+
+        connection.mSocket = std::move( *socket );
+        connection.mAttemptDeadline = AttemptDeadline(
+            connection.mDeadline.Deadline(),
+            endpoints.size() - connection.mEndpoint, Clock::now() );
+
+        const auto result = connection.mSocket->StartConnect();
+
+        if ( result.mStatus == EIoStatus::Error )
+        {
+            Retry( slot, EError::ConnectFailed,
+                   std::format( "connect error: {}", result.mError ) );
+
+            return;
+        }
+
+        epoll_event event{ .events = EPOLLOUT, .data = { .u64 = slot } };
+
+        if ( epoll_ctl( mEpoll, EPOLL_CTL_ADD,
+                        static_cast<int>( connection.mSocket->Handle() ),
+                        &event ) == -1 )
+        {
+            Fail( slot, EError::System,
+                  std::format( "epoll_ctl error: {}", errno ) );
+
+            return;
+        }
+
+        if ( result.mStatus == EIoStatus::Ok )
+        {
+            connection.mTimings.Mark( EPhase::Connect );
+            connection.mState = EState::Sending;
+        }
+    }
+
+    void Handle( const size_t slot, const uint32_t events ) noexcept
+    {
+        auto& connection = mConnections[slot];
+
+        if ( connection.mState == EState::Connecting )
+        {
+            if ( const auto result = connection.mSocket->FinishConnect();
+                 result.mStatus != EIoStatus::Ok )
+            {
+                Retry( slot, EError::ConnectFailed,
+                       std::format( "connect error: {}", result.mError ) );
+
+                return;
+            }
+
+            connection.mTimings.Mark( EPhase::Connect );
+            connection.mState = EState::Sending;
+        }
+
+        if ( connection.mState == EState::Sending )
+        {
+            Send( slot );
+        }
+        else if ( connection.mState == EState::Receiving &&
+                  ( events & ( EPOLLIN | EPOLLHUP | EPOLLERR ) ) != 0 )
+        {
+            Receive( slot );
+        }
+    }
+
+    void Send( const size_t slot ) noexcept
+    {
+        auto& connection = mConnections[slot];
+        const std::span<const char> packet{ connection.mPacket };
+
+        while ( connection.mSent < packet.size() )
+        {
+            const auto result = connection.mSocket->TrySend(
+                packet.subspan( connection.mSent ) );
+
+            switch ( result.mStatus )
+            {
+            case EIoStatus::Ok:
+                connection.mSent += result.mBytes;
+                break;
+            case EIoStatus::WouldBlock:
+                return;
+            case EIoStatus::Closed:
+                Fail( slot, EError::ConnectionClosed, "Connection closed" );
+
+                return;
+            case EIoStatus::TimedOut:
+            case EIoStatus::Error:
+                // With Fast Open the first send reports a failed connect.
+                if ( mSocketOptions.mFastOpen && connection.mSent == 0 )
+                {
+                    Retry( slot, EError::ConnectFailed,
+                           std::format( "connect error: {}", result.mError ) );
+                }
+                else
+                {
+                    Fail( slot, EError::SendFailed,
+                          std::format( "send error: {}", result.mError ) );
+                }
+
+                return;
+            }
+        }
+
+        const auto sent = Clock::now();
+
+        connection.mTimings.Mark( EPhase::Send, sent );
+        connection.mState = EState::Receiving;
+        connection.mDeadline.Enter( ETimeout::FirstByte, mTimeouts.mFirstByte,
+                                    sent );
+
+        epoll_event event{ .events = EPOLLIN, .data = { .u64 = slot } };
+
+        if ( epoll_ctl( mEpoll, EPOLL_CTL_MOD,
+                        static_cast<int>( connection.mSocket->Handle() ),
+                        &event ) == -1 )
+        {
+            Fail( slot, EError::System,
+                  std::format( "epoll_ctl error: {}", errno ) );
+        }
+    }
+
+    void Receive( const size_t slot ) noexcept
+    {
+        auto& connection = mConnections[slot];
+        auto& buffer = connection.mBuffer;
+
+        while ( true )
+        {
+            // Keep room for the rest of the reply so its body ends up
+            // contiguous in the buffer.
+            const auto needed = connection.mParsed +
+                                connection.mDecoder.bytes_needed();
+
+            if ( const auto size =
+                     std::max( needed, connection.mReceived + 512 );
+                 buffer.size() < size )
+            {
+                buffer.resize( size );
+            }
+
+            const auto result = connection.mSocket->TryRecv(
+                std::span{ buffer }.subspan( connection.mReceived ) );
+
+            switch ( result.mStatus )
+            {
+            case EIoStatus::Ok:
+                break;
+            case EIoStatus::WouldBlock:
+                return;
+            case EIoStatus::Closed:
+                Fail( slot, EError::UnexpectedEof, "Unexpected eof" );
+
+                return;
+            case EIoStatus::TimedOut:
+            case EIoStatus::Error:
+                // The topic went out in a Fast Open SYN that was refused.
+                if ( result.mError == ECONNREFUSED )
+                {
+                    Retry( slot, EError::ConnectFailed,
+                           std::format( "connect error: {}", result.mError ) );
+                }
+                else
+                {
+                    Fail( slot, EError::RecvFailed,
+                          std::format( "recv error: {}", result.mError ) );
+                }
+
+                return;
+            }
+
+            if ( connection.mReceived == 0 )
+            {
+                const auto firstByte = Clock::now();
+
+                connection.mTimings.Mark( EPhase::FirstByte, firstByte );
+                connection.mDeadline.Enter( ETimeout::Response,
+                                            std::chrono::milliseconds{ 0 },
+                                            firstByte );
+            }
+
+            connection.mReceived += result.mBytes;
+
+            const auto [status, consumed] = connection.mDecoder.feed(
+                std::span<const char>{ buffer }.subspan(
+                    connection.mParsed,
+                    connection.mReceived - connection.mParsed ) );
+
+            connection.mParsed += consumed;
+
+            if ( status == bt::EDecodeStatus::Done )
+            {
+                connection.mTimings.Mark( EPhase::LastByte );
+
+                Complete( slot, FanoutResult{
+                                    .mIndex = connection.mIndex,
+                                    .mReply = connection.mDecoder.reply() } );
+
+                return;
+            }
+
+            if ( status != bt::EDecodeStatus::NeedMore )
+            {
+                const auto error = FromDecoder( status );
+
+                Fail( slot, error.mCode, ToMessage( error ) );
+
+                return;
+            }
+        }
+    }
+
+    /// Connects to the next address of the target, or fails it with the
+    /// error of the last one.
+    void Retry( const size_t slot, const EError code,
+                std::string error ) noexcept
+    {
+        auto& connection = mConnections[slot];
+
+        if ( connection.mState == EState::Connecting &&
+             connection.mEndpoint + 1 <
+                 connection.mResolution->mEndpoints.size() )
+        {
+            connection.mEndpoint++;
+
+            Connect( slot );
+
+            return;
+        }
+
+        Fail( slot, code, std::move( error ) );
+    }
+
+    void Fail( const size_t slot, const EError code,
+               std::string error ) noexcept
+    {
+        Complete( slot, FanoutResult{ .mIndex = mConnections[slot].mIndex,
+                                      .mCode = code,
+                                      .mError = std::move( error ) } );
+    }
+
+    void Complete( const size_t slot, FanoutResult result ) noexcept
+    {
+        auto& connection = mConnections[slot];
+
+        result.mTimings = connection.mTimings;
+
+        mOnResult( result );
+
+        // Closing the descriptor removes it from the epoll set.
+        connection.mSocket.reset();
+        connection.mResolution.reset();
+
+        mActive--;
+        mFree.push_back( slot );
+    }
+
+    std::span<const FanoutTarget> mTargets;
+    CWorkQueue& mQueue;
+    size_t mWorker;
+    /// False once the queue ran out of targets.
+    bool mMore = true;
+    Timeouts mTimeouts;
+    SocketOptions mSocketOptions;
+    /// The addresses of the targets, by their index.
+    CFanout::Resolutions mResolutions;
+    const CFanout::Callback& mOnResult;
+    int mEpoll;
+    /// Why the loop can't go on, empty while it can.
+    std::string mError;
+    std::vector<Connection> mConnections;
+    std::vector<size_t> mFree;
+    size_t mActive = 0;
+};
+
+} // namespace
+
+void CFanout::RunEpoll( const std::span<const FanoutTarget> targets,
+                        CWorkQueue& queue, const size_t worker,
+                        const Resolutions resolutions,
+                        const size_t maxInFlight,
+                        const Callback& onResult ) noexcept
+{
+    CEpollLoop loop{ targets, queue, worker, maxInFlight, mTimeouts,
+                     mSocketOptions, resolutions, onResult };
+
+    loop.Run();
+}
+
+} // namespace btcmd
@@ -0,0 +1,708 @@
+//-----------------------------------------------------------------------------
+// Copyright 2024 Igor Spichkin
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//-----------------------------------------------------------------------------
+
+#include "fanout.hpp"
+#include "socket.hpp"
+#include "uring.hpp"
+#include <algorithm>
+#include <bit>
+#include <cerrno>
+#include <format>
+#include <memory>
+#include <sys/socket.h>
+#include <vector>
+
+namespace btcmd
+{
+
+namespace
+{
+
+/// Replies are received into a registered slab, one slot per connection.
+/// Longer replies continue in a heap buffer.
+constexpr size_t SlotSize = 4096;
+
+enum class EOp : uint64_t
+{
+    Connect,
+    Send,
+    Recv
+};
+
+[[nodiscard]] constexpr uint64_t UserData( const size_t slot,
+                                           const EOp op ) noexcept
+{
+    return static_cast<uint64_t>( slot ) << 2 | static_cast<uint64_t>( op );
+}
+
+struct Connection final
+{
+    size_t mIndex = 0;
+    /// The addresses of the target and the one being connected to.
+    std::shared_ptr<const Resolution> mResolution;
+    size_t mEndpoint = 0;
+    /// When to give up on the address and try the next one.
+    Clock::time_point mAttemptDeadline = NoDeadline;
+    bool mConnected = false;
+    /// The address is given up on, the next one is tried once nothing is
+    /// pending.
+    bool mRetry = false;
+    std::unique_ptr<ISocket> mSocket;
+    std::vector<char> mPacket;
+    /// Completions the kernel still owes for this connection.
+    uint32_t mPending = 0;
+    /// The result is reported, the slot is released once nothing is pending.
+    bool mDone = false;
+    /// Set once the reply outgrows the slot.
+    bool mOverflow = false;
+    std::vector<char> mOverflowBuffer;
+    size_t mReceived = 0;
+    size_t mParsed = 0;
+    bt::Decoder mDecoder;
+    CTargetDeadline mDeadline;
+    /// Marked as the completions are reaped.
+    CTimings mTimings;
+};
+
+class CUringLoop final
+{
+  public:
+    CUringLoop( CUring& ring, std::span<const FanoutTarget> targets,
+                CWorkQueue& queue, const size_t worker, const size_t slots,
+                const Timeouts& timeouts, const SocketOptions& socketOptions,
+                const CFanout::Resolutions resolutions,
+                const CFanout::Callback& onResult ) noexcept
+        : mRing( ring ), mTargets( targets ), mQueue( queue ),
+          mWorker( worker ), mTimeouts( timeouts ),
+          mSocketOptions( socketOptions ), mResolutions( resolutions ),
+          mOnResult( onResult ),
+          mSlab( slots * SlotSize ), mConnections( slots )
+    {
+        const iovec slab{ .iov_base = mSlab.data(), .iov_len = mSlab.size() };
+
+        mFixed = mRing.RegisterBuffers( std::span{ &slab, 1 } );
+
+        mFree.reserve( slots );
+
+        for ( size_t i = slots; i > 0; i-- )
+        {
+            mFree.push_back( i - 1 );
+        }
+    }
+
+    void Run() noexcept
+    {
+        while ( mMore || mActive != 0 )
+        {
+            size_t index;
+
+            while ( mMore && !mFree.empty() && mError.empty() )
+            {
+                if ( !mQueue.Pop( mWorker, index ) )
+                {
+                    mMore = false;
+
+                    break;
+                }
+
+                const auto slot = mFree.back();
+                mFree.pop_back();
+
+                Start( slot, index );
+            }
+
+            if ( !mError.empty() )
+            {
+                Abort();
+
+                return;
+            }
+
+            if ( mActive == 0 )
+            {
+                continue;
+            }
+
+            // New connections and the wait for completions share one
+            // system call.
+            if ( !mRing.Submit( 1, PollTimeout( NearestDeadline() ) ) &&
+                 errno != EINTR )
+            {
+                mError = std::format( "io_uring_enter error: {}", errno );
+
+                Abort();
+
+                return;
+            }
+
+            mRing.ForEachCompletion(
+                [this]( const io_uring_cqe& cqe )
+                {
+                    Handle( cqe );
+                } );
+
+            Expire();
+        }
+    }
+
+  private:
+    /// Fails the targets in flight and the rest of the queue once
+    /// io_uring_enter fails. Nothing is submitted or reaped after that, the
+    /// ring is torn down with the operations still queued.
+    void Abort() noexcept
+    {
+        std::vector<bool> free( mConnections.size() );
+
+        for ( const auto slot : mFree )
+        {
+            free[slot] = true;
+        }
+
+        for ( size_t slot = 0; slot < mConnections.size(); slot++ )
+        {
+            auto& connection = mConnections[slot];
+
+            if ( free[slot] || connection.mDone )
+            {
+                continue;
+            }
+
+            connection.mDone = true;
+
+            mOnResult( FanoutResult{ .mIndex = connection.mIndex,
+                                     .mCode = EError::System,
+                                     .mError = mError,
+                                     .mTimings = connection.mTimings } );
+        }
+
+        FailQueued( mQueue, mWorker, EError::System, mError, mOnResult );
+    }
+
+    [[nodiscard]] Clock::time_point NearestDeadline() const noexcept
+    {
+        auto deadline = NoDeadline;
+
+        for ( const auto& connection : mConnections )
+        {
+            if ( connection.mSocket == nullptr || connection.mDone ||
+                 connection.mRetry )
+            {
+                continue;
+            }
+
+            deadline = std::min( deadline, connection.mDeadline.Deadline() );
+
+            if ( !connection.mConnected )
+            {
+                deadline = std::min( deadline, connection.mAttemptDeadline );
+            }
+        }
+
+        return deadline;
+    }
+
+    /// Fails the targets whose deadline passed and gives up on the address
+    /// of the targets whose connection attempt took too long, their queued
+    /// operations complete once the socket is shut down.
+    void Expire() noexcept
+    {
+        const auto now = Clock::now();
+
+        for ( size_t slot = 0; slot < mConnections.size(); slot++ )
+        {
+            const auto& connection = mConnections[slot];
+
+            if ( connection.mSocket == nullptr || connection.mDone ||
+                 connection.mRetry )
+            {
+                continue;
+            }
+
+            const auto phase = connection.mDeadline.Phase();
+
+            if ( connection.mDeadline.Deadline() <= now ||
+                 ( !connection.mConnected &&
+                   connection.mAttemptDeadline <= now && !Retry( slot ) ) )
+            {
+                Fail( slot, FromTimeout( phase ),
+                      std::string{ ToString( phase ) } );
+            }
+        }
+    }
+
+    /// \returns nullptr once io_uring_enter failed, the loop aborts then.
+    [[nodiscard]] io_uring_sqe* Sqe() noexcept
+    {
+        auto* sqe = mError.empty() ? mRing.GetSqe() : nullptr;
+
+        // Hand the queued entries to the kernel to make room.
+        while ( sqe == nullptr && mError.empty() )
+        {
+            if ( !mRing.Submit( 0 ) && errno != EINTR )
+            {
+                mError = std::format( "io_uring_enter error: {}", errno );
+
+                break;
+            }
+
+            sqe = mRing.GetSqe();
+        }
+
+        return sqe;
+    }
+
+    [[nodiscard]] std::span<char> SlotBuffer( const size_t slot ) noexcept
+    {
+        return std::span{ mSlab }.subspan( slot * SlotSize, SlotSize );
+    }
+
+    void Start( const size_t slot, const size_t index ) noexcept
+    {
+        auto& connection = mConnections[slot];
+        const auto& target = mTargets[index];
+
+        mActive++;
+
+        // The name was resolved before the sweep, the target counts from
+        // when its lookup started.
+        const auto& resolved = mResolutions[index];
+        const auto now = Clock::now();
+        const auto start = now - resolved.mElapsed;
+
+        connection.mIndex = index;
+        connection.mTimings.Start( start );
+        connection.mPending = 0;
+        connection.mDone = false;
+        connection.mOverflow = false;
+        connection.mReceived = 0;
+        connection.mParsed = 0;
+        connection.mDecoder.reset();
+        connection.mPacket.resize( bt::encoded_size( target.mMessage.size() ) );
+
+        if ( const auto [result, size] =
+                 bt::encode_into( connection.mPacket, target.mMessage );
+             result != bt::EResult::Ok )
+        {
+            Fail( slot, EError::TooLong,
+                  "Fail to encode the message: data is too long" );
+
+            return;
+        }
+
+        connection.mDeadline.Start( mTimeouts, start );
+        connection.mResolution = resolved.mResolution;
+
+        if ( connection.mResolution == nullptr )
+        {
+            Fail( slot, EError::ResolveTimeout,
+                  std::string{ ToString( ETimeout::Resolve ) } );
+
+            return;
+        }
+
+        if ( connection.mResolution->mError != 0 ||
+             connection.mResolution->mEndpoints.empty() )
+        {
+            Fail( slot, EError::ResolveFailed,
+                  std::format( "getaddrinfo error: {}",
+                               connection.mResolution->mError ) );
+
+            return;
+        }
+
+        connection.mTimings.Mark( EPhase::Resolve, now );
+        connection.mDeadline.Enter( ETimeout::Connect, mTimeouts.mConnect,
+                                    now );
+        connection.mEndpoint = 0;
+
+        Connect( slot );
+    }
+
+    /// Queues the whole exchange with the current address of the target.
+    void Connect( const size_t slot ) noexcept
+    {
+        auto& connection = mConnections[slot];
+        const auto& endpoints = connection.mResolution->mEndpoints;
+
+        auto socket =
+            CreateSocket( endpoints[connection.mEndpoint], mSocketOptions );
+
+        if ( !socket )
+        {
+            // Nothing is queued for the slot, move on right away.
+            if ( connection.mEndpoint + 1 < endpoints.size() )
+            {
+                connection.mEndpoint++;
+
+                Connect( slot );
+
+                return;
+            }
+
+            Fail( slot, socket.GetError().mCode,
+                  ToMessage( socket.GetError() ) );
+
+            return;
+        }
+
+        connection.mSocket = std::move( *socket );
+        connection.mAttemptDeadline = AttemptDeadline(
+            connection.mDeadline.Deadline(),
+            endpoints.size() - connection.mEndpoint, Clock::now() );
+        connection.mConnected = false;
+        connection.mRetry = false;
+
+        const auto fd = static_cast<int>( connection.mSocket->Handle() );
+        const auto address = connection.mSocket->Address();
+
+        // connect -> send -> recv, each starts only if the previous one
+        // succeeded.
+        auto* connect = Sqe();
+        auto* send = connect != nullptr ? Sqe() : nullptr;
+
+        if ( send == nullptr )
+        {
+            return;
+        }
+
+        connect->opcode = IORING_OP_CONNECT;
+        connect->fd = fd;
+        connect->addr = reinterpret_cast<uint64_t>( address.data() );
+        connect->off = address.size();
+        connect->flags = IOSQE_IO_LINK;
+        connect->user_data = UserData( slot, EOp::Connect );
+
+        send->opcode = IORING_OP_SEND;
+        send->fd = fd;
+        send->addr = reinterpret_cast<uint64_t>( connection.mPacket.data() );
+        send->len = static_cast<uint32_t>( connection.mPacket.size() );
+        send->msg_flags = MSG_NOSIGNAL | MSG_WAITALL;
+        send->flags = IOSQE_IO_LINK;
+        send->user_data = UserData( slot, EOp::Send );
+
+        connection.mPending = 2;
+
+        QueueRecv( slot );
+    }
+
+    void QueueRecv( const size_t slot ) noexcept
+    {
+        auto& connection = mConnections[slot];
+        const auto fd = static_cast<int>( connection.mSocket->Handle() );
+
+        auto* recv = Sqe();
+
+        if ( recv == nullptr )
+        {
+            return;
+        }
+
+        recv->fd = fd;
+        recv->user_data = UserData( slot, EOp::Recv );
+
+        if ( connection.mOverflow )
+        {
+            auto& buffer = connection.mOverflowBuffer;
+
+            recv->opcode = IORING_OP_RECV;
+            recv->addr = reinterpret_cast<uint64_t>( buffer.data() +
+                                                     connection.mReceived );
+            recv->len =
+                static_cast<uint32_t>( buffer.size() - connection.mReceived );
+        }
+        else
+        {
+            const auto buffer =
+                SlotBuffer( slot ).subspan( connection.mReceived );
+
+            recv->opcode = mFixed ? IORING_OP_READ_FIXED : IORING_OP_RECV;
+            recv->addr = reinterpret_cast<uint64_t>( buffer.data() );
+            recv->len = static_cast<uint32_t>( buffer.size() );
+            recv->buf_index = 0;
+        }
+
+        connection.mPending++;
+    }
+
+    void Handle( const io_uring_cqe& cqe ) noexcept
+    {
+        const auto slot = static_cast<size_t>( cqe.user_data >> 2 );
+        const auto op = static_cast<EOp>( cqe.user_data & 3 );
+        auto& connection = mConnections[slot];
+
+        connection.mPending--;
+
+        if ( connection.mDone )
+        {
+            Release( slot );
+
+            return;
+        }
+
+        // The rest of the chain is cancelled, start over with the next
+        // address once it is.
+        if ( connection.mRetry )
+        {
+            if ( connection.mPending == 0 )
+            {
+                connection.mEndpoint++;
+
+                Connect( slot );
+            }
+
+            return;
+        }
+
+        if ( cqe.res < 0 )
+        {
+            const auto error = -cqe.res;
+
+            switch ( op )
+            {
+            case EOp::Connect:
+                if ( !Retry( slot ) )
+                {
+                    Fail( slot, EError::ConnectFailed,
+                          std::format( "connect error: {}", error ) );
+                }
+                break;
+            case EOp::Send:
+                if ( error == EPIPE || error == ECONNRESET )
+                {
+                    Fail( slot, EError::ConnectionClosed, "Connection closed" );
+                }
+                else
+                {
+                    Fail( slot, EError::SendFailed,
+                          std::format( "send error: {}", error ) );
+                }
+                break;
+            case EOp::Recv:
+                Fail( slot, EError::RecvFailed,
+                      std::format( "recv error: {}", error ) );
+                break;
+            }
+
+            return;
+        }
+
+        if ( op == EOp::Connect )
+        {
+            connection.mConnected = true;
+            connection.mTimings.Mark( EPhase::Connect );
+        }
+
+        if ( op == EOp::Send )
+        {
+            const auto sent = Clock::now();
+
+            connection.mTimings.Mark( EPhase::Send, sent );
+            connection.mDeadline.Enter( ETimeout::FirstByte,
+                                        mTimeouts.mFirstByte, sent );
+        }
+
+        if ( op != EOp::Recv )
+        {
+            return;
+        }
+
+        if ( cqe.res == 0 )
+        {
+            Fail( slot, EError::UnexpectedEof, "Unexpected eof" );
+
+            return;
+        }
+
+        if ( connection.mReceived == 0 )
+        {
+            const auto firstByte = Clock::now();
+
+            connection.mTimings.Mark( EPhase::FirstByte, firstByte );
+            connection.mDeadline.Enter( ETimeout::Response,
+                                        std::chrono::milliseconds{ 0 },
+                                        firstByte );
+        }
+
+        connection.mReceived += static_cast<size_t>( cqe.res );
+
+        const std::span<const char> buffer =
+            connection.mOverflow
+                ? std::span<const char>{ connection.mOverflowBuffer }
+                : SlotBuffer( slot );
+
+        const auto [status, consumed] = connection.mDecoder.feed(
+            buffer.subspan( connection.mParsed,
+                            connection.mReceived - connection.mParsed ) );
+
+        connection.mParsed += consumed;
+
+        if ( status == bt::EDecodeStatus::Done )
+        {
+            connection.mDone = true;
+            connection.mTimings.Mark( EPhase::LastByte );
+
+            mOnResult( FanoutResult{ .mIndex = connection.mIndex,
+                                     .mReply = connection.mDecoder.reply(),
+                                     .mTimings = connection.mTimings } );
+
+            Release( slot );
+
+            return;
+        }
+
+        if ( status != bt::EDecodeStatus::NeedMore )
+        {
+            const auto error = FromDecoder( status );
+
+            Fail( slot, error.mCode, ToMessage( error ) );
+
+            return;
+        }
+
+        // The body must end up contiguous, move to the heap buffer once it
+        // doesn't fit into the slot.
+        const auto needed = std::max( connection.mParsed +
+                                          connection.mDecoder.bytes_needed(),
+                                      connection.mReceived + 512 );
+
+        if ( !connection.mOverflow && needed > SlotSize )
+        {
+            const auto received =
+                SlotBuffer( slot ).first( connection.mReceived );
+
+            connection.mOverflow = true;
+            connection.mOverflowBuffer.assign( received.begin(),
+                                               received.end() );
+        }
+
+        if ( connection.mOverflow &&
+             connection.mOverflowBuffer.size() < needed )
+        {
+            connection.mOverflowBuffer.resize( needed );
+        }
+
+        QueueRecv( slot );
+    }
+
+    /// Gives up on the current address if the target has more.
+    /// \returns false if it was the last one.
+    bool Retry( const size_t slot ) noexcept
+    {
+        auto& connection = mConnections[slot];
+
+        if ( connection.mEndpoint + 1 >=
+             connection.mResolution->mEndpoints.size() )
+        {
+            return false;
+        }
+
+        connection.mRetry = true;
+
+        // Aborts the connection attempt, the linked operations are
+        // cancelled with it.
+        shutdown( static_cast<int>( connection.mSocket->Handle() ),
+                  SHUT_RDWR );
+
+        return true;
+    }
+
+    void Fail( const size_t slot, const EError code,
+               std::string error ) noexcept
+    {
+        auto& connection = mConnections[slot];
+
+        connection.mDone = true;
+
+        mOnResult( FanoutResult{ .mIndex = connection.mIndex,
+                                 .mCode = code,
+                                 .mError = std::move( error ),
+                                 .mTimings = connection.mTimings } );
+
+        // Wake up the operations that are still queued.
+        if ( connection.mSocket != nullptr )
+        {
+            shutdown( static_cast<int>( connection.mSocket->Handle() ),
+                      SHUT_RDWR );
+        }
+
+        Release( slot );
+    }
+
+    void Release( const size_t slot ) noexcept
+    {
+        auto& connection = mConnections[slot];
+
+        if ( connection.mPending != 0 )
+        {
+            return;
+        }
+
+        connection.mSocket.reset();
+        connection.mResolution.reset();
+
+        mFree.push_back( slot );
+        mActive--;
+    }
+
+    CUring& mRing;
+    std::span<const FanoutTarget> mTargets;
+    CWorkQueue& mQueue;
+    size_t mWorker;
+    /// False once the queue ran out of targets.
+    bool mMore = true;
+    Timeouts mTimeouts;
+    SocketOptions mSocketOptions;
+    /// The addresses of the targets, by their index.
+    CFanout::Resolutions mResolutions;
+    const CFanout::Callback& mOnResult;
+    /// Why the loop can't go on, empty while it can.
+    std::string mError;
+    std::vector<char> mSlab;
+    bool mFixed = false;
+    std::vector<Connection> mConnections;
+    std::vector<size_t> mFree;
+    size_t mActive = 0;
+};
+
+} // namespace
+
+bool CFanout::RunUring( const std::span<const FanoutTarget> targets,
+                        CWorkQueue& queue, const size_t worker,
+                        const Resolutions resolutions,
+                        const size_t maxInFlight,
+                        const Callback& onResult ) noexcept
+{
+    const auto slots = std::min( maxInFlight, targets.size() );
+
+    // Three entries per connection, the queue is flushed when it fills up.
+    const auto entries = std::bit_ceil( static_cast<uint32_t>(
+        std::clamp( slots * 3, size_t{ 8 }, size_t{ 4096 } ) ) );
+
+    const auto ring = CUring::Create( entries );
+
+    if ( ring == nullptr )
+    {
+        return false;
+    }
+
+    CUringLoop loop{ *ring, targets, queue, worker, slots, mTimeouts,
+                     mSocketOptions, resolutions, onResult };
+
+    loop.Run();
+
+    return true;
+}
+
+} // namespace btcmd
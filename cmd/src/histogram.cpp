@@ -0,0 +1,116 @@
+//-----------------------------------------------------------------------------
+// Copyright 2024 Igor Spichkin
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//-----------------------------------------------------------------------------
+
+#include "histogram.hpp"
+#include <algorithm>
+#include <bit>
+#include <cmath>
+
+namespace btcmd
+{
+
+void CHistogram::Record( const std::chrono::nanoseconds value ) noexcept
+{
+    const auto ns =
+        static_cast<uint64_t>( std::max<int64_t>( value.count(), 0 ) );
+
+    mCounts[IndexOf( ns )]++;
+    mCount++;
+    mMax = std::max( mMax, ns );
+    mSum += ns;
+}
+
+void CHistogram::Merge( const CHistogram& other ) noexcept
+{
+    for ( size_t i = 0; i < mCounts.size(); i++ )
+    {
+        mCounts[i] += other.mCounts[i];
+    }
+
+    mCount += other.mCount;
+    mMax = std::max( mMax, other.mMax );
+    mSum += other.mSum;
+}
+
+std::chrono::nanoseconds
+CHistogram::Percentile( const double percentile ) const noexcept
+{
+    if ( mCount == 0 )
+    {
+        return std::chrono::nanoseconds{ 0 };
+    }
+
+    const auto rank = std::max<uint64_t>(
+        static_cast<uint64_t>(
+            std::ceil( std::clamp( percentile, 0.0, 100.0 ) / 100 * mCount ) ),
+        1 );
+
+    uint64_t seen = 0;
+
+    for ( size_t i = 0; i < mCounts.size(); i++ )
+    {
+        seen += mCounts[i];
+
+        if ( seen >= rank )
+        {
+            return std::chrono::nanoseconds{ static_cast<int64_t>(
+                std::min( HighestValueOf( i ), mMax ) ) };
+        }
+    }
+
+    return Max();
+}
+
+std::chrono::nanoseconds CHistogram::Max() const noexcept
+{
+    return std::chrono::nanoseconds{ static_cast<int64_t>( mMax ) };
+}
+
+uint64_t CHistogram::Count() const noexcept
+{
+    return mCount;
+}
+
+std::chrono::nanoseconds CHistogram::Sum() const noexcept
+{
+    return std::chrono::nanoseconds{ static_cast<int64_t>( mSum ) };
+}
+
+size_t CHistogram::IndexOf( uint64_t value ) noexcept
+{
+    value = std::min( value, ( uint64_t{ 1 } << MaxBits ) - 1 );
+
+    // Values below SubBucketCount are exact, every next power of two is
+    // split into SubBucketHalf buckets.
+    const auto bits = static_cast<unsigned>( std::bit_width( value ) );
+    const auto shift = std::max( bits, SubBucketBits ) - SubBucketBits;
+
+    return shift * SubBucketHalf + ( value >> shift );
+}
+
+uint64_t CHistogram::HighestValueOf( const size_t index ) noexcept
+{
+    if ( index < SubBucketCount )
+    {
+        return index;
+    }
+
+    const auto shift = index / SubBucketHalf - 1;
+    const auto subBucket = index - shift * SubBucketHalf;
+
+    return ( ( subBucket + 1 ) << shift ) - 1;
+}
+
+} // namespace btcmd
@@ -0,0 +1,66 @@
+//-----------------------------------------------------------------------------
+// Copyright 2024 Igor Spichkin
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//-----------------------------------------------------------------------------
+
+#pragma once
+
+#include <array>
+#include <chrono>
+#include <cstdint>
+
+namespace btcmd
+{
+
+/// A log-linear histogram of durations in the spirit of HdrHistogram: values
+/// are kept with 7 significant bits, under 1% of error, up to about 18
+/// minutes.
+class CHistogram final
+{
+  public:
+    void Record( std::chrono::nanoseconds value ) noexcept;
+
+    void Merge( const CHistogram& other ) noexcept;
+
+    /// \param percentile from 0 to 100.
+    /// \returns the highest value of the bucket the percentile falls into.
+    [[nodiscard]] std::chrono::nanoseconds
+    Percentile( double percentile ) const noexcept;
+
+    [[nodiscard]] std::chrono::nanoseconds Max() const noexcept;
+
+    [[nodiscard]] uint64_t Count() const noexcept;
+
+    /// \returns the sum of recorded values.
+    [[nodiscard]] std::chrono::nanoseconds Sum() const noexcept;
+
+  private:
+    static constexpr unsigned SubBucketBits = 7;
+    static constexpr uint64_t SubBucketCount = 1 << SubBucketBits;
+    static constexpr uint64_t SubBucketHalf = SubBucketCount / 2;
+    /// Values up to 2^40 ns.
+    static constexpr unsigned MaxBits = 40;
+    static constexpr size_t BucketCount =
+        ( MaxBits - SubBucketBits + 1 ) * SubBucketHalf + SubBucketHalf;
+
+    [[nodiscard]] static size_t IndexOf( uint64_t value ) noexcept;
+
+    [[nodiscard]] static uint64_t HighestValueOf( size_t index ) noexcept;
+
+    std::array<uint64_t, BucketCount> mCounts{};
+    uint64_t mCount = 0;
+    uint64_t mMax = 0;
+    uint64_t mSum = 0;
+};
+
+} // namespace btcmd
@@ -13,65 +13,597 @@
 // limitations under the License.
 //-----------------------------------------------------------------------------
 
+#include "bench.hpp"
 #include "bt/bt.hpp"
+#include "bt/cache.hpp"
+#include "fanout.hpp"
+#include "metrics.hpp"
+#include "mpsc_queue.hpp"
+#include "output.hpp"
+#include "resolver.hpp"
+#include "session.hpp"
 #include "socket.hpp"
-#include "socket_buffer.hpp"
-#include <algorithm>
-#include <array>
+#include "watch.hpp"
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
 #include <format>
+#include <fstream>
 #include <iostream>
+#include <limits>
+#include <map>
+#include <optional>
 #include <string>
+#include <string_view>
+#include <thread>
+#include <unordered_map>
+#include <utility>
 #include <vector>
 
+enum class EInput
+{
+    /// The message is passed as an argument.
+    Argument,
+    Stdin,
+    Batch,
+    Fanout
+};
+
 struct Args final
 {
     std::string mAddr;
     std::string mMessage;
+    EInput mInput = EInput::Argument;
+    /// A file for --batch and --fanout, "-" is stdin.
+    std::string mInputFile;
+    size_t mMaxInFlight = 64;
+    /// Event loops of --fanout, each on its own thread.
+    size_t mThreads = 1;
+    btcmd::Timeouts mTimeouts;
+    btcmd::SocketOptions mSocketOptions;
+    /// How long resolved names and failed lookups are cached.
+    std::chrono::milliseconds mDnsTtl{ 60000 };
+    std::chrono::milliseconds mDnsNegativeTtl{ 5000 };
+    /// Print the phase timings of every topic.
+    bool mTimings = false;
+    /// A file to keep the Prometheus metrics in, none if empty.
+    std::string mMetricsFile;
+    btcmd::EFormat mFormat = btcmd::EFormat::Text;
+    /// The topics whose replies are reused, none by default.
+    bt::CachePolicy mCachePolicy;
+    size_t mCacheSize = 16 * 1024 * 1024;
+    /// `bt bench`, the address and the message are the positional arguments.
+    bool mBench = false;
+    size_t mConnections = 1;
+    double mRate = 100;
+    std::chrono::milliseconds mDuration{ 10000 };
+    /// `bt watch`, the file is the positional argument.
+    bool mWatch = false;
+    std::chrono::milliseconds mInterval{ 5000 };
+    /// A tenth of the interval if not set.
+    std::optional<std::chrono::milliseconds> mJitter;
+};
+
+/// How often the metrics file is rewritten.
+constexpr std::chrono::milliseconds MetricsInterval{ 5000 };
+
+/// Where the phase timings of the topics go.
+struct Instruments final
+{
+    bool mTimings = false;
+    btcmd::CMetrics* mMetrics = nullptr;
+    /// The address of the session modes.
+    std::string mTarget;
+
+    /// Prints the timings as a JSON line to stderr and adds them to the
+    /// metrics, as enabled. Can be called from any thread.
+    void Report( const std::string_view target,
+                 const btcmd::CTimings& timings, const bool ok ) const
+    {
+        if ( mTimings )
+        {
+            // One write per line, so lines of different threads don't mix.
+            std::cerr << timings.ToJson( target ) + '\n';
+        }
+
+        if ( mMetrics != nullptr )
+        {
+            mMetrics->Record( timings, ok );
+        }
+    }
 };
 
-void PrintHelp() noexcept
+void PrintHelp( std::ostream& out ) noexcept
 {
-    std::cout << "Usage: bt <NODE>:<PORT> <MESSAGE>\nExample: bt "
-                 "127.0.0.1:8080 ?ping\n";
+    out << "Usage: bt <NODE>:<PORT> <MESSAGE>\n"
+                 "       bt <NODE>:<PORT> --stdin\n"
+                 "       bt <NODE>:<PORT> --batch <FILE>\n"
+                 "       bt --fanout <FILE> [--max-in-flight <N>] "
+                 "[--threads <N>]\n"
+                 "       bt bench <NODE>:<PORT> <MESSAGE> [--connections <N>] "
+                 "[--rate <R>]\n"
+                 "                [--duration <T>]\n"
+                 "       bt watch <FILE> [--interval <T>] [--jitter <T>]\n"
+                 "\n"
+                 "Timeouts (\"500ms\", \"2s\", \"1m\", seconds by default, "
+                 "none by default):\n"
+                 "  --resolve-timeout <T>     name resolution\n"
+                 "  --connect-timeout <T>     establishing the connection\n"
+                 "  --first-byte-timeout <T>  waiting for the reply after "
+                 "sending\n"
+                 "  --timeout <T>             the whole topic, from the "
+                 "connection to the reply\n"
+                 "\n"
+                 "Sockets:\n"
+                 "  --fast-open               TCP Fast Open, new connections "
+                 "send the topic in the\n"
+                 "                            SYN once the server gave out a "
+                 "cookie (Linux)\n"
+                 "  --low-latency             TCP_NODELAY, TCP_QUICKACK and "
+                 "SO_BUSY_POLL, at the\n"
+                 "                            cost of CPU time\n"
+                 "\n"
+                 "Instrumentation:\n"
+                 "  --timings                 print the time until the end "
+                 "of each phase of every\n"
+                 "                            topic as a JSON line to "
+                 "stderr\n"
+                 "  --metrics <FILE>          keep topic counters and phase "
+                 "histograms in the file\n"
+                 "                            in the Prometheus text format, "
+                 "rewritten every 5s\n"
+                 "\n"
+                 "Output:\n"
+                 "  --format <F>              text (default), jsonl, tsv or "
+                 "raw records with the\n"
+                 "                            target, the reply type, the "
+                 "latency and the error\n"
+                 "                            code, see the README. In text, "
+                 "errors go to stderr\n"
+                 "\n"
+                 "Reply cache, for topics that don't change anything on the "
+                 "server:\n"
+                 "  --cache <TOPIC>=<T>       reuse the reply to the topic "
+                 "for <T>, a trailing '*'\n"
+                 "                            matches any suffix, the first "
+                 "match wins; repeated\n"
+                 "                            --fanout targets are queried "
+                 "once\n"
+                 "  --cache-size <N>[K|M|G]   the memory the replies may "
+                 "take (16M by default)\n"
+                 "\n"
+                 "Name resolution cache:\n"
+                 "  --dns-ttl <T>             keep resolved names (60s by "
+                 "default, 0 disables)\n"
+                 "  --dns-negative-ttl <T>    keep failed lookups (5s by "
+                 "default)\n"
+                 "\n"
+                 "--stdin and --batch read newline-delimited messages and "
+                 "print one reply per line.\n"
+                 "--fanout reads \"<NODE>:<PORT> <MESSAGE>\" lines (\"-\" "
+                 "is stdin), queries up to\n"
+                 "<N> targets at once (64 by default) and prints "
+                 "\"<NODE>:<PORT>\\t<REPLY>\" lines\n"
+                 "as they complete. --threads runs <N> event loops (1 by "
+                 "default) that share the\n"
+                 "targets and the <N> of --max-in-flight, and prints the "
+                 "lines in the order of\n"
+                 "the targets.\n"
+                 "\n"
+                 "bench sends the message <R> times per second (100 by "
+                 "default) over <N>\n"
+                 "connections (1 by default) for <T> (10s by default) and "
+                 "prints the latency\n"
+                 "percentiles, counted from the time each topic was "
+                 "scheduled, and the errors.\n"
+                 "\n"
+                 "watch polls the \"<NODE>:<PORT> <MESSAGE>\" lines of the "
+                 "file every <T> (5s by\n"
+                 "default), each poll moved by up to the --jitter (a tenth "
+                 "of the interval by\n"
+                 "default) either way, keeping the connections open. A "
+                 "target is printed when\n"
+                 "its first reply comes and then whenever the reply or the "
+                 "error changes.\n"
+                 "The total --timeout is the interval by default.\n"
+                 "\n"
+                 "Example: bt 127.0.0.1:8080 ?ping\n";
 }
 
-[[nodiscard]] Args ParseArgs( const int argc, const char* argv[] ) noexcept
+[[noreturn]] void InvalidCommand( const std::string& message ) noexcept
 {
-    Args args{};
+    std::cerr << message << '\n';
+
+    PrintHelp( std::cerr );
+
+    std::exit( -1 );
+}
+
+/// Parses "<NUMBER>[K|M|G]", bytes if there is no unit.
+[[nodiscard]] size_t ParseSize( const std::string& option,
+                                const std::string& value ) noexcept
+{
+    size_t number = 0;
+    size_t end = 0;
 
-    if ( argc < 3 )
+    // std::stoull takes "-1" as the largest number.
+    const bool digit = !value.empty() && value[0] >= '0' && value[0] <= '9';
+
+    try
+    {
+        number = digit ? std::stoull( value, &end ) : 0;
+    }
+    catch ( const std::exception& )
+    {
+        end = 0;
+    }
+
+    const auto unit = std::string_view{ value }.substr( end );
+    constexpr std::string_view units = "KMG";
+    const auto scale = unit.size() == 1 ? units.find( unit[0] ) : 0;
+    const auto shift = unit.empty() ? 0 : 10 * ( scale + 1 );
+
+    if ( end == 0 || unit.size() > 1 || scale == std::string_view::npos ||
+         number > SIZE_MAX >> shift )
+    {
+        InvalidCommand(
+            std::format( "Invalid command: invalid {}: {}", option, value ) );
+    }
+
+    return number << shift;
+}
+
+/// Parses "<NUMBER>[ms|s|m]", seconds if there is no unit.
+[[nodiscard]] std::chrono::milliseconds
+ParseDuration( const std::string& option, const std::string& value ) noexcept
+{
+    double number;
+    size_t end;
+
+    try
     {
-        std::cout << "Invalid command: an address with a message required\n";
+        number = std::stod( value, &end );
+    }
+    catch ( const std::exception& )
+    {
+        InvalidCommand(
+            std::format( "Invalid command: invalid {}: {}", option, value ) );
+    }
 
-        PrintHelp();
+    const auto unit = std::string_view{ value }.substr( end );
+    double scale;
 
-        std::exit( -1 );
+    if ( unit == "ms" )
+    {
+        scale = 1;
+    }
+    else if ( unit.empty() || unit == "s" )
+    {
+        scale = 1000;
+    }
+    else if ( unit == "m" )
+    {
+        scale = 60 * 1000;
+    }
+    else
+    {
+        InvalidCommand(
+            std::format( "Invalid command: invalid {}: {}", option, value ) );
     }
 
-    args.mAddr = std::string{ argv[1] };
-    args.mMessage = std::string{ argv[2] };
+    const auto milliseconds = number * scale;
 
-    if ( argc == 3 )
+    // NaN, infinities and values that don't fit can't be converted.
+    if ( !std::isfinite( milliseconds ) || milliseconds < 0 ||
+         milliseconds >= static_cast<double>( std::numeric_limits<
+                             std::chrono::milliseconds::rep>::max() ) )
     {
-        return args;
+        InvalidCommand(
+            std::format( "Invalid command: invalid {}: {}", option, value ) );
     }
 
+    return std::chrono::milliseconds{
+        static_cast<std::chrono::milliseconds::rep>( milliseconds ) };
+}
+
+[[nodiscard]] Args ParseArgs( const int argc, const char* argv[] ) noexcept
+{
+    Args args{};
+
     std::vector<std::string> options;
-    options.reserve( argc - 3 );
+    options.reserve( argc - 1 );
 
-    for ( size_t i = 3; i < argc; i++ )
+    for ( size_t i = 1; i < argc; i++ )
     {
         options.emplace_back( argv[i] );
     }
 
-    for ( const auto& arg : options )
+    if ( !options.empty() && options.front() == "bench" )
+    {
+        args.mBench = true;
+        options.erase( options.begin() );
+    }
+    else if ( !options.empty() && options.front() == "watch" )
+    {
+        args.mWatch = true;
+        options.erase( options.begin() );
+    }
+
+    // "--option=value" is the same as "--option value".
+    std::optional<std::string> inlineValue;
+
+    const auto value = [&]( size_t& i ) -> const std::string&
+    {
+        if ( inlineValue )
+        {
+            options[i] = *std::exchange( inlineValue, std::nullopt );
+
+            return options[i];
+        }
+
+        if ( i + 1 == options.size() )
+        {
+            InvalidCommand( std::format( "Invalid command: {} requires a value",
+                                         options[i] ) );
+        }
+
+        return options[++i];
+    };
+
+    std::vector<std::string> positional;
+
+    for ( size_t i = 0; i < options.size(); i++ )
+    {
+        if ( const auto del = options[i].find( '=' );
+             options[i].starts_with( "--" ) && del != std::string::npos )
+        {
+            inlineValue = options[i].substr( del + 1 );
+            options[i].resize( del );
+        }
+
+        const auto arg = options[i];
+
+        if ( arg == "--stdin" )
+        {
+            args.mInput = EInput::Stdin;
+        }
+        else if ( arg == "--batch" )
+        {
+            args.mInput = EInput::Batch;
+            args.mInputFile = value( i );
+        }
+        else if ( arg == "--fanout" )
+        {
+            args.mInput = EInput::Fanout;
+            args.mInputFile = value( i );
+        }
+        else if ( arg == "--max-in-flight" )
+        {
+            const auto& number = value( i );
+
+            try
+            {
+                args.mMaxInFlight = std::stoul( number );
+            }
+            catch ( const std::exception& )
+            {
+                InvalidCommand( std::format(
+                    "Invalid command: invalid --max-in-flight: {}", number ) );
+            }
+        }
+        else if ( arg == "--threads" )
+        {
+            const auto& number = value( i );
+
+            try
+            {
+                args.mThreads = std::stoul( number );
+            }
+            catch ( const std::exception& )
+            {
+                InvalidCommand( std::format(
+                    "Invalid command: invalid --threads: {}", number ) );
+            }
+
+            if ( args.mThreads == 0 )
+            {
+                InvalidCommand( std::format(
+                    "Invalid command: invalid --threads: {}", number ) );
+            }
+        }
+        else if ( arg == "--connections" )
+        {
+            const auto& number = value( i );
+
+            try
+            {
+                args.mConnections = std::stoul( number );
+            }
+            catch ( const std::exception& )
+            {
+                InvalidCommand( std::format(
+                    "Invalid command: invalid --connections: {}", number ) );
+            }
+
+            if ( args.mConnections == 0 )
+            {
+                InvalidCommand( std::format(
+                    "Invalid command: invalid --connections: {}", number ) );
+            }
+        }
+        else if ( arg == "--rate" )
+        {
+            const auto& number = value( i );
+
+            try
+            {
+                args.mRate = std::stod( number );
+            }
+            catch ( const std::exception& )
+            {
+                InvalidCommand( std::format(
+                    "Invalid command: invalid --rate: {}", number ) );
+            }
+
+            if ( !( args.mRate > 0 ) )
+            {
+                InvalidCommand( std::format(
+                    "Invalid command: invalid --rate: {}", number ) );
+            }
+        }
+        else if ( arg == "--duration" )
+        {
+            args.mDuration = ParseDuration( arg, value( i ) );
+        }
+        else if ( arg == "--interval" )
+        {
+            const auto& interval = value( i );
+            args.mInterval = ParseDuration( arg, interval );
+
+            if ( args.mInterval.count() == 0 )
+            {
+                InvalidCommand( std::format(
+                    "Invalid command: invalid --interval: {}", interval ) );
+            }
+        }
+        else if ( arg == "--jitter" )
+        {
+            args.mJitter = ParseDuration( arg, value( i ) );
+        }
+        else if ( arg == "--resolve-timeout" )
+        {
+            args.mTimeouts.mResolve = ParseDuration( arg, value( i ) );
+        }
+        else if ( arg == "--connect-timeout" )
+        {
+            args.mTimeouts.mConnect = ParseDuration( arg, value( i ) );
+        }
+        else if ( arg == "--first-byte-timeout" )
+        {
+            args.mTimeouts.mFirstByte = ParseDuration( arg, value( i ) );
+        }
+        else if ( arg == "--timeout" )
+        {
+            args.mTimeouts.mTotal = ParseDuration( arg, value( i ) );
+        }
+        else if ( arg == "--fast-open" )
+        {
+            args.mSocketOptions.mFastOpen = true;
+        }
+        else if ( arg == "--low-latency" )
+        {
+            args.mSocketOptions.mLowLatency = true;
+        }
+        else if ( arg == "--timings" )
+        {
+            args.mTimings = true;
+        }
+        else if ( arg == "--metrics" )
+        {
+            args.mMetricsFile = value( i );
+        }
+        else if ( arg == "--format" )
+        {
+            const auto& name = value( i );
+
+            if ( const auto format = btcmd::ParseFormat( name ) )
+            {
+                args.mFormat = *format;
+            }
+            else
+            {
+                InvalidCommand(
+                    std::format( "Invalid command: invalid --format: {}",
+                                 name ) );
+            }
+        }
+        else if ( arg == "--cache" )
+        {
+            const auto& rule = value( i );
+            const auto del = rule.find_last_of( '=' );
+
+            if ( del == std::string::npos )
+            {
+                InvalidCommand( std::format(
+                    "Invalid command: invalid --cache: {}", rule ) );
+            }
+
+            const auto ttl = ParseDuration( arg, rule.substr( del + 1 ) );
+            args.mCachePolicy.add( rule.substr( 0, del ), ttl );
+        }
+        else if ( arg == "--cache-size" )
+        {
+            args.mCacheSize = ParseSize( arg, value( i ) );
+        }
+        else if ( arg == "--dns-ttl" )
+        {
+            args.mDnsTtl = ParseDuration( arg, value( i ) );
+        }
+        else if ( arg == "--dns-negative-ttl" )
+        {
+            args.mDnsNegativeTtl = ParseDuration( arg, value( i ) );
+        }
+        else if ( arg.starts_with( "--" ) )
+        {
+            InvalidCommand( std::format( "Unknown argument: {}", arg ) );
+        }
+        else
+        {
+            positional.push_back( arg );
+        }
+
+        if ( inlineValue )
+        {
+            InvalidCommand( std::format(
+                "Invalid command: {} doesn't take a value", arg ) );
+        }
+    }
+
+    if ( args.mBench && args.mInput != EInput::Argument )
+    {
+        InvalidCommand( "Invalid command: bench takes the message as an "
+                        "argument" );
+    }
+
+    if ( args.mWatch && args.mInput != EInput::Argument )
+    {
+        InvalidCommand( "Invalid command: watch takes the file as an "
+                        "argument" );
+    }
+
+    // Fan-out targets come from the file.
+    const size_t expected = args.mInput == EInput::Fanout     ? 0
+                            : args.mWatch                     ? 1
+                            : args.mInput == EInput::Argument ? 2
+                                                              : 1;
+
+    if ( positional.size() < expected )
     {
+        InvalidCommand(
+            args.mWatch
+                ? "Invalid command: a file with the targets required"
+                : "Invalid command: an address with a message required" );
+    }
 
-        std::cout << std::format( "Unknown argument: {}\n", arg );
+    if ( positional.size() > expected )
+    {
+        InvalidCommand(
+            std::format( "Unknown argument: {}", positional[expected] ) );
+    }
 
-        PrintHelp();
+    if ( args.mWatch )
+    {
+        args.mInputFile = positional[0];
+    }
+    else if ( expected >= 1 )
+    {
+        args.mAddr = positional[0];
+    }
 
-        std::exit( -1 );
+    if ( expected == 2 )
+    {
+        args.mMessage = positional[1];
     }
 
     return args;
@@ -83,163 +615,582 @@ struct AddressPair final
     std::string mPort;
 };
 
-AddressPair ParseAddress( const std::string& address ) noexcept
+/// Splits "<NODE>:<PORT>".
+[[nodiscard]] btcmd::CExpected<AddressPair>
+ParseAddress( const std::string& address ) noexcept
 {
-    std::string node;
-    std::string port;
+    const auto del = address.find_last_of( ':' );
+
+    if ( del == std::string::npos || del == 0 || del + 1 == address.size() )
+    {
+        return btcmd::Error{ .mCode = btcmd::EError::InvalidAddress };
+    }
+
+    return AddressPair{ .mNode = address.substr( 0, del ),
+                        .mPort = address.substr( del + 1 ) };
+}
+
+/// Sends the message, or reuses a cached reply, and writes the reply or the
+/// error.
+/// \returns false on error.
+bool Query( btcmd::CSession& session, const std::string& message,
+            const Instruments& instruments, btcmd::COutput& output,
+            const bt::CachePolicy& policy, bt::ReplyCache& cache ) noexcept
+{
+    btcmd::Record record{ .mTarget = instruments.mTarget };
+
+    if ( message.size() + 6 > UINT16_MAX )
+    {
+        record.mError = btcmd::EError::TooLong;
+        record.mMessage = "Fail to encode the message: data is too long";
+        output.Write( record );
+
+        return false;
+    }
 
+    const auto ttl = policy.ttl( message );
+    std::vector<char> packet;
+
+    if ( ttl )
     {
-        const auto del = address.find_last_of( ':' );
+        const auto start = btcmd::Clock::now();
+        packet = bt::encode( message ).second;
 
-        if ( del == std::string::npos )
+        if ( const auto cached = cache.find( instruments.mTarget, packet ) )
         {
-            std::cout << std::format( "Invalid address: {}\n", address );
+            record.mReply = &cached->reply();
+            record.mLatency = btcmd::Clock::now() - start;
+            output.Write( record );
 
-            std::exit( -1 );
+            return true;
         }
+    }
+
+    bt::Decoder decoder;
+    const auto error = session.Query( message, decoder );
+
+    instruments.Report( instruments.mTarget, session.Timings(), error.Ok() );
+
+    record.mLatency = session.Timings().Latency();
+
+    std::string errorMessage;
 
-        node = address.substr( 0, del );
-        port = address.substr( del + 1 );
+    if ( error.Ok() )
+    {
+        record.mReply = &decoder.reply();
+
+        // A reply that doesn't encode back into one reply is still written,
+        // from the decoder, but not cached.
+        if ( ttl )
+        {
+            if ( auto cached = bt::CachedReply::from_reply( decoder.reply() ) )
+            {
+                cache.insert( instruments.mTarget, packet, std::move( cached ),
+                              *ttl );
+            }
+        }
+    }
+    else
+    {
+        errorMessage = btcmd::ToMessage( error );
+        record.mError = error.mCode;
+        record.mMessage = errorMessage;
     }
 
-    return AddressPair{ .mNode = std::move( node ),
-                        .mPort = std::move( port ) };
+    output.Write( record );
+
+    return record.mReply != nullptr;
 }
 
-int main( const int argc, const char* argv[] )
+/// Calls `callback` with every non-empty line, without the line break.
+template <typename Callback>
+void ForEachLine( std::istream& input, Callback&& callback ) noexcept
 {
-    const auto args = ParseArgs( argc, argv );
-    const auto wsa = btcmd::CWSAGuard::Create();
+    std::string line;
+
+    while ( std::getline( input, line ) )
+    {
+        if ( !line.empty() && line.back() == '\r' )
+        {
+            line.pop_back();
+        }
+
+        if ( line.empty() )
+        {
+            continue;
+        }
+
+        callback( line );
+    }
+}
+
+/// Sends every non-empty line as a message.
+/// \returns false if any of the messages failed.
+bool QueryLines( btcmd::CSession& session, std::istream& input,
+                 const Instruments& instruments, btcmd::COutput& output,
+                 const bt::CachePolicy& policy, bt::ReplyCache& cache ) noexcept
+{
+    bool ok = true;
+
+    ForEachLine( input,
+                 [&]( const std::string& line )
+                 {
+                     ok &= Query( session, line, instruments, output, policy,
+                                  cache );
+
+                     // Whoever writes the input may wait for the replies
+                     // before writing more.
+                     if ( input.rdbuf()->in_avail() <= 0 )
+                     {
+                         output.Flush();
+                     }
+                 } );
+
+    return ok;
+}
+
+#ifdef BTCMD_EPOLL
+
+/// Reports a line that is skipped because of its address.
+void WriteInvalidAddress( const std::string& address,
+                          btcmd::COutput& output )
+{
+    const auto message = std::format( "Invalid address: {}", address );
+
+    output.Write( btcmd::Record{ .mTarget = address,
+                                 .mError = btcmd::EError::InvalidAddress,
+                                 .mMessage = message } );
+}
+
+[[nodiscard]] btcmd::Record
+ToRecord( const std::string& address,
+          const btcmd::FanoutResult& result ) noexcept
+{
+    const auto ok = result.mCode == btcmd::EError::None;
+
+    return btcmd::Record{ .mTarget = address,
+                          .mReply = ok ? &result.mReply : nullptr,
+                          .mError = result.mCode,
+                          .mMessage = result.mError,
+                          .mLatency = result.mTimings.Latency() };
+}
 
-    std::vector<char> encodedMessage;
+/// Queries "<NODE>:<PORT> <MESSAGE>" lines concurrently. Repeated lines
+/// with a cached topic are queried once and share the result.
+/// \returns false if any of the targets failed.
+bool Fanout( std::istream& input, const Args& args,
+             btcmd::CResolver& resolver, const Instruments& instruments,
+             btcmd::COutput& output ) noexcept
+{
+    std::vector<std::string> addresses;
+    std::vector<btcmd::FanoutTarget> targets;
+    /// How many times each target is printed.
+    std::vector<size_t> copies;
+    /// The target of each cached line.
+    std::unordered_map<std::string, size_t> coalesced;
+    /// False if any of the lines has an invalid address.
+    bool valid = true;
+
+    ForEachLine( input,
+                 [&]( const std::string& line )
+                 {
+                     const auto del = line.find_first_of( " \t" );
+                     auto address = line.substr( 0, del );
+                     auto message = del == std::string::npos
+                                        ? std::string{}
+                                        : line.substr( del + 1 );
+
+                     // Each invalid line reports its own error.
+                     auto parsed = ParseAddress( address );
+
+                     if ( !parsed )
+                     {
+                         valid = false;
+                         WriteInvalidAddress( address, output );
+
+                         return;
+                     }
+
+                     if ( args.mCachePolicy.ttl( message ) )
+                     {
+                         const auto [it, inserted] = coalesced.emplace(
+                             address + '\0' + message, targets.size() );
+
+                         if ( !inserted )
+                         {
+                             copies[it->second]++;
+
+                             return;
+                         }
+                     }
+
+                     auto& [node, port] = *parsed;
+
+                     addresses.push_back( std::move( address ) );
+                     copies.push_back( 1 );
+                     targets.push_back( btcmd::FanoutTarget{
+                         .mNode = std::move( node ),
+                         .mPort = std::move( port ),
+                         .mMessage = std::move( message ) } );
+                 } );
+
+    btcmd::CFanout fanout{ args.mMaxInFlight, args.mTimeouts, resolver,
+                           args.mThreads, args.mSocketOptions };
 
+    if ( args.mThreads == 1 )
     {
-        bt::EResult result;
+        bool ok = true;
 
-        std::tie( result, encodedMessage ) = bt::encode( args.mMessage );
+        fanout.Run( targets,
+                    [&]( const btcmd::FanoutResult& result )
+                    {
+                        const auto& address = addresses[result.mIndex];
+                        const auto record = ToRecord( address, result );
 
-        if ( result != bt::EResult::Ok )
+                        ok &= record.mReply != nullptr;
+
+                        for ( size_t i = 0; i < copies[result.mIndex]; i++ )
+                        {
+                            output.Write( record );
+                        }
+
+                        instruments.Report( address, result.mTimings,
+                                            record.mReply != nullptr );
+                    } );
+
+        return ok && valid;
+    }
+
+    // The workers format their records, this thread only writes them in the
+    // order of the targets.
+    btcmd::CMpscQueue<std::pair<size_t, std::string>> records;
+    std::atomic<bool> ok = true;
+
+    const auto format = [&]( const btcmd::FanoutResult& result )
+    {
+        const auto& address = addresses[result.mIndex];
+        const auto record = ToRecord( address, result );
+
+        thread_local std::string formatted;
+        formatted.clear();
+        output.Format( record, formatted );
+
+        if ( record.mReply == nullptr )
         {
-            switch ( result )
+            ok.store( false, std::memory_order_relaxed );
+        }
+
+        std::string lines;
+
+        for ( size_t i = 0; i < copies[result.mIndex]; i++ )
+        {
+            if ( output.ToStderr( record ) )
+            {
+                // One write per line, so lines of different threads don't
+                // mix.
+                std::cerr << formatted;
+            }
+            else
             {
-            case bt::EResult::DataTooLong:
-                std::cout << "Fail to encode the message: data is too long\n";
-            default:
-                return -1;
+                lines += formatted;
             }
         }
+
+        // Sent even if empty, the targets after it wait for it.
+        records.Push( std::make_pair( result.mIndex, std::move( lines ) ) );
+
+        instruments.Report( address, result.mTimings,
+                            record.mReply != nullptr );
+    };
+
+    std::jthread run{ [&]
+                      {
+                          fanout.Run( targets, format );
+                          records.Close();
+                      } };
+
+    /// The records that came before the ones of the targets ahead of them.
+    std::map<size_t, std::string> early;
+    size_t next = 0;
+
+    while ( true )
+    {
+        auto record = records.TryPop();
+
+        // Write out what is buffered while the workers are busy.
+        if ( !record )
+        {
+            output.Flush();
+            record = records.Pop();
+        }
+
+        if ( !record )
+        {
+            break;
+        }
+
+        if ( record->first != next )
+        {
+            early.emplace( record->first, std::move( record->second ) );
+
+            continue;
+        }
+
+        output.WriteFormatted( record->second );
+        next++;
+
+        for ( auto it = early.begin();
+              it != early.end() && it->first == next; it = early.erase( it ) )
+        {
+            output.WriteFormatted( it->second );
+            next++;
+        }
     }
 
-    auto [node, port] = ParseAddress( args.mAddr );
-    auto socket = btcmd::CreateSocket( node, port );
+    return ok.load() && valid;
+}
+
+/// Polls "<NODE>:<PORT> <MESSAGE>" lines until killed and writes the
+/// replies that changed. Returns only if the event loop fails.
+void Watch( std::istream& input, const Args& args, btcmd::CResolver& resolver,
+            const Instruments& instruments, btcmd::COutput& output ) noexcept
+{
+    std::vector<std::string> addresses;
+    std::vector<btcmd::FanoutTarget> targets;
+
+    ForEachLine( input,
+                 [&]( const std::string& line )
+                 {
+                     const auto del = line.find_first_of( " \t" );
+                     auto address = line.substr( 0, del );
+                     auto parsed = ParseAddress( address );
 
-    socket->Connect();
-    socket->Send( encodedMessage );
+                     if ( !parsed )
+                     {
+                         WriteInvalidAddress( address, output );
 
-    btcmd::CSocketBuffer socketBuffer{ std::move( socket ) };
+                         return;
+                     }
+
+                     auto& [node, port] = *parsed;
+
+                     addresses.push_back( std::move( address ) );
+                     targets.push_back( btcmd::FanoutTarget{
+                         .mNode = std::move( node ),
+                         .mPort = std::move( port ),
+                         .mMessage = del == std::string::npos
+                                         ? std::string{}
+                                         : line.substr( del + 1 ) } );
+                 } );
+
+    btcmd::CWatch watch{
+        btcmd::WatchOptions{ .mInterval = args.mInterval,
+                             .mJitter = args.mJitter.value_or(
+                                 args.mInterval / 10 ),
+                             .mTimeouts = args.mTimeouts,
+                             .mSocket = args.mSocketOptions },
+        resolver };
+
+    watch.Run(
+        targets,
+        [&]( const btcmd::FanoutResult& result )
+        { output.Write( ToRecord( addresses[result.mIndex], result ) ); },
+        [&]( const btcmd::FanoutResult& result )
+        {
+            instruments.Report( addresses[result.mIndex], result.mTimings,
+                                result.mCode == btcmd::EError::None );
+        },
+        [&] { output.Flush(); } );
+}
 
-    std::array<char, 2> magic;
+#endif
 
-    if ( !socketBuffer.Read( magic ) )
+/// Runs `bt bench` and prints the report.
+/// \returns false if any of the topics failed.
+bool Bench( const Args& args, btcmd::CResolver& resolver,
+            btcmd::CMetrics* metrics ) noexcept
+{
+    if ( args.mMessage.size() + 6 > UINT16_MAX )
     {
-        std::cout << "Unexpected eof\n";
+        std::cerr << "Fail to encode the message: data is too long\n";
 
-        return -1;
+        return false;
     }
 
-    if ( magic[0] != 0x0 || static_cast<uint8_t>( magic[1] ) != 0x83 )
+    auto parsed = ParseAddress( args.mAddr );
+
+    if ( !parsed )
     {
-        std::cout << "Invalid magic\n";
+        std::cerr << std::format( "Invalid address: {}\n", args.mAddr );
 
-        return -1;
+        return false;
     }
 
-    std::array<char, 2> dataSizeBytes;
+    auto& [node, port] = *parsed;
+
+    btcmd::CBench bench{ btcmd::BenchOptions{
+        .mNode = std::move( node ),
+        .mPort = std::move( port ),
+        .mMessage = args.mMessage,
+        .mConnections = args.mConnections,
+        .mRate = args.mRate,
+        .mDuration = args.mDuration,
+        .mTimeouts = args.mTimeouts,
+        .mSocket = args.mSocketOptions,
+        .mMetrics = metrics },
+        resolver };
 
-    if ( !socketBuffer.Read( dataSizeBytes ) )
+    const auto report = bench.Run();
+    const auto seconds =
+        std::chrono::duration<double>( report.mElapsed ).count();
+
+    uint64_t errors = 0;
+
+    for ( const auto& [kind, count] : report.mErrors )
     {
-        std::cout << "Unexpected eof\n";
+        errors += count;
+    }
 
-        return -1;
+    const auto ms = []( const std::chrono::nanoseconds value )
+    { return std::chrono::duration<double, std::milli>( value ).count(); };
+
+    std::cout << std::format(
+        "Topics: {} in {:.2f}s, {:.1f}/s (target {:.1f}/s)\n",
+        report.mLatency.Count() + errors, seconds,
+        ( report.mLatency.Count() + errors ) / seconds, args.mRate );
+
+    if ( report.mMissed != 0 )
+    {
+        std::cout << std::format( "Missed: {} (every connection was busy)\n",
+                                  report.mMissed );
     }
 
-    uint16_t dataSize = 0;
+    std::cout << std::format( "Errors: {}\n", errors );
 
-    if constexpr ( std::endian::native == std::endian::little )
+    for ( const auto& [kind, count] : report.mErrors )
     {
-        dataSize |= static_cast<uint8_t>( dataSizeBytes[0] ) << 8;
-        dataSize |= static_cast<uint8_t>( dataSizeBytes[1] );
+        std::cout << std::format( "  {}: {}\n", kind, count );
     }
-    else
+
+    if ( report.mLatency.Count() == 0 )
     {
-        memcpy( &dataSize, dataSizeBytes.data(), sizeof( uint16_t ) );
+        return false;
     }
 
-    dataSize -= 2;
+    std::cout << "Latency:\n";
+
+    for ( const auto& [name, percentile] :
+          { std::pair{ "p50", 50.0 }, std::pair{ "p90", 90.0 },
+            std::pair{ "p99", 99.0 }, std::pair{ "p99.9", 99.9 } } )
+    {
+        const auto value = report.mLatency.Percentile( percentile );
+
+        std::cout << std::format( "  {:<6} {:.3f}ms\n", name, ms( value ) );
+    }
+
+    std::cout << std::format( "  {:<6} {:.3f}ms\n", "max",
+                              ms( report.mLatency.Max() ) );
+
+    return errors == 0 && report.mMissed == 0;
+}
 
-    char dataType;
+int main( const int argc, const char* argv[] )
+{
+    const auto args = ParseArgs( argc, argv );
+    const auto wsa = btcmd::CWSAGuard::Create();
 
-    if ( !socketBuffer.Read( &dataType, 1 ) )
+    if ( !wsa )
     {
-        std::cout << "Unexpected eof\n";
+        std::cerr << std::format( "WSAStartup error: {}\n",
+                                  wsa.GetError().mSystemError );
 
         return -1;
     }
 
-    // String
-    if ( dataType == 0x06 )
-    {
-        std::string result;
-        result.resize( dataSize, '\0' );
+    btcmd::CResolver resolver{ args.mDnsTtl, args.mDnsNegativeTtl };
+    bt::ReplyCache cache{ args.mCacheSize };
 
-        if ( !socketBuffer.Read( result.data(), dataSize ) )
-        {
-            std::cout << "Unexpected eof\n";
+    btcmd::CMetrics metrics;
+    std::optional<btcmd::CMetricsWriter> metricsWriter;
 
-            return -1;
-        }
+    if ( !args.mMetricsFile.empty() )
+    {
+        metricsWriter.emplace( metrics, args.mMetricsFile, MetricsInterval );
+    }
+
+    const Instruments instruments{
+        .mTimings = args.mTimings,
+        .mMetrics = args.mMetricsFile.empty() ? nullptr : &metrics,
+        .mTarget = args.mAddr };
 
-        std::cout << result << std::endl;
+    if ( args.mBench )
+    {
+        return Bench( args, resolver, instruments.mMetrics ) ? 0 : -1;
     }
-    // Float
-    else if ( dataType == 0x2A )
+
+    std::ifstream file;
+
+    if ( !args.mInputFile.empty() && args.mInputFile != "-" )
     {
-        std::array<char, 4> floatBytes;
+        file.open( args.mInputFile );
 
-        if ( !socketBuffer.Read( floatBytes ) )
+        if ( !file )
         {
-            std::cout << "Unexpected eof\n";
+            std::cerr << std::format( "Can't open the file: {}\n",
+                                      args.mInputFile );
 
             return -1;
         }
+    }
 
-        float result = 0;
+    auto& input = file.is_open() ? static_cast<std::istream&>( file )
+                                 : std::cin;
 
-        if constexpr ( std::endian::native == std::endian::little )
-        {
-            memcpy( &result, floatBytes.data(), floatBytes.size() );
-        }
-        else
-        {
-            std::array<char, 4> revFloatBytes;
-            std::ranges::reverse_copy( floatBytes, revFloatBytes.begin() );
+    btcmd::COutput output{ args.mFormat,
+                           args.mInput == EInput::Fanout || args.mWatch };
 
-            memcpy( &result, revFloatBytes.data(), revFloatBytes.size() );
-        }
+    if ( args.mWatch )
+    {
+#ifdef BTCMD_EPOLL
+        Watch( input, args, resolver, instruments, output );
 
-        std::cout << result << std::endl;
+        return -1;
+#else
+        std::cerr << "watch is not supported on this platform\n";
+
+        return -1;
+#endif
     }
-    // Null
-    else if ( dataType == 0x00 )
+
+    if ( args.mInput == EInput::Fanout )
     {
-        std::cout << "NULL\n";
+#ifdef BTCMD_EPOLL
+        return Fanout( input, args, resolver, instruments, output ) ? 0 : -1;
+#else
+        std::cerr << "--fanout is not supported on this platform\n";
+
+        return -1;
+#endif
     }
-    else
+
+    auto parsed = ParseAddress( args.mAddr );
+
+    if ( !parsed )
     {
-        std::cout << std::format( "Unsupported type: 0x{:0>2X}\n", dataType );
+        std::cerr << std::format( "Invalid address: {}\n", args.mAddr );
 
         return -1;
     }
 
-    return 0;
+    auto& [node, port] = *parsed;
+    btcmd::CSession session{ std::move( node ), std::move( port ), resolver,
+                             args.mTimeouts, args.mSocketOptions };
+
+    const auto ok = args.mInput == EInput::Argument
+                        ? Query( session, args.mMessage, instruments, output,
+                                 args.mCachePolicy, cache )
+                        : QueryLines( session, input, instruments, output,
+                                      args.mCachePolicy, cache );
+
+    return ok ? 0 : -1;
 }
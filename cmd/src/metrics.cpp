@@ -0,0 +1,152 @@
+//-----------------------------------------------------------------------------
+// Copyright 2024 Igor Spichkin
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//-----------------------------------------------------------------------------
+
+#include "metrics.hpp"
+#include <algorithm>
+#include <cstdio>
+#include <format>
+#include <fstream>
+
+namespace btcmd
+{
+
+//-----------------------------------------------------------------------------
+// CMetrics
+//-----------------------------------------------------------------------------
+
+void CMetrics::Record( const CTimings& timings, const bool ok ) noexcept
+{
+    ( ok ? mOk : mErrors ).fetch_add( 1, std::memory_order_relaxed );
+
+    for ( size_t i = 0; i < PhaseCount; i++ )
+    {
+        const auto elapsed = timings.Elapsed( static_cast<EPhase>( i ) );
+
+        if ( !elapsed.has_value() )
+        {
+            continue;
+        }
+
+        auto& histogram = mPhases[i];
+        const auto seconds =
+            std::chrono::duration<double>( *elapsed ).count();
+        const auto bucket = static_cast<size_t>(
+            std::ranges::lower_bound( Buckets, seconds ) - Buckets.begin() );
+
+        histogram.mCounts[bucket].fetch_add( 1, std::memory_order_relaxed );
+        histogram.mSumNs.fetch_add( static_cast<uint64_t>( elapsed->count() ),
+                                    std::memory_order_relaxed );
+    }
+}
+
+std::string CMetrics::Render() const
+{
+    std::string text;
+
+    text += "# HELP bt_topics_total Topics by the result.\n"
+            "# TYPE bt_topics_total counter\n";
+    text += std::format( "bt_topics_total{{result=\"ok\"}} {}\n",
+                         mOk.load( std::memory_order_relaxed ) );
+    text += std::format( "bt_topics_total{{result=\"error\"}} {}\n",
+                         mErrors.load( std::memory_order_relaxed ) );
+
+    text += "# HELP bt_phase_seconds Time from the start of a topic until "
+            "the end of each phase.\n"
+            "# TYPE bt_phase_seconds histogram\n";
+
+    for ( size_t i = 0; i < PhaseCount; i++ )
+    {
+        const auto phase = ToString( static_cast<EPhase>( i ) );
+        const auto& histogram = mPhases[i];
+        uint64_t count = 0;
+
+        for ( size_t bucket = 0; bucket < Buckets.size(); bucket++ )
+        {
+            count +=
+                histogram.mCounts[bucket].load( std::memory_order_relaxed );
+
+            text += std::format(
+                "bt_phase_seconds_bucket{{phase=\"{}\",le=\"{}\"}} {}\n",
+                phase, Buckets[bucket], count );
+        }
+
+        count += histogram.mCounts.back().load( std::memory_order_relaxed );
+
+        text += std::format(
+            "bt_phase_seconds_bucket{{phase=\"{}\",le=\"+Inf\"}} {}\n", phase,
+            count );
+        text += std::format(
+            "bt_phase_seconds_sum{{phase=\"{}\"}} {:.9f}\n", phase,
+            static_cast<double>(
+                histogram.mSumNs.load( std::memory_order_relaxed ) ) /
+                1e9 );
+        text += std::format( "bt_phase_seconds_count{{phase=\"{}\"}} {}\n",
+                             phase, count );
+    }
+
+    return text;
+}
+
+bool CMetrics::WriteFile( const std::string& path ) const
+{
+    const auto temporary = path + ".tmp";
+
+    {
+        std::ofstream file{ temporary, std::ios::binary | std::ios::trunc };
+
+        if ( !file || !( file << Render() ) || !file.flush() )
+        {
+            return false;
+        }
+    }
+
+    return std::rename( temporary.c_str(), path.c_str() ) == 0;
+}
+
+//-----------------------------------------------------------------------------
+// CMetricsWriter
+//-----------------------------------------------------------------------------
+
+CMetricsWriter::CMetricsWriter( const CMetrics& metrics, std::string path,
+                                const std::chrono::milliseconds interval )
+    : mMetrics( metrics ), mPath( std::move( path ) )
+{
+    mThread = std::thread{ [this, interval]
+                           {
+                               std::unique_lock lock{ mMutex };
+
+                               while ( !mWake.wait_for( lock, interval,
+                                                        [this]
+                                                        { return mStop; } ) )
+                               {
+                                   mMetrics.WriteFile( mPath );
+                               }
+                           } };
+}
+
+CMetricsWriter::~CMetricsWriter()
+{
+    {
+        std::lock_guard lock{ mMutex };
+        mStop = true;
+    }
+
+    mWake.notify_one();
+    mThread.join();
+
+    mMetrics.WriteFile( mPath );
+}
+
+} // namespace btcmd
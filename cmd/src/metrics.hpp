@@ -0,0 +1,89 @@
+//-----------------------------------------------------------------------------
+// Copyright 2024 Igor Spichkin
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//-----------------------------------------------------------------------------
+
+#pragma once
+
+#include "timings.hpp"
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <thread>
+
+namespace btcmd
+{
+
+/// Counters and per-phase histograms of all topics, rendered in the
+/// Prometheus text format. Recording is a few relaxed atomic increments, so
+/// any thread can record.
+class CMetrics final
+{
+  public:
+    /// Counts the topic and adds the phases it reached to the histograms.
+    void Record( const CTimings& timings, bool ok ) noexcept;
+
+    /// \returns the metrics in the Prometheus text exposition format.
+    [[nodiscard]] std::string Render() const;
+
+    /// Writes the metrics to a temporary file and renames it over `path`,
+    /// so a collector never reads a partial file.
+    /// \returns false if the file could not be written.
+    bool WriteFile( const std::string& path ) const;
+
+  private:
+    /// Upper bounds of the histogram buckets, in seconds.
+    static constexpr std::array<double, 16> Buckets{
+        0.0001, 0.00025, 0.0005, 0.001, 0.0025, 0.005, 0.01, 0.025,
+        0.05,   0.1,     0.25,   0.5,   1,      2.5,   5,     10 };
+
+    struct Histogram final
+    {
+        /// Not cumulative, the last one counts values above every bound.
+        std::array<std::atomic<uint64_t>, Buckets.size() + 1> mCounts{};
+        std::atomic<uint64_t> mSumNs = 0;
+    };
+
+    std::atomic<uint64_t> mOk = 0;
+    std::atomic<uint64_t> mErrors = 0;
+    std::array<Histogram, PhaseCount> mPhases{};
+};
+
+/// Writes the metrics to a file periodically on its own thread and once more
+/// when destroyed, for node_exporter's textfile collector or anything else
+/// that scrapes files.
+class CMetricsWriter final
+{
+  public:
+    CMetricsWriter( const CMetrics& metrics, std::string path,
+                    std::chrono::milliseconds interval );
+
+    CMetricsWriter( CMetricsWriter& other ) = delete;
+    CMetricsWriter& operator=( CMetricsWriter& other ) = delete;
+
+    ~CMetricsWriter();
+
+  private:
+    const CMetrics& mMetrics;
+    std::string mPath;
+    std::mutex mMutex;
+    std::condition_variable mWake;
+    bool mStop = false;
+    std::thread mThread;
+};
+
+} // namespace btcmd
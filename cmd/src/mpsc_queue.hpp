@@ -0,0 +1,164 @@
+//-----------------------------------------------------------------------------
+// Copyright 2024 Igor Spichkin
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//-----------------------------------------------------------------------------
+
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <optional>
+#include <utility>
+
+namespace btcmd
+{
+
+/// An unbounded multi-producer single-consumer queue: a linked list where
+/// producers swap themselves in as the head with one atomic exchange and the
+/// consumer follows the links from the tail. Pushing never blocks, only the
+/// consumer waits when it is empty.
+template <typename T> class CMpscQueue final
+{
+  public:
+    CMpscQueue() : mHead( &mStub ), mTail( &mStub )
+    {
+    }
+
+    CMpscQueue( CMpscQueue& other ) = delete;
+    CMpscQueue& operator=( CMpscQueue& other ) = delete;
+
+    ~CMpscQueue()
+    {
+        while ( TryPop() )
+        {
+        }
+    }
+
+    /// Can be called from any thread.
+    void Push( T value )
+    {
+        auto* node = new Node{ .mValue = std::move( value ) };
+
+        Link( node );
+
+        mEpoch.fetch_add( 1, std::memory_order_release );
+        mEpoch.notify_one();
+    }
+
+    /// Wakes the consumer up once everything pushed so far is popped.
+    /// Nothing can be pushed after that.
+    void Close() noexcept
+    {
+        mClosed.store( true, std::memory_order_release );
+
+        mEpoch.fetch_add( 1, std::memory_order_release );
+        mEpoch.notify_one();
+    }
+
+    /// Consumer only.
+    /// \returns std::nullopt if the queue is empty, or a producer is still
+    /// linking the next value in.
+    [[nodiscard]] std::optional<T> TryPop()
+    {
+        auto* tail = mTail;
+        auto* next = tail->mNext.load( std::memory_order_acquire );
+
+        if ( tail == &mStub )
+        {
+            if ( next == nullptr )
+            {
+                return std::nullopt;
+            }
+
+            // Skip the stub.
+            mTail = next;
+            tail = next;
+            next = next->mNext.load( std::memory_order_acquire );
+        }
+
+        if ( next == nullptr )
+        {
+            // The last node can go only with the stub behind it.
+            if ( tail != mHead.load( std::memory_order_acquire ) )
+            {
+                return std::nullopt;
+            }
+
+            mStub.mNext.store( nullptr, std::memory_order_relaxed );
+            Link( &mStub );
+
+            next = tail->mNext.load( std::memory_order_acquire );
+
+            if ( next == nullptr )
+            {
+                return std::nullopt;
+            }
+        }
+
+        mTail = next;
+
+        auto value = std::move( *tail->mValue );
+        delete tail;
+
+        return value;
+    }
+
+    /// Consumer only, waits until there is a value.
+    /// \returns std::nullopt once the queue is closed and empty.
+    [[nodiscard]] std::optional<T> Pop()
+    {
+        while ( true )
+        {
+            const auto epoch = mEpoch.load( std::memory_order_acquire );
+
+            if ( auto value = TryPop() )
+            {
+                return value;
+            }
+
+            if ( mClosed.load( std::memory_order_acquire ) )
+            {
+                // Close() may have raced with the last Push().
+                return TryPop();
+            }
+
+            mEpoch.wait( epoch, std::memory_order_acquire );
+        }
+    }
+
+  private:
+    struct Node final
+    {
+        std::atomic<Node*> mNext = nullptr;
+        /// Empty in the stub.
+        std::optional<T> mValue;
+    };
+
+    void Link( Node* node ) noexcept
+    {
+        auto* previous = mHead.exchange( node, std::memory_order_acq_rel );
+
+        // Between the exchange and this store the consumer can't see the
+        // node yet.
+        previous->mNext.store( node, std::memory_order_release );
+    }
+
+    Node mStub;
+    std::atomic<Node*> mHead;
+    /// Consumer only.
+    Node* mTail;
+    std::atomic<uint64_t> mEpoch = 0;
+    std::atomic<bool> mClosed = false;
+};
+
+} // namespace btcmd
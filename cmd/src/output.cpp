@@ -0,0 +1,453 @@
+//-----------------------------------------------------------------------------
+// Copyright 2024 Igor Spichkin
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//-----------------------------------------------------------------------------
+
+#include "output.hpp"
+#include <algorithm>
+#include <bit>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <format>
+
+#ifdef BTCMD_WIN32
+#include <fcntl.h>
+#include <io.h>
+#else
+#include <unistd.h>
+#endif
+
+namespace btcmd
+{
+
+namespace
+{
+
+/// The type byte of an error in the raw format.
+constexpr uint8_t RawErrorType = 0xFF;
+
+[[nodiscard]] std::string_view TypeName( const Record& record ) noexcept
+{
+    if ( record.mReply == nullptr )
+    {
+        return "error";
+    }
+
+    return record.mReply->visit( bt::overloaded{
+        []( std::nullptr_t ) { return std::string_view{ "null" }; },
+        []( std::string_view ) { return std::string_view{ "string" }; },
+        []( float ) { return std::string_view{ "float" }; },
+        []( const bt::RawReply& ) { return std::string_view{ "raw" }; } } );
+}
+
+/// \returns the type byte and the body in hex, e.g. "0x10 6162".
+[[nodiscard]] std::string RawText( const bt::RawReply& raw )
+{
+    auto text = std::format( "0x{:0>2X}", raw.mType );
+
+    if ( !raw.mBytes.empty() )
+    {
+        text += ' ';
+    }
+
+    for ( const auto c : raw.mBytes )
+    {
+        text += std::format( "{:0>2x}", static_cast<uint8_t>( c ) );
+    }
+
+    return text;
+}
+
+[[nodiscard]] double Milliseconds( const std::chrono::nanoseconds value )
+{
+    return std::chrono::duration<double, std::milli>( value ).count();
+}
+
+/// \returns the length of the valid UTF-8 sequence that starts the value, 0
+/// if it is not one: overlong, a surrogate or above U+10FFFF.
+[[nodiscard]] size_t Utf8Length( const std::string_view value ) noexcept
+{
+    const auto lead = static_cast<uint8_t>( value[0] );
+
+    if ( lead < 0x80 )
+    {
+        return 1;
+    }
+
+    // The range of the second byte depends on the lead byte.
+    size_t length;
+    uint8_t low = 0x80;
+    uint8_t high = 0xBF;
+
+    if ( lead >= 0xC2 && lead <= 0xDF )
+    {
+        length = 2;
+    }
+    else if ( lead >= 0xE0 && lead <= 0xEF )
+    {
+        length = 3;
+        low = lead == 0xE0 ? 0xA0 : low;
+        high = lead == 0xED ? 0x9F : high;
+    }
+    else if ( lead >= 0xF0 && lead <= 0xF4 )
+    {
+        length = 4;
+        low = lead == 0xF0 ? 0x90 : low;
+        high = lead == 0xF4 ? 0x8F : high;
+    }
+    else
+    {
+        return 0;
+    }
+
+    if ( value.size() < length )
+    {
+        return 0;
+    }
+
+    for ( size_t i = 1; i < length; i++ )
+    {
+        const auto c = static_cast<uint8_t>( value[i] );
+
+        if ( c < low || c > high )
+        {
+            return 0;
+        }
+
+        low = 0x80;
+        high = 0xBF;
+    }
+
+    return length;
+}
+
+void AppendTsvField( std::string& out, const std::string_view value )
+{
+    for ( const auto c : value )
+    {
+        switch ( c )
+        {
+        case '\t':
+            out += "\\t";
+            break;
+        case '\n':
+            out += "\\n";
+            break;
+        case '\r':
+            out += "\\r";
+            break;
+        case '\\':
+            out += "\\\\";
+            break;
+        default:
+            out += c;
+        }
+    }
+}
+
+template <typename T> void AppendLittleEndian( std::string& out, T value )
+{
+    for ( size_t i = 0; i < sizeof( T ); i++ )
+    {
+        out += static_cast<char>( value & 0xFF );
+        value >>= 8;
+    }
+}
+
+/// Appends a u16 length and the bytes, cut to UINT16_MAX.
+void AppendRawField( std::string& out, std::string_view value )
+{
+    value = value.substr( 0, UINT16_MAX );
+
+    AppendLittleEndian( out, static_cast<uint16_t>( value.size() ) );
+    out += value;
+}
+
+void AppendText( std::string& out, const Record& record,
+                 const bool withTarget )
+{
+    if ( withTarget )
+    {
+        out += record.mTarget;
+        out += '\t';
+    }
+
+    if ( record.mReply == nullptr )
+    {
+        out += record.mMessage;
+    }
+    else
+    {
+        record.mReply->visit( bt::overloaded{
+            [&]( std::nullptr_t ) { out += "NULL"; },
+            [&]( const std::string_view text ) { out += text; },
+            // Like std::ostream prints it.
+            [&]( const float number ) { out += std::format( "{:g}", number ); },
+            [&]( const bt::RawReply& raw ) { out += RawText( raw ); } } );
+    }
+
+    out += '\n';
+}
+
+void AppendJsonl( std::string& out, const Record& record )
+{
+    out += "{\"target\":";
+    AppendJsonString( out, record.mTarget );
+    out += ",\"type\":\"";
+    out += TypeName( record );
+    out += "\",\"value\":";
+
+    if ( record.mReply == nullptr )
+    {
+        out += "null";
+    }
+    else
+    {
+        record.mReply->visit( bt::overloaded{
+            [&]( std::nullptr_t ) { out += "null"; },
+            [&]( const std::string_view text )
+            { AppendJsonString( out, text ); },
+            [&]( const float number )
+            {
+                out += std::isfinite( number ) ? std::format( "{}", number )
+                                               : "null";
+            },
+            [&]( const bt::RawReply& raw )
+            { AppendJsonString( out, RawText( raw ) ); } } );
+    }
+
+    out += std::format( ",\"latency_ms\":{:.3f}",
+                        Milliseconds( record.mLatency ) );
+
+    if ( record.mReply == nullptr )
+    {
+        out += ",\"error\":\"";
+        out += ToCode( record.mError );
+        out += "\",\"message\":";
+        AppendJsonString( out, record.mMessage );
+    }
+    else
+    {
+        out += ",\"error\":null,\"message\":null";
+    }
+
+    out += "}\n";
+}
+
+void AppendTsv( std::string& out, const Record& record )
+{
+    AppendTsvField( out, record.mTarget );
+    out += '\t';
+    out += TypeName( record );
+    out += '\t';
+
+    if ( record.mReply == nullptr )
+    {
+        AppendTsvField( out, record.mMessage );
+    }
+    else
+    {
+        record.mReply->visit( bt::overloaded{
+            []( std::nullptr_t ) {},
+            [&]( const std::string_view text ) { AppendTsvField( out, text ); },
+            [&]( const float number ) { out += std::format( "{}", number ); },
+            [&]( const bt::RawReply& raw ) { out += RawText( raw ); } } );
+    }
+
+    out += std::format( "\t{:.3f}\t{}\n", Milliseconds( record.mLatency ),
+                        ToCode( record.mError ) );
+}
+
+void AppendRaw( std::string& out, const Record& record )
+{
+    const auto micros =
+        std::chrono::duration_cast<std::chrono::microseconds>(
+            record.mLatency )
+            .count();
+
+    out += static_cast<char>(
+        record.mReply == nullptr
+            ? RawErrorType
+            : static_cast<uint8_t>( record.mReply->mType ) );
+    AppendLittleEndian(
+        out, static_cast<uint32_t>(
+                 std::clamp<int64_t>( micros, 0, UINT32_MAX ) ) );
+    AppendRawField( out, record.mTarget );
+
+    if ( record.mReply == nullptr )
+    {
+        AppendRawField( out, ToCode( record.mError ) );
+
+        return;
+    }
+
+    record.mReply->visit( bt::overloaded{
+        [&]( std::nullptr_t ) { AppendLittleEndian( out, uint16_t{ 0 } ); },
+        [&]( const std::string_view text ) { AppendRawField( out, text ); },
+        [&]( const float number )
+        {
+            AppendLittleEndian( out, uint16_t{ 4 } );
+            AppendLittleEndian( out, std::bit_cast<uint32_t>( number ) );
+        },
+        [&]( const bt::RawReply& raw )
+        { AppendRawField( out, raw.mBytes ); } } );
+}
+
+} // namespace
+
+std::optional<EFormat> ParseFormat( const std::string_view name )
+{
+    if ( name == "text" )
+    {
+        return EFormat::Text;
+    }
+
+    if ( name == "jsonl" )
+    {
+        return EFormat::Jsonl;
+    }
+
+    if ( name == "tsv" )
+    {
+        return EFormat::Tsv;
+    }
+
+    if ( name == "raw" )
+    {
+        return EFormat::Raw;
+    }
+
+    return std::nullopt;
+}
+
+void AppendJsonString( std::string& out, const std::string_view value )
+{
+    out += '"';
+
+    for ( size_t i = 0; i < value.size(); )
+    {
+        const auto c = value[i];
+        const auto byte = static_cast<uint8_t>( c );
+
+        if ( c == '"' || c == '\\' )
+        {
+            out += '\\';
+            out += c;
+            i++;
+        }
+        else if ( byte < 0x20 )
+        {
+            out += std::format( "\\u{:0>4x}", byte );
+            i++;
+        }
+        else if ( const auto length = Utf8Length( value.substr( i ) );
+                  length != 0 )
+        {
+            out += value.substr( i, length );
+            i += length;
+        }
+        else
+        {
+            // Not UTF-8, the byte is read as Latin-1 so the JSON stays valid
+            // and the byte can still be told.
+            out += std::format( "\\u{:0>4x}", byte );
+            i++;
+        }
+    }
+
+    out += '"';
+}
+
+COutput::COutput( const EFormat format, const bool withTarget ) noexcept
+    : mFormat{ format }, mWithTarget{ withTarget }
+{
+#ifdef BTCMD_WIN32
+    mInteractive = _isatty( _fileno( stdout ) ) != 0;
+
+    if ( format == EFormat::Raw )
+    {
+        _setmode( _fileno( stdout ), _O_BINARY );
+    }
+#else
+    mInteractive = isatty( fileno( stdout ) ) != 0;
+#endif
+
+    // The buffer of stdout itself, so it is still written out when the
+    // process exits on a fatal error.
+    if ( !mInteractive )
+    {
+        std::setvbuf( stdout, nullptr, _IOFBF, BufferSize );
+    }
+}
+
+COutput::~COutput()
+{
+    Flush();
+}
+
+bool COutput::ToStderr( const Record& record ) const noexcept
+{
+    return mFormat == EFormat::Text && record.mReply == nullptr;
+}
+
+void COutput::Format( const Record& record, std::string& out ) const
+{
+    switch ( mFormat )
+    {
+    case EFormat::Text:
+        AppendText( out, record, mWithTarget );
+        break;
+    case EFormat::Jsonl:
+        AppendJsonl( out, record );
+        break;
+    case EFormat::Tsv:
+        AppendTsv( out, record );
+        break;
+    case EFormat::Raw:
+        AppendRaw( out, record );
+        break;
+    }
+}
+
+void COutput::Write( const Record& record )
+{
+    mScratch.clear();
+    Format( record, mScratch );
+
+    if ( ToStderr( record ) )
+    {
+        std::fwrite( mScratch.data(), 1, mScratch.size(), stderr );
+    }
+    else
+    {
+        WriteFormatted( mScratch );
+    }
+}
+
+void COutput::WriteFormatted( const std::string_view record )
+{
+    std::fwrite( record.data(), 1, record.size(), stdout );
+
+    if ( mInteractive )
+    {
+        std::fflush( stdout );
+    }
+}
+
+void COutput::Flush() noexcept
+{
+    std::fflush( stdout );
+}
+
+} // namespace btcmd
@@ -0,0 +1,101 @@
+//-----------------------------------------------------------------------------
+// Copyright 2024 Igor Spichkin
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//-----------------------------------------------------------------------------
+
+#pragma once
+
+#include "bt/bt.hpp"
+#include "error.hpp"
+#include <chrono>
+#include <cstdio>
+#include <optional>
+#include <string>
+#include <string_view>
+
+namespace btcmd
+{
+
+/// How replies and errors are printed.
+enum class EFormat
+{
+    /// The reply as is, errors go to stderr.
+    Text,
+    /// One JSON object per line.
+    Jsonl,
+    /// Tab-separated fields, one record per line.
+    Tsv,
+    /// Length-prefixed binary records, see the README.
+    Raw
+};
+
+[[nodiscard]] std::optional<EFormat> ParseFormat( std::string_view name );
+
+/// Appends `value` as a quoted JSON string. Bytes that are not valid UTF-8
+/// are escaped as the Latin-1 characters, `\u00XX`.
+void AppendJsonString( std::string& out, std::string_view value );
+
+/// The outcome of one topic.
+struct Record final
+{
+    std::string_view mTarget;
+    /// Null on error.
+    const bt::Reply* mReply = nullptr;
+    EError mError = EError::None;
+    /// The details of the error.
+    std::string_view mMessage;
+    /// Until the last byte of the reply, or until the error.
+    std::chrono::nanoseconds mLatency{};
+};
+
+/// Formats records and writes them to stdout with a large stdio buffer, so a
+/// pipeline of many replies costs a write per buffer instead of a flush per
+/// reply. On a terminal every record is flushed.
+class COutput final
+{
+  public:
+    static constexpr size_t BufferSize = 64 * 1024;
+
+    /// `withTarget` prints the target in the text format too.
+    COutput( EFormat format, bool withTarget ) noexcept;
+
+    COutput( const COutput& ) = delete;
+    COutput& operator=( const COutput& ) = delete;
+
+    ~COutput();
+
+    /// \returns true if the record goes to stderr rather than stdout.
+    [[nodiscard]] bool ToStderr( const Record& record ) const noexcept;
+
+    /// Appends the formatted record to `out`. Can be called from any thread.
+    void Format( const Record& record, std::string& out ) const;
+
+    /// Formats the record and writes it to stdout or stderr.
+    void Write( const Record& record );
+
+    /// Writes a record formatted by `Format` that goes to stdout.
+    void WriteFormatted( std::string_view record );
+
+    /// Writes out the buffered records.
+    void Flush() noexcept;
+
+  private:
+    EFormat mFormat;
+    bool mWithTarget;
+    /// Flush after every record.
+    bool mInteractive;
+    /// The record being written.
+    std::string mScratch;
+};
+
+} // namespace btcmd
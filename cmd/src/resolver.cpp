@@ -0,0 +1,323 @@
+//-----------------------------------------------------------------------------
+// Copyright 2024 Igor Spichkin
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//-----------------------------------------------------------------------------
+
+#include "resolver.hpp"
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstring>
+#include <deque>
+#include <optional>
+#include <thread>
+#include <vector>
+
+namespace btcmd
+{
+
+namespace
+{
+
+/// Shared with the lookup thread, which drops a result that came too late.
+struct PendingResolution final
+{
+    std::mutex mMutex;
+    std::condition_variable mDone;
+    bool mFinished = false;
+    Resolution mResult;
+};
+
+/// Lookups that run getaddrinfo at the same time, the rest wait in a queue.
+constexpr size_t MaxLookupThreads = 16;
+
+/// Runs getaddrinfo for the lookups with a deadline on a bounded number of
+/// threads. getaddrinfo can't be interrupted, so the threads are detached
+/// and the pool lives as long as the process.
+class CLookupPool final
+{
+  public:
+    [[nodiscard]] static CLookupPool& Instance()
+    {
+        // Never destroyed, a detached thread may still be in getaddrinfo
+        // when the process exits.
+        static auto* pool = new CLookupPool;
+
+        return *pool;
+    }
+
+    /// Queues the lookup, starting another thread if all of them are busy.
+    /// A lookup that is still queued at its deadline is dropped.
+    void Start( std::shared_ptr<PendingResolution> pending, std::string node,
+                std::string port, const Clock::time_point deadline )
+    {
+        {
+            std::lock_guard lock{ mMutex };
+
+            mPending.push_back( Lookup{ .mPending = std::move( pending ),
+                                        .mNode = std::move( node ),
+                                        .mPort = std::move( port ),
+                                        .mDeadline = deadline } );
+
+            if ( mIdle == 0 && mThreads < MaxLookupThreads )
+            {
+                mThreads++;
+                std::thread{ [this] { Work(); } }.detach();
+            }
+        }
+
+        mWake.notify_one();
+    }
+
+  private:
+    struct Lookup final
+    {
+        std::shared_ptr<PendingResolution> mPending;
+        std::string mNode;
+        std::string mPort;
+        Clock::time_point mDeadline;
+    };
+
+    CLookupPool() noexcept = default;
+
+    [[noreturn]] void Work() noexcept
+    {
+        std::unique_lock lock{ mMutex };
+
+        while ( true )
+        {
+            mIdle++;
+            mWake.wait( lock, [this] { return !mPending.empty(); } );
+            mIdle--;
+
+            auto lookup = std::move( mPending.front() );
+            mPending.pop_front();
+
+            // Nobody waits for it anymore.
+            if ( lookup.mDeadline <= Clock::now() )
+            {
+                continue;
+            }
+
+            lock.unlock();
+
+            auto result = GetAddrInfo( lookup.mNode, lookup.mPort );
+
+            {
+                std::lock_guard done{ lookup.mPending->mMutex };
+
+                lookup.mPending->mFinished = true;
+                lookup.mPending->mResult = std::move( result );
+                lookup.mPending->mDone.notify_one();
+            }
+
+            lock.lock();
+        }
+    }
+
+    std::mutex mMutex;
+    std::condition_variable mWake;
+    std::deque<Lookup> mPending;
+    size_t mThreads = 0;
+    size_t mIdle = 0;
+};
+
+/// Drops the addresses that getaddrinfo returned more than once, once per
+/// protocol or per matching interface, keeping the first.
+[[nodiscard]] Resolution Unique( Resolution resolution ) noexcept
+{
+    auto& endpoints = resolution.mEndpoints;
+
+    for ( auto it = endpoints.begin(); it != endpoints.end(); )
+    {
+        const auto same = [&]( const Endpoint& other )
+        {
+            return other.mSize == it->mSize &&
+                   std::memcmp( other.mAddress.data(), it->mAddress.data(),
+                                it->mSize ) == 0;
+        };
+
+        if ( std::any_of( endpoints.begin(), it, same ) )
+        {
+            it = endpoints.erase( it );
+        }
+        else
+        {
+            ++it;
+        }
+    }
+
+    return resolution;
+}
+
+/// Runs getaddrinfo, giving up at the deadline.
+/// \returns std::nullopt if the deadline passed first.
+[[nodiscard]] std::optional<Resolution>
+ResolveAddresses( const std::string& node, const std::string& port,
+                  const Clock::time_point deadline ) noexcept
+{
+    if ( deadline == NoDeadline )
+    {
+        return Unique( GetAddrInfo( node, port ) );
+    }
+
+    // getaddrinfo can't be interrupted, it runs on the pool.
+    const auto pending = std::make_shared<PendingResolution>();
+
+    CLookupPool::Instance().Start( pending, node, port, deadline );
+
+    std::unique_lock lock{ pending->mMutex };
+
+    if ( !pending->mDone.wait_until( lock, deadline,
+                                     [&]
+                                     {
+                                         return pending->mFinished;
+                                     } ) )
+    {
+        return std::nullopt;
+    }
+
+    return Unique( std::move( pending->mResult ) );
+}
+
+} // namespace
+
+CResolver::CResolver( const std::chrono::milliseconds ttl,
+                      const std::chrono::milliseconds negativeTtl ) noexcept
+    : mTtl( ttl ), mNegativeTtl( negativeTtl )
+{
+}
+
+std::shared_ptr<const Resolution>
+CResolver::Resolve( const std::string& node, const std::string& port,
+                    const Clock::time_point deadline )
+{
+    Name name{ node, port };
+    std::shared_ptr<const Resolution> result;
+
+    if ( Find( name, result ) )
+    {
+        return result;
+    }
+
+    // Concurrent lookups of the same name are not joined, the later one
+    // overwrites the entry with the same addresses.
+    if ( auto resolved = ResolveAddresses( node, port, deadline ) )
+    {
+        result = std::make_shared<const Resolution>( std::move( *resolved ) );
+    }
+
+    const bool failed = result == nullptr || result->mError != 0 ||
+                        result->mEndpoints.empty();
+    const auto ttl = failed ? mNegativeTtl : mTtl;
+
+    if ( ttl.count() != 0 )
+    {
+        std::lock_guard lock{ mMutex };
+
+        mEntries.insert_or_assign(
+            std::move( name ),
+            Entry{ .mResolution = result, .mExpires = Clock::now() + ttl } );
+    }
+
+    return result;
+}
+
+std::vector<CResolver::Resolved>
+CResolver::ResolveAll( const std::span<const Name> names,
+                       const size_t parallel,
+                       const std::chrono::milliseconds timeout )
+{
+    std::vector<Name> distinct{ names.begin(), names.end() };
+
+    std::ranges::sort( distinct );
+    distinct.erase( std::ranges::unique( distinct ).begin(), distinct.end() );
+
+    std::vector<Resolved> resolved( distinct.size() );
+    std::atomic<size_t> next = 0;
+
+    const auto worker = [&]
+    {
+        for ( auto i = next++; i < distinct.size(); i = next++ )
+        {
+            const auto& [node, port] = distinct[i];
+            const auto start = Clock::now();
+
+            auto resolution =
+                Resolve( node, port, DeadlineAfter( timeout, start ) );
+            const auto elapsed = Clock::now() - start;
+
+            // A lookup that finished just as the deadline passed is late too.
+            if ( timeout.count() != 0 && elapsed > timeout )
+            {
+                resolution.reset();
+            }
+
+            resolved[i] = Resolved{ .mResolution = std::move( resolution ),
+                                    .mElapsed = elapsed };
+        }
+    };
+
+    {
+        const auto threadCount =
+            std::min( std::max( parallel, static_cast<size_t>( 1 ) ),
+                      distinct.size() );
+        std::vector<std::jthread> threads;
+
+        // The calling thread resolves too.
+        for ( size_t i = 1; i < threadCount; i++ )
+        {
+            threads.emplace_back( worker );
+        }
+
+        worker();
+    }
+
+    std::vector<Resolved> result;
+    result.reserve( names.size() );
+
+    for ( const auto& name : names )
+    {
+        result.push_back(
+            resolved[std::ranges::lower_bound( distinct, name ) -
+                     distinct.begin()] );
+    }
+
+    return result;
+}
+
+bool CResolver::Find( const Name& name,
+                      std::shared_ptr<const Resolution>& result )
+{
+    std::lock_guard lock{ mMutex };
+
+    const auto it = mEntries.find( name );
+
+    if ( it == mEntries.end() )
+    {
+        return false;
+    }
+
+    if ( it->second.mExpires <= Clock::now() )
+    {
+        mEntries.erase( it );
+
+        return false;
+    }
+
+    result = it->second.mResolution;
+
+    return true;
+}
+
+} // namespace btcmd
@@ -0,0 +1,87 @@
+//-----------------------------------------------------------------------------
+// Copyright 2024 Igor Spichkin
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//-----------------------------------------------------------------------------
+
+#pragma once
+
+#include "socket.hpp"
+#include <chrono>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <span>
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace btcmd
+{
+
+/// Caches resolved names, so topics to the same server don't wait for
+/// getaddrinfo every time. getaddrinfo doesn't report the record TTLs, so
+/// entries live for a fixed time instead. Thread safe.
+class CResolver final
+{
+  public:
+    using Name = std::pair<std::string, std::string>;
+
+    /// \param ttl how long resolved names are kept, zero disables the cache.
+    /// \param negativeTtl how long failures and timeouts are kept.
+    CResolver( std::chrono::milliseconds ttl,
+               std::chrono::milliseconds negativeTtl ) noexcept;
+
+    /// \returns the cached addresses or resolves the name, giving up at the
+    /// deadline. nullptr if the deadline passed.
+    [[nodiscard]] std::shared_ptr<const Resolution>
+    Resolve( const std::string& node, const std::string& port,
+             Clock::time_point deadline = NoDeadline );
+
+    /// A name resolved by `ResolveAll`.
+    struct Resolved final
+    {
+        /// nullptr if the name timed out.
+        std::shared_ptr<const Resolution> mResolution;
+        /// How long the lookup took, or the cache lookup if it was cached.
+        Clock::duration mElapsed{ 0 };
+    };
+
+    /// Resolves the distinct names on up to `parallel` threads at once, each
+    /// with its own timeout, taking the ones that are cached from the cache.
+    /// A name that took longer than the timeout counts as timed out.
+    /// \returns every name, in the order of `names`. The addresses stay valid
+    /// whatever the TTL of the cache is.
+    [[nodiscard]] std::vector<Resolved>
+    ResolveAll( std::span<const Name> names, size_t parallel,
+                std::chrono::milliseconds timeout );
+
+    /// Looks the name up in the cache only, without blocking on getaddrinfo.
+    /// \returns false if the name is not cached or has expired.
+    [[nodiscard]] bool Find( const Name& name,
+                             std::shared_ptr<const Resolution>& result );
+
+  private:
+    struct Entry final
+    {
+        /// nullptr if the name timed out.
+        std::shared_ptr<const Resolution> mResolution;
+        Clock::time_point mExpires;
+    };
+
+    std::chrono::milliseconds mTtl;
+    std::chrono::milliseconds mNegativeTtl;
+    std::mutex mMutex;
+    std::map<Name, Entry> mEntries;
+};
+
+} // namespace btcmd
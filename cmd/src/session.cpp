@@ -0,0 +1,219 @@
+//-----------------------------------------------------------------------------
+// Copyright 2024 Igor Spichkin
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//-----------------------------------------------------------------------------
+
+#include "session.hpp"
+#include <algorithm>
+#include <array>
+#include <cerrno>
+#include <span>
+
+namespace btcmd
+{
+
+CSession::CSession( std::string node, std::string port, CResolver& resolver,
+                    const Timeouts& timeouts,
+                    const SocketOptions& socketOptions )
+    : mNode( std::move( node ) ), mPort( std::move( port ) ),
+      mResolver( resolver ), mTimeouts( timeouts ),
+      mSocketOptions( socketOptions )
+{
+}
+
+const CTimings& CSession::Timings() const noexcept
+{
+    return mTimings;
+}
+
+Error CSession::Query( const std::string& message,
+                       bt::Decoder& decoder ) noexcept
+{
+    std::array<char, bt::header_size_v> header;
+
+    // The caller checks the length.
+    static_cast<void>( bt::encode_header_into( header, message.size() ) );
+
+    // The message is sent with the NUL of the string as the trailing byte.
+    const std::array<std::span<const char>, 2> packet{
+        std::span<const char>{ header },
+        std::span{ message.c_str(), message.size() + 1 } };
+
+    const auto start = Clock::now();
+    const auto totalDeadline = DeadlineAfter( mTimeouts.mTotal, start );
+
+    mTimings.Start( start );
+
+    // A previous topic may have failed in the middle of a reply.
+    decoder.reset();
+
+    while ( true )
+    {
+        // A server that doesn't keep connections alive has closed it by now,
+        // the topic goes over a new one.
+        if ( mConnection && mConnection->PeerClosed() )
+        {
+            mConnection.reset();
+        }
+
+        const bool reused = mConnection.has_value();
+
+        if ( !reused )
+        {
+            if ( const auto error = Connect( start, totalDeadline );
+                 !error.Ok() )
+            {
+                return error;
+            }
+        }
+
+        mConnection->SetDeadlines(
+            DeadlineAfter( mTimeouts.mFirstByte, Clock::now() ),
+            totalDeadline );
+        mConnection->Track( &mTimings );
+
+        if ( const auto sent = mConnection->Send( packet );
+             sent.mStatus != EIoStatus::Ok )
+        {
+            mConnection.reset();
+
+            // Closed before the topic went out, it didn't reach the server.
+            if ( sent.mStatus == EIoStatus::Closed &&
+                 ShouldResend( reused, false ) )
+            {
+                continue;
+            }
+
+            // With Fast Open the first send finishes connecting.
+            if ( sent.mStatus == EIoStatus::TimedOut )
+            {
+                return Error{ .mCode = EError::ConnectTimeout };
+            }
+
+            if ( sent.mStatus == EIoStatus::Error && mSocketOptions.mFastOpen )
+            {
+                return Error{ .mCode = EError::ConnectFailed,
+                              .mSystemError = sent.mError };
+            }
+
+            return sent.mStatus == EIoStatus::Closed
+                       ? Error{ .mCode = EError::ConnectionClosed }
+                       : Error{ .mCode = EError::SendFailed,
+                                .mSystemError = sent.mError };
+        }
+
+        mTimings.Mark( EPhase::Send );
+
+        const auto status = mConnection->ReadReply( decoder );
+
+        if ( status == bt::EDecodeStatus::Done )
+        {
+            return Error{};
+        }
+
+        auto error = status == bt::EDecodeStatus::NeedMore
+                         ? mConnection->LastError()
+                         : FromDecoder( status );
+
+        // The topic went out in a Fast Open SYN that was refused.
+        if ( error.mCode == EError::RecvFailed &&
+             error.mSystemError == ECONNREFUSED )
+        {
+            error.mCode = EError::ConnectFailed;
+        }
+
+        mConnection.reset();
+
+        // The probe above can run before the FIN of a server that closes
+        // after every reply has arrived.
+        if ( ( error.mCode == EError::UnexpectedEof ||
+               error.mCode == EError::RecvFailed ) &&
+             ShouldResend( reused, decoder.in_progress() ) )
+        {
+            decoder.reset();
+
+            continue;
+        }
+
+        return error;
+    }
+}
+
+Error CSession::Connect( const Clock::time_point start,
+                         const Clock::time_point totalDeadline ) noexcept
+{
+    const auto resolution = mResolver.Resolve(
+        mNode, mPort, DeadlineAfter( mTimeouts.mResolve, start ) );
+
+    if ( resolution == nullptr )
+    {
+        return Error{ .mCode = EError::ResolveTimeout };
+    }
+
+    if ( resolution->mError != 0 || resolution->mEndpoints.empty() )
+    {
+        return Error{ .mCode = EError::ResolveFailed,
+                      .mSystemError = resolution->mError };
+    }
+
+    mTimings.Mark( EPhase::Resolve );
+
+    // The connection also counts against the whole reply.
+    const auto connectDeadline =
+        DeadlineAfter( mTimeouts.mConnect, Clock::now() );
+    const bool connectFirst = connectDeadline <= totalDeadline;
+    const auto deadline = std::min( connectDeadline, totalDeadline );
+    const auto& endpoints = resolution->mEndpoints;
+
+    // Each address gets a share of the budget, the next one is tried if it
+    // doesn't answer or refuses the connection.
+    Error error;
+
+    for ( size_t i = 0; i < endpoints.size(); i++ )
+    {
+        auto socket = CreateSocket( endpoints[i], mSocketOptions );
+
+        if ( !socket )
+        {
+            error = socket.GetError();
+
+            continue;
+        }
+
+        const auto result = ( *socket )->Connect(
+            AttemptDeadline( deadline, endpoints.size() - i, Clock::now() ) );
+
+        if ( result.mStatus == EIoStatus::Ok )
+        {
+            mTimings.Mark( EPhase::Connect );
+            mConnection.emplace( std::move( *socket ) );
+
+            return Error{};
+        }
+
+        error = result.mStatus == EIoStatus::TimedOut
+                    ? Error{ .mCode = connectFirst ? EError::ConnectTimeout
+                                                   : EError::ResponseTimeout }
+                    : Error{ .mCode = EError::ConnectFailed,
+                             .mSystemError = result.mError };
+
+        if ( Clock::now() >= deadline )
+        {
+            break;
+        }
+    }
+
+    return error;
+}
+
+} // namespace btcmd
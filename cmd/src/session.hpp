@@ -0,0 +1,62 @@
+//-----------------------------------------------------------------------------
+// Copyright 2024 Igor Spichkin
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//-----------------------------------------------------------------------------
+
+#pragma once
+
+#include "bt/bt.hpp"
+#include "resolver.hpp"
+#include "socket.hpp"
+#include "socket_buffer.hpp"
+#include "timings.hpp"
+#include <optional>
+#include <string>
+
+namespace btcmd
+{
+
+/// Sends topics to one server over a reused connection.
+class CSession final
+{
+  public:
+    /// \param resolver must outlive the session.
+    CSession( std::string node, std::string port, CResolver& resolver,
+              const Timeouts& timeouts = {},
+              const SocketOptions& socketOptions = {} );
+
+    /// Sends the message and decodes the reply into the decoder. If the
+    /// server closed the connection since the previous topic, reconnects
+    /// first, and a topic lost on a reused connection is sent again as
+    /// `ShouldResend` describes. A failed topic only closes the connection,
+    /// the next one opens a new one.
+    /// \returns `EError::None` once the reply is decoded.
+    Error Query( const std::string& message, bt::Decoder& decoder ) noexcept;
+
+    /// \returns when each phase of the last query ended.
+    [[nodiscard]] const CTimings& Timings() const noexcept;
+
+  private:
+    Error Connect( Clock::time_point start,
+                   Clock::time_point totalDeadline ) noexcept;
+
+    std::string mNode;
+    std::string mPort;
+    CResolver& mResolver;
+    Timeouts mTimeouts;
+    SocketOptions mSocketOptions;
+    CTimings mTimings;
+    std::optional<CSocketBuffer> mConnection;
+};
+
+} // namespace btcmd
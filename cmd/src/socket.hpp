@@ -15,8 +15,17 @@
 
 #pragma once
 
+#include "error.hpp"
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
 #include <memory>
+#include <span>
 #include <string>
+#include <string_view>
+#include <utility>
 #include <vector>
 
 namespace btcmd
@@ -27,17 +36,150 @@ class CWSAGuard final
 {
   public:
     CWSAGuard( CWSAGuard& other ) = delete;
-    CWSAGuard( CWSAGuard&& other ) = delete;
+
+    /// The moved-from guard doesn't clean up.
+    CWSAGuard( CWSAGuard&& other ) noexcept
+        : mOwner( std::exchange( other.mOwner, false ) )
+    {
+    }
 
     CWSAGuard& operator=( CWSAGuard& other ) = delete;
     CWSAGuard& operator=( CWSAGuard&& other ) = delete;
 
-    [[nodiscard]] static CWSAGuard Create() noexcept;
+    /// \returns `System` with the WSAStartup error if it fails.
+    [[nodiscard]] static CExpected<CWSAGuard> Create() noexcept;
 
     ~CWSAGuard();
 
   private:
     CWSAGuard() = default;
+
+    bool mOwner = true;
+};
+
+using Clock = std::chrono::steady_clock;
+
+inline constexpr Clock::time_point NoDeadline = Clock::time_point::max();
+
+/// Time budgets of one topic, zero means no limit.
+struct Timeouts final
+{
+    /// Name resolution.
+    std::chrono::milliseconds mResolve{ 0 };
+    /// Establishing the connection.
+    std::chrono::milliseconds mConnect{ 0 };
+    /// From sending the topic until the first byte of the reply.
+    std::chrono::milliseconds mFirstByte{ 0 };
+    /// From the start of the topic until the reply is complete.
+    std::chrono::milliseconds mTotal{ 0 };
+};
+
+/// \returns `NoDeadline` if the timeout is zero.
+[[nodiscard]] inline Clock::time_point
+DeadlineAfter( const std::chrono::milliseconds timeout,
+               const Clock::time_point from ) noexcept
+{
+    return timeout.count() == 0 ? NoDeadline : from + timeout;
+}
+
+/// \returns the milliseconds left until the deadline for poll(), -1 if there
+/// is no deadline.
+[[nodiscard]] inline int
+PollTimeout( const Clock::time_point deadline ) noexcept
+{
+    if ( deadline == NoDeadline )
+    {
+        return -1;
+    }
+
+    const auto left = std::chrono::ceil<std::chrono::milliseconds>(
+        deadline - Clock::now() );
+
+    return static_cast<int>( std::clamp<std::chrono::milliseconds::rep>(
+        left.count(), 0, INT32_MAX ) );
+}
+
+/// Gives each of the addresses left an equal share of the time until the
+/// deadline, so an address that doesn't answer doesn't use it all up.
+[[nodiscard]] inline Clock::time_point
+AttemptDeadline( const Clock::time_point deadline, const size_t attemptsLeft,
+                 const Clock::time_point now ) noexcept
+{
+    if ( deadline == NoDeadline || deadline <= now || attemptsLeft <= 1 )
+    {
+        return deadline;
+    }
+
+    return now + ( deadline - now ) / attemptsLeft;
+}
+
+/// A resolved address.
+struct Endpoint final
+{
+    int mFamily = 0;
+    /// A native `sockaddr` of `mSize` bytes, as large as `sockaddr_storage`.
+    std::array<std::byte, 128> mAddress{};
+    size_t mSize = 0;
+};
+
+/// The addresses of a name, in the order getaddrinfo returned them.
+struct Resolution final
+{
+    /// The getaddrinfo error, 0 on success.
+    int mError = 0;
+    std::vector<Endpoint> mEndpoints;
+};
+
+/// Runs getaddrinfo for stream sockets and copies the addresses, blocking
+/// until it returns. `CResolver` adds the deadline and drops duplicates.
+[[nodiscard]] Resolution GetAddrInfo( const std::string& node,
+                                      const std::string& port ) noexcept;
+
+enum class EIoStatus
+{
+    Ok,
+    /// The operation would block, wait for readiness and retry.
+    WouldBlock,
+    /// The connection was closed by the peer.
+    Closed,
+    /// The deadline passed.
+    TimedOut,
+    Error
+};
+
+struct IoResult final
+{
+    EIoStatus mStatus = EIoStatus::Ok;
+    size_t mBytes = 0;
+    /// errno or WSAGetLastError() if the status is `Error`.
+    int mError = 0;
+};
+
+/// The one rule for sending a topic again, kept by sessions, `bt watch` and
+/// bt-proxy alike. A topic whose connection closed or was reset before any
+/// byte of its reply arrived is sent once more on a new connection if that
+/// connection was reused: a server that doesn't keep connections alive
+/// closes them while idle, without reading the topic. A topic on a new
+/// connection, one with part of a reply or one that timed out is never sent
+/// again.
+/// \returns true if the topic is sent again.
+[[nodiscard]] constexpr bool ShouldResend( const bool reused,
+                                           const bool replyStarted ) noexcept
+{
+    return reused && !replyStarted;
+}
+
+/// Options applied to a socket when it is created, all off by default. The
+/// ones the system doesn't support are skipped.
+struct SocketOptions final
+{
+    /// TCP Fast Open, Linux only: connecting returns at once and the first
+    /// send carries the data in the SYN if the server gave out a cookie
+    /// before, otherwise it waits for a regular handshake.
+    bool mFastOpen = false;
+    /// TCP_NODELAY, TCP_QUICKACK and SO_BUSY_POLL, which trade CPU time
+    /// for a few microseconds on each packet.
+    bool mLowLatency = false;
 };
 
 class ISocket
@@ -48,16 +190,65 @@ class ISocket
     ISocket( ISocket& other ) = delete;
     ISocket& operator=( ISocket& other ) = delete;
 
-    virtual void Connect() const noexcept = 0;
+    /// Connects in the blocking mode, giving up at the deadline.
+    [[nodiscard]] virtual IoResult
+    Connect( Clock::time_point deadline ) const noexcept = 0;
+
+    /// Waits until there is something to receive.
+    /// \returns TimedOut if the deadline passed first.
+    [[nodiscard]] virtual EIoStatus
+    WaitReadable( Clock::time_point deadline ) const noexcept = 0;
+
+    /// Sends all buffers in one gather write, without joining them. With Fast
+    /// Open the first send after `Connect` also finishes connecting, within
+    /// the connect deadline.
+    /// \returns Closed if the connection was closed by the peer, TimedOut if
+    /// the connect deadline passed.
+    [[nodiscard]] virtual IoResult
+    Send( std::span<const std::span<const char>> buffers ) const noexcept = 0;
+
+    [[nodiscard]] IoResult Send( const std::vector<char>& data ) const noexcept
+    {
+        const std::span<const char> buffer{ data };
+
+        return Send( std::span{ &buffer, 1 } );
+    }
+
+    /// Receives in the blocking mode, `mBytes` is the number of bytes
+    /// received.
+    /// \returns Closed if there is eof.
+    [[nodiscard]] virtual IoResult
+    Recv( std::span<char> dst ) const noexcept = 0;
+
+    /// \returns the resolved address as a native `sockaddr`.
+    [[nodiscard]] virtual std::span<const std::byte>
+    Address() const noexcept = 0;
+
+    /// \returns the native descriptor to poll for readiness.
+    [[nodiscard]] virtual intptr_t Handle() const noexcept = 0;
+
+    /// Switches the socket to the non-blocking mode and starts connecting.
+    /// \returns WouldBlock if the connection is in progress, wait until the
+    /// socket is writable and call `FinishConnect`.
+    [[nodiscard]] virtual IoResult StartConnect() const noexcept = 0;
+
+    [[nodiscard]] virtual IoResult FinishConnect() const noexcept = 0;
 
-    virtual void Send( std::vector<char>& data ) const noexcept = 0;
+    /// Non-blocking send, `mBytes` is the number of bytes sent.
+    [[nodiscard]] virtual IoResult
+    TrySend( std::span<const char> data ) const noexcept = 0;
 
-    virtual size_t Recv( char* dst, int length ) const noexcept = 0;
+    /// Non-blocking receive, `mBytes` is the number of bytes received.
+    [[nodiscard]] virtual IoResult
+    TryRecv( std::span<char> dst ) const noexcept = 0;
 
     virtual ~ISocket() = default;
 };
 
-[[nodiscard]] std::unique_ptr<ISocket>
-CreateSocket( const std::string& node, const std::string& port ) noexcept;
+/// Creates a socket to connect to the address.
+/// \returns `SocketFailed` with the system error if there is none.
+[[nodiscard]] CExpected<std::unique_ptr<ISocket>>
+CreateSocket( const Endpoint& endpoint,
+              const SocketOptions& options = {} ) noexcept;
 
 } // namespace btcmd
@@ -14,41 +14,252 @@
 //-----------------------------------------------------------------------------
 
 #include "socket_buffer.hpp"
+#include <algorithm>
+#include <climits>
 #include <cstring>
 
 namespace btcmd
 {
 
+/// Reads of at least this size skip the buffer when it is empty.
+constexpr size_t DirectReadSize = 4096;
+
 CSocketBuffer::CSocketBuffer( std::unique_ptr<ISocket>&& socket )
-    : mSocket( std::move( socket ) )
+    : mBuffer( std::make_unique_for_overwrite<char[]>( Capacity ) ),
+      mSocket( std::move( socket ) )
+{
+}
+
+void CSocketBuffer::SetDeadlines( const Clock::time_point firstByte,
+                                  const Clock::time_point response ) noexcept
+{
+    mFirstByteDeadline = firstByte;
+    mResponseDeadline = response;
+    mAwaitingFirstByte = true;
+    mError = Error{};
+}
+
+void CSocketBuffer::Track( CTimings* timings ) noexcept
+{
+    mTimings = timings;
+}
+
+const Error& CSocketBuffer::LastError() const noexcept
+{
+    return mError;
+}
+
+bool CSocketBuffer::PeerClosed() noexcept
+{
+    if ( mSocket->WaitReadable( Clock::now() ) == EIoStatus::TimedOut )
+    {
+        return false;
+    }
+
+    if ( mEnd == Capacity )
+    {
+        // The buffer is full of bytes nobody asked for, it is not closed.
+        return false;
+    }
+
+    const auto result =
+        mSocket->Recv( std::span{ mBuffer.get() + mEnd, Capacity - mEnd } );
+
+    if ( result.mStatus != EIoStatus::Ok )
+    {
+        return true;
+    }
+
+    mEnd += result.mBytes;
+
+    return false;
+}
+
+IoResult CSocketBuffer::Send(
+    const std::span<const std::span<const char>> buffers ) const noexcept
 {
+    return mSocket->Send( buffers );
 }
 
 bool CSocketBuffer::Read( char* dst, size_t length ) noexcept
 {
-    if ( mCursor == mBuffer.size() || mCursor + length > mBuffer.size() )
+    while ( length != 0 )
     {
-        const auto bufferSize = std::max( length, static_cast<size_t>( 256 ) );
-        const auto oldSize = mBuffer.size();
+        if ( const auto data = Data(); !data.empty() )
+        {
+            const auto size = std::min( data.size(), length );
 
-        mBuffer.resize( oldSize + bufferSize, 0 );
+            memcpy( dst, data.data(), size );
+            Consume( size );
 
-        const auto bytesRecv = mSocket->Recv( mBuffer.data() + oldSize,
-                                              static_cast<int>( bufferSize ) );
+            dst += size;
+            length -= size;
 
-        mBuffer.resize( oldSize + bytesRecv );
+            continue;
+        }
 
-        // TODO: timeout
-        if ( mCursor == mBuffer.size() || mCursor + length >= mBuffer.size() )
+        // Nothing is buffered, large reads go straight to the destination.
+        if ( length >= DirectReadSize )
+        {
+            const auto bytesRecv = Recv( dst, length );
+
+            if ( bytesRecv == 0 )
+            {
+                return false;
+            }
+
+            dst += bytesRecv;
+            length -= bytesRecv;
+
+            continue;
+        }
+
+        if ( !Fill( length ) )
         {
             return false;
         }
     }
 
-    memcpy( dst, mBuffer.data() + mCursor, length );
-    mCursor += static_cast<ptrdiff_t>( length );
-
     return true;
 }
 
+bt::EDecodeStatus CSocketBuffer::ReadReply( bt::Decoder& decoder ) noexcept
+{
+    auto status = bt::EDecodeStatus::NeedMore;
+
+    while ( true )
+    {
+        const auto result = decoder.feed( Data() );
+
+        Consume( result.mConsumed );
+        status = result.mStatus;
+
+        if ( status != bt::EDecodeStatus::NeedMore )
+        {
+            break;
+        }
+
+        const auto length = decoder.bytes_needed();
+
+        // Only a body is this long. It is received straight into the
+        // payload, without reading past the reply.
+        if ( length >= DirectReadSize )
+        {
+            if ( mPayload.size() < length )
+            {
+                mPayload.resize( length );
+            }
+
+            if ( !Read( mPayload.data(), length ) )
+            {
+                return bt::EDecodeStatus::NeedMore;
+            }
+
+            status = decoder.feed( std::span{ mPayload.data(), length } )
+                         .mStatus;
+
+            break;
+        }
+
+        if ( !Fill( length ) )
+        {
+            return bt::EDecodeStatus::NeedMore;
+        }
+    }
+
+    if ( status == bt::EDecodeStatus::Done && mTimings != nullptr )
+    {
+        mTimings->Mark( EPhase::LastByte );
+    }
+
+    return status;
+}
+
+std::span<const char> CSocketBuffer::Data() const noexcept
+{
+    return std::span{ mBuffer.get() + mBegin, mEnd - mBegin };
+}
+
+void CSocketBuffer::Consume( const size_t length ) noexcept
+{
+    mBegin += length;
+
+    if ( mBegin == mEnd )
+    {
+        mBegin = 0;
+        mEnd = 0;
+    }
+}
+
+bool CSocketBuffer::Fill( const size_t length ) noexcept
+{
+    if ( length > Capacity )
+    {
+        return false;
+    }
+
+    if ( mBegin + length > Capacity || mEnd == Capacity )
+    {
+        const auto buffered = mEnd - mBegin;
+
+        memmove( mBuffer.get(), mBuffer.get() + mBegin, buffered );
+
+        mBegin = 0;
+        mEnd = buffered;
+    }
+
+    const auto bytesRecv = Recv( mBuffer.get() + mEnd, Capacity - mEnd );
+
+    mEnd += bytesRecv;
+
+    return bytesRecv != 0;
+}
+
+size_t CSocketBuffer::Recv( char* dst, const size_t length ) noexcept
+{
+    const bool firstByte =
+        mAwaitingFirstByte && mFirstByteDeadline < mResponseDeadline;
+    const auto deadline = firstByte ? mFirstByteDeadline : mResponseDeadline;
+
+    if ( mSocket->WaitReadable( deadline ) == EIoStatus::TimedOut )
+    {
+        mError = Error{ .mCode = firstByte ? EError::FirstByteTimeout
+                                           : EError::ResponseTimeout };
+
+        return 0;
+    }
+
+    const auto chunk = std::min( length, static_cast<size_t>( INT_MAX ) );
+    const auto result = mSocket->Recv( std::span{ dst, chunk } );
+
+    switch ( result.mStatus )
+    {
+    case EIoStatus::Ok:
+        break;
+    case EIoStatus::Closed:
+        mError = Error{ .mCode = EError::UnexpectedEof };
+
+        return 0;
+    default:
+        mError = Error{ .mCode = EError::RecvFailed,
+                        .mSystemError = result.mError };
+
+        return 0;
+    }
+
+    const auto bytesRecv = result.mBytes;
+
+    if ( bytesRecv != 0 && mAwaitingFirstByte )
+    {
+        mAwaitingFirstByte = false;
+
+        if ( mTimings != nullptr )
+        {
+            mTimings->Mark( EPhase::FirstByte );
+        }
+    }
+
+    return bytesRecv;
+}
+
 } // namespace btcmd
@@ -15,30 +15,83 @@
 
 #pragma once
 
+#include "bt/bt.hpp"
 #include "socket.hpp"
+#include "timings.hpp"
 #include <memory>
+#include <span>
+#include <string>
 
 namespace btcmd
 {
 
+/// Buffers received bytes in a fixed block that fits the longest reply.
+/// Consumed bytes are dropped and the rest is moved to the front when the
+/// tail runs out of room.
 class CSocketBuffer final
 {
   public:
+    static constexpr size_t Capacity = bt::max_reply_size_v;
+
     explicit CSocketBuffer( std::unique_ptr<ISocket>&& socket );
 
+    /// Sets the deadlines of the next reply, for its first byte and for the
+    /// whole reply. Reads report eof once one of them passes.
+    void SetDeadlines( Clock::time_point firstByte,
+                       Clock::time_point response ) noexcept;
+
+    /// Marks the first and the last byte of the replies in the timings,
+    /// nullptr stops. The timings must outlive the tracking.
+    void Track( CTimings* timings ) noexcept;
+
+    /// \returns why the last read failed since `SetDeadlines`: a timeout, a
+    /// receive error or eof.
+    [[nodiscard]] const Error& LastError() const noexcept;
+
+    /// Checks without blocking whether the peer closed the connection or
+    /// reset it. Bytes that arrived are kept.
+    /// \returns false if it is still open.
+    [[nodiscard]] bool PeerClosed() noexcept;
+
+    /// \returns Closed if the connection was closed by the peer.
+    [[nodiscard]] IoResult
+    Send( std::span<const std::span<const char>> buffers ) const noexcept;
+
+    /// Feeds the decoder until it finishes a reply. A large body is received
+    /// straight into a string the buffer keeps, the rest is decoded in the
+    /// buffer. The reply is valid until the next call.
+    /// \returns NeedMore if there is eof before the reply is complete.
+    bt::EDecodeStatus ReadReply( bt::Decoder& decoder ) noexcept;
+
+    /// \returns buffered bytes that were not consumed yet.
+    [[nodiscard]] std::span<const char> Data() const noexcept;
+
+    void Consume( size_t length ) noexcept;
+
+    /// Receives more bytes, making room for `length` unconsumed bytes in
+    /// total so they stay contiguous.
+    /// \returns false if there is eof or `length` doesn't fit.
+    bool Fill( size_t length ) noexcept;
+
+  private:
+    /// Reads exactly `length` bytes, receiving as many times as needed.
     /// \returns false if there is eof.
     bool Read( char* dst, size_t length ) noexcept;
 
-    /// \returns false if there is eof.
-    template <size_t Size>
-    bool Read( std::array<char, Size>& buffer ) noexcept
-    {
-        return Read( buffer.data(), buffer.size() );
-    }
+    /// \returns the number of bytes received, 0 if there is eof or a deadline
+    /// passed.
+    size_t Recv( char* dst, size_t length ) noexcept;
 
-  private:
-    ptrdiff_t mCursor = 0;
-    std::vector<char> mBuffer;
+    std::unique_ptr<char[]> mBuffer;
+    /// Holds the last large body. Only grows, so its bytes are zeroed once.
+    std::string mPayload;
+    size_t mBegin = 0;
+    size_t mEnd = 0;
+    Clock::time_point mFirstByteDeadline = NoDeadline;
+    Clock::time_point mResponseDeadline = NoDeadline;
+    bool mAwaitingFirstByte = false;
+    Error mError;
+    CTimings* mTimings = nullptr;
     std::unique_ptr<ISocket> mSocket;
 };
 
@@ -14,11 +14,19 @@
 //-----------------------------------------------------------------------------
 
 #include "socket.hpp"
-#include <format>
-#include <iostream>
+#include <algorithm>
+#include <array>
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
 #include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
 #include <sys/socket.h>
 #include <sys/types.h>
+#include <sys/uio.h>
+#include <unistd.h>
 #include <utility>
 
 namespace btcmd
@@ -28,7 +36,7 @@ namespace btcmd
 // CWSAGuard
 //-----------------------------------------------------------------------------
 
-CWSAGuard CWSAGuard::Create() noexcept
+CExpected<CWSAGuard> CWSAGuard::Create() noexcept
 {
     return CWSAGuard{};
 }
@@ -39,94 +47,488 @@ CWSAGuard::~CWSAGuard() = default;
 // CUnixSocket
 //-----------------------------------------------------------------------------
 
+namespace
+{
+
 class CUnixSocket final : public ISocket
 {
   public:
-    explicit CUnixSocket( const int socket, addrinfo* addrInfo )
-        : ISocket(), mSocket( socket ), mAddrInfo( addrInfo )
+    /// \param fastOpen whether TCP_FASTOPEN_CONNECT is set on the socket.
+    /// \param quickAck whether to ask for TCP_QUICKACK before each receive.
+    explicit CUnixSocket( const int socket, const Endpoint& endpoint,
+                          const bool fastOpen, const bool quickAck )
+        : ISocket(), mSocket( socket ), mEndpoint( endpoint ),
+          mFastOpen( fastOpen ), mQuickAck( quickAck )
     {
     }
 
     CUnixSocket( CUnixSocket&& other ) noexcept
         : mSocket( std::exchange( other.mSocket, 0 ) ),
-          mAddrInfo( std::exchange( other.mAddrInfo, nullptr ) )
+          mEndpoint( other.mEndpoint ), mFastOpen( other.mFastOpen ),
+          mQuickAck( other.mQuickAck )
     {
     }
 
-    void Connect() const noexcept override
+    [[nodiscard]] IoResult
+    Connect( const Clock::time_point deadline ) const noexcept override
     {
-        if ( connect( mSocket, mAddrInfo->ai_addr, mAddrInfo->ai_addrlen ) ==
-             -1 )
+        // With Fast Open connect() returns at once, the handshake happens in
+        // the first send.
+        mFastOpenPending = mFastOpen;
+        mConnectDeadline = deadline;
+
+        if ( deadline == NoDeadline )
+        {
+            if ( connect( mSocket, SockAddr(), SockAddrLength() ) == -1 )
+            {
+                return IoResult{ .mStatus = EIoStatus::Error, .mError = errno };
+            }
+
+            return IoResult{};
+        }
+
+        // Connect without blocking and wait for it with poll() to stop at the
+        // deadline instead of the kernel's SYN retry limit.
+        auto result = StartConnect();
+
+        if ( result.mStatus == EIoStatus::WouldBlock )
         {
-            std::cout << std::format( "connect error: {}\n", errno );
+            if ( const auto ready = Poll( POLLOUT, deadline );
+                 ready != EIoStatus::Ok )
+            {
+                result = IoResult{ .mStatus = ready, .mError = errno };
+            }
+            else
+            {
+                result = FinishConnect();
+            }
+        }
 
-            std::exit( -1 );
+        if ( !SetNonBlocking( false ) && result.mStatus == EIoStatus::Ok )
+        {
+            return IoResult{ .mStatus = EIoStatus::Error, .mError = errno };
         }
+
+        return result;
     }
 
-    void Send( std::vector<char>& data ) const noexcept override
+    [[nodiscard]] EIoStatus
+    WaitReadable( const Clock::time_point deadline ) const noexcept override
     {
-        if ( send( mSocket, data.data(), data.size(), 0 ) == -1 )
+        if ( deadline == NoDeadline )
         {
-            std::cout << std::format( "send error: {}\n", errno );
+            return EIoStatus::Ok;
+        }
 
-            std::exit( -1 );
+        return Poll( POLLIN, deadline );
+    }
+
+    [[nodiscard]] IoResult
+    Send( const std::span<const std::span<const char>> buffers )
+        const noexcept override
+    {
+        if ( !std::exchange( mFastOpenPending, false ) )
+        {
+            return SendAll( buffers, NoDeadline );
         }
+
+        // A blocking send would wait for the handshake as long as the
+        // kernel retries the SYN, send without blocking and poll until the
+        // connect deadline instead.
+        if ( !SetNonBlocking( true ) )
+        {
+            return IoResult{ .mStatus = EIoStatus::Error, .mError = errno };
+        }
+
+        const auto result = SendAll( buffers, mConnectDeadline );
+
+        if ( !SetNonBlocking( false ) && result.mStatus == EIoStatus::Ok )
+        {
+            return IoResult{ .mStatus = EIoStatus::Error, .mError = errno };
+        }
+
+        return result;
     }
 
-    size_t Recv( char* dst, int length ) const noexcept override
+    [[nodiscard]] IoResult
+    Recv( const std::span<char> dst ) const noexcept override
     {
-        return recv( mSocket, dst, length, 0 );
+        // The same call, the socket blocks in the blocking mode.
+        return TryRecv( dst );
     }
 
-    ~CUnixSocket() override
+    [[nodiscard]] std::span<const std::byte> Address() const noexcept override
+    {
+        return std::span{ mEndpoint.mAddress }.first( mEndpoint.mSize );
+    }
+
+    [[nodiscard]] intptr_t Handle() const noexcept override
+    {
+        return mSocket;
+    }
+
+    [[nodiscard]] IoResult StartConnect() const noexcept override
+    {
+        if ( !SetNonBlocking( true ) )
+        {
+            return IoResult{ .mStatus = EIoStatus::Error, .mError = errno };
+        }
+
+        if ( connect( mSocket, SockAddr(), SockAddrLength() ) == 0 )
+        {
+            return IoResult{};
+        }
+
+        if ( errno == EINPROGRESS )
+        {
+            return IoResult{ .mStatus = EIoStatus::WouldBlock };
+        }
+
+        return IoResult{ .mStatus = EIoStatus::Error, .mError = errno };
+    }
+
+    [[nodiscard]] IoResult FinishConnect() const noexcept override
     {
-        if ( mAddrInfo != nullptr )
+        int error = 0;
+        socklen_t length = sizeof( error );
+
+        if ( getsockopt( mSocket, SOL_SOCKET, SO_ERROR, &error, &length ) ==
+             -1 )
+        {
+            error = errno;
+        }
+
+        if ( error != 0 )
         {
-            freeaddrinfo( std::exchange( mAddrInfo, nullptr ) );
+            return IoResult{ .mStatus = EIoStatus::Error, .mError = error };
         }
 
+        return IoResult{};
+    }
+
+    [[nodiscard]] IoResult
+    TrySend( const std::span<const char> data ) const noexcept override
+    {
+        while ( true )
+        {
+            const auto bytesSent =
+                send( mSocket, data.data(), data.size(), SendFlags );
+
+            if ( bytesSent != -1 )
+            {
+                return IoResult{ .mBytes = static_cast<size_t>( bytesSent ) };
+            }
+
+            if ( errno != EINTR )
+            {
+                return ErrnoResult();
+            }
+        }
+    }
+
+    [[nodiscard]] IoResult
+    TryRecv( const std::span<char> dst ) const noexcept override
+    {
+#ifdef TCP_QUICKACK
+        // The kernel leaves the quick ack mode on its own, ask again so the
+        // reply is acked at once.
+        if ( mQuickAck )
+        {
+            const int enable = 1;
+
+            static_cast<void>( setsockopt( mSocket, IPPROTO_TCP, TCP_QUICKACK,
+                                           &enable, sizeof( enable ) ) );
+        }
+#endif
+
+        while ( true )
+        {
+            const auto bytesRecv = recv( mSocket, dst.data(), dst.size(), 0 );
+
+            if ( bytesRecv == 0 && !dst.empty() )
+            {
+                return IoResult{ .mStatus = EIoStatus::Closed };
+            }
+
+            if ( bytesRecv != -1 )
+            {
+                return IoResult{ .mBytes = static_cast<size_t>( bytesRecv ) };
+            }
+
+            if ( errno != EINTR )
+            {
+                return ErrnoResult();
+            }
+        }
+    }
+
+    ~CUnixSocket() override
+    {
         if ( mSocket == 0 )
         {
             return;
         }
 
-        if ( shutdown( mSocket, 0 ) == -1 )
+        // Fails if the peer has closed the connection already, there is
+        // nothing to do about it either way.
+        static_cast<void>( shutdown( mSocket, SHUT_RDWR ) );
+
+        close( mSocket );
+    }
+
+  private:
+    [[nodiscard]] const sockaddr* SockAddr() const noexcept
+    {
+        return reinterpret_cast<const sockaddr*>( mEndpoint.mAddress.data() );
+    }
+
+    [[nodiscard]] socklen_t SockAddrLength() const noexcept
+    {
+        return static_cast<socklen_t>( mEndpoint.mSize );
+    }
+
+    /// Sends all buffers, waiting until the deadline for the socket to
+    /// become writable if it is in the non-blocking mode.
+    [[nodiscard]] IoResult
+    SendAll( std::span<const std::span<const char>> buffers,
+             const Clock::time_point deadline ) const noexcept
+    {
+        std::array<iovec, 8> iov;
+
+        while ( !buffers.empty() )
         {
-            std::cout << std::format( "shutdown error: {}\n", errno );
+            const auto count = std::min( buffers.size(), iov.size() );
+
+            for ( size_t i = 0; i < count; i++ )
+            {
+                iov[i].iov_base = const_cast<char*>( buffers[i].data() );
+                iov[i].iov_len = buffers[i].size();
+            }
+
+            buffers = buffers.subspan( count );
+
+            msghdr message{};
+            message.msg_iov = iov.data();
+            message.msg_iovlen = count;
+
+            // sendmsg may write less than asked, continue from where it
+            // stopped.
+            while ( message.msg_iovlen != 0 )
+            {
+                const auto bytesSent = sendmsg( mSocket, &message, SendFlags );
 
-            std::exit( -1 );
+                if ( bytesSent == -1 )
+                {
+                    if ( errno == EINTR )
+                    {
+                        continue;
+                    }
+
+                    // Only in the non-blocking mode: the socket is full or,
+                    // with Fast Open, still connecting.
+                    if ( errno == EAGAIN || errno == EWOULDBLOCK ||
+                         errno == EINPROGRESS )
+                    {
+                        if ( const auto ready = Poll( POLLOUT, deadline );
+                             ready != EIoStatus::Ok )
+                        {
+                            return IoResult{ .mStatus = ready,
+                                             .mError = errno };
+                        }
+
+                        if ( const auto connected = FinishConnect();
+                             connected.mStatus != EIoStatus::Ok )
+                        {
+                            return connected;
+                        }
+
+                        continue;
+                    }
+
+                    return ErrnoResult();
+                }
+
+                auto rest = static_cast<size_t>( bytesSent );
+
+                while ( message.msg_iovlen != 0 &&
+                        rest >= message.msg_iov->iov_len )
+                {
+                    rest -= message.msg_iov->iov_len;
+                    message.msg_iov++;
+                    message.msg_iovlen--;
+                }
+
+                if ( message.msg_iovlen != 0 )
+                {
+                    message.msg_iov->iov_base =
+                        static_cast<char*>( message.msg_iov->iov_base ) + rest;
+                    message.msg_iov->iov_len -= rest;
+                }
+            }
         }
+
+        return IoResult{};
     }
 
-  private:
+    /// \returns false on error, errno is set.
+    [[nodiscard]] bool SetNonBlocking( const bool enable ) const noexcept
+    {
+        const auto flags = fcntl( mSocket, F_GETFL, 0 );
+
+        if ( flags == -1 )
+        {
+            return false;
+        }
+
+        const auto newFlags = enable ? flags | O_NONBLOCK : flags & ~O_NONBLOCK;
+
+        return newFlags == flags || fcntl( mSocket, F_SETFL, newFlags ) != -1;
+    }
+
+    /// Waits for the events until the deadline.
+    [[nodiscard]] EIoStatus
+    Poll( const short events, const Clock::time_point deadline ) const noexcept
+    {
+        pollfd fd{ .fd = mSocket, .events = events, .revents = 0 };
+
+        while ( true )
+        {
+            const auto result = poll( &fd, 1, PollTimeout( deadline ) );
+
+            if ( result > 0 )
+            {
+                return EIoStatus::Ok;
+            }
+
+            if ( result == 0 )
+            {
+                return EIoStatus::TimedOut;
+            }
+
+            if ( errno != EINTR )
+            {
+                return EIoStatus::Error;
+            }
+        }
+    }
+
+    [[nodiscard]] static IoResult ErrnoResult() noexcept
+    {
+        switch ( errno )
+        {
+        case EAGAIN:
+#if EWOULDBLOCK != EAGAIN
+        case EWOULDBLOCK:
+#endif
+        // A Fast Open send without a cookie, the SYN went out alone.
+        case EINPROGRESS:
+            return IoResult{ .mStatus = EIoStatus::WouldBlock };
+        case EPIPE:
+        case ECONNRESET:
+            return IoResult{ .mStatus = EIoStatus::Closed };
+        default:
+            return IoResult{ .mStatus = EIoStatus::Error, .mError = errno };
+        }
+    }
+
+#ifdef MSG_NOSIGNAL
+    static constexpr int SendFlags = MSG_NOSIGNAL;
+#else
+    static constexpr int SendFlags = 0;
+#endif
+
     int mSocket;
-    addrinfo* mAddrInfo;
+    Endpoint mEndpoint;
+    bool mFastOpen;
+    bool mQuickAck;
+    /// Set by `Connect` until the first send.
+    mutable bool mFastOpenPending = false;
+    mutable Clock::time_point mConnectDeadline = NoDeadline;
 };
 
-[[nodiscard]] std::unique_ptr<ISocket>
-CreateSocket( const std::string& node, const std::string& port ) noexcept
+/// How long a receive spins on the device queue before sleeping.
+constexpr int BusyPollMicroseconds = 50;
+
+/// Best effort, an option the kernel doesn't know or doesn't allow is skipped.
+/// \returns false if it wasn't set.
+bool SetOption( const int socket, const int level, const int name,
+                const int value ) noexcept
 {
-    addrinfo* addrInfo;
+    return setsockopt( socket, level, name, &value, sizeof( value ) ) == 0;
+}
+
+} // namespace
 
-    if ( const auto error =
-             getaddrinfo( node.c_str(), port.c_str(), nullptr, &addrInfo ) )
+Resolution GetAddrInfo( const std::string& node,
+                        const std::string& port ) noexcept
+{
+    addrinfo hints{};
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+
+    addrinfo* addrInfo = nullptr;
+    const auto error =
+        getaddrinfo( node.c_str(), port.c_str(), &hints, &addrInfo );
+
+    Resolution resolution{ .mError = error, .mEndpoints = {} };
+
+    if ( error != 0 )
     {
-        std::cout << std::format( "getaddrinfo error: {}\n", error );
+        return resolution;
+    }
 
-        std::exit( -1 );
+    for ( auto* info = addrInfo; info != nullptr; info = info->ai_next )
+    {
+        Endpoint endpoint{ .mFamily = info->ai_family,
+                           .mSize = static_cast<size_t>( info->ai_addrlen ) };
+
+        if ( endpoint.mSize <= endpoint.mAddress.size() )
+        {
+            std::memcpy( endpoint.mAddress.data(), info->ai_addr,
+                         endpoint.mSize );
+            resolution.mEndpoints.push_back( endpoint );
+        }
     }
 
-    const auto sock = socket( addrInfo->ai_family, SOCK_STREAM, 0 );
+    freeaddrinfo( addrInfo );
+
+    return resolution;
+}
+
+[[nodiscard]] CExpected<std::unique_ptr<ISocket>>
+CreateSocket( const Endpoint& endpoint, const SocketOptions& options ) noexcept
+{
+    const auto sock = socket( endpoint.mFamily, SOCK_STREAM, 0 );
 
     if ( sock == -1 )
     {
-        std::cout << std::format( "Can't create a socket: error {}\n", errno );
+        return Error{ .mCode = EError::SocketFailed, .mSystemError = errno };
+    }
+
+    bool fastOpen = false;
+    bool quickAck = false;
 
-        std::exit( -1 );
+#ifdef TCP_FASTOPEN_CONNECT
+    // Kernels older than 4.11 don't have it, the socket connects the usual
+    // way.
+    fastOpen = options.mFastOpen &&
+               SetOption( sock, IPPROTO_TCP, TCP_FASTOPEN_CONNECT, 1 );
+#endif
+
+    if ( options.mLowLatency )
+    {
+        SetOption( sock, IPPROTO_TCP, TCP_NODELAY, 1 );
+#ifdef TCP_QUICKACK
+        quickAck = true;
+#endif
+#ifdef SO_BUSY_POLL
+        // Raising it above net.core.busy_read needs CAP_NET_ADMIN.
+        SetOption( sock, SOL_SOCKET, SO_BUSY_POLL, BusyPollMicroseconds );
+#endif
     }
 
-    return std::make_unique<CUnixSocket>( sock, addrInfo );
+    return std::unique_ptr<ISocket>{
+        std::make_unique<CUnixSocket>( sock, endpoint, fastOpen, quickAck ) };
 }
 
 } // namespace btcmd
@@ -14,8 +14,9 @@
 //-----------------------------------------------------------------------------
 
 #include "socket.hpp"
-#include <format>
-#include <iostream>
+#include <algorithm>
+#include <array>
+#include <cstring>
 #include <utility>
 #include <winsock2.h>
 #include <ws2tcpip.h>
@@ -27,15 +28,14 @@ namespace btcmd
 // CWSAGuard
 //-----------------------------------------------------------------------------
 
-CWSAGuard CWSAGuard::Create() noexcept
+CExpected<CWSAGuard> CWSAGuard::Create() noexcept
 {
     WSAData wsaData;
 
     if ( const auto error = WSAStartup( MAKEWORD( 2, 2 ), &wsaData );
          error != 0 )
     {
-        std::cout << std::format( "WSAStartup error: {}\n", error );
-        std::exit( -1 );
+        return Error{ .mCode = EError::System, .mSystemError = error };
     }
 
     return CWSAGuard{};
@@ -43,12 +43,10 @@ CWSAGuard CWSAGuard::Create() noexcept
 
 CWSAGuard::~CWSAGuard()
 {
-    if ( const auto ok = WSACleanup(); ok != 0 )
+    // Nothing is left to do about it at exit.
+    if ( mOwner )
     {
-        const auto error = WSAGetLastError();
-
-        std::cout << std::format( "WSACleanup error: {}\n", error );
-        std::exit( -1 );
+        static_cast<void>( WSACleanup() );
     }
 }
 
@@ -56,17 +54,20 @@ CWSAGuard::~CWSAGuard()
 // CWin32Socket
 //-----------------------------------------------------------------------------
 
+namespace
+{
+
 class CWin32Socket final : public ISocket
 {
   public:
-    explicit CWin32Socket( const SOCKET socket, ADDRINFOA* addrInfo )
-        : ISocket(), mSocket( socket ), mAddrInfo( addrInfo )
+    explicit CWin32Socket( const SOCKET socket, const Endpoint& endpoint )
+        : ISocket(), mSocket( socket ), mEndpoint( endpoint )
     {
     }
 
     CWin32Socket( CWin32Socket&& other ) noexcept
         : mSocket( std::exchange( other.mSocket, 0 ) ),
-          mAddrInfo( std::exchange( other.mAddrInfo, nullptr ) )
+          mEndpoint( other.mEndpoint )
     {
     }
 
@@ -77,91 +78,315 @@ class CWin32Socket final : public ISocket
         return *this;
     }
 
-    void Connect() const noexcept override
+    [[nodiscard]] IoResult
+    Connect( const Clock::time_point deadline ) const noexcept override
     {
-        if ( WSAConnect( mSocket, mAddrInfo->ai_addr,
-                         static_cast<int>( mAddrInfo->ai_addrlen ), nullptr,
-                         nullptr, nullptr, nullptr ) )
+        if ( deadline == NoDeadline )
+        {
+            if ( WSAConnect( mSocket, SockAddr(), SockAddrLength(), nullptr,
+                             nullptr, nullptr, nullptr ) )
+            {
+                return IoResult{ .mStatus = EIoStatus::Error,
+                                 .mError = WSAGetLastError() };
+            }
+
+            return IoResult{};
+        }
+
+        // Connect without blocking and wait for it with WSAPoll() to stop at
+        // the deadline.
+        auto result = StartConnect();
+
+        if ( result.mStatus == EIoStatus::WouldBlock )
+        {
+            if ( const auto ready = Poll( POLLWRNORM, deadline );
+                 ready != EIoStatus::Ok )
+            {
+                result = IoResult{ .mStatus = ready,
+                                   .mError = WSAGetLastError() };
+            }
+            else
+            {
+                result = FinishConnect();
+            }
+        }
+
+        if ( !SetNonBlocking( false ) && result.mStatus == EIoStatus::Ok )
         {
-            std::cout << std::format( "WSAConnect error: {}\n",
-                                      WSAGetLastError() );
+            return IoResult{ .mStatus = EIoStatus::Error,
+                             .mError = WSAGetLastError() };
+        }
+
+        return result;
+    }
 
-            std::exit( -1 );
+    [[nodiscard]] EIoStatus
+    WaitReadable( const Clock::time_point deadline ) const noexcept override
+    {
+        if ( deadline == NoDeadline )
+        {
+            return EIoStatus::Ok;
         }
+
+        return Poll( POLLRDNORM, deadline );
     }
 
-    void Send( std::vector<char>& data ) const noexcept override
+    [[nodiscard]] IoResult
+    Send( std::span<const std::span<const char>> buffers )
+        const noexcept override
     {
-        WSABUF buffer{ .len = static_cast<ULONG>( data.size() ),
-                       .buf = data.data() };
-        DWORD bytesSend;
+        std::array<WSABUF, 8> wsaBuffers;
 
-        if ( WSASend( mSocket, &buffer, 1, &bytesSend, 0, nullptr, nullptr ) )
+        while ( !buffers.empty() )
         {
-            std::cout << std::format( "send error: {}\n", WSAGetLastError() );
+            const auto count = std::min( buffers.size(), wsaBuffers.size() );
+
+            for ( size_t i = 0; i < count; i++ )
+            {
+                wsaBuffers[i] =
+                    WSABUF{ .len = static_cast<ULONG>( buffers[i].size() ),
+                            .buf = const_cast<char*>( buffers[i].data() ) };
+            }
+
+            buffers = buffers.subspan( count );
+
+            // A blocking WSASend completes only when all buffers are sent.
+            DWORD bytesSend;
+
+            if ( WSASend( mSocket, wsaBuffers.data(),
+                          static_cast<DWORD>( count ), &bytesSend, 0, nullptr,
+                          nullptr ) )
+            {
+                const auto error = WSAGetLastError();
+
+                if ( error == WSAECONNRESET || error == WSAECONNABORTED ||
+                     error == WSAESHUTDOWN )
+                {
+                    return IoResult{ .mStatus = EIoStatus::Closed };
+                }
+
+                return IoResult{ .mStatus = EIoStatus::Error,
+                                 .mError = error };
+            }
+        }
+
+        return IoResult{};
+    }
+
+    [[nodiscard]] IoResult
+    Recv( const std::span<char> dst ) const noexcept override
+    {
+        // The same call, the socket blocks in the blocking mode.
+        return TryRecv( dst );
+    }
 
-            std::exit( -1 );
+    [[nodiscard]] std::span<const std::byte> Address() const noexcept override
+    {
+        return std::span{ mEndpoint.mAddress }.first( mEndpoint.mSize );
+    }
+
+    [[nodiscard]] intptr_t Handle() const noexcept override
+    {
+        return static_cast<intptr_t>( mSocket );
+    }
+
+    [[nodiscard]] IoResult StartConnect() const noexcept override
+    {
+        if ( !SetNonBlocking( true ) )
+        {
+            return IoResult{ .mStatus = EIoStatus::Error,
+                             .mError = WSAGetLastError() };
         }
+
+        if ( connect( mSocket, SockAddr(), SockAddrLength() ) == 0 )
+        {
+            return IoResult{};
+        }
+
+        return LastErrorResult();
     }
 
-    size_t Recv( char* dst, const int length ) const noexcept override
+    [[nodiscard]] IoResult FinishConnect() const noexcept override
     {
-        return recv( mSocket, dst, length, 0 );
+        int error = 0;
+        int length = sizeof( error );
+
+        if ( getsockopt( mSocket, SOL_SOCKET, SO_ERROR,
+                         reinterpret_cast<char*>( &error ), &length ) )
+        {
+            error = WSAGetLastError();
+        }
+
+        if ( error != 0 )
+        {
+            return IoResult{ .mStatus = EIoStatus::Error, .mError = error };
+        }
+
+        return IoResult{};
     }
 
-    ~CWin32Socket() override
+    [[nodiscard]] IoResult
+    TrySend( const std::span<const char> data ) const noexcept override
+    {
+        const auto bytesSent =
+            send( mSocket, data.data(), static_cast<int>( data.size() ), 0 );
+
+        if ( bytesSent == SOCKET_ERROR )
+        {
+            return LastErrorResult();
+        }
+
+        return IoResult{ .mBytes = static_cast<size_t>( bytesSent ) };
+    }
+
+    [[nodiscard]] IoResult
+    TryRecv( const std::span<char> dst ) const noexcept override
     {
-        if ( mAddrInfo != nullptr )
+        const auto bytesRecv =
+            recv( mSocket, dst.data(), static_cast<int>( dst.size() ), 0 );
+
+        if ( bytesRecv == 0 && !dst.empty() )
+        {
+            return IoResult{ .mStatus = EIoStatus::Closed };
+        }
+
+        if ( bytesRecv == SOCKET_ERROR )
         {
-            freeaddrinfo( std::exchange( mAddrInfo, nullptr ) );
+            return LastErrorResult();
         }
 
-        if ( mSocket != 0 )
+        return IoResult{ .mBytes = static_cast<size_t>( bytesRecv ) };
+    }
+
+    ~CWin32Socket() override
+    {
+        if ( mSocket == 0 )
         {
             return;
         }
 
-        if ( closesocket( mSocket ) )
+        // There is nothing to do about a failure here.
+        static_cast<void>( closesocket( mSocket ) );
+    }
+
+  private:
+    [[nodiscard]] const sockaddr* SockAddr() const noexcept
+    {
+        return reinterpret_cast<const sockaddr*>( mEndpoint.mAddress.data() );
+    }
+
+    [[nodiscard]] int SockAddrLength() const noexcept
+    {
+        return static_cast<int>( mEndpoint.mSize );
+    }
+
+    [[nodiscard]] bool SetNonBlocking( const bool enable ) const noexcept
+    {
+        u_long nonBlocking = enable ? 1 : 0;
+
+        return ioctlsocket( mSocket, FIONBIO, &nonBlocking ) == 0;
+    }
+
+    /// Waits for the events until the deadline.
+    [[nodiscard]] EIoStatus
+    Poll( const SHORT events, const Clock::time_point deadline ) const noexcept
+    {
+        WSAPOLLFD fd{ .fd = mSocket, .events = events, .revents = 0 };
+
+        const auto result = WSAPoll( &fd, 1, PollTimeout( deadline ) );
+
+        if ( result > 0 )
         {
-            std::cout << std::format( "closesocket error: {}\n",
-                                      WSAGetLastError() );
+            return EIoStatus::Ok;
+        }
 
-            std::exit( -1 );
+        return result == 0 ? EIoStatus::TimedOut : EIoStatus::Error;
+    }
+
+    [[nodiscard]] static IoResult LastErrorResult() noexcept
+    {
+        switch ( const auto error = WSAGetLastError() )
+        {
+        case WSAEWOULDBLOCK:
+            return IoResult{ .mStatus = EIoStatus::WouldBlock };
+        case WSAECONNRESET:
+        case WSAECONNABORTED:
+        case WSAESHUTDOWN:
+            return IoResult{ .mStatus = EIoStatus::Closed };
+        default:
+            return IoResult{ .mStatus = EIoStatus::Error, .mError = error };
         }
     }
 
-  private:
     SOCKET mSocket;
-    PADDRINFOA mAddrInfo;
+    Endpoint mEndpoint;
 };
 
-[[nodiscard]] std::unique_ptr<ISocket>
-CreateSocket( const std::string& node, const std::string& port ) noexcept
+} // namespace
+
+Resolution GetAddrInfo( const std::string& node,
+                        const std::string& port ) noexcept
 {
-    PADDRINFOA addrInfo;
+    ADDRINFOA hints{};
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_protocol = IPPROTO_TCP;
 
-    if ( const auto error =
-             getaddrinfo( node.c_str(), port.c_str(), nullptr, &addrInfo ) )
+    PADDRINFOA addrInfo = nullptr;
+    const auto error =
+        getaddrinfo( node.c_str(), port.c_str(), &hints, &addrInfo );
+
+    Resolution resolution{ .mError = error, .mEndpoints = {} };
+
+    if ( error != 0 )
     {
-        std::cout << std::format( "getaddrinfo error: {} ({})\n",
-                                  gai_strerror( error ), WSAGetLastError() );
+        return resolution;
+    }
 
-        std::exit( -1 );
+    for ( auto* info = addrInfo; info != nullptr; info = info->ai_next )
+    {
+        Endpoint endpoint{ .mFamily = info->ai_family,
+                           .mSize = static_cast<size_t>( info->ai_addrlen ) };
+
+        if ( endpoint.mSize <= endpoint.mAddress.size() )
+        {
+            std::memcpy( endpoint.mAddress.data(), info->ai_addr,
+                         endpoint.mSize );
+            resolution.mEndpoints.push_back( endpoint );
+        }
     }
 
+    freeaddrinfo( addrInfo );
+
+    return resolution;
+}
+
+[[nodiscard]] CExpected<std::unique_ptr<ISocket>>
+CreateSocket( const Endpoint& endpoint, const SocketOptions& options ) noexcept
+{
     const auto socket =
-        WSASocketW( addrInfo->ai_family, SOCK_STREAM, IPPROTO_TCP, nullptr, 0,
+        WSASocketW( endpoint.mFamily, SOCK_STREAM, IPPROTO_TCP, nullptr, 0,
                     WSA_FLAG_OVERLAPPED );
 
     if ( socket == INVALID_SOCKET )
     {
-        std::cout << std::format( "Can't create a socket: error {}\n",
-                                  WSAGetLastError() );
+        return Error{ .mCode = EError::SocketFailed,
+                      .mSystemError = WSAGetLastError() };
+    }
+
+    // Fast Open needs ConnectEx and overlapped I/O, only Nagle is turned off.
+    if ( options.mLowLatency )
+    {
+        const BOOL enable = TRUE;
 
-        std::exit( -1 );
+        static_cast<void>(
+            setsockopt( socket, IPPROTO_TCP, TCP_NODELAY,
+                        reinterpret_cast<const char*>( &enable ),
+                        sizeof( enable ) ) );
     }
 
-    return std::make_unique<CWin32Socket>( socket, addrInfo );
+    return std::unique_ptr<ISocket>{
+        std::make_unique<CWin32Socket>( socket, endpoint ) };
 }
 
 } // namespace btcmd
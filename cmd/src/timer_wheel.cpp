@@ -0,0 +1,123 @@
+//-----------------------------------------------------------------------------
+// Copyright 2024 Igor Spichkin
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//-----------------------------------------------------------------------------
+
+#include "timer_wheel.hpp"
+#include <algorithm>
+#include <bit>
+
+namespace btcmd
+{
+
+CTimerWheel::CTimerWheel( const Clock::duration tick,
+                          const Clock::time_point start ) noexcept
+    : mTick( std::max( tick, Clock::duration{ 1 } ) ), mStart( start )
+{
+}
+
+void CTimerWheel::Schedule( const Clock::time_point when, const uint64_t id )
+{
+    // Rounded up, so a timer never fires early.
+    auto tick = mCurrent + 1;
+
+    if ( when > mStart )
+    {
+        tick = std::max<uint64_t>(
+            tick, ( when - mStart + mTick - Clock::duration{ 1 } ) / mTick );
+    }
+
+    Insert( Timer{ .mTick = tick, .mId = id } );
+}
+
+Clock::time_point CTimerWheel::NextExpiry() const noexcept
+{
+    if ( mSize == 0 )
+    {
+        return NoDeadline;
+    }
+
+    auto next = UINT64_MAX;
+
+    for ( size_t level = 0; level < Levels; level++ )
+    {
+        const auto position = mCurrent >> ( SlotBits * level );
+
+        // The slots after the current one, in the order their turns come.
+        const auto occupied = std::rotr(
+            mOccupied[level], static_cast<int>( Index( position + 1, 0 ) ) );
+
+        if ( occupied == 0 )
+        {
+            continue;
+        }
+
+        const auto turns =
+            static_cast<uint64_t>( std::countr_zero( occupied ) ) + 1;
+
+        next = std::min( next, ( position + turns ) << ( SlotBits * level ) );
+    }
+
+    return mStart + mTick * next;
+}
+
+size_t CTimerWheel::Size() const noexcept
+{
+    return mSize;
+}
+
+uint64_t CTimerWheel::ToTick( const Clock::time_point time ) const noexcept
+{
+    if ( time <= mStart )
+    {
+        return 0;
+    }
+
+    return static_cast<uint64_t>( ( time - mStart ) / mTick );
+}
+
+void CTimerWheel::Take( const size_t level, const size_t index )
+{
+    auto& slot = mSlots[level][index];
+
+    mScratch.clear();
+    mScratch.swap( slot );
+    mOccupied[level] &= ~( uint64_t{ 1 } << index );
+    mSize -= mScratch.size();
+}
+
+void CTimerWheel::Insert( const Timer& timer )
+{
+    constexpr auto range = uint64_t{ 1 } << ( SlotBits * Levels );
+
+    // Timers beyond the top level are parked at its end.
+    const auto tick = std::min( std::max( timer.mTick, mCurrent ),
+                                mCurrent + range - 1 );
+    const auto delta = tick - mCurrent;
+
+    size_t level = 0;
+
+    while ( level + 1 < Levels &&
+            delta >= ( uint64_t{ 1 } << ( SlotBits * ( level + 1 ) ) ) )
+    {
+        level++;
+    }
+
+    const auto index = Index( tick, level );
+
+    mSlots[level][index].push_back( timer );
+    mOccupied[level] |= uint64_t{ 1 } << index;
+    mSize++;
+}
+
+} // namespace btcmd
@@ -0,0 +1,144 @@
+//-----------------------------------------------------------------------------
+// Copyright 2024 Igor Spichkin
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//-----------------------------------------------------------------------------
+
+#pragma once
+
+#include "socket.hpp"
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+namespace btcmd
+{
+
+/// A hierarchical timer wheel: `Levels` wheels of 64 slots, each slot of a
+/// level spanning a whole turn of the level below. Scheduling is O(1), a
+/// timer is moved down one level at a time as its turn comes, so the loop
+/// doesn't need to sort or scan thousands of deadlines. Timers can't be
+/// cancelled, the owner ignores ids it no longer expects instead. Timers
+/// further away than the top level are parked there and rescheduled.
+class CTimerWheel final
+{
+  public:
+    static constexpr size_t SlotBits = 6;
+    static constexpr size_t Slots = size_t{ 1 } << SlotBits;
+    static constexpr size_t Levels = 4;
+
+    /// \param tick the resolution, timers fire on the first tick after their
+    /// time.
+    CTimerWheel( Clock::duration tick, Clock::time_point start ) noexcept;
+
+    void Schedule( Clock::time_point when, uint64_t id );
+
+    /// \returns when `Advance` has something to do next, `NoDeadline` if
+    /// there are no timers. May be earlier than the next timer, when a
+    /// timer moves down a level.
+    [[nodiscard]] Clock::time_point NextExpiry() const noexcept;
+
+    [[nodiscard]] size_t Size() const noexcept;
+
+    /// Calls `onExpired( id )` for every timer due by `now`, in the order of
+    /// their ticks. The callback may schedule more timers.
+    template <typename Callback>
+    void Advance( const Clock::time_point now, Callback&& onExpired )
+    {
+        const auto target = ToTick( now );
+
+        while ( mCurrent < target )
+        {
+            if ( mSize == 0 )
+            {
+                mCurrent = target;
+
+                return;
+            }
+
+            mCurrent++;
+
+            // Moves the timers of the slots whose turn has come down a level,
+            // from the highest level that turned over.
+            size_t level = 1;
+
+            while ( level < Levels &&
+                    ( mCurrent & ( ( uint64_t{ 1 } << ( SlotBits * level ) ) -
+                                   1 ) ) == 0 )
+            {
+                level++;
+            }
+
+            for ( ; level > 1; level-- )
+            {
+                Take( level - 1, Index( mCurrent, level - 1 ) );
+
+                for ( const auto& timer : mScratch )
+                {
+                    Insert( timer );
+                }
+            }
+
+            Take( 0, Index( mCurrent, 0 ) );
+
+            for ( const auto& timer : mScratch )
+            {
+                // Parked on the top level.
+                if ( timer.mTick > mCurrent )
+                {
+                    Insert( timer );
+                }
+                else
+                {
+                    onExpired( timer.mId );
+                }
+            }
+        }
+    }
+
+  private:
+    struct Timer final
+    {
+        uint64_t mTick;
+        uint64_t mId;
+    };
+
+    using Slot = std::vector<Timer>;
+
+    [[nodiscard]] static constexpr size_t Index( const uint64_t tick,
+                                                 const size_t level ) noexcept
+    {
+        return ( tick >> ( SlotBits * level ) ) & ( Slots - 1 );
+    }
+
+    /// \returns the last tick that ended by `time`.
+    [[nodiscard]] uint64_t ToTick( Clock::time_point time ) const noexcept;
+
+    /// Moves the timers of the slot to `mScratch`.
+    void Take( size_t level, size_t index );
+
+    void Insert( const Timer& timer );
+
+    Clock::duration mTick;
+    Clock::time_point mStart;
+    /// Every timer up to this tick has fired.
+    uint64_t mCurrent = 0;
+    std::array<std::array<Slot, Slots>, Levels> mSlots;
+    /// A bit per slot that has timers.
+    std::array<uint64_t, Levels> mOccupied{};
+    size_t mSize = 0;
+    /// The timers being moved or fired, kept to reuse its memory.
+    Slot mScratch;
+};
+
+} // namespace btcmd
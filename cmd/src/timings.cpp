@@ -0,0 +1,53 @@
+//-----------------------------------------------------------------------------
+// Copyright 2024 Igor Spichkin
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//-----------------------------------------------------------------------------
+
+#include "timings.hpp"
+#include "output.hpp"
+#include <format>
+
+namespace btcmd
+{
+
+std::string CTimings::ToJson( const std::string_view target ) const
+{
+    std::string json = "{\"target\":";
+    AppendJsonString( json, target );
+
+    for ( size_t i = 0; i < PhaseCount; i++ )
+    {
+        const auto phase = static_cast<EPhase>( i );
+
+        json += ",\"";
+        json += ToString( phase );
+        json += "_ms\":";
+
+        if ( const auto elapsed = Elapsed( phase ) )
+        {
+            json += std::format(
+                "{:.3f}",
+                std::chrono::duration<double, std::milli>( *elapsed ).count() );
+        }
+        else
+        {
+            json += "null";
+        }
+    }
+
+    json += '}';
+
+    return json;
+}
+
+} // namespace btcmd
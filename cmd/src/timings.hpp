@@ -0,0 +1,116 @@
+//-----------------------------------------------------------------------------
+// Copyright 2024 Igor Spichkin
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//-----------------------------------------------------------------------------
+
+#pragma once
+
+#include "socket.hpp"
+#include <array>
+#include <chrono>
+#include <cstddef>
+#include <optional>
+#include <string>
+#include <string_view>
+
+namespace btcmd
+{
+
+/// The milestones of one topic, in the order they are reached.
+enum class EPhase
+{
+    /// The name is resolved.
+    Resolve,
+    /// The connection is established.
+    Connect,
+    /// The whole topic is handed to the kernel.
+    Send,
+    /// The first byte of the reply arrived.
+    FirstByte,
+    /// The reply is complete.
+    LastByte
+};
+
+inline constexpr size_t PhaseCount = 5;
+
+[[nodiscard]] constexpr std::string_view
+ToString( const EPhase phase ) noexcept
+{
+    switch ( phase )
+    {
+    case EPhase::Resolve:
+        return "resolve";
+    case EPhase::Connect:
+        return "connect";
+    case EPhase::Send:
+        return "send";
+    case EPhase::FirstByte:
+        return "first_byte";
+    default:
+        return "last_byte";
+    }
+}
+
+/// When each phase of one topic ended on the monotonic clock. A mark is one
+/// clock read and a store, cheap enough to take on every topic. Phases that
+/// were skipped, like resolving and connecting on a reused connection, stay
+/// unmarked.
+class CTimings final
+{
+  public:
+    /// Clears the marks and starts counting from `now`.
+    void Start( const Clock::time_point now = Clock::now() ) noexcept
+    {
+        mStart = now;
+        mMarks.fill( Clock::time_point{} );
+    }
+
+    void Mark( const EPhase phase,
+               const Clock::time_point now = Clock::now() ) noexcept
+    {
+        mMarks[static_cast<size_t>( phase )] = now;
+    }
+
+    /// \returns the time from the start until the end of the phase, nullopt
+    /// if the phase was not reached.
+    [[nodiscard]] std::optional<std::chrono::nanoseconds>
+    Elapsed( const EPhase phase ) const noexcept
+    {
+        const auto mark = mMarks[static_cast<size_t>( phase )];
+
+        if ( mark == Clock::time_point{} )
+        {
+            return std::nullopt;
+        }
+
+        return mark - mStart;
+    }
+
+    /// \returns the time until the last byte, or until `now` if the topic
+    /// didn't get that far.
+    [[nodiscard]] std::chrono::nanoseconds
+    Latency( const Clock::time_point now = Clock::now() ) const noexcept
+    {
+        return Elapsed( EPhase::LastByte ).value_or( now - mStart );
+    }
+
+    /// \returns a JSON object with the elapsed milliseconds of every phase,
+    /// null for the phases that were not reached, and the target.
+    [[nodiscard]] std::string ToJson( std::string_view target ) const;
+
+  private:
+    Clock::time_point mStart;
+    std::array<Clock::time_point, PhaseCount> mMarks{};
+};
+
+} // namespace btcmd
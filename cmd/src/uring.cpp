@@ -0,0 +1,281 @@
+//-----------------------------------------------------------------------------
+// Copyright 2024 Igor Spichkin
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//-----------------------------------------------------------------------------
+
+#include "uring.hpp"
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cerrno>
+#include <cstring>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+namespace btcmd
+{
+
+namespace
+{
+
+int SysSetup( const uint32_t entries, io_uring_params* params ) noexcept
+{
+    return static_cast<int>( syscall( __NR_io_uring_setup, entries, params ) );
+}
+
+int SysEnter( const int fd, const uint32_t toSubmit, const uint32_t minComplete,
+              const uint32_t flags, const io_uring_getevents_arg* arg ) noexcept
+{
+    return static_cast<int>(
+        syscall( __NR_io_uring_enter, fd, toSubmit, minComplete, flags, arg,
+                 arg != nullptr ? sizeof( io_uring_getevents_arg ) : 0 ) );
+}
+
+int SysRegister( const int fd, const uint32_t opcode, const void* arg,
+                 const uint32_t count ) noexcept
+{
+    return static_cast<int>(
+        syscall( __NR_io_uring_register, fd, opcode, arg, count ) );
+}
+
+/// \returns true if the kernel supports every operation the client submits.
+bool ProbeOperations( const int fd ) noexcept
+{
+    constexpr size_t opsCount = 256;
+
+    alignas( io_uring_probe )
+        std::array<std::byte, sizeof( io_uring_probe ) +
+                                  opsCount * sizeof( io_uring_probe_op )>
+            storage{};
+    auto* probe = reinterpret_cast<io_uring_probe*>( storage.data() );
+
+    if ( SysRegister( fd, IORING_REGISTER_PROBE, probe, opsCount ) < 0 )
+    {
+        return false;
+    }
+
+    for ( const auto op : { IORING_OP_CONNECT, IORING_OP_SEND, IORING_OP_RECV,
+                            IORING_OP_READ_FIXED } )
+    {
+        if ( op > probe->last_op ||
+             ( probe->ops[op].flags & IO_URING_OP_SUPPORTED ) == 0 )
+        {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+} // namespace
+
+std::unique_ptr<CUring> CUring::Create( const uint32_t entries ) noexcept
+{
+    io_uring_params params{};
+
+    const auto fd = SysSetup( entries, &params );
+
+    if ( fd < 0 )
+    {
+        return nullptr;
+    }
+
+    std::unique_ptr<CUring> ring{ new CUring() };
+    ring->mFd = fd;
+
+    // Completions must not be dropped when the completion queue overflows,
+    // and waiting needs a timeout for the deadlines.
+    if ( ( params.features & IORING_FEAT_NODROP ) == 0 ||
+         ( params.features & IORING_FEAT_EXT_ARG ) == 0 ||
+         !ProbeOperations( fd ) )
+    {
+        return nullptr;
+    }
+
+    ring->mSqRingSize =
+        params.sq_off.array + params.sq_entries * sizeof( uint32_t );
+    ring->mCqRingSize =
+        params.cq_off.cqes + params.cq_entries * sizeof( io_uring_cqe );
+
+    const bool singleMmap = ( params.features & IORING_FEAT_SINGLE_MMAP ) != 0;
+
+    if ( singleMmap )
+    {
+        ring->mSqRingSize = std::max( ring->mSqRingSize, ring->mCqRingSize );
+    }
+
+    ring->mSqRing = mmap( nullptr, ring->mSqRingSize, PROT_READ | PROT_WRITE,
+                          MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING );
+
+    if ( ring->mSqRing == MAP_FAILED )
+    {
+        ring->mSqRing = nullptr;
+
+        return nullptr;
+    }
+
+    if ( singleMmap )
+    {
+        ring->mCqRing = ring->mSqRing;
+    }
+    else
+    {
+        ring->mCqRing =
+            mmap( nullptr, ring->mCqRingSize, PROT_READ | PROT_WRITE,
+                  MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING );
+
+        if ( ring->mCqRing == MAP_FAILED )
+        {
+            ring->mCqRing = nullptr;
+
+            return nullptr;
+        }
+    }
+
+    ring->mSqesSize = params.sq_entries * sizeof( io_uring_sqe );
+
+    auto* sqes = mmap( nullptr, ring->mSqesSize, PROT_READ | PROT_WRITE,
+                       MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES );
+
+    if ( sqes == MAP_FAILED )
+    {
+        return nullptr;
+    }
+
+    ring->mSqes = static_cast<io_uring_sqe*>( sqes );
+
+    auto* sq = static_cast<char*>( ring->mSqRing );
+    ring->mSqHead = reinterpret_cast<uint32_t*>( sq + params.sq_off.head );
+    ring->mSqTail = reinterpret_cast<uint32_t*>( sq + params.sq_off.tail );
+    ring->mSqArray = reinterpret_cast<uint32_t*>( sq + params.sq_off.array );
+    ring->mSqMask =
+        *reinterpret_cast<uint32_t*>( sq + params.sq_off.ring_mask );
+    ring->mSqEntries = params.sq_entries;
+    ring->mSqLocalTail = *ring->mSqTail;
+
+    auto* cq = static_cast<char*>( ring->mCqRing );
+    ring->mCqHead = reinterpret_cast<uint32_t*>( cq + params.cq_off.head );
+    ring->mCqTail = reinterpret_cast<uint32_t*>( cq + params.cq_off.tail );
+    ring->mCqes = reinterpret_cast<io_uring_cqe*>( cq + params.cq_off.cqes );
+    ring->mCqMask =
+        *reinterpret_cast<uint32_t*>( cq + params.cq_off.ring_mask );
+
+    return ring;
+}
+
+CUring::~CUring()
+{
+    if ( mSqes != nullptr )
+    {
+        munmap( mSqes, mSqesSize );
+    }
+
+    if ( mCqRing != nullptr && mCqRing != mSqRing )
+    {
+        munmap( mCqRing, mCqRingSize );
+    }
+
+    if ( mSqRing != nullptr )
+    {
+        munmap( mSqRing, mSqRingSize );
+    }
+
+    if ( mFd != -1 )
+    {
+        close( mFd );
+    }
+}
+
+io_uring_sqe* CUring::GetSqe() noexcept
+{
+    if ( mSqLocalTail - LoadAcquire( mSqHead ) >= mSqEntries )
+    {
+        return nullptr;
+    }
+
+    const auto index = mSqLocalTail & mSqMask;
+    auto* sqe = &mSqes[index];
+
+    memset( sqe, 0, sizeof( io_uring_sqe ) );
+    mSqArray[index] = index;
+    mSqLocalTail++;
+
+    return sqe;
+}
+
+bool CUring::Submit( const uint32_t waitFor, const int timeoutMs ) noexcept
+{
+    const auto toSubmit = mSqLocalTail - *mSqTail;
+
+    StoreRelease( mSqTail, mSqLocalTail );
+
+    if ( toSubmit == 0 && waitFor == 0 )
+    {
+        return true;
+    }
+
+    auto flags = waitFor != 0 ? IORING_ENTER_GETEVENTS : 0u;
+
+    __kernel_timespec timeout{ .tv_sec = timeoutMs / 1000,
+                               .tv_nsec = timeoutMs % 1000 * 1000000ll };
+    io_uring_getevents_arg arg{};
+
+    if ( waitFor != 0 && timeoutMs >= 0 )
+    {
+        arg.ts = reinterpret_cast<uint64_t>( &timeout );
+        flags |= IORING_ENTER_EXT_ARG;
+    }
+
+    while ( true )
+    {
+        const auto result =
+            SysEnter( mFd, toSubmit, waitFor, flags,
+                      ( flags & IORING_ENTER_EXT_ARG ) != 0 ? &arg : nullptr );
+
+        if ( result >= 0 )
+        {
+            return true;
+        }
+
+        // The wait timed out, the submission went through.
+        if ( errno == ETIME )
+        {
+            return true;
+        }
+
+        if ( errno != EINTR )
+        {
+            return false;
+        }
+    }
+}
+
+bool CUring::RegisterBuffers( const std::span<const iovec> buffers ) noexcept
+{
+    return SysRegister( mFd, IORING_REGISTER_BUFFERS, buffers.data(),
+                        static_cast<uint32_t>( buffers.size() ) ) == 0;
+}
+
+uint32_t CUring::LoadAcquire( const uint32_t* value ) noexcept
+{
+    return std::atomic_ref{ *const_cast<uint32_t*>( value ) }.load(
+        std::memory_order_acquire );
+}
+
+void CUring::StoreRelease( uint32_t* value, const uint32_t desired ) noexcept
+{
+    std::atomic_ref{ *value }.store( desired, std::memory_order_release );
+}
+
+} // namespace btcmd
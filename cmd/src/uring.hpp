@@ -0,0 +1,105 @@
+//-----------------------------------------------------------------------------
+// Copyright 2024 Igor Spichkin
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//-----------------------------------------------------------------------------
+
+#pragma once
+
+#include <cstdint>
+#include <linux/io_uring.h>
+#include <memory>
+#include <span>
+#include <sys/uio.h>
+
+namespace btcmd
+{
+
+/// A minimal io_uring instance on top of the raw system calls.
+class CUring final
+{
+  public:
+    CUring( CUring& other ) = delete;
+    CUring& operator=( CUring& other ) = delete;
+
+    /// \returns nullptr if the kernel doesn't support io_uring or any of the
+    /// socket operations the client uses.
+    [[nodiscard]] static std::unique_ptr<CUring>
+    Create( uint32_t entries ) noexcept;
+
+    ~CUring();
+
+    /// \returns a zeroed submission entry, or nullptr if the queue is full.
+    [[nodiscard]] io_uring_sqe* GetSqe() noexcept;
+
+    /// Submits the queued entries and waits for at least `waitFor`
+    /// completions in the same system call, for at most `timeoutMs`
+    /// milliseconds unless it is -1.
+    /// \returns false on error, errno is set.
+    bool Submit( uint32_t waitFor, int timeoutMs = -1 ) noexcept;
+
+    /// Calls `callback` with every available completion.
+    template <typename Callback>
+    void ForEachCompletion( Callback&& callback ) noexcept
+    {
+        auto head = *mCqHead;
+        const auto tail = LoadAcquire( mCqTail );
+
+        while ( head != tail )
+        {
+            callback( mCqes[head & mCqMask] );
+            head++;
+        }
+
+        StoreRelease( mCqHead, head );
+    }
+
+    /// Registers buffers for IORING_OP_READ_FIXED.
+    /// \returns false if the kernel refused, e.g. over RLIMIT_MEMLOCK.
+    bool RegisterBuffers( std::span<const iovec> buffers ) noexcept;
+
+    [[nodiscard]] uint32_t Entries() const noexcept
+    {
+        return mSqEntries;
+    }
+
+  private:
+    CUring() = default;
+
+    [[nodiscard]] static uint32_t LoadAcquire( const uint32_t* value ) noexcept;
+
+    static void StoreRelease( uint32_t* value, uint32_t desired ) noexcept;
+
+    int mFd = -1;
+
+    void* mSqRing = nullptr;
+    size_t mSqRingSize = 0;
+    void* mCqRing = nullptr;
+    size_t mCqRingSize = 0;
+    io_uring_sqe* mSqes = nullptr;
+    size_t mSqesSize = 0;
+
+    uint32_t* mSqHead = nullptr;
+    uint32_t* mSqTail = nullptr;
+    uint32_t* mSqArray = nullptr;
+    uint32_t mSqMask = 0;
+    uint32_t mSqEntries = 0;
+    /// Entries taken by `GetSqe` but not published to the kernel yet.
+    uint32_t mSqLocalTail = 0;
+
+    uint32_t* mCqHead = nullptr;
+    uint32_t* mCqTail = nullptr;
+    io_uring_cqe* mCqes = nullptr;
+    uint32_t mCqMask = 0;
+};
+
+} // namespace btcmd
@@ -0,0 +1,986 @@
+//-----------------------------------------------------------------------------
+// Copyright 2024 Igor Spichkin
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//-----------------------------------------------------------------------------
+
+#include "watch.hpp"
+#include "error.hpp"
+#include "mpsc_queue.hpp"
+#include "timer_wheel.hpp"
+#include <algorithm>
+#include <array>
+#include <cerrno>
+#include <condition_variable>
+#include <deque>
+#include <format>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <random>
+#include <string>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+namespace btcmd
+{
+
+namespace
+{
+
+/// The resolution of the polls and the deadlines.
+constexpr std::chrono::milliseconds TimerTick{ 1 };
+
+/// Threads that resolve the names that are not cached.
+constexpr size_t MaxResolverThreads = 16;
+
+/// The epoll data of the eventfd that signals finished lookups, no target
+/// has this index.
+constexpr uint64_t LookupEvent = UINT64_MAX;
+
+enum class EState
+{
+    /// Waiting for the next poll, maybe with the connection kept open.
+    Idle,
+    /// Waiting for a lookup on a resolver thread.
+    Resolving,
+    Connecting,
+    Sending,
+    Receiving
+};
+
+struct Watched final
+{
+    EState mState = EState::Idle;
+    /// The index of the encoded message in the batch of all targets, unused
+    /// if the message is too long.
+    size_t mPacket = 0;
+    /// The addresses of the target and the one being connected to.
+    std::shared_ptr<const Resolution> mResolution;
+    size_t mEndpoint = 0;
+    /// Tells the lookup of the current poll from the late ones.
+    uint32_t mLookup = 0;
+    /// When to give up on the address and try the next one.
+    Clock::time_point mAttemptDeadline = NoDeadline;
+    std::unique_ptr<ISocket> mSocket;
+    /// The epoll events the socket is registered for, 0 if it isn't.
+    uint32_t mEvents = 0;
+    /// The connection was kept from a previous poll, the server may have
+    /// closed it meanwhile.
+    bool mReused = false;
+    size_t mSent = 0;
+    /// Received bytes, the decoder has consumed `mParsed` of `mReceived`.
+    std::vector<char> mBuffer;
+    size_t mReceived = 0;
+    size_t mParsed = 0;
+    bt::Decoder mDecoder;
+    CTargetDeadline mDeadline;
+    CTimings mTimings;
+    /// When the next poll is due, before the jitter: the start plus a whole
+    /// number of intervals.
+    Clock::time_point mNextPoll;
+    /// Tells the current timer of the target from the stale ones.
+    uint32_t mTimer = 0;
+    /// The outcome of the last poll, only changes are reported.
+    bool mReported = false;
+    EError mLastError = EError::None;
+    bt::EReplyType mLastType = bt::EReplyType::Null;
+    std::string mLastValue;
+
+    [[nodiscard]] Clock::time_point Deadline() const noexcept
+    {
+        return mState == EState::Connecting
+                   ? std::min( mAttemptDeadline, mDeadline.Deadline() )
+                   : mDeadline.Deadline();
+    }
+};
+
+/// Resolves names on background threads, so a slow or dead name doesn't
+/// hold up the polls of the other targets. The results go back to the loop
+/// through a queue, and an eventfd wakes it up.
+class CLookups final
+{
+  public:
+    struct Lookup final
+    {
+        size_t mIndex = 0;
+        uint32_t mId = 0;
+        Clock::time_point mDeadline = NoDeadline;
+        /// nullptr if the name timed out.
+        std::shared_ptr<const Resolution> mResolution;
+    };
+
+    CLookups( const std::span<const FanoutTarget> targets,
+              CResolver& resolver, const int event ) noexcept
+        : mTargets( targets ), mResolver( resolver ), mEvent( event )
+    {
+    }
+
+    CLookups( CLookups& other ) = delete;
+    CLookups& operator=( CLookups& other ) = delete;
+
+    ~CLookups()
+    {
+        Stop();
+    }
+
+    /// Waits for the lookups in progress and drops the queued ones.
+    void Stop() noexcept
+    {
+        {
+            std::lock_guard lock{ mMutex };
+
+            mStopped = true;
+        }
+
+        mWake.notify_all();
+        mThreads.clear();
+    }
+
+    /// Queues a lookup of the name of the target, starting another thread
+    /// if all of them are busy.
+    void Start( const Lookup& lookup )
+    {
+        {
+            std::lock_guard lock{ mMutex };
+
+            mPending.push_back( lookup );
+
+            if ( mIdle == 0 && mThreads.size() < MaxResolverThreads )
+            {
+                mThreads.emplace_back( [this] { Work(); } );
+            }
+        }
+
+        mWake.notify_one();
+    }
+
+    /// Loop only.
+    /// \returns std::nullopt if no lookup finished since the last call.
+    [[nodiscard]] std::optional<Lookup> TryPop()
+    {
+        return mDone.TryPop();
+    }
+
+  private:
+    void Work() noexcept
+    {
+        std::unique_lock lock{ mMutex };
+
+        while ( true )
+        {
+            mIdle++;
+            mWake.wait( lock,
+                        [this] { return mStopped || !mPending.empty(); } );
+            mIdle--;
+
+            if ( mStopped )
+            {
+                return;
+            }
+
+            auto lookup = mPending.front();
+            mPending.pop_front();
+
+            lock.unlock();
+
+            const auto& target = mTargets[lookup.mIndex];
+
+            lookup.mResolution = mResolver.Resolve(
+                target.mNode, target.mPort, lookup.mDeadline );
+
+            mDone.Push( std::move( lookup ) );
+
+            const uint64_t one = 1;
+            static_cast<void>( write( mEvent, &one, sizeof( one ) ) );
+
+            lock.lock();
+        }
+    }
+
+    std::span<const FanoutTarget> mTargets;
+    CResolver& mResolver;
+    int mEvent;
+    CMpscQueue<Lookup> mDone;
+    std::mutex mMutex;
+    std::condition_variable mWake;
+    std::deque<Lookup> mPending;
+    size_t mIdle = 0;
+    bool mStopped = false;
+    /// Joined first, while the rest is still there.
+    std::vector<std::jthread> mThreads;
+};
+
+class CWatchLoop final
+{
+  public:
+    CWatchLoop( const std::span<const FanoutTarget> targets,
+                const WatchOptions& options, CResolver& resolver,
+                const CWatch::Callback& onChange,
+                const CWatch::Callback& onPoll,
+                const std::function<void()>& onIdle ) noexcept
+        : mTargets( targets ), mOptions( options ), mResolver( resolver ),
+          mOnChange( onChange ), mOnPoll( onPoll ), mOnIdle( onIdle ),
+          mEpoll( epoll_create1( EPOLL_CLOEXEC ) ),
+          mLookupEvent( eventfd( 0, EFD_CLOEXEC | EFD_NONBLOCK ) ),
+          mLookups( targets, resolver, mLookupEvent ),
+          mWheel( TimerTick, Clock::now() ), mWatched( targets.size() ),
+          mRandom( std::random_device{}() )
+    {
+        if ( mEpoll == -1 )
+        {
+            mError = std::format( "epoll_create1 error: {}", errno );
+
+            return;
+        }
+
+        epoll_event event{ .events = EPOLLIN, .data = { .u64 = LookupEvent } };
+
+        if ( mLookupEvent == -1 ||
+             epoll_ctl( mEpoll, EPOLL_CTL_ADD, mLookupEvent, &event ) == -1 )
+        {
+            mError = std::format( "eventfd error: {}", errno );
+        }
+    }
+
+    CWatchLoop( CWatchLoop& other ) = delete;
+    CWatchLoop& operator=( CWatchLoop& other ) = delete;
+
+    ~CWatchLoop()
+    {
+        // The lookup threads write to the eventfd until they are joined.
+        mLookups.Stop();
+
+        close( mLookupEvent );
+        close( mEpoll );
+    }
+
+    /// Returns only once epoll fails.
+    void Run() noexcept
+    {
+        if ( !mError.empty() )
+        {
+            Abort();
+
+            return;
+        }
+
+        const auto start = Clock::now();
+
+        size_t totalLength = 0;
+
+        for ( const auto& target : mTargets )
+        {
+            totalLength += target.mMessage.size();
+        }
+
+        // The packets are encoded once into one buffer.
+        mPackets.reserve( mTargets.size(), totalLength );
+
+        // The first polls are spread evenly over the first interval.
+        for ( size_t index = 0; index < mTargets.size(); index++ )
+        {
+            auto& watched = mWatched[index];
+
+            watched.mPacket = mPackets.size();
+
+            if ( mPackets.add( mTargets[index].mMessage ) != bt::EResult::Ok )
+            {
+                Report( index, FanoutResult{
+                                   .mIndex = index,
+                                   .mCode = EError::TooLong,
+                                   .mError = "Fail to encode the message: "
+                                             "data is too long" } );
+
+                continue;
+            }
+
+            watched.mNextPoll =
+                start + mOptions.mInterval * index / mTargets.size();
+
+            Arm( index, watched.mNextPoll );
+        }
+
+        std::array<epoll_event, 256> events;
+
+        while ( true )
+        {
+            mWheel.Advance( Clock::now(),
+                            [this]( const uint64_t id ) { OnTimer( id ); } );
+
+            mOnIdle();
+
+            const auto count =
+                epoll_wait( mEpoll, events.data(),
+                            static_cast<int>( events.size() ),
+                            PollTimeout( mWheel.NextExpiry() ) );
+
+            if ( count == -1 )
+            {
+                if ( errno == EINTR )
+                {
+                    continue;
+                }
+
+                mError = std::format( "epoll_wait error: {}", errno );
+
+                Abort();
+
+                return;
+            }
+
+            for ( int i = 0; i < count; i++ )
+            {
+                if ( events[i].data.u64 == LookupEvent )
+                {
+                    FinishLookups();
+
+                    continue;
+                }
+
+                Handle( events[i].data.u64, events[i].events );
+            }
+        }
+    }
+
+  private:
+    /// Fails the polls in flight and reports the error for the other
+    /// targets, the loop can't go on.
+    void Abort() noexcept
+    {
+        for ( size_t index = 0; index < mWatched.size(); index++ )
+        {
+            if ( mWatched[index].mState != EState::Idle )
+            {
+                Fail( index, EError::System, mError );
+            }
+            else
+            {
+                FanoutResult result{ .mIndex = index,
+                                     .mCode = EError::System,
+                                     .mError = mError };
+
+                result.mTimings.Start();
+
+                Report( index, result );
+            }
+        }
+    }
+
+    /// Replaces the timer of the target, the previous one is ignored when it
+    /// fires.
+    void Arm( const size_t index, const Clock::time_point when )
+    {
+        auto& watched = mWatched[index];
+
+        watched.mTimer++;
+
+        mWheel.Schedule( when, static_cast<uint64_t>( index ) << 32 |
+                                   watched.mTimer );
+    }
+
+    void OnTimer( const uint64_t id ) noexcept
+    {
+        const auto index = static_cast<size_t>( id >> 32 );
+        auto& watched = mWatched[index];
+
+        if ( static_cast<uint32_t>( id ) != watched.mTimer )
+        {
+            return;
+        }
+
+        if ( watched.mState == EState::Idle )
+        {
+            Poll( index );
+
+            return;
+        }
+
+        // The deadline of the poll in flight, see `CEpollLoop::Expire`.
+        const auto phase = watched.mDeadline.Phase();
+        auto error = std::string{ ToString( phase ) };
+
+        if ( watched.mDeadline.Deadline() <= Clock::now() )
+        {
+            Fail( index, FromTimeout( phase ), std::move( error ) );
+        }
+        else
+        {
+            Retry( index, FromTimeout( phase ), std::move( error ) );
+        }
+    }
+
+    void Poll( const size_t index ) noexcept
+    {
+        auto& watched = mWatched[index];
+        const auto now = Clock::now();
+
+        // Polls that fell behind are not made up for, the schedule skips
+        // them and stays on its intervals.
+        watched.mNextPoll += mOptions.mInterval;
+
+        if ( watched.mNextPoll <= now )
+        {
+            watched.mNextPoll +=
+                mOptions.mInterval *
+                ( ( now - watched.mNextPoll ) / mOptions.mInterval + 1 );
+        }
+
+        watched.mTimings.Start( now );
+        watched.mDeadline.Start( mOptions.mTimeouts, now );
+        watched.mSent = 0;
+        watched.mReceived = 0;
+        watched.mParsed = 0;
+        watched.mDecoder.reset();
+
+        if ( watched.mSocket == nullptr )
+        {
+            Open( index );
+
+            return;
+        }
+
+        watched.mReused = true;
+        watched.mState = EState::Sending;
+
+        Arm( index, watched.Deadline() );
+        Send( index );
+    }
+
+    /// Starts connecting to the first address of the target, once a
+    /// resolver thread has looked up its name if it is not cached.
+    void Open( const size_t index ) noexcept
+    {
+        auto& watched = mWatched[index];
+        const auto& target = mTargets[index];
+        const auto now = Clock::now();
+
+        watched.mSocket.reset();
+        watched.mEvents = 0;
+        watched.mReused = false;
+        watched.mSent = 0;
+        watched.mState = EState::Resolving;
+        watched.mLookup++;
+        watched.mDeadline.Enter( ETimeout::Resolve,
+                                 mOptions.mTimeouts.mResolve, now );
+
+        // getaddrinfo blocks, it never runs on the loop.
+        if ( std::shared_ptr<const Resolution> resolution; mResolver.Find(
+                 CResolver::Name{ target.mNode, target.mPort }, resolution ) )
+        {
+            Resolved( index, std::move( resolution ) );
+
+            return;
+        }
+
+        Arm( index, watched.Deadline() );
+
+        mLookups.Start( CLookups::Lookup{
+            .mIndex = index,
+            .mId = watched.mLookup,
+            .mDeadline = watched.mDeadline.Deadline() } );
+    }
+
+    /// Hands the lookups that finished to their targets, dropping the ones
+    /// of polls that timed out meanwhile.
+    void FinishLookups() noexcept
+    {
+        uint64_t count;
+        static_cast<void>( read( mLookupEvent, &count, sizeof( count ) ) );
+
+        while ( auto lookup = mLookups.TryPop() )
+        {
+            const auto& watched = mWatched[lookup->mIndex];
+
+            if ( watched.mState == EState::Resolving &&
+                 watched.mLookup == lookup->mId )
+            {
+                Resolved( lookup->mIndex, std::move( lookup->mResolution ) );
+            }
+        }
+    }
+
+    /// Starts connecting to the first address of the name, or fails the
+    /// target if it didn't resolve.
+    void Resolved( const size_t index,
+                   std::shared_ptr<const Resolution> resolution ) noexcept
+    {
+        auto& watched = mWatched[index];
+
+        watched.mResolution = std::move( resolution );
+        watched.mState = EState::Connecting;
+
+        if ( watched.mResolution == nullptr )
+        {
+            Fail( index, EError::ResolveTimeout,
+                  std::string{ ToString( ETimeout::Resolve ) } );
+
+            return;
+        }
+
+        if ( watched.mResolution->mError != 0 ||
+             watched.mResolution->mEndpoints.empty() )
+        {
+            Fail( index, EError::ResolveFailed,
+                  std::format( "getaddrinfo error: {}",
+                               watched.mResolution->mError ) );
+
+            return;
+        }
+
+        const auto resolved = Clock::now();
+
+        watched.mTimings.Mark( EPhase::Resolve, resolved );
+        watched.mDeadline.Enter( ETimeout::Connect,
+                                 mOptions.mTimeouts.mConnect, resolved );
+        watched.mEndpoint = 0;
+
+        Connect( index );
+    }
+
+    /// Starts connecting to the current address of the target.
+    void Connect( const size_t index ) noexcept
+    {
+        auto& watched = mWatched[index];
+        const auto& endpoints = watched.mResolution->mEndpoints;
+
+        // Replacing the socket removes the previous attempt from the epoll
+        // set.
+        auto socket =
+            CreateSocket( endpoints[watched.mEndpoint], mOptions.mSocket );
+        watched.mEvents = 0;
+
+        if ( !socket )
+        {
+            watched.mSocket.reset();
+
+            Retry( index, socket.GetError().mCode,
+                   ToMessage( socket.GetError() ) );
+
+            return;
+        }
+
+        watched.mSocket = std::move( *socket );
+        watched.mAttemptDeadline = AttemptDeadline(
+            watched.mDeadline.Deadline(),
+            endpoints.size() - watched.mEndpoint, Clock::now() );
+
+        Arm( index, watched.Deadline() );
+
+        const auto result = watched.mSocket->StartConnect();
+
+        if ( result.mStatus == EIoStatus::Error )
+        {
+            Retry( index, EError::ConnectFailed,
+                   std::format( "connect error: {}", result.mError ) );
+
+            return;
+        }
+
+        if ( !Register( index, EPOLLOUT ) )
+        {
+            return;
+        }
+
+        if ( result.mStatus == EIoStatus::Ok )
+        {
+            watched.mTimings.Mark( EPhase::Connect );
+            watched.mState = EState::Sending;
+        }
+    }
+
+    /// Sets the events the socket of the target is polled for.
+    /// \returns false on error.
+    [[nodiscard]] bool Watch( const size_t index,
+                              const uint32_t events ) noexcept
+    {
+        auto& watched = mWatched[index];
+
+        if ( watched.mEvents == events )
+        {
+            return true;
+        }
+
+        epoll_event event{ .events = events, .data = { .u64 = index } };
+
+        if ( epoll_ctl( mEpoll,
+                        watched.mEvents == 0 ? EPOLL_CTL_ADD : EPOLL_CTL_MOD,
+                        static_cast<int>( watched.mSocket->Handle() ),
+                        &event ) == -1 )
+        {
+            return false;
+        }
+
+        watched.mEvents = events;
+
+        return true;
+    }
+
+    /// Like `Watch`, but fails the target on error.
+    /// \returns false if the target failed.
+    bool Register( const size_t index, const uint32_t events ) noexcept
+    {
+        if ( !Watch( index, events ) )
+        {
+            Fail( index, EError::System,
+                  std::format( "epoll_ctl error: {}", errno ) );
+
+            return false;
+        }
+
+        return true;
+    }
+
+    void Handle( const size_t index, const uint32_t events ) noexcept
+    {
+        auto& watched = mWatched[index];
+
+        switch ( watched.mState )
+        {
+        case EState::Idle:
+            // The server closed the connection between the polls, or sent
+            // something nobody asked for.
+            watched.mSocket.reset();
+            watched.mEvents = 0;
+            break;
+        case EState::Resolving:
+            // An event of the connection closed by the same batch.
+            break;
+        case EState::Connecting:
+            if ( const auto result = watched.mSocket->FinishConnect();
+                 result.mStatus != EIoStatus::Ok )
+            {
+                Retry( index, EError::ConnectFailed,
+                       std::format( "connect error: {}", result.mError ) );
+
+                return;
+            }
+
+            watched.mTimings.Mark( EPhase::Connect );
+            watched.mState = EState::Sending;
+
+            Send( index );
+            break;
+        case EState::Sending:
+            Send( index );
+            break;
+        case EState::Receiving:
+            if ( ( events & ( EPOLLIN | EPOLLHUP | EPOLLERR ) ) != 0 )
+            {
+                Receive( index );
+            }
+            break;
+        }
+    }
+
+    void Send( const size_t index ) noexcept
+    {
+        auto& watched = mWatched[index];
+        const auto packet = mPackets[watched.mPacket];
+
+        while ( watched.mSent < packet.size() )
+        {
+            const auto result =
+                watched.mSocket->TrySend( packet.subspan( watched.mSent ) );
+
+            switch ( result.mStatus )
+            {
+            case EIoStatus::Ok:
+                watched.mSent += result.mBytes;
+                break;
+            case EIoStatus::WouldBlock:
+                Register( index, EPOLLOUT );
+
+                return;
+            case EIoStatus::Closed:
+                if ( !Reconnect( index ) )
+                {
+                    Fail( index, EError::ConnectionClosed,
+                          "Connection closed" );
+                }
+
+                return;
+            case EIoStatus::TimedOut:
+            case EIoStatus::Error:
+                if ( Reconnect( index ) )
+                {
+                    return;
+                }
+
+                // With Fast Open the first send reports a failed connect.
+                if ( mOptions.mSocket.mFastOpen && watched.mSent == 0 )
+                {
+                    Retry( index, EError::ConnectFailed,
+                           std::format( "connect error: {}", result.mError ) );
+                }
+                else
+                {
+                    Fail( index, EError::SendFailed,
+                          std::format( "send error: {}", result.mError ) );
+                }
+
+                return;
+            }
+        }
+
+        const auto sent = Clock::now();
+
+        watched.mTimings.Mark( EPhase::Send, sent );
+        watched.mState = EState::Receiving;
+        watched.mDeadline.Enter( ETimeout::FirstByte,
+                                 mOptions.mTimeouts.mFirstByte, sent );
+
+        Arm( index, watched.Deadline() );
+        Register( index, EPOLLIN );
+    }
+
+    void Receive( const size_t index ) noexcept
+    {
+        auto& watched = mWatched[index];
+        auto& buffer = watched.mBuffer;
+
+        while ( true )
+        {
+            // Keep room for the rest of the reply so its body ends up
+            // contiguous in the buffer.
+            const auto needed =
+                watched.mParsed + watched.mDecoder.bytes_needed();
+
+            if ( const auto size = std::max( needed, watched.mReceived + 512 );
+                 buffer.size() < size )
+            {
+                buffer.resize( size );
+            }
+
+            const auto result = watched.mSocket->TryRecv(
+                std::span{ buffer }.subspan( watched.mReceived ) );
+
+            switch ( result.mStatus )
+            {
+            case EIoStatus::Ok:
+                break;
+            case EIoStatus::WouldBlock:
+                return;
+            case EIoStatus::Closed:
+                // A kept connection the server closed before the reply was
+                // started.
+                if ( !Reconnect( index ) )
+                {
+                    Fail( index, EError::UnexpectedEof, "Unexpected eof" );
+                }
+
+                return;
+            case EIoStatus::TimedOut:
+            case EIoStatus::Error:
+                // The topic went out in a Fast Open SYN that was refused.
+                if ( result.mError == ECONNREFUSED )
+                {
+                    Retry( index, EError::ConnectFailed,
+                           std::format( "connect error: {}", result.mError ) );
+                }
+                else if ( !Reconnect( index ) )
+                {
+                    Fail( index, EError::RecvFailed,
+                          std::format( "recv error: {}", result.mError ) );
+                }
+
+                return;
+            }
+
+            if ( watched.mReceived == 0 )
+            {
+                const auto firstByte = Clock::now();
+
+                watched.mTimings.Mark( EPhase::FirstByte, firstByte );
+                watched.mDeadline.Enter( ETimeout::Response,
+                                         std::chrono::milliseconds{ 0 },
+                                         firstByte );
+
+                Arm( index, watched.Deadline() );
+            }
+
+            watched.mReceived += result.mBytes;
+
+            const auto [status, consumed] = watched.mDecoder.feed(
+                std::span<const char>{ buffer }.subspan(
+                    watched.mParsed, watched.mReceived - watched.mParsed ) );
+
+            watched.mParsed += consumed;
+
+            if ( status == bt::EDecodeStatus::Done )
+            {
+                watched.mTimings.Mark( EPhase::LastByte );
+
+                Complete( index, FanoutResult{
+                                     .mIndex = index,
+                                     .mReply = watched.mDecoder.reply() } );
+
+                return;
+            }
+
+            if ( status != bt::EDecodeStatus::NeedMore )
+            {
+                const auto error = FromDecoder( status );
+
+                Fail( index, error.mCode, ToMessage( error ) );
+
+                return;
+            }
+        }
+    }
+
+    /// Opens a new connection if the kept one turned out to be closed and
+    /// `ShouldResend` allows sending the topic again.
+    /// \returns false if the topic fails instead.
+    bool Reconnect( const size_t index ) noexcept
+    {
+        const auto& watched = mWatched[index];
+
+        if ( !ShouldResend( watched.mReused, watched.mReceived != 0 ) )
+        {
+            return false;
+        }
+
+        Open( index );
+
+        return true;
+    }
+
+    /// Connects to the next address of the target, or fails it with the
+    /// error of the last one.
+    void Retry( const size_t index, const EError code,
+                std::string error ) noexcept
+    {
+        auto& watched = mWatched[index];
+
+        if ( watched.mState == EState::Connecting &&
+             watched.mEndpoint + 1 < watched.mResolution->mEndpoints.size() )
+        {
+            watched.mEndpoint++;
+
+            Connect( index );
+
+            return;
+        }
+
+        Fail( index, code, std::move( error ) );
+    }
+
+    void Fail( const size_t index, const EError code,
+               std::string error ) noexcept
+    {
+        Complete( index, FanoutResult{ .mIndex = index,
+                                       .mCode = code,
+                                       .mError = std::move( error ) } );
+    }
+
+    /// Reports the result if it changed and schedules the next poll. The
+    /// connection is kept only after a reply.
+    void Complete( const size_t index, FanoutResult result ) noexcept
+    {
+        auto& watched = mWatched[index];
+
+        result.mTimings = watched.mTimings;
+
+        mOnPoll( result );
+        Report( index, result );
+
+        watched.mState = EState::Idle;
+        watched.mResolution.reset();
+
+        // Closing the descriptor removes it from the epoll set.
+        if ( result.mCode != EError::None ||
+             !Watch( index, EPOLLIN | EPOLLRDHUP ) )
+        {
+            watched.mSocket.reset();
+            watched.mEvents = 0;
+        }
+
+        // Each poll gets its own jitter, it doesn't carry over to the next.
+        const auto jitter = std::uniform_int_distribution<Clock::rep>{
+            -mJitter.count(), mJitter.count() }( mRandom );
+
+        Arm( index, std::max( watched.mNextPoll + Clock::duration{ jitter },
+                              Clock::now() ) );
+    }
+
+    /// Calls `onChange` if the reply or the kind of error differs from the
+    /// last one.
+    void Report( const size_t index, const FanoutResult& result )
+    {
+        auto& watched = mWatched[index];
+        const auto& reply = result.mReply;
+        // The body as it came tells the values of any type apart.
+        const auto value = reply.mBytes;
+
+        if ( watched.mReported && watched.mLastError == result.mCode &&
+             ( result.mCode != EError::None ||
+               ( watched.mLastType == reply.mType &&
+                 watched.mLastValue == value ) ) )
+        {
+            return;
+        }
+
+        watched.mReported = true;
+        watched.mLastError = result.mCode;
+        watched.mLastType = reply.mType;
+        watched.mLastValue = value;
+
+        mOnChange( result );
+    }
+
+    std::span<const FanoutTarget> mTargets;
+    const WatchOptions& mOptions;
+    CResolver& mResolver;
+    const CWatch::Callback& mOnChange;
+    const CWatch::Callback& mOnPoll;
+    const std::function<void()>& mOnIdle;
+    int mEpoll;
+    int mLookupEvent;
+    /// Why the loop can't go on, empty while it can.
+    std::string mError;
+    CLookups mLookups;
+    CTimerWheel mWheel;
+    std::vector<Watched> mWatched;
+    bt::EncodedBatch mPackets;
+    std::minstd_rand mRandom;
+    Clock::duration mJitter = std::chrono::duration_cast<Clock::duration>(
+        std::min( mOptions.mJitter, mOptions.mInterval / 2 ) );
+};
+
+} // namespace
+
+CWatch::CWatch( const WatchOptions& options, CResolver& resolver ) noexcept
+    : mOptions( options ), mResolver( resolver )
+{
+    mOptions.mInterval =
+        std::max( mOptions.mInterval, std::chrono::milliseconds{ 1 } );
+
+    if ( mOptions.mTimeouts.mTotal.count() == 0 )
+    {
+        mOptions.mTimeouts.mTotal = mOptions.mInterval;
+    }
+}
+
+void CWatch::Run( const std::span<const FanoutTarget> targets,
+                  const Callback& onChange, const Callback& onPoll,
+                  const std::function<void()>& onIdle ) noexcept
+{
+    CWatchLoop loop{ targets, mOptions, mResolver, onChange, onPoll, onIdle };
+
+    loop.Run();
+}
+
+} // namespace btcmd
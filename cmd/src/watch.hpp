@@ -0,0 +1,67 @@
+//-----------------------------------------------------------------------------
+// Copyright 2024 Igor Spichkin
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//-----------------------------------------------------------------------------
+
+#pragma once
+
+#include "fanout.hpp"
+#include "resolver.hpp"
+#include "socket.hpp"
+#include <chrono>
+#include <functional>
+#include <span>
+
+namespace btcmd
+{
+
+struct WatchOptions final
+{
+    /// Time between two polls of a target.
+    std::chrono::milliseconds mInterval{ 5000 };
+    /// Each poll is moved by up to this much either way, so the targets
+    /// don't drift into polling at the same time.
+    std::chrono::milliseconds mJitter{ 500 };
+    /// A zero total timeout is replaced by the interval, so a poll never
+    /// overlaps the next one.
+    Timeouts mTimeouts;
+    SocketOptions mSocket;
+};
+
+/// Polls many targets forever on one event loop. Every target keeps its
+/// connection and its encoded packet between polls, and its polls are
+/// scheduled on a timer wheel together with the deadlines of the poll in
+/// flight. Names that are not cached are resolved on background threads.
+class CWatch final
+{
+  public:
+    using Callback = std::function<void( const FanoutResult& )>;
+
+    /// \param resolver must outlive the watch.
+    CWatch( const WatchOptions& options, CResolver& resolver ) noexcept;
+
+    /// Calls `onChange` with the first result of every target and then with
+    /// every result whose reply, or whose kind of error, differs from the
+    /// previous one. `onPoll` is called with the result of every poll, and
+    /// `onIdle` before the loop waits for events. Returns only once the loop
+    /// can't go on, after every target got an `EError::System` result.
+    void Run( std::span<const FanoutTarget> targets, const Callback& onChange,
+              const Callback& onPoll,
+              const std::function<void()>& onIdle ) noexcept;
+
+  private:
+    WatchOptions mOptions;
+    CResolver& mResolver;
+};
+
+} // namespace btcmd
@@ -0,0 +1,106 @@
+//-----------------------------------------------------------------------------
+// Copyright 2024 Igor Spichkin
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//-----------------------------------------------------------------------------
+
+#include "work_queue.hpp"
+#include <algorithm>
+
+namespace btcmd
+{
+
+CWorkQueue::CWorkQueue( const size_t count, const size_t workers )
+    : mWorkers( std::max( workers, static_cast<size_t>( 1 ) ) ),
+      mShards( std::make_unique<Shard[]>( mWorkers ) )
+{
+    for ( size_t i = 0; i < mWorkers; i++ )
+    {
+        mShards[i].mRange.store(
+            Pack( count * i / mWorkers, count * ( i + 1 ) / mWorkers ),
+            std::memory_order_relaxed );
+    }
+}
+
+bool CWorkQueue::Pop( const size_t worker, size_t& index ) noexcept
+{
+    auto& own = mShards[worker].mRange;
+
+    while ( true )
+    {
+        auto range = own.load( std::memory_order_acquire );
+
+        while ( Begin( range ) < End( range ) )
+        {
+            // Thieves may shrink the end at the same time.
+            if ( own.compare_exchange_weak(
+                     range, Pack( Begin( range ) + 1, End( range ) ),
+                     std::memory_order_acq_rel, std::memory_order_acquire ) )
+            {
+                index = static_cast<size_t>( Begin( range ) );
+
+                return true;
+            }
+        }
+
+        if ( !Steal( worker ) )
+        {
+            return false;
+        }
+    }
+}
+
+bool CWorkQueue::Steal( const size_t worker ) noexcept
+{
+    while ( true )
+    {
+        size_t victim = worker;
+        uint64_t range = 0;
+        uint64_t largest = 0;
+
+        for ( size_t i = 1; i < mWorkers; i++ )
+        {
+            const auto other = ( worker + i ) % mWorkers;
+            const auto candidate =
+                mShards[other].mRange.load( std::memory_order_acquire );
+            const auto size = End( candidate ) - Begin( candidate );
+
+            if ( size > largest )
+            {
+                victim = other;
+                range = candidate;
+                largest = size;
+            }
+        }
+
+        if ( largest == 0 )
+        {
+            return false;
+        }
+
+        // Leave the owner the front half, the lone last index goes too.
+        const auto middle = End( range ) - ( largest + 1 ) / 2;
+
+        if ( mShards[victim].mRange.compare_exchange_strong(
+                 range, Pack( Begin( range ), middle ),
+                 std::memory_order_acq_rel, std::memory_order_acquire ) )
+        {
+            // The own shard is empty, so nobody else touches it.
+            mShards[worker].mRange.store( Pack( middle, End( range ) ),
+                                          std::memory_order_release );
+
+            return true;
+        }
+    }
+}
+
+} // namespace btcmd
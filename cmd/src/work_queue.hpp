@@ -0,0 +1,72 @@
+//-----------------------------------------------------------------------------
+// Copyright 2024 Igor Spichkin
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//-----------------------------------------------------------------------------
+
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+
+namespace btcmd
+{
+
+/// Hands out the indices `[0, count)` to a fixed set of workers. The range is
+/// split into one contiguous shard per worker, a worker takes indices from
+/// the front of its own shard and, once it runs dry, steals the back half of
+/// the largest other shard. Lock free.
+class CWorkQueue final
+{
+  public:
+    /// \param count must be less than 2^32.
+    CWorkQueue( size_t count, size_t workers );
+
+    /// Takes the next index for the worker.
+    /// \returns false once every shard is empty.
+    [[nodiscard]] bool Pop( size_t worker, size_t& index ) noexcept;
+
+  private:
+    /// `[begin, end)` packed into one word, so both ends move together.
+    struct alignas( 64 ) Shard final
+    {
+        std::atomic<uint64_t> mRange;
+    };
+
+    [[nodiscard]] static constexpr uint64_t Pack( const uint64_t begin,
+                                                  const uint64_t end ) noexcept
+    {
+        return begin << 32 | end;
+    }
+
+    [[nodiscard]] static constexpr uint64_t
+    Begin( const uint64_t range ) noexcept
+    {
+        return range >> 32;
+    }
+
+    [[nodiscard]] static constexpr uint64_t End( const uint64_t range ) noexcept
+    {
+        return range & UINT32_MAX;
+    }
+
+    /// Moves half of the largest other shard to the worker's own one.
+    /// \returns false if there was nothing to steal.
+    [[nodiscard]] bool Steal( size_t worker ) noexcept;
+
+    size_t mWorkers;
+    std::unique_ptr<Shard[]> mShards;
+};
+
+} // namespace btcmd
@@ -0,0 +1,1127 @@
+//-----------------------------------------------------------------------------
+// Copyright 2024 Igor Spichkin
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//-----------------------------------------------------------------------------
+
+#pragma once
+
+#include "bt/bt.hpp"
+#include "bt/cache.hpp"
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <coroutine>
+#include <cstdint>
+#include <exception>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <system_error>
+#include <thread>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#ifndef __linux__
+#error "bt/async.hpp needs epoll and is only available on Linux"
+#endif
+
+#include <cerrno>
+#include <cstring>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+namespace bt
+{
+
+//-----------------------------------------------------------------------------
+// Tasks
+//-----------------------------------------------------------------------------
+
+template <typename T = void> class Task;
+
+namespace detail
+{
+
+/// Resumes whoever awaits the task once it finishes.
+struct FinalAwaiter final
+{
+    [[nodiscard]] bool await_ready() const noexcept
+    {
+        return false;
+    }
+
+    template <typename Promise>
+    [[nodiscard]] std::coroutine_handle<>
+    await_suspend( const std::coroutine_handle<Promise> handle ) noexcept
+    {
+        const auto continuation = handle.promise().mContinuation;
+
+        return continuation ? continuation : std::noop_coroutine();
+    }
+
+    void await_resume() const noexcept
+    {
+    }
+};
+
+struct TaskPromiseBase
+{
+    std::coroutine_handle<> mContinuation;
+    std::exception_ptr mException;
+
+    [[nodiscard]] std::suspend_always initial_suspend() const noexcept
+    {
+        return {};
+    }
+
+    [[nodiscard]] FinalAwaiter final_suspend() const noexcept
+    {
+        return {};
+    }
+
+    void unhandled_exception() noexcept
+    {
+        mException = std::current_exception();
+    }
+};
+
+template <typename T> struct TaskPromise final : TaskPromiseBase
+{
+    std::optional<T> mValue;
+
+    [[nodiscard]] Task<T> get_return_object() noexcept;
+
+    template <typename U>
+        requires std::convertible_to<U, T>
+    void return_value( U&& value )
+    {
+        mValue.emplace( std::forward<U>( value ) );
+    }
+};
+
+template <> struct TaskPromise<void> final : TaskPromiseBase
+{
+    [[nodiscard]] Task<void> get_return_object() noexcept;
+
+    void return_void() const noexcept
+    {
+    }
+};
+
+} // namespace detail
+
+/// A lazy coroutine: it starts when it is awaited, and resumes the awaiting
+/// coroutine when it finishes, rethrowing what escaped it.
+template <typename T> class Task final
+{
+  public:
+    using promise_type = detail::TaskPromise<T>;
+
+    explicit Task( const std::coroutine_handle<promise_type> handle ) noexcept
+        : mHandle{ handle }
+    {
+    }
+
+    Task( Task&& other ) noexcept
+        : mHandle{ std::exchange( other.mHandle, nullptr ) }
+    {
+    }
+
+    Task& operator=( Task&& other ) noexcept
+    {
+        if ( this != &other )
+        {
+            if ( mHandle )
+            {
+                mHandle.destroy();
+            }
+
+            mHandle = std::exchange( other.mHandle, nullptr );
+        }
+
+        return *this;
+    }
+
+    ~Task()
+    {
+        if ( mHandle )
+        {
+            mHandle.destroy();
+        }
+    }
+
+    [[nodiscard]] bool await_ready() const noexcept
+    {
+        return false;
+    }
+
+    [[nodiscard]] std::coroutine_handle<>
+    await_suspend( const std::coroutine_handle<> awaiting ) noexcept
+    {
+        mHandle.promise().mContinuation = awaiting;
+
+        return mHandle;
+    }
+
+    T await_resume()
+    {
+        auto& promise = mHandle.promise();
+
+        if ( promise.mException )
+        {
+            std::rethrow_exception( promise.mException );
+        }
+
+        if constexpr ( !std::is_void_v<T> )
+        {
+            return std::move( *promise.mValue );
+        }
+    }
+
+  private:
+    std::coroutine_handle<promise_type> mHandle;
+};
+
+namespace detail
+{
+
+template <typename T> Task<T> TaskPromise<T>::get_return_object() noexcept
+{
+    return Task<T>{ std::coroutine_handle<TaskPromise>::from_promise( *this ) };
+}
+
+inline Task<void> TaskPromise<void>::get_return_object() noexcept
+{
+    return Task<void>{ std::coroutine_handle<TaskPromise>::from_promise(
+        *this ) };
+}
+
+} // namespace detail
+
+//-----------------------------------------------------------------------------
+// Executors
+//-----------------------------------------------------------------------------
+
+class Reactor;
+
+/// Decides where the coroutines that the reactor wakes up run. The reactor
+/// calls `execute` on its own thread; an executor may resume the coroutine
+/// right there or hand it to other threads. Coroutines may start topics from
+/// any thread.
+class Executor
+{
+  public:
+    virtual ~Executor() = default;
+
+    /// \returns the reactor that runs the sockets of the topics.
+    [[nodiscard]] virtual Reactor& reactor() noexcept = 0;
+
+    virtual void execute( std::coroutine_handle<> handle ) noexcept = 0;
+};
+
+//-----------------------------------------------------------------------------
+// Reactor
+//-----------------------------------------------------------------------------
+
+namespace detail
+{
+
+/// Functions posted to the reactor from any thread. Kept alive by the threads
+/// that resolve names, so they can outlive the reactor.
+class Inbox final
+{
+  public:
+    Inbox() noexcept
+        : mEventFd{ eventfd( 0, EFD_NONBLOCK | EFD_CLOEXEC ) }
+    {
+    }
+
+    Inbox( const Inbox& ) = delete;
+    Inbox& operator=( const Inbox& ) = delete;
+
+    ~Inbox()
+    {
+        if ( mEventFd != -1 )
+        {
+            close( mEventFd );
+        }
+    }
+
+    [[nodiscard]] int fd() const noexcept
+    {
+        return mEventFd;
+    }
+
+    /// Does nothing once the reactor is gone.
+    void post( std::function<void()> function )
+    {
+        {
+            const std::lock_guard lock{ mMutex };
+
+            if ( mClosed )
+            {
+                return;
+            }
+
+            mFunctions.push_back( std::move( function ) );
+        }
+
+        wake();
+    }
+
+    void wake() const noexcept
+    {
+        const uint64_t one = 1;
+        static_cast<void>( write( mEventFd, &one, sizeof( one ) ) );
+    }
+
+    [[nodiscard]] std::vector<std::function<void()>> take()
+    {
+        uint64_t count;
+        static_cast<void>( read( mEventFd, &count, sizeof( count ) ) );
+
+        const std::lock_guard lock{ mMutex };
+
+        return std::exchange( mFunctions, {} );
+    }
+
+    void close_inbox() noexcept
+    {
+        const std::lock_guard lock{ mMutex };
+        mClosed = true;
+        mFunctions.clear();
+    }
+
+  private:
+    int mEventFd;
+    std::mutex mMutex;
+    std::vector<std::function<void()>> mFunctions;
+    bool mClosed = false;
+};
+
+class TopicOperation;
+
+/// What the reactor calls back on readiness and deadlines.
+class Pollable
+{
+  public:
+    virtual void on_events( uint32_t events ) noexcept = 0;
+    virtual void on_deadline() noexcept = 0;
+
+  protected:
+    ~Pollable() = default;
+};
+
+} // namespace detail
+
+/// An epoll loop that drives the sockets of any number of topics on the
+/// thread that calls `run`. It is also the executor that resumes coroutines
+/// inline, on that thread.
+class Reactor final : public Executor
+{
+  public:
+    using clock = std::chrono::steady_clock;
+
+    /// `valid()` tells if epoll could be set up, topics fail with
+    /// `EAsyncError::System` otherwise.
+    Reactor() noexcept
+        : mEpoll{ epoll_create1( EPOLL_CLOEXEC ) },
+          mInbox{ std::make_shared<detail::Inbox>() }
+    {
+        epoll_event event{ .events = EPOLLIN, .data = { .ptr = nullptr } };
+
+        if ( mEpoll != -1 && ( mInbox->fd() == -1 ||
+                               epoll_ctl( mEpoll, EPOLL_CTL_ADD, mInbox->fd(),
+                                          &event ) == -1 ) )
+        {
+            close( mEpoll );
+            mEpoll = -1;
+        }
+    }
+
+    Reactor( const Reactor& ) = delete;
+    Reactor& operator=( const Reactor& ) = delete;
+
+    ~Reactor() override
+    {
+        mInbox->close_inbox();
+
+        if ( mEpoll != -1 )
+        {
+            close( mEpoll );
+        }
+    }
+
+    [[nodiscard]] bool valid() const noexcept
+    {
+        return mEpoll != -1;
+    }
+
+    [[nodiscard]] Reactor& reactor() noexcept override
+    {
+        return *this;
+    }
+
+    void execute( const std::coroutine_handle<> handle ) noexcept override
+    {
+        handle.resume();
+    }
+
+    /// Runs until every topic and spawned task has finished, or `stop` is
+    /// called.
+    void run() noexcept
+    {
+        mThread.store( std::this_thread::get_id() );
+        mStopped.store( false );
+
+        std::array<epoll_event, 128> events;
+
+        while ( valid() && mWork.load() != 0 && !mStopped.load() )
+        {
+            const auto count = epoll_wait( mEpoll, events.data(),
+                                           events.size(), timeout() );
+
+            for ( int i = 0; i < count; i++ )
+            {
+                if ( events[i].data.ptr == nullptr )
+                {
+                    for ( auto& function : mInbox->take() )
+                    {
+                        function();
+                    }
+                }
+                else
+                {
+                    static_cast<detail::Pollable*>( events[i].data.ptr )
+                        ->on_events( events[i].events );
+                }
+            }
+
+            const auto now = clock::now();
+
+            while ( !mDeadlines.empty() && mDeadlines.begin()->first <= now )
+            {
+                const auto pollable = mDeadlines.begin()->second;
+                mDeadlines.erase( mDeadlines.begin() );
+
+                pollable->on_deadline();
+            }
+        }
+
+        mThread.store( std::thread::id{} );
+    }
+
+    /// Makes `run` return. Can be called from any thread.
+    void stop() noexcept
+    {
+        mStopped.store( true );
+        mInbox->wake();
+    }
+
+    /// Runs the function on the reactor thread. Can be called from any
+    /// thread.
+    void post( std::function<void()> function )
+    {
+        mInbox->post( std::move( function ) );
+    }
+
+    /// \returns true on the thread inside `run`.
+    [[nodiscard]] bool on_reactor_thread() const noexcept
+    {
+        return mThread.load() == std::this_thread::get_id();
+    }
+
+    /// Keeps `run` going until the matching `release_work`.
+    void add_work() noexcept
+    {
+        mWork.fetch_add( 1 );
+    }
+
+    void release_work() noexcept
+    {
+        if ( mWork.fetch_sub( 1 ) == 1 && !on_reactor_thread() )
+        {
+            mInbox->wake();
+        }
+    }
+
+  private:
+    friend class detail::TopicOperation;
+
+    [[nodiscard]] int timeout() const noexcept
+    {
+        if ( mDeadlines.empty() )
+        {
+            return -1;
+        }
+
+        const auto left = std::chrono::ceil<std::chrono::milliseconds>(
+            mDeadlines.begin()->first - clock::now() );
+
+        return static_cast<int>( std::clamp<std::chrono::milliseconds::rep>(
+            left.count(), 0, INT32_MAX ) );
+    }
+
+    int mEpoll;
+    std::shared_ptr<detail::Inbox> mInbox;
+    std::atomic<size_t> mWork = 0;
+    std::atomic<bool> mStopped = false;
+    std::atomic<std::thread::id> mThread;
+    std::multimap<clock::time_point, detail::Pollable*> mDeadlines;
+    /// The operations waiting for a name, by their id.
+    std::unordered_map<uint64_t, detail::Pollable*> mResolving;
+    uint64_t mNextId = 0;
+};
+
+//-----------------------------------------------------------------------------
+// Spawning
+//-----------------------------------------------------------------------------
+
+namespace detail
+{
+
+/// A coroutine that starts right away and frees itself when it finishes.
+struct Detached final
+{
+    struct promise_type final
+    {
+        [[nodiscard]] Detached get_return_object() const noexcept
+        {
+            return {};
+        }
+
+        [[nodiscard]] std::suspend_never initial_suspend() const noexcept
+        {
+            return {};
+        }
+
+        [[nodiscard]] std::suspend_never final_suspend() const noexcept
+        {
+            return {};
+        }
+
+        void return_void() const noexcept
+        {
+        }
+
+        [[noreturn]] void unhandled_exception() const noexcept
+        {
+            std::terminate();
+        }
+    };
+};
+
+inline Detached run_detached( Reactor& reactor, Task<void> task )
+{
+    co_await std::move( task );
+
+    reactor.release_work();
+}
+
+} // namespace detail
+
+/// Starts the task on the calling thread and lets it run on its own; the
+/// reactor keeps running until it finishes. An exception escaping the task
+/// terminates the program.
+inline void spawn( Executor& executor, Task<void> task )
+{
+    executor.reactor().add_work();
+    detail::run_detached( executor.reactor(), std::move( task ) );
+}
+
+//-----------------------------------------------------------------------------
+// Topics
+//-----------------------------------------------------------------------------
+
+enum class EAsyncError
+{
+    None,
+    /// The target is not "<NODE>:<PORT>".
+    InvalidTarget,
+    DataTooLong,
+    ResolveFailed,
+    ConnectFailed,
+    SendFailed,
+    RecvFailed,
+    /// The server closed the connection before the reply was complete.
+    ConnectionClosed,
+    /// The reply has an invalid magic, length or type.
+    InvalidReply,
+    Timeout,
+    /// The reactor could not set up epoll.
+    System
+};
+
+/// The reply of a topic, or why there is none.
+struct AsyncResult final
+{
+    /// Null on error.
+    std::shared_ptr<const CachedReply> mReply;
+    EAsyncError mError = EAsyncError::None;
+    /// The errno, or the getaddrinfo error for `ResolveFailed`, if any.
+    int mSystemError = 0;
+
+    [[nodiscard]] explicit operator bool() const noexcept
+    {
+        return mError == EAsyncError::None;
+    }
+};
+
+namespace detail
+{
+
+/// One topic: resolves the name, tries its addresses in order, sends the
+/// packet and reads the reply, all on the reactor thread. Lives inside the
+/// awaiting coroutine's frame.
+class TopicOperation final : public Pollable
+{
+  public:
+    TopicOperation( Executor& executor, const std::string_view target,
+                    const std::string_view message,
+                    const std::chrono::milliseconds timeout )
+        : mExecutor{ executor }, mReactor{ executor.reactor() },
+          mTimeout{ timeout }
+    {
+        auto address = target;
+        const auto del = address.find_last_of( ':' );
+
+        if ( del == std::string_view::npos || del == 0 ||
+             del + 1 == address.size() )
+        {
+            mResult.mError = EAsyncError::InvalidTarget;
+
+            return;
+        }
+
+        mPort = address.substr( del + 1 );
+        address = address.substr( 0, del );
+
+        // "[::1]:2506"
+        if ( address.size() >= 2 && address.front() == '[' &&
+             address.back() == ']' )
+        {
+            address = address.substr( 1, address.size() - 2 );
+        }
+
+        mNode = address;
+
+        auto [result, packet] = encode( message.data(), message.size() );
+
+        if ( result != EResult::Ok )
+        {
+            mResult.mError = EAsyncError::DataTooLong;
+
+            return;
+        }
+
+        mPacket = std::move( packet );
+
+        if ( !mReactor.valid() )
+        {
+            mResult.mError = EAsyncError::System;
+        }
+    }
+
+    TopicOperation( const TopicOperation& ) = delete;
+    TopicOperation& operator=( const TopicOperation& ) = delete;
+
+    /// \returns true if the topic failed before it started.
+    [[nodiscard]] bool failed() const noexcept
+    {
+        return mResult.mError != EAsyncError::None;
+    }
+
+    /// \returns false if the topic finished right away, the waiting
+    /// coroutine is not resumed then.
+    [[nodiscard]] bool start( const std::coroutine_handle<> waiting )
+    {
+        mWaiting = waiting;
+        mReactor.add_work();
+
+        if ( !mReactor.on_reactor_thread() )
+        {
+            mReactor.post( [this] { begin(); } );
+
+            return true;
+        }
+
+        // Resuming from inside `await_suspend` would nest every failed topic
+        // of a retry loop one level deeper on the stack.
+        mStarting = true;
+        begin();
+        mStarting = false;
+
+        return !mFinished;
+    }
+
+    [[nodiscard]] AsyncResult take_result() noexcept
+    {
+        return std::move( mResult );
+    }
+
+    void on_events( const uint32_t events ) noexcept override
+    {
+        switch ( mState )
+        {
+        case EState::Connecting:
+            on_connected();
+            break;
+        case EState::Sending:
+            if ( ( events & ( EPOLLERR | EPOLLHUP ) ) != 0 )
+            {
+                finish( EAsyncError::SendFailed, socket_error() );
+            }
+            else
+            {
+                send_packet();
+            }
+            break;
+        case EState::Receiving:
+            receive();
+            break;
+        default:
+            break;
+        }
+    }
+
+    void on_deadline() noexcept override
+    {
+        mHasDeadline = false;
+        finish( EAsyncError::Timeout, 0 );
+    }
+
+  private:
+    enum class EState
+    {
+        Idle,
+        Resolving,
+        Connecting,
+        Sending,
+        Receiving
+    };
+
+    void begin() noexcept
+    {
+        if ( mTimeout.count() != 0 )
+        {
+            mDeadline = mReactor.mDeadlines.emplace(
+                Reactor::clock::now() + mTimeout, this );
+            mHasDeadline = true;
+        }
+
+        // Numeric addresses resolve without blocking.
+        addrinfo hints{};
+        hints.ai_flags = AI_NUMERICHOST | AI_NUMERICSERV;
+        hints.ai_family = AF_UNSPEC;
+        hints.ai_socktype = SOCK_STREAM;
+        addrinfo* list = nullptr;
+
+        if ( getaddrinfo( mNode.c_str(), mPort.c_str(), &hints, &list ) == 0 )
+        {
+            resolved( 0, list );
+
+            return;
+        }
+
+        // Names are resolved on a thread of their own, the result comes back
+        // through the inbox unless the topic gave up meanwhile.
+        mState = EState::Resolving;
+        mId = mReactor.mNextId++;
+        mReactor.mResolving.emplace( mId, this );
+
+        try
+        {
+            resolve_detached();
+        }
+        catch ( const std::system_error& e )
+        {
+            finish( EAsyncError::System, e.code().value() );
+        }
+    }
+
+    void resolve_detached()
+    {
+        std::thread{ [inbox = mReactor.mInbox, reactor = &mReactor, id = mId,
+                      node = mNode, port = mPort]
+                     {
+                         addrinfo hints{};
+                         hints.ai_family = AF_UNSPEC;
+                         hints.ai_socktype = SOCK_STREAM;
+                         addrinfo* list = nullptr;
+                         const auto error = getaddrinfo(
+                             node.c_str(), port.c_str(), &hints, &list );
+
+                         inbox->post(
+                             [reactor, id, error, list]
+                             {
+                                 const auto it = reactor->mResolving.find( id );
+
+                                 if ( it == reactor->mResolving.end() )
+                                 {
+                                     if ( list != nullptr )
+                                     {
+                                         freeaddrinfo( list );
+                                     }
+
+                                     return;
+                                 }
+
+                                 auto* operation =
+                                     static_cast<TopicOperation*>( it->second );
+                                 reactor->mResolving.erase( it );
+
+                                 operation->resolved( error, list );
+                             } );
+                     } }
+            .detach();
+    }
+
+    /// Takes the list and frees it.
+    void resolved( const int error, addrinfo* const list ) noexcept
+    {
+        if ( error != 0 )
+        {
+            finish( EAsyncError::ResolveFailed, error );
+
+            return;
+        }
+
+        for ( auto* info = list; info != nullptr; info = info->ai_next )
+        {
+            Address address{ .mSize = info->ai_addrlen };
+            std::memcpy( &address.mStorage, info->ai_addr, info->ai_addrlen );
+            mAddresses.push_back( address );
+        }
+
+        freeaddrinfo( list );
+
+        connect_next();
+    }
+
+    /// Connects to the next address, or fails with the last error.
+    void connect_next() noexcept
+    {
+        close_socket();
+
+        while ( mNextAddress < mAddresses.size() )
+        {
+            const auto& address = mAddresses[mNextAddress++];
+
+            mSocket = socket( address.mStorage.ss_family,
+                              SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0 );
+
+            if ( mSocket == -1 )
+            {
+                mLastError = errno;
+
+                continue;
+            }
+
+            const int one = 1;
+            setsockopt( mSocket, IPPROTO_TCP, TCP_NODELAY, &one,
+                        sizeof( one ) );
+
+            epoll_event event{ .events = EPOLLOUT, .data = { .ptr = this } };
+
+            if ( ( connect( mSocket,
+                            reinterpret_cast<const sockaddr*>(
+                                &address.mStorage ),
+                            address.mSize ) == -1 &&
+                   errno != EINPROGRESS ) ||
+                 epoll_ctl( mReactor.mEpoll, EPOLL_CTL_ADD, mSocket,
+                            &event ) == -1 )
+            {
+                mLastError = errno;
+                close_socket();
+
+                continue;
+            }
+
+            mState = EState::Connecting;
+
+            return;
+        }
+
+        finish( EAsyncError::ConnectFailed, mLastError );
+    }
+
+    void on_connected() noexcept
+    {
+        if ( const auto error = socket_error(); error != 0 )
+        {
+            mLastError = error;
+            connect_next();
+
+            return;
+        }
+
+        mState = EState::Sending;
+        send_packet();
+    }
+
+    void send_packet() noexcept
+    {
+        while ( mSent < mPacket.size() )
+        {
+            const auto sent = send( mSocket, mPacket.data() + mSent,
+                                    mPacket.size() - mSent, MSG_NOSIGNAL );
+
+            if ( sent == -1 && errno == EINTR )
+            {
+                continue;
+            }
+
+            if ( sent == -1 && ( errno == EAGAIN || errno == EWOULDBLOCK ) )
+            {
+                return;
+            }
+
+            if ( sent == -1 )
+            {
+                finish( EAsyncError::SendFailed, errno );
+
+                return;
+            }
+
+            mSent += sent;
+        }
+
+        epoll_event event{ .events = EPOLLIN | EPOLLRDHUP,
+                           .data = { .ptr = this } };
+
+        if ( epoll_ctl( mReactor.mEpoll, EPOLL_CTL_MOD, mSocket, &event ) ==
+             -1 )
+        {
+            finish( EAsyncError::System, errno );
+
+            return;
+        }
+
+        mState = EState::Receiving;
+    }
+
+    void receive() noexcept
+    {
+        std::array<char, 4096> chunk;
+        auto open = true;
+
+        while ( true )
+        {
+            const auto read = recv( mSocket, chunk.data(), chunk.size(), 0 );
+
+            if ( read > 0 )
+            {
+                mInput.insert( mInput.end(), chunk.data(),
+                               chunk.data() + read );
+
+                continue;
+            }
+
+            if ( read == -1 && errno == EINTR )
+            {
+                continue;
+            }
+
+            if ( read == -1 && errno != EAGAIN && errno != EWOULDBLOCK )
+            {
+                finish( EAsyncError::RecvFailed, errno );
+
+                return;
+            }
+
+            open = read == -1;
+
+            break;
+        }
+
+        const auto [status, consumed] =
+            mDecoder.feed( std::span{ mInput }.subspan( mParsed ) );
+
+        mParsed += consumed;
+
+        switch ( status )
+        {
+        case EDecodeStatus::Done:
+            mResult.mReply =
+                CachedReply::from_bytes( std::span{ mInput }.first( mParsed ) );
+            finish( EAsyncError::None, 0 );
+            break;
+        case EDecodeStatus::NeedMore:
+            if ( !open )
+            {
+                finish( EAsyncError::ConnectionClosed, 0 );
+            }
+            break;
+        default:
+            finish( EAsyncError::InvalidReply, 0 );
+            break;
+        }
+    }
+
+    [[nodiscard]] int socket_error() const noexcept
+    {
+        int error = 0;
+        socklen_t size = sizeof( error );
+
+        if ( getsockopt( mSocket, SOL_SOCKET, SO_ERROR, &error, &size ) == -1 )
+        {
+            return errno;
+        }
+
+        return error;
+    }
+
+    void close_socket() noexcept
+    {
+        // Closing the socket also removes it from the epoll set.
+        if ( mSocket != -1 )
+        {
+            close( mSocket );
+            mSocket = -1;
+        }
+    }
+
+    /// Resumes the awaiting coroutine, which may destroy this operation,
+    /// unless `start` is still running.
+    void finish( const EAsyncError error, const int systemError ) noexcept
+    {
+        close_socket();
+
+        if ( mHasDeadline )
+        {
+            mReactor.mDeadlines.erase( mDeadline );
+            mHasDeadline = false;
+        }
+
+        if ( mState == EState::Resolving )
+        {
+            mReactor.mResolving.erase( mId );
+        }
+
+        mState = EState::Idle;
+        mResult.mError = error;
+        mResult.mSystemError = systemError;
+
+        if ( error != EAsyncError::None )
+        {
+            mResult.mReply = nullptr;
+        }
+
+        if ( mStarting )
+        {
+            mFinished = true;
+            mReactor.release_work();
+
+            return;
+        }
+
+        auto& reactor = mReactor;
+        mExecutor.execute( mWaiting );
+        reactor.release_work();
+    }
+
+    struct Address final
+    {
+        sockaddr_storage mStorage{};
+        socklen_t mSize = 0;
+    };
+
+    Executor& mExecutor;
+    Reactor& mReactor;
+    std::chrono::milliseconds mTimeout;
+    std::string mNode;
+    std::string mPort;
+    std::vector<char> mPacket;
+    std::coroutine_handle<> mWaiting;
+    AsyncResult mResult;
+    EState mState = EState::Idle;
+    uint64_t mId = 0;
+    std::vector<Address> mAddresses;
+    size_t mNextAddress = 0;
+    int mLastError = 0;
+    int mSocket = -1;
+    size_t mSent = 0;
+    /// Received bytes, the decoder has consumed `mParsed` of them.
+    std::vector<char> mInput;
+    size_t mParsed = 0;
+    Decoder mDecoder;
+    std::multimap<Reactor::clock::time_point, Pollable*>::iterator mDeadline;
+    bool mHasDeadline = false;
+    /// Set while `start` runs `begin` on the reactor thread.
+    bool mStarting = false;
+    /// The topic finished inside `start`.
+    bool mFinished = false;
+};
+
+} // namespace detail
+
+/// Awaits one topic, see `async_topic`.
+class TopicAwaitable final
+{
+  public:
+    TopicAwaitable( Executor& executor, const std::string_view target,
+                    const std::string_view message,
+                    const std::chrono::milliseconds timeout )
+        : mOperation{ executor, target, message, timeout }
+    {
+    }
+
+    TopicAwaitable( const TopicAwaitable& ) = delete;
+    TopicAwaitable& operator=( const TopicAwaitable& ) = delete;
+
+    [[nodiscard]] bool await_ready() const noexcept
+    {
+        return mOperation.failed();
+    }
+
+    [[nodiscard]] bool await_suspend( const std::coroutine_handle<> waiting )
+    {
+        return mOperation.start( waiting );
+    }
+
+    [[nodiscard]] AsyncResult await_resume() noexcept
+    {
+        return mOperation.take_result();
+    }
+
+  private:
+    detail::TopicOperation mOperation;
+};
+
+/// Sends the message to "<NODE>:<PORT>" over a new connection and decodes
+/// the reply. The sockets run on the executor's reactor, the awaiting
+/// coroutine is resumed through the executor. Names that are not numeric
+/// addresses are resolved on a short-lived thread.
+/// \param timeout the whole topic, from resolving to the reply, zero for no
+/// limit.
+[[nodiscard]] inline TopicAwaitable
+async_topic( Executor& executor, const std::string_view target,
+             const std::string_view message,
+             const std::chrono::milliseconds timeout = std::chrono::seconds{
+                 10 } )
+{
+    return TopicAwaitable{ executor, target, message, timeout };
+}
+
+} // namespace bt
@@ -15,29 +15,53 @@
 
 #pragma once
 
+#include <algorithm>
 #include <array>
 #include <bit>
+#include <concepts>
+#include <cstddef>
 #include <cstdint>
 #include <cstring>
 #include <iterator>
+#include <limits>
+#include <optional>
 #include <ranges>
+#include <span>
+#include <string_view>
+#include <type_traits>
 #include <utility>
 #include <vector>
 
+// Percent-encoding uses AVX2 or SSE2 when the compiler targets them, define
+// BT_NO_SIMD to always use the scalar code.
+#if defined( BT_NO_SIMD )
+#elif defined( __AVX2__ )
+#define BT_DETAIL_SIMD 32
+#include <immintrin.h>
+#elif defined( __SSE2__ ) || defined( _M_X64 ) ||                              \
+    ( defined( _M_IX86_FP ) && _M_IX86_FP >= 2 )
+#define BT_DETAIL_SIMD 16
+#include <emmintrin.h>
+#endif
+
 namespace bt
 {
 
 enum class EResult
 {
     Ok,
-    DataTooLong
+    DataTooLong,
+    BufferTooSmall
 };
 
+/// Size of the packet header that precedes the message.
+inline constexpr size_t header_size_v = 9;
+
 template <uint16_t DataSize>
 constexpr bool data_fits_v = DataSize + 6 <= UINT16_MAX;
 
 template <uint16_t DataSize>
-constexpr uint16_t message_size_v = 10 + DataSize;
+constexpr size_t message_size_v = 10 + size_t{ DataSize };
 
 template <uint16_t ArraySize>
     requires data_fits_v<ArraySize>
@@ -90,34 +114,92 @@ template <typename ArrayType>
     return encode_array<std::tuple_size_v<ArrayType>>( data.data() );
 }
 
-[[nodiscard]] constexpr std::pair<EResult, std::vector<char>>
-encode( const char* data, const size_t length ) noexcept
+/// \returns the size of an encoded message: the header, the data and a
+/// trailing NUL.
+[[nodiscard]] constexpr size_t encoded_size( const size_t length ) noexcept
+{
+    return header_size_v + length + 1;
+}
+
+/// Writes the packet header for a message of `length` bytes. The message
+/// itself and a trailing NUL must follow the header on the wire.
+[[nodiscard]] constexpr EResult
+encode_header_into( std::span<char, header_size_v> dst,
+                    const size_t length ) noexcept
 {
     if ( length + 6 > UINT16_MAX )
     {
-        return std::make_pair( EResult::DataTooLong, std::vector<char>{} );
+        return EResult::DataTooLong;
     }
 
     const auto packet_size = static_cast<uint16_t>( length + 6 );
-    const auto* packet_size_bytes =
-        reinterpret_cast<const char*>( &packet_size );
 
-    constexpr bool swapBytes = std::endian::native == std::endian::little;
+    dst[0] = '\x00';
+    dst[1] = '\x83';
+    dst[2] = static_cast<char>( packet_size >> 8 );
+    dst[3] = static_cast<char>( packet_size );
+    dst[4] = '\x00';
+    dst[5] = '\x00';
+    dst[6] = '\x00';
+    dst[7] = '\x00';
+    dst[8] = '\x00';
+
+    return EResult::Ok;
+}
+
+/// Encodes a message into the caller's buffer.
+/// \returns the number of bytes written, `encoded_size( length )` on success.
+/// `DataTooLong` wins over `BufferTooSmall`, no buffer fits such a message.
+[[nodiscard]] constexpr std::pair<EResult, size_t>
+encode_into( std::span<char> dst, const char* data,
+             const size_t length ) noexcept
+{
+    if ( length + 6 > UINT16_MAX )
+    {
+        return std::make_pair( EResult::DataTooLong, size_t{ 0 } );
+    }
+
+    if ( dst.size() < encoded_size( length ) )
+    {
+        return std::make_pair( EResult::BufferTooSmall, size_t{ 0 } );
+    }
+
+    static_cast<void>(
+        encode_header_into( dst.first<header_size_v>(), length ) );
+
+    std::copy_n( data, length, dst.data() + header_size_v );
+    dst[header_size_v + length] = '\0';
 
-    std::vector result{ '\x00',
-                        '\x83',
-                        packet_size_bytes[swapBytes ? 1 : 0],
-                        packet_size_bytes[swapBytes ? 0 : 1],
-                        '\x00',
-                        '\x00',
-                        '\x00',
-                        '\x00',
-                        '\x00' };
+    return std::make_pair( EResult::Ok, encoded_size( length ) );
+}
 
-    const auto old_size = result.size();
-    result.resize( result.size() + length + 1 );
+template <std::ranges::sized_range ArrayType>
+[[nodiscard]] constexpr std::pair<EResult, size_t>
+encode_into( std::span<char> dst, const ArrayType& data ) noexcept
+{
+    return encode_into( dst, data.data(), data.size() );
+}
 
-    memcpy( result.data() + old_size, data, length );
+[[nodiscard]] inline std::pair<EResult, size_t>
+encode_into( std::span<char> dst, const char* data ) noexcept
+{
+    return encode_into( dst, data, strlen( data ) );
+}
+
+[[nodiscard]] constexpr std::pair<EResult, std::vector<char>>
+encode( const char* data, const size_t length ) noexcept
+{
+    if ( length + 6 > UINT16_MAX )
+    {
+        return std::make_pair( EResult::DataTooLong, std::vector<char>{} );
+    }
+
+    std::vector<char> result( encoded_size( length ) );
+
+    static_cast<void>( encode_header_into(
+        std::span{ result }.first<header_size_v>(), length ) );
+
+    std::copy_n( data, length, result.data() + header_size_v );
 
     return std::make_pair( EResult::Ok, std::move( result ) );
 }
@@ -135,4 +217,1427 @@ encode( const char* data ) noexcept
     return encode( data, strlen( data ) );
 }
 
+//-----------------------------------------------------------------------------
+// Encoding many topics
+//-----------------------------------------------------------------------------
+
+/// Many encoded topics in one buffer, instead of a heap block per topic. The
+/// packets lie back to back in the order they were added, so the whole batch
+/// can also go out in one write. The packet `i` spans from `offsets[i]` to
+/// `offsets[i + 1]`.
+///
+/// \code
+/// bt::EncodedBatch batch;
+/// batch.reserve( topics.size(), total_length );
+///
+/// for ( const auto& topic : topics )
+/// {
+///     batch.add( topic );
+/// }
+///
+/// for ( const std::span<const char> packet : batch )
+/// {
+///     send( packet );
+/// }
+///
+/// batch.reset(); // Keeps the memory for the next sweep.
+/// \endcode
+class EncodedBatch final
+{
+  public:
+    class iterator final
+    {
+      public:
+        using value_type = std::span<const char>;
+        using difference_type = std::ptrdiff_t;
+
+        constexpr iterator() noexcept = default;
+
+        constexpr iterator( const EncodedBatch* batch,
+                            const size_t index ) noexcept
+            : mBatch( batch ), mIndex( index )
+        {
+        }
+
+        [[nodiscard]] constexpr std::span<const char>
+        operator*() const noexcept
+        {
+            return ( *mBatch )[mIndex];
+        }
+
+        constexpr iterator& operator++() noexcept
+        {
+            mIndex++;
+
+            return *this;
+        }
+
+        constexpr iterator operator++( int ) noexcept
+        {
+            auto previous = *this;
+            ++*this;
+
+            return previous;
+        }
+
+        [[nodiscard]] constexpr bool
+        operator==( const iterator& other ) const noexcept
+        {
+            return mIndex == other.mIndex;
+        }
+
+      private:
+        const EncodedBatch* mBatch = nullptr;
+        size_t mIndex = 0;
+    };
+
+    constexpr EncodedBatch() : mOffsets{ 0 }
+    {
+    }
+
+    /// Makes room for `count` topics with `total_length` bytes of messages
+    /// between them, so adding them doesn't allocate.
+    constexpr void reserve( const size_t count,
+                            const size_t total_length ) noexcept
+    {
+        mArena.reserve( mArena.size() + total_length +
+                        count * encoded_size( 0 ) );
+        mOffsets.reserve( mOffsets.size() + count );
+    }
+
+    /// Encodes a message after the last one.
+    /// \returns `DataTooLong` and leaves the batch as it was if the message
+    /// doesn't fit into a packet.
+    constexpr EResult add( const char* data, const size_t length ) noexcept
+    {
+        if ( length + 6 > UINT16_MAX )
+        {
+            return EResult::DataTooLong;
+        }
+
+        const auto offset = mArena.size();
+
+        mArena.resize( offset + encoded_size( length ) );
+
+        static_cast<void>( encode_into( std::span{ mArena }.subspan( offset ),
+                                        data, length ) );
+
+        mOffsets.push_back( mArena.size() );
+
+        return EResult::Ok;
+    }
+
+    template <std::ranges::sized_range ArrayType>
+    constexpr EResult add( const ArrayType& data ) noexcept
+    {
+        return add( data.data(), data.size() );
+    }
+
+    EResult add( const char* data ) noexcept
+    {
+        return add( data, strlen( data ) );
+    }
+
+    /// Forgets the topics but keeps the memory.
+    constexpr void reset() noexcept
+    {
+        mArena.clear();
+        mOffsets.resize( 1 );
+    }
+
+    /// \returns the number of topics.
+    [[nodiscard]] constexpr size_t size() const noexcept
+    {
+        return mOffsets.size() - 1;
+    }
+
+    [[nodiscard]] constexpr bool empty() const noexcept
+    {
+        return size() == 0;
+    }
+
+    /// \returns the encoded packet of the topic.
+    [[nodiscard]] constexpr std::span<const char>
+    operator[]( const size_t index ) const noexcept
+    {
+        return std::span{ mArena }.subspan(
+            mOffsets[index], mOffsets[index + 1] - mOffsets[index] );
+    }
+
+    /// \returns all packets, back to back.
+    [[nodiscard]] constexpr std::span<const char> arena() const noexcept
+    {
+        return mArena;
+    }
+
+    /// \returns where each packet starts, and the end of the last one.
+    [[nodiscard]] constexpr std::span<const size_t> offsets() const noexcept
+    {
+        return mOffsets;
+    }
+
+    [[nodiscard]] constexpr iterator begin() const noexcept
+    {
+        return iterator{ this, 0 };
+    }
+
+    [[nodiscard]] constexpr iterator end() const noexcept
+    {
+        return iterator{ this, size() };
+    }
+
+  private:
+    std::vector<char> mArena;
+    std::vector<size_t> mOffsets;
+};
+
+//-----------------------------------------------------------------------------
+// Building topics
+//-----------------------------------------------------------------------------
+
+namespace detail
+{
+
+/// \returns true for the characters URLs don't escape: letters, digits and
+/// "-._~".
+[[nodiscard]] constexpr bool is_unreserved( const char c ) noexcept
+{
+    return ( c >= '0' && c <= '9' ) || ( c >= 'A' && c <= 'Z' ) ||
+           ( c >= 'a' && c <= 'z' ) || c == '-' || c == '.' || c == '_' ||
+           c == '~';
+}
+
+inline constexpr std::string_view hex_digits_v = "0123456789ABCDEF";
+
+#if BT_DETAIL_SIMD == 32
+
+inline constexpr size_t simd_width_v = 32;
+
+/// \returns a bit per byte of the block at `src`, set for unreserved bytes.
+[[nodiscard]] inline uint32_t unreserved_mask( const char* src ) noexcept
+{
+    const auto block =
+        _mm256_loadu_si256( reinterpret_cast<const __m256i*>( src ) );
+
+    // Signed comparisons also reject bytes from 0x80, they are negative.
+    const auto in_range = [&]( const char lo, const char hi )
+    {
+        return _mm256_and_si256(
+            _mm256_cmpgt_epi8( block, _mm256_set1_epi8( lo - 1 ) ),
+            _mm256_cmpgt_epi8( _mm256_set1_epi8( hi + 1 ), block ) );
+    };
+
+    const auto equal = [&]( const char c )
+    { return _mm256_cmpeq_epi8( block, _mm256_set1_epi8( c ) ); };
+
+    const auto letters_digits = _mm256_or_si256(
+        _mm256_or_si256( in_range( '0', '9' ), in_range( 'A', 'Z' ) ),
+        in_range( 'a', 'z' ) );
+    const auto marks = _mm256_or_si256(
+        _mm256_or_si256( equal( '-' ), equal( '.' ) ),
+        _mm256_or_si256( equal( '_' ), equal( '~' ) ) );
+
+    const auto mask = _mm256_or_si256( letters_digits, marks );
+
+    return static_cast<uint32_t>( _mm256_movemask_epi8( mask ) );
+}
+
+/// \returns a bit per byte of the block at `src`, set for `a` and `b`.
+[[nodiscard]] inline uint32_t match_mask( const char* src, const char a,
+                                          const char b ) noexcept
+{
+    const auto block =
+        _mm256_loadu_si256( reinterpret_cast<const __m256i*>( src ) );
+
+    return static_cast<uint32_t>( _mm256_movemask_epi8( _mm256_or_si256(
+        _mm256_cmpeq_epi8( block, _mm256_set1_epi8( a ) ),
+        _mm256_cmpeq_epi8( block, _mm256_set1_epi8( b ) ) ) ) );
+}
+
+inline void copy_block( char* dst, const char* src ) noexcept
+{
+    _mm256_storeu_si256(
+        reinterpret_cast<__m256i*>( dst ),
+        _mm256_loadu_si256( reinterpret_cast<const __m256i*>( src ) ) );
+}
+
+#elif BT_DETAIL_SIMD == 16
+
+inline constexpr size_t simd_width_v = 16;
+
+/// \returns a bit per byte of the block at `src`, set for unreserved bytes.
+[[nodiscard]] inline uint32_t unreserved_mask( const char* src ) noexcept
+{
+    const auto block =
+        _mm_loadu_si128( reinterpret_cast<const __m128i*>( src ) );
+
+    // Signed comparisons also reject bytes from 0x80, they are negative.
+    const auto in_range = [&]( const char lo, const char hi )
+    {
+        return _mm_and_si128(
+            _mm_cmpgt_epi8( block, _mm_set1_epi8( lo - 1 ) ),
+            _mm_cmplt_epi8( block, _mm_set1_epi8( hi + 1 ) ) );
+    };
+
+    const auto equal = [&]( const char c )
+    { return _mm_cmpeq_epi8( block, _mm_set1_epi8( c ) ); };
+
+    const auto letters_digits = _mm_or_si128(
+        _mm_or_si128( in_range( '0', '9' ), in_range( 'A', 'Z' ) ),
+        in_range( 'a', 'z' ) );
+    const auto marks =
+        _mm_or_si128( _mm_or_si128( equal( '-' ), equal( '.' ) ),
+                      _mm_or_si128( equal( '_' ), equal( '~' ) ) );
+
+    const auto mask = _mm_or_si128( letters_digits, marks );
+
+    return static_cast<uint32_t>( _mm_movemask_epi8( mask ) );
+}
+
+/// \returns a bit per byte of the block at `src`, set for `a` and `b`.
+[[nodiscard]] inline uint32_t match_mask( const char* src, const char a,
+                                          const char b ) noexcept
+{
+    const auto block =
+        _mm_loadu_si128( reinterpret_cast<const __m128i*>( src ) );
+
+    return static_cast<uint32_t>( _mm_movemask_epi8(
+        _mm_or_si128( _mm_cmpeq_epi8( block, _mm_set1_epi8( a ) ),
+                      _mm_cmpeq_epi8( block, _mm_set1_epi8( b ) ) ) ) );
+}
+
+inline void copy_block( char* dst, const char* src ) noexcept
+{
+    _mm_storeu_si128(
+        reinterpret_cast<__m128i*>( dst ),
+        _mm_loadu_si128( reinterpret_cast<const __m128i*>( src ) ) );
+}
+
+#endif
+
+/// \returns the position of the first `a` or `b` from `from`, or the size of
+/// the text if there is none.
+[[nodiscard]] constexpr size_t find_either( const std::string_view text,
+                                            size_t from, const char a,
+                                            const char b ) noexcept
+{
+#ifdef BT_DETAIL_SIMD
+    if ( !std::is_constant_evaluated() )
+    {
+        while ( text.size() - from >= simd_width_v )
+        {
+            if ( const auto mask = match_mask( text.data() + from, a, b );
+                 mask != 0 )
+            {
+                return from + std::countr_zero( mask );
+            }
+
+            from += simd_width_v;
+        }
+    }
+#endif
+
+    while ( from < text.size() && text[from] != a && text[from] != b )
+    {
+        from++;
+    }
+
+    return from;
+}
+
+/// \returns the value of a hex digit, or -1.
+[[nodiscard]] constexpr int hex_value( const char c ) noexcept
+{
+    if ( c >= '0' && c <= '9' )
+    {
+        return c - '0';
+    }
+
+    if ( c >= 'A' && c <= 'F' )
+    {
+        return c - 'A' + 10;
+    }
+
+    if ( c >= 'a' && c <= 'f' )
+    {
+        return c - 'a' + 10;
+    }
+
+    return -1;
+}
+
+} // namespace detail
+
+/// Percent-encodes the text as URLs do, leaving only letters, digits and
+/// "-._~" as they are.
+/// \returns the number of bytes written.
+[[nodiscard]] constexpr std::pair<EResult, size_t>
+percent_encode_into( std::span<char> dst, const std::string_view text ) noexcept
+{
+    size_t in = 0;
+    size_t out = 0;
+
+    const auto escape = [&]
+    {
+        const auto c = static_cast<uint8_t>( text[in++] );
+
+        dst[out++] = '%';
+        dst[out++] = detail::hex_digits_v[c >> 4];
+        dst[out++] = detail::hex_digits_v[c & 0x0F];
+    };
+
+#ifdef BT_DETAIL_SIMD
+    if ( !std::is_constant_evaluated() )
+    {
+        constexpr auto width = detail::simd_width_v;
+        constexpr auto all =
+            static_cast<uint32_t>( ( uint64_t{ 1 } << width ) - 1 );
+
+        while ( text.size() - in >= width && dst.size() - out >= width )
+        {
+            const auto mask = detail::unreserved_mask( text.data() + in );
+
+            // Copy the whole block, but keep only the bytes before the first
+            // one to escape.
+            detail::copy_block( dst.data() + out, text.data() + in );
+
+            if ( mask == all )
+            {
+                in += width;
+                out += width;
+
+                continue;
+            }
+
+            const auto kept = static_cast<size_t>( std::countr_one( mask ) );
+            in += kept;
+            out += kept;
+
+            if ( dst.size() - out < 3 )
+            {
+                return std::make_pair( EResult::BufferTooSmall, size_t{ 0 } );
+            }
+
+            escape();
+        }
+    }
+#endif
+
+    while ( in < text.size() )
+    {
+        if ( detail::is_unreserved( text[in] ) )
+        {
+            if ( out == dst.size() )
+            {
+                return std::make_pair( EResult::BufferTooSmall, size_t{ 0 } );
+            }
+
+            dst[out++] = text[in++];
+
+            continue;
+        }
+
+        if ( dst.size() - out < 3 )
+        {
+            return std::make_pair( EResult::BufferTooSmall, size_t{ 0 } );
+        }
+
+        escape();
+    }
+
+    return std::make_pair( EResult::Ok, out );
+}
+
+/// Builds a "?key=value&key2=value2" topic right in the buffer it is sent
+/// from: the text goes after the room for the header, and `finish` writes the
+/// header with the final length.
+///
+/// \code
+/// std::array<char, 256> buffer;
+/// const auto [result, size] = bt::TopicBuilder{ buffer }
+///                                 .raw( "?ban" )
+///                                 .param( "ckey", ckey )
+///                                 .param( "reason", reason )
+///                                 .finish();
+/// \endcode
+///
+/// Once the buffer runs out the rest of the calls do nothing and `finish`
+/// returns `BufferTooSmall`.
+class TopicBuilder final
+{
+  public:
+    constexpr explicit TopicBuilder( const std::span<char> dst ) noexcept
+        : mDst( dst )
+    {
+        if ( dst.size() < header_size_v )
+        {
+            mResult = EResult::BufferTooSmall;
+        }
+    }
+
+    /// Appends the text as it is.
+    constexpr TopicBuilder& raw( const std::string_view text ) noexcept
+    {
+        if ( mResult != EResult::Ok )
+        {
+            return *this;
+        }
+
+        if ( mDst.size() - mSize < text.size() )
+        {
+            mResult = EResult::BufferTooSmall;
+
+            return *this;
+        }
+
+        std::copy_n( text.data(), text.size(), mDst.data() + mSize );
+        mSize += text.size();
+
+        return *this;
+    }
+
+    /// Appends the text percent-encoded.
+    constexpr TopicBuilder& escaped( const std::string_view text ) noexcept
+    {
+        if ( mResult != EResult::Ok )
+        {
+            return *this;
+        }
+
+        const auto [result, size] =
+            percent_encode_into( mDst.subspan( mSize ), text );
+
+        mResult = result;
+        mSize += size;
+
+        return *this;
+    }
+
+    /// Appends a percent-encoded parameter without a value, after a '&'
+    /// unless the message is empty or ends with '?'.
+    constexpr TopicBuilder& param( const std::string_view key ) noexcept
+    {
+        if ( mResult == EResult::Ok && size() != 0 && mDst[mSize - 1] != '?' )
+        {
+            raw( "&" );
+        }
+
+        return escaped( key );
+    }
+
+    /// Appends "key=value", both percent-encoded, after a '&' unless the
+    /// message is empty or ends with '?'.
+    constexpr TopicBuilder& param( const std::string_view key,
+                                   const std::string_view value ) noexcept
+    {
+        return param( key ).raw( "=" ).escaped( value );
+    }
+
+    /// \returns the length of the message built so far.
+    [[nodiscard]] constexpr size_t size() const noexcept
+    {
+        return mSize - header_size_v;
+    }
+
+    /// Writes the header and the trailing NUL.
+    /// \returns the size of the encoded message, as `encode_into` does.
+    [[nodiscard]] constexpr std::pair<EResult, size_t> finish() noexcept
+    {
+        if ( mResult == EResult::Ok && mSize == mDst.size() )
+        {
+            mResult = EResult::BufferTooSmall;
+        }
+
+        if ( mResult == EResult::Ok )
+        {
+            mResult =
+                encode_header_into( mDst.first<header_size_v>(), size() );
+        }
+
+        if ( mResult != EResult::Ok )
+        {
+            return std::make_pair( mResult, size_t{ 0 } );
+        }
+
+        mDst[mSize] = '\0';
+
+        return std::make_pair( EResult::Ok, mSize + 1 );
+    }
+
+  private:
+    std::span<char> mDst;
+    size_t mSize = header_size_v;
+    EResult mResult = EResult::Ok;
+};
+
+/// A string literal as a template argument.
+template <size_t Size> struct fixed_string final
+{
+    // Implicit to pass literals as they are.
+    constexpr fixed_string( const char ( &text )[Size] ) noexcept
+    {
+        std::copy_n( text, Size, mText.begin() );
+    }
+
+    /// \returns the text without the trailing NUL.
+    [[nodiscard]] constexpr std::string_view view() const noexcept
+    {
+        return std::string_view{ mText.data(), Size - 1 };
+    }
+
+    std::array<char, Size> mText{};
+};
+
+namespace detail
+{
+
+template <typename T>
+concept topic_text = std::convertible_to<const T&, std::string_view>;
+
+template <typename T>
+concept topic_number = std::integral<T> && !std::same_as<T, bool> &&
+                       !std::same_as<T, char>;
+
+/// Writes the number in decimal.
+/// \returns the number of bytes written, 0 if it doesn't fit.
+template <topic_number T>
+[[nodiscard]] constexpr size_t write_number( std::span<char> dst,
+                                             const T value ) noexcept
+{
+    using Unsigned = std::make_unsigned_t<T>;
+
+    std::array<char, std::numeric_limits<Unsigned>::digits10 + 2> digits{};
+    size_t count = 0;
+
+    bool negative = false;
+    auto magnitude = static_cast<Unsigned>( value );
+
+    if constexpr ( std::is_signed_v<T> )
+    {
+        // Negated as unsigned, the magnitude of the minimum value doesn't fit
+        // into `T`.
+        if ( value < 0 )
+        {
+            negative = true;
+            magnitude = static_cast<Unsigned>( Unsigned{ 0 } - magnitude );
+        }
+    }
+
+    do
+    {
+        digits[count++] = static_cast<char>( '0' + magnitude % 10 );
+        magnitude /= 10;
+    } while ( magnitude != 0 );
+
+    if ( negative )
+    {
+        digits[count++] = '-';
+    }
+
+    if ( dst.size() < count )
+    {
+        return 0;
+    }
+
+    std::reverse_copy( digits.begin(), digits.begin() + count, dst.begin() );
+
+    return count;
+}
+
+} // namespace detail
+
+/// A topic with "{}" placeholders, e.g.
+/// `bt::TopicTemplate<"?ban&ckey={}&reason={}">`.
+///
+/// The header and the constant text are laid out at compile time, so
+/// `encode_into` only copies them and writes the values: strings are
+/// percent-encoded, integers are written in decimal.
+///
+/// \code
+/// using Ban = bt::TopicTemplate<"?ban&ckey={}&reason={}">;
+///
+/// std::array<char, 512> buffer;
+/// const auto [result, size] = Ban::encode_into( buffer, ckey, reason );
+/// \endcode
+template <fixed_string Pattern> class TopicTemplate final
+{
+    static constexpr std::string_view pattern_v = Pattern.view();
+
+    [[nodiscard]] static consteval size_t count_placeholders() noexcept
+    {
+        size_t count = 0;
+
+        for ( auto pos = pattern_v.find( "{}" ); pos != std::string_view::npos;
+              pos = pattern_v.find( "{}", pos + 2 ) )
+        {
+            count++;
+        }
+
+        return count;
+    }
+
+  public:
+    static constexpr size_t placeholders = count_placeholders();
+
+    /// The length of the message without the values.
+    static constexpr size_t text_size = pattern_v.size() - 2 * placeholders;
+
+    static_assert( text_size + 6 <= UINT16_MAX,
+                   "The topic is too long to encode" );
+
+    /// The size of the encoded message with empty values.
+    static constexpr size_t min_size = encoded_size( text_size );
+
+    template <typename... Values>
+        requires( sizeof...( Values ) == placeholders &&
+                  ( ( detail::topic_text<Values> ||
+                      detail::topic_number<Values> ) &&
+                    ... ) )
+    [[nodiscard]] static constexpr std::pair<EResult, size_t>
+    encode_into( std::span<char> dst, const Values&... values ) noexcept
+    {
+        if ( dst.size() < min_size )
+        {
+            return std::make_pair( EResult::BufferTooSmall, size_t{ 0 } );
+        }
+
+        // The header and the text before the first value.
+        std::copy_n( layout_v.mText.data(), layout_v.mEnds[0], dst.data() );
+
+        size_t out = layout_v.mEnds[0];
+        size_t segment = 0;
+        bool fits = true;
+
+        [[maybe_unused]] const auto write = [&]( const auto& value )
+        {
+            if ( !fits )
+            {
+                return;
+            }
+
+            // Keep the room for the rest of the constant text and the NUL.
+            const auto rest = layout_v.mText.size() -
+                              layout_v.mEnds[segment] + 1;
+            const auto room = dst.first( dst.size() - rest ).subspan( out );
+
+            size_t written;
+
+            if constexpr ( detail::topic_number<
+                               std::remove_cvref_t<decltype( value )>> )
+            {
+                written = detail::write_number( room, value );
+                fits = written != 0;
+            }
+            else
+            {
+                const auto [result, size] =
+                    percent_encode_into( room, std::string_view{ value } );
+
+                written = size;
+                fits = result == EResult::Ok;
+            }
+
+            out += written;
+
+            const auto begin = layout_v.mEnds[segment];
+            const auto end = layout_v.mEnds[segment + 1];
+
+            std::copy_n( layout_v.mText.data() + begin, end - begin,
+                         dst.data() + out );
+            out += end - begin;
+            segment++;
+        };
+
+        ( write( values ), ... );
+
+        if ( !fits )
+        {
+            return std::make_pair( EResult::BufferTooSmall, size_t{ 0 } );
+        }
+
+        const auto length = out - header_size_v;
+
+        if ( length + 6 > UINT16_MAX )
+        {
+            return std::make_pair( EResult::DataTooLong, size_t{ 0 } );
+        }
+
+        const auto packet_size = static_cast<uint16_t>( length + 6 );
+
+        dst[2] = static_cast<char>( packet_size >> 8 );
+        dst[3] = static_cast<char>( packet_size );
+        dst[out] = '\0';
+
+        return std::make_pair( EResult::Ok, out + 1 );
+    }
+
+  private:
+    struct Layout final
+    {
+        /// The header and the constant text without the placeholders.
+        std::array<char, header_size_v + text_size> mText{};
+        /// Where each run of constant text ends, the first one includes the
+        /// header.
+        std::array<size_t, placeholders + 1> mEnds{};
+    };
+
+    [[nodiscard]] static consteval Layout make_layout() noexcept
+    {
+        Layout layout;
+
+        static_cast<void>( encode_header_into(
+            std::span{ layout.mText }.template first<header_size_v>(),
+            text_size ) );
+
+        size_t out = header_size_v;
+        size_t from = 0;
+
+        for ( size_t i = 0; i <= placeholders; i++ )
+        {
+            auto to = pattern_v.find( "{}", from );
+
+            if ( to == std::string_view::npos )
+            {
+                to = pattern_v.size();
+            }
+
+            std::copy_n( pattern_v.data() + from, to - from,
+                         layout.mText.data() + out );
+            out += to - from;
+            layout.mEnds[i] = out;
+            from = to + 2;
+        }
+
+        return layout;
+    }
+
+    static constexpr Layout layout_v = make_layout();
+};
+
+//-----------------------------------------------------------------------------
+// Decoding
+//-----------------------------------------------------------------------------
+
+enum class EDecodeStatus
+{
+    /// The reply is incomplete, feed more bytes.
+    NeedMore,
+    Done,
+    InvalidMagic,
+    InvalidLength
+};
+
+/// The longest reply: the magic, the length and up to UINT16_MAX bytes of the
+/// type and the body.
+inline constexpr size_t max_reply_size_v = 4 + UINT16_MAX;
+
+/// The type byte of a reply. Replies of other types are decoded too, with
+/// the type byte as it is.
+enum class EReplyType : uint8_t
+{
+    Null = 0x00,
+    String = 0x06,
+    Float = 0x2A
+};
+
+/// The body of a reply of a type that isn't in `EReplyType`.
+struct RawReply final
+{
+    uint8_t mType = 0;
+    std::string_view mBytes;
+};
+
+/// A decoded reply. The views point into the buffer that was passed to
+/// `Decoder::feed` and are valid as long as that buffer is.
+struct Reply final
+{
+    EReplyType mType = EReplyType::Null;
+    std::string_view mString;
+    float mFloat = 0;
+    /// The body as it is on the wire, whatever the type.
+    std::string_view mBytes;
+
+    /// \returns false for a type that isn't in `EReplyType`.
+    [[nodiscard]] constexpr bool known() const noexcept
+    {
+        return mType == EReplyType::Null || mType == EReplyType::String ||
+               mType == EReplyType::Float;
+    }
+
+    /// Calls the visitor with `nullptr` for null, a `std::string_view` for a
+    /// string, a `float` or a `RawReply` for any other type.
+    ///
+    /// \code
+    /// reply.visit( bt::overloaded{
+    ///     []( std::nullptr_t ) { ... },
+    ///     []( std::string_view text ) { ... },
+    ///     []( float number ) { ... },
+    ///     []( const bt::RawReply& raw ) { ... } } );
+    /// \endcode
+    template <typename Visitor>
+    constexpr decltype( auto ) visit( Visitor&& visitor ) const
+    {
+        switch ( mType )
+        {
+        case EReplyType::Null:
+            return std::forward<Visitor>( visitor )( nullptr );
+        case EReplyType::String:
+            return std::forward<Visitor>( visitor )( mString );
+        case EReplyType::Float:
+            return std::forward<Visitor>( visitor )( mFloat );
+        default:
+            return std::forward<Visitor>( visitor )(
+                RawReply{ static_cast<uint8_t>( mType ), mBytes } );
+        }
+    }
+};
+
+/// Lambdas joined into one visitor for `Reply::visit`.
+template <typename... Visitors> struct overloaded final : Visitors...
+{
+    using Visitors::operator()...;
+};
+
+template <typename... Visitors>
+overloaded( Visitors... ) -> overloaded<Visitors...>;
+
+namespace detail
+{
+
+/// \returns the bytes as an integer, in the order they are in memory.
+template <std::unsigned_integral T>
+[[nodiscard]] constexpr T load( const char* src ) noexcept
+{
+    std::array<char, sizeof( T )> bytes;
+    std::copy_n( src, sizeof( T ), bytes.begin() );
+
+    return std::bit_cast<T>( bytes );
+}
+
+template <std::unsigned_integral T>
+[[nodiscard]] constexpr T byte_swap( T value ) noexcept
+{
+    T result = 0;
+
+    for ( size_t i = 0; i < sizeof( T ); i++ )
+    {
+        result = static_cast<T>( result << 8 | ( value & 0xFF ) );
+        value = static_cast<T>( value >> 8 );
+    }
+
+    return result;
+}
+
+/// Loads a little-endian integer, one load on little-endian targets.
+template <std::unsigned_integral T>
+[[nodiscard]] constexpr T load_le( const char* src ) noexcept
+{
+    if constexpr ( std::endian::native == std::endian::little )
+    {
+        return load<T>( src );
+    }
+    else
+    {
+        return byte_swap( load<T>( src ) );
+    }
+}
+
+/// Loads a big-endian integer, a load and a byte swap on little-endian
+/// targets.
+template <std::unsigned_integral T>
+[[nodiscard]] constexpr T load_be( const char* src ) noexcept
+{
+    if constexpr ( std::endian::native == std::endian::big )
+    {
+        return load<T>( src );
+    }
+    else
+    {
+        return byte_swap( load<T>( src ) );
+    }
+}
+
+} // namespace detail
+
+/// An incremental reply decoder.
+///
+/// The header may be split across any number of chunks, it is kept inside the
+/// decoder. The body is never copied: `feed` only completes when the whole body
+/// is available in a single chunk and leaves it unconsumed otherwise, so the
+/// caller keeps the unconsumed bytes and feeds them again with more data
+/// appended. `bytes_needed` tells how much is missing.
+class Decoder final
+{
+  public:
+    struct Result final
+    {
+        EDecodeStatus mStatus;
+        /// Number of bytes from the chunk that belong to the decoder now.
+        size_t mConsumed;
+    };
+
+    static constexpr size_t header_size = 5;
+
+    /// Feeding a decoder that is done or failed starts a new reply.
+    [[nodiscard]] constexpr Result feed( std::span<const char> chunk ) noexcept
+    {
+        if ( mState == EState::Done || mState == EState::Failed )
+        {
+            reset();
+        }
+
+        size_t consumed = 0;
+
+        if ( mState == EState::Header )
+        {
+            while ( mHeaderSize < header_size && consumed < chunk.size() )
+            {
+                mHeader[mHeaderSize++] = chunk[consumed++];
+            }
+
+            if ( mHeaderSize >= 2 && ( mHeader[0] != '\x00' ||
+                                       mHeader[1] != '\x83' ) )
+            {
+                return fail( EDecodeStatus::InvalidMagic, consumed );
+            }
+
+            if ( mHeaderSize < header_size )
+            {
+                return Result{ EDecodeStatus::NeedMore, consumed };
+            }
+
+            const auto length = detail::load_be<uint16_t>( &mHeader[2] );
+
+            // The length includes the type byte.
+            if ( length == 0 )
+            {
+                return fail( EDecodeStatus::InvalidLength, consumed );
+            }
+
+            mBodySize = length - 1;
+            mReply.mType = static_cast<EReplyType>( mHeader[4] );
+
+            if ( mReply.mType == EReplyType::Float && mBodySize < 4 )
+            {
+                return fail( EDecodeStatus::InvalidLength, consumed );
+            }
+
+            mState = EState::Body;
+        }
+
+        const auto rest = chunk.subspan( consumed );
+
+        if ( rest.size() < mBodySize )
+        {
+            return Result{ EDecodeStatus::NeedMore, consumed };
+        }
+
+        const auto body = rest.first( mBodySize );
+
+        mReply.mBytes = std::string_view{ body.data(), body.size() };
+
+        switch ( mReply.mType )
+        {
+        case EReplyType::String:
+            // Strings are sent with a trailing NUL.
+            mReply.mString = mReply.mBytes.substr(
+                0, body.size() - ( !body.empty() && body.back() == '\0' ) );
+            break;
+        case EReplyType::Float:
+            // Floats are little-endian on the wire.
+            mReply.mFloat = std::bit_cast<float>(
+                detail::load_le<uint32_t>( body.data() ) );
+            break;
+        default:
+            break;
+        }
+
+        mState = EState::Done;
+
+        return Result{ EDecodeStatus::Done, consumed + mBodySize };
+    }
+
+    /// \returns the last decoded reply, valid after `feed` returned `Done`.
+    [[nodiscard]] constexpr const Reply& reply() const noexcept
+    {
+        return mReply;
+    }
+
+    /// \returns how many more bytes are needed, counting from the first
+    /// unconsumed byte.
+    [[nodiscard]] constexpr size_t bytes_needed() const noexcept
+    {
+        switch ( mState )
+        {
+        case EState::Header:
+            return header_size - mHeaderSize;
+        case EState::Body:
+            return mBodySize;
+        default:
+            return 0;
+        }
+    }
+
+    /// \returns true if a reply was started but is not complete yet.
+    [[nodiscard]] constexpr bool in_progress() const noexcept
+    {
+        return ( mState == EState::Header && mHeaderSize != 0 ) ||
+               mState == EState::Body;
+    }
+
+    constexpr void reset() noexcept
+    {
+        mState = EState::Header;
+        mHeaderSize = 0;
+        mBodySize = 0;
+        mReply = Reply{};
+    }
+
+  private:
+    enum class EState
+    {
+        Header,
+        Body,
+        Done,
+        Failed
+    };
+
+    [[nodiscard]] constexpr Result fail( const EDecodeStatus status,
+                                         const size_t consumed ) noexcept
+    {
+        mState = EState::Failed;
+
+        return Result{ status, consumed };
+    }
+
+    EState mState = EState::Header;
+    std::array<char, header_size> mHeader{};
+    size_t mHeaderSize = 0;
+    uint16_t mBodySize = 0;
+    Reply mReply;
+};
+
+//-----------------------------------------------------------------------------
+// Parameters
+//-----------------------------------------------------------------------------
+
+/// \returns true if the text has "%XX" or '+' to decode.
+[[nodiscard]] constexpr bool
+needs_decoding( const std::string_view text ) noexcept
+{
+    return detail::find_either( text, 0, '%', '+' ) != text.size();
+}
+
+/// Decodes "%XX" and '+' as a space. A '%' without two hex digits after it is
+/// kept as it is. The result is never longer than the text.
+/// \returns the number of bytes written.
+[[nodiscard]] constexpr std::pair<EResult, size_t>
+percent_decode_into( std::span<char> dst, const std::string_view text ) noexcept
+{
+    size_t in = 0;
+    size_t out = 0;
+
+    while ( in < text.size() )
+    {
+        // Copy everything up to the next escape at once.
+        const auto next = detail::find_either( text, in, '%', '+' );
+        const auto count = next - in;
+
+        if ( dst.size() - out < count + ( next < text.size() ? 1 : 0 ) )
+        {
+            return std::make_pair( EResult::BufferTooSmall, size_t{ 0 } );
+        }
+
+        std::copy_n( text.data() + in, count, dst.data() + out );
+        in += count;
+        out += count;
+
+        if ( in == text.size() )
+        {
+            break;
+        }
+
+        if ( text[in] == '+' )
+        {
+            dst[out++] = ' ';
+            in++;
+
+            continue;
+        }
+
+        const auto high =
+            in + 1 < text.size() ? detail::hex_value( text[in + 1] ) : -1;
+        const auto low =
+            in + 2 < text.size() ? detail::hex_value( text[in + 2] ) : -1;
+
+        if ( high == -1 || low == -1 )
+        {
+            dst[out++] = text[in++];
+
+            continue;
+        }
+
+        dst[out++] = static_cast<char>( high << 4 | low );
+        in += 3;
+    }
+
+    return std::make_pair( EResult::Ok, out );
+}
+
+/// A parameter as it is in the text, still percent-encoded.
+struct Param final
+{
+    std::string_view mKey;
+    /// Empty for a parameter without '='.
+    std::string_view mValue;
+};
+
+/// A set of keys known at compile time, to pick their values out of
+/// parameters in one pass.
+///
+/// \code
+/// static constexpr bt::KeySet keys{ "players", "map", "version" };
+/// const auto [players, map, version] = bt::Params{ reply }.extract( keys );
+/// \endcode
+template <size_t Size> class KeySet final
+{
+  public:
+    static_assert( Size != 0 && Size < UINT16_MAX );
+
+    template <typename... Keys>
+    constexpr explicit KeySet( const Keys&... keys ) noexcept
+        : mKeys{ std::string_view{ keys }... }
+    {
+        for ( size_t i = 0; i < Size; i++ )
+        {
+            auto slot = hash( mKeys[i] ) & ( table_size - 1 );
+
+            // Linear probing, the table is at least twice as large as the set.
+            while ( mSlots[slot] != 0 )
+            {
+                slot = ( slot + 1 ) & ( table_size - 1 );
+            }
+
+            mSlots[slot] = static_cast<uint16_t>( i + 1 );
+        }
+    }
+
+    /// \returns the index of the key in the set, `Size` if it is not there.
+    [[nodiscard]] constexpr size_t
+    find( const std::string_view key ) const noexcept
+    {
+        auto slot = hash( key ) & ( table_size - 1 );
+
+        while ( mSlots[slot] != 0 )
+        {
+            const auto index = mSlots[slot] - 1u;
+
+            if ( mKeys[index] == key )
+            {
+                return index;
+            }
+
+            slot = ( slot + 1 ) & ( table_size - 1 );
+        }
+
+        return Size;
+    }
+
+    [[nodiscard]] constexpr std::string_view
+    operator[]( const size_t index ) const noexcept
+    {
+        return mKeys[index];
+    }
+
+    [[nodiscard]] static constexpr size_t size() noexcept
+    {
+        return Size;
+    }
+
+  private:
+    static constexpr size_t table_size = std::bit_ceil( Size * 2 );
+
+    /// FNV-1a.
+    [[nodiscard]] static constexpr size_t
+    hash( const std::string_view key ) noexcept
+    {
+        uint32_t result = 2166136261u;
+
+        for ( const auto c : key )
+        {
+            result = ( result ^ static_cast<uint8_t>( c ) ) * 16777619u;
+        }
+
+        return result;
+    }
+
+    std::array<std::string_view, Size> mKeys;
+    /// Indices into `mKeys` plus one, zero for an empty slot.
+    std::array<uint16_t, table_size> mSlots{};
+};
+
+template <typename... Keys>
+KeySet( const Keys&... ) -> KeySet<sizeof...( Keys )>;
+
+/// A view of a "key=value&key2=value2" string, the way `list2params` makes
+/// it, that splits it into parameters without copying.
+///
+/// Keys and values stay percent-encoded until they are passed to
+/// `percent_decode_into`, most of them never need it. Empty parameters, as in
+/// "a=1&&b=2", are skipped.
+class Params final
+{
+  public:
+    class iterator final
+    {
+      public:
+        using value_type = Param;
+        using difference_type = std::ptrdiff_t;
+
+        constexpr iterator() noexcept = default;
+
+        constexpr explicit iterator( const std::string_view text ) noexcept
+            : mText( text ), mDone( false )
+        {
+            load( 0 );
+        }
+
+        [[nodiscard]] constexpr const Param& operator*() const noexcept
+        {
+            return mParam;
+        }
+
+        [[nodiscard]] constexpr const Param* operator->() const noexcept
+        {
+            return &mParam;
+        }
+
+        constexpr iterator& operator++() noexcept
+        {
+            load( mNext );
+
+            return *this;
+        }
+
+        constexpr iterator operator++( int ) noexcept
+        {
+            auto previous = *this;
+            ++*this;
+
+            return previous;
+        }
+
+        [[nodiscard]] constexpr bool
+        operator==( std::default_sentinel_t ) const noexcept
+        {
+            return mDone;
+        }
+
+        [[nodiscard]] constexpr bool
+        operator==( const iterator& other ) const noexcept
+        {
+            return mDone == other.mDone &&
+                   ( mDone || ( mText.data() == other.mText.data() &&
+                                mNext == other.mNext ) );
+        }
+
+      private:
+        constexpr void load( size_t from ) noexcept
+        {
+            while ( from < mText.size() && mText[from] == '&' )
+            {
+                from++;
+            }
+
+            if ( from >= mText.size() )
+            {
+                mDone = true;
+
+                return;
+            }
+
+            const auto key_end = detail::find_either( mText, from, '&', '=' );
+            auto end = key_end;
+
+            mParam.mKey = mText.substr( from, key_end - from );
+            mParam.mValue = {};
+
+            if ( key_end < mText.size() && mText[key_end] == '=' )
+            {
+                end = detail::find_either( mText, key_end + 1, '&', '&' );
+                mParam.mValue = mText.substr( key_end + 1, end - key_end - 1 );
+            }
+
+            mNext = end + 1;
+        }
+
+        std::string_view mText;
+        Param mParam;
+        size_t mNext = 0;
+        bool mDone = true;
+    };
+
+    constexpr explicit Params( const std::string_view text ) noexcept
+        : mText( text )
+    {
+    }
+
+    [[nodiscard]] constexpr iterator begin() const noexcept
+    {
+        return iterator{ mText };
+    }
+
+    [[nodiscard]] constexpr std::default_sentinel_t end() const noexcept
+    {
+        return std::default_sentinel;
+    }
+
+    /// \returns the still encoded value of the first parameter with the
+    /// key, compared as it is in the text.
+    [[nodiscard]] constexpr std::optional<std::string_view>
+    find( const std::string_view key ) const noexcept
+    {
+        for ( const auto& param : *this )
+        {
+            if ( param.mKey == key )
+            {
+                return param.mValue;
+            }
+        }
+
+        return std::nullopt;
+    }
+
+    /// Picks the values of the known keys in one pass, the first parameter
+    /// with a key wins. Keys are compared as they are in the text.
+    /// \returns the still encoded values in the order of the keys in the set.
+    template <size_t Size>
+    [[nodiscard]] constexpr std::array<std::optional<std::string_view>, Size>
+    extract( const KeySet<Size>& keys ) const noexcept
+    {
+        std::array<std::optional<std::string_view>, Size> values;
+        size_t left = Size;
+
+        for ( const auto& param : *this )
+        {
+            const auto index = keys.find( param.mKey );
+
+            if ( index != Size && !values[index] )
+            {
+                values[index] = param.mValue;
+
+                if ( --left == 0 )
+                {
+                    break;
+                }
+            }
+        }
+
+        return values;
+    }
+
+  private:
+    std::string_view mText;
+};
+
 } // namespace bt
@@ -0,0 +1,416 @@
+//-----------------------------------------------------------------------------
+// Copyright 2024 Igor Spichkin
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//-----------------------------------------------------------------------------
+
+#pragma once
+
+#include "bt/bt.hpp"
+#include <bit>
+#include <chrono>
+#include <concepts>
+#include <cstddef>
+#include <cstdint>
+#include <future>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <span>
+#include <string>
+#include <string_view>
+#include <type_traits>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+namespace bt
+{
+
+/// A reply that owns its bytes, so it can be kept and shared between threads.
+/// Keeps both the wire bytes, to relay them, and the decoded reply.
+class CachedReply final
+{
+  public:
+    /// \returns nullptr if the bytes are not exactly one valid reply.
+    [[nodiscard]] static std::shared_ptr<const CachedReply>
+    from_bytes( const std::span<const char> bytes )
+    {
+        std::shared_ptr<CachedReply> cached{ new CachedReply };
+        cached->mBytes.assign( bytes.begin(), bytes.end() );
+
+        Decoder decoder;
+        const auto [status, consumed] = decoder.feed( cached->mBytes );
+
+        if ( status != EDecodeStatus::Done || consumed != bytes.size() )
+        {
+            return nullptr;
+        }
+
+        cached->mReply = decoder.reply();
+
+        return cached;
+    }
+
+    /// Encodes the reply as the server would.
+    /// \returns nullptr if the string doesn't fit into a reply.
+    [[nodiscard]] static std::shared_ptr<const CachedReply>
+    from_reply( const Reply& reply )
+    {
+        std::vector<char> bytes{ '\x00', '\x83', '\x00', '\x00',
+                                 static_cast<char>( reply.mType ) };
+
+        switch ( reply.mType )
+        {
+        case EReplyType::String:
+            bytes.insert( bytes.end(), reply.mString.begin(),
+                          reply.mString.end() );
+            bytes.push_back( '\0' );
+            break;
+        case EReplyType::Float:
+        {
+            const auto bits = std::bit_cast<uint32_t>( reply.mFloat );
+
+            for ( size_t i = 0; i < 4; i++ )
+            {
+                bytes.push_back( static_cast<char>( bits >> ( i * 8 ) ) );
+            }
+            break;
+        }
+        case EReplyType::Null:
+            break;
+        default:
+            bytes.insert( bytes.end(), reply.mBytes.begin(),
+                          reply.mBytes.end() );
+            break;
+        }
+
+        // The length counts the type byte.
+        const auto length = bytes.size() - 4;
+
+        if ( length > UINT16_MAX )
+        {
+            return nullptr;
+        }
+
+        bytes[2] = static_cast<char>( length >> 8 );
+        bytes[3] = static_cast<char>( length );
+
+        return from_bytes( bytes );
+    }
+
+    /// \returns the decoded reply, its string points into `bytes()`.
+    [[nodiscard]] const Reply& reply() const noexcept
+    {
+        return mReply;
+    }
+
+    /// \returns the reply as it is sent on the wire.
+    [[nodiscard]] std::span<const char> bytes() const noexcept
+    {
+        return mBytes;
+    }
+
+    CachedReply( const CachedReply& ) = delete;
+    CachedReply& operator=( const CachedReply& ) = delete;
+
+  private:
+    CachedReply() noexcept = default;
+
+    std::vector<char> mBytes;
+    Reply mReply;
+};
+
+/// Which topics are cached and for how long. "<TOPIC>" matches the topic
+/// exactly, "<PREFIX>*" any topic that starts with the prefix, and the first
+/// matching rule wins. A TTL of zero only coalesces concurrent requests.
+/// Only add topics that don't change anything on the server.
+class CachePolicy final
+{
+  public:
+    using duration = std::chrono::steady_clock::duration;
+
+    void add( std::string pattern, const duration ttl )
+    {
+        mRules.push_back( Rule{ std::move( pattern ), ttl } );
+    }
+
+    /// \returns the TTL of the topic, nullopt if it is not cached.
+    [[nodiscard]] std::optional<duration>
+    ttl( const std::string_view topic ) const noexcept
+    {
+        for ( const auto& [pattern, ttl] : mRules )
+        {
+            const auto matches =
+                !pattern.empty() && pattern.back() == '*'
+                    ? topic.starts_with(
+                          std::string_view{ pattern }.substr(
+                              0, pattern.size() - 1 ) )
+                    : topic == pattern;
+
+            if ( matches )
+            {
+                return ttl;
+            }
+        }
+
+        return std::nullopt;
+    }
+
+    [[nodiscard]] bool empty() const noexcept
+    {
+        return mRules.empty();
+    }
+
+  private:
+    struct Rule final
+    {
+        std::string mPattern;
+        duration mTtl;
+    };
+
+    std::vector<Rule> mRules;
+};
+
+/// A thread-safe reply cache keyed by the target and the encoded topic, with
+/// a TTL per entry, a memory cap with least-recently-used eviction, and
+/// coalescing: while a topic is being fetched, identical requests wait for
+/// that reply instead of sending their own.
+class ReplyCache final
+{
+  public:
+    using clock = std::chrono::steady_clock;
+    using value_type = std::shared_ptr<const CachedReply>;
+
+    /// Bookkeeping counted for every entry on top of its key and reply.
+    static constexpr size_t entry_overhead_v = 128;
+
+    /// \param max_bytes the memory the entries may take, counting the keys,
+    /// the replies and `entry_overhead_v` per entry.
+    explicit ReplyCache( const size_t max_bytes ) noexcept
+        : mMaxBytes{ max_bytes }
+    {
+    }
+
+    ReplyCache( const ReplyCache& ) = delete;
+    ReplyCache& operator=( const ReplyCache& ) = delete;
+
+    /// \returns the reply if it is cached and fresh, nullptr otherwise.
+    [[nodiscard]] value_type find( const std::string_view target,
+                                   const std::span<const char> topic )
+    {
+        const auto key = make_key( target, topic );
+        const std::lock_guard lock{ mMutex };
+
+        return find_locked( key, clock::now() );
+    }
+
+    /// Caches the reply for `ttl`, replacing an older one. Does nothing for a
+    /// zero TTL or a reply larger than the whole cache.
+    void insert( const std::string_view target,
+                 const std::span<const char> topic, value_type reply,
+                 const clock::duration ttl )
+    {
+        auto key = make_key( target, topic );
+        const std::lock_guard lock{ mMutex };
+
+        insert_locked( std::move( key ), std::move( reply ), ttl );
+    }
+
+    /// \returns the cached reply, or the one `fetch` returns. Only one of the
+    /// concurrent calls for the same key runs `fetch`, the others wait for
+    /// its result, nullptr included. The reply is cached for `ttl` unless
+    /// it is nullptr.
+    template <typename Fetch>
+        requires std::convertible_to<std::invoke_result_t<Fetch&>, value_type>
+    [[nodiscard]] value_type
+    get_or_fetch( const std::string_view target,
+                  const std::span<const char> topic, const clock::duration ttl,
+                  Fetch&& fetch )
+    {
+        auto key = make_key( target, topic );
+        std::promise<value_type> promise;
+
+        {
+            std::unique_lock lock{ mMutex };
+
+            if ( auto cached = find_locked( key, clock::now() ) )
+            {
+                return cached;
+            }
+
+            if ( const auto it = mFlights.find( key ); it != mFlights.end() )
+            {
+                const auto flight = it->second;
+                lock.unlock();
+
+                return flight.get();
+            }
+
+            mFlights.emplace( key, promise.get_future().share() );
+        }
+
+        value_type reply;
+
+        try
+        {
+            reply = fetch();
+        }
+        catch ( ... )
+        {
+            {
+                const std::lock_guard lock{ mMutex };
+                mFlights.erase( key );
+            }
+
+            promise.set_exception( std::current_exception() );
+
+            throw;
+        }
+
+        {
+            const std::lock_guard lock{ mMutex };
+            mFlights.erase( key );
+
+            if ( reply != nullptr )
+            {
+                insert_locked( std::move( key ), reply, ttl );
+            }
+        }
+
+        promise.set_value( reply );
+
+        return reply;
+    }
+
+    /// \returns the number of cached replies.
+    [[nodiscard]] size_t size() const
+    {
+        const std::lock_guard lock{ mMutex };
+
+        return mIndex.size();
+    }
+
+    /// \returns the memory the entries take, as counted against the cap.
+    [[nodiscard]] size_t size_bytes() const
+    {
+        const std::lock_guard lock{ mMutex };
+
+        return mBytes;
+    }
+
+  private:
+    struct Entry final
+    {
+        std::string mKey;
+        value_type mReply;
+        clock::time_point mExpires;
+    };
+
+    using Lru = std::list<Entry>;
+
+    /// A NUL can't be a part of the target, so the key is unambiguous.
+    [[nodiscard]] static std::string
+    make_key( const std::string_view target, const std::span<const char> topic )
+    {
+        std::string key;
+        key.reserve( target.size() + 1 + topic.size() );
+        key += target;
+        key += '\0';
+        key.append( topic.data(), topic.size() );
+
+        return key;
+    }
+
+    [[nodiscard]] static size_t cost( const Entry& entry ) noexcept
+    {
+        return entry.mKey.size() + entry.mReply->bytes().size() +
+               entry_overhead_v;
+    }
+
+    [[nodiscard]] value_type find_locked( const std::string_view key,
+                                          const clock::time_point now )
+    {
+        const auto it = mIndex.find( key );
+
+        if ( it == mIndex.end() )
+        {
+            return nullptr;
+        }
+
+        if ( it->second->mExpires <= now )
+        {
+            erase_locked( it->second );
+
+            return nullptr;
+        }
+
+        // The most recently used entries are at the front.
+        mLru.splice( mLru.begin(), mLru, it->second );
+
+        return it->second->mReply;
+    }
+
+    void insert_locked( std::string key, value_type reply,
+                        const clock::duration ttl )
+    {
+        if ( ttl <= clock::duration::zero() || reply == nullptr )
+        {
+            return;
+        }
+
+        if ( const auto it = mIndex.find( key ); it != mIndex.end() )
+        {
+            erase_locked( it->second );
+        }
+
+        mLru.push_front( Entry{ .mKey = std::move( key ),
+                                .mReply = std::move( reply ),
+                                .mExpires = clock::now() + ttl } );
+
+        const auto entry = mLru.begin();
+        const auto entry_cost = cost( *entry );
+
+        if ( entry_cost > mMaxBytes )
+        {
+            mLru.pop_front();
+
+            return;
+        }
+
+        mIndex.emplace( entry->mKey, entry );
+        mBytes += entry_cost;
+
+        while ( mBytes > mMaxBytes )
+        {
+            erase_locked( std::prev( mLru.end() ) );
+        }
+    }
+
+    void erase_locked( const Lru::iterator entry )
+    {
+        mBytes -= cost( *entry );
+        mIndex.erase( entry->mKey );
+        mLru.erase( entry );
+    }
+
+    size_t mMaxBytes;
+    mutable std::mutex mMutex;
+    size_t mBytes = 0;
+    Lru mLru;
+    /// The keys point into the entries of `mLru`.
+    std::unordered_map<std::string_view, Lru::iterator> mIndex;
+    std::unordered_map<std::string, std::shared_future<value_type>> mFlights;
+};
+
+} // namespace bt
@@ -0,0 +1,299 @@
+//-----------------------------------------------------------------------------
+// Copyright 2024 Igor Spichkin
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//-----------------------------------------------------------------------------
+
+#include "script.hpp"
+#include "server.hpp"
+#include <chrono>
+#include <format>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+void PrintHelp() noexcept
+{
+    std::cout
+        << "Usage: bt-mockd [--listen <NODE>:<PORT>] [--unix <PATH>] "
+           "[--script <FILE>]\n"
+           "                [--reply <REPLY>] [--latency <T>] [--jitter <T>]\n"
+           "                [--fail <RATE>] [--fail-mode <MODE>] [--close]\n"
+           "                [--threads <N>] [--seed <N>]\n"
+           "\n"
+           "A mock BYOND world that answers topics from a script.\n"
+           "\n"
+           "  --listen     TCP address, 127.0.0.1:2506 by default\n"
+           "  --unix       also listen on a Unix socket\n"
+           "  --script     \"<TOPIC> <REPLY>\" lines, a trailing '*' in the "
+           "topic matches\n"
+           "               any suffix, the first matching line wins\n"
+           "  --reply      the reply to topics that match no line, \"echo\" "
+           "by default\n"
+           "  --latency    delay every reply (\"500us\", \"20ms\", \"1s\", "
+           "seconds by default)\n"
+           "  --jitter     add a random delay up to <T>\n"
+           "  --fail       the share of topics that fail, from 0 to 1\n"
+           "  --fail-mode  close (default), truncate, garbage or hang\n"
+           "  --close      close the connection after every reply\n"
+           "  --threads    worker threads, one per CPU by default\n"
+           "  --seed       seed the latency and failure generators\n"
+           "\n"
+           "Replies: \"string <TEXT>\", \"float <NUMBER>\", \"null\" or "
+           "\"echo\".\n"
+           "\n"
+           "Example script:\n"
+           "  ?ping      float 1\n"
+           "  ?status*   string version=1&players=0\n"
+           "  ?shutdown  null\n";
+}
+
+[[noreturn]] void InvalidCommand( const std::string& message ) noexcept
+{
+    std::cout << message << '\n';
+
+    PrintHelp();
+
+    std::exit( -1 );
+}
+
+/// Parses "<NUMBER>[us|ms|s]", seconds if there is no unit.
+[[nodiscard]] std::chrono::microseconds
+ParseDuration( const std::string& option, const std::string& value ) noexcept
+{
+    double number = -1;
+    size_t end = 0;
+
+    try
+    {
+        number = std::stod( value, &end );
+    }
+    catch ( const std::exception& )
+    {
+    }
+
+    const auto unit = std::string_view{ value }.substr( end );
+    double scale = -1;
+
+    if ( unit == "us" )
+    {
+        scale = 1;
+    }
+    else if ( unit == "ms" )
+    {
+        scale = 1000;
+    }
+    else if ( unit.empty() || unit == "s" )
+    {
+        scale = 1000 * 1000;
+    }
+
+    if ( number < 0 || scale < 0 )
+    {
+        InvalidCommand(
+            std::format( "Invalid command: invalid {}: {}", option, value ) );
+    }
+
+    return std::chrono::microseconds{
+        static_cast<std::chrono::microseconds::rep>( number * scale ) };
+}
+
+[[nodiscard]] btmockd::CServer ParseArgs( const int argc,
+                                          const char* argv[] ) noexcept
+{
+    btmockd::ServerOptions options{ .mThreads = std::max(
+                                        std::thread::hardware_concurrency(),
+                                        1u ) };
+    btmockd::CScript script;
+    btmockd::Rule fallback;
+
+    std::vector<std::string> args( argv + 1, argv + argc );
+
+    const auto value = [&]( size_t& i ) -> const std::string&
+    {
+        if ( i + 1 == args.size() )
+        {
+            InvalidCommand( std::format( "Invalid command: {} requires a value",
+                                         args[i] ) );
+        }
+
+        return args[++i];
+    };
+
+    for ( size_t i = 0; i < args.size(); i++ )
+    {
+        const auto& arg = args[i];
+
+        if ( arg == "--help" )
+        {
+            PrintHelp();
+
+            std::exit( 0 );
+        }
+        else if ( arg == "--listen" )
+        {
+            const auto& address = value( i );
+            const auto del = address.find_last_of( ':' );
+
+            if ( del == std::string::npos )
+            {
+                InvalidCommand(
+                    std::format( "Invalid address: {}", address ) );
+            }
+
+            options.mNode = address.substr( 0, del );
+            options.mPort = address.substr( del + 1 );
+        }
+        else if ( arg == "--unix" )
+        {
+            options.mUnixPath = value( i );
+        }
+        else if ( arg == "--script" )
+        {
+            const auto& path = value( i );
+            std::ifstream file{ path };
+
+            if ( !file )
+            {
+                InvalidCommand(
+                    std::format( "Can't open the file: {}", path ) );
+            }
+
+            if ( const auto line = script.Load( file ); line != 0 )
+            {
+                InvalidCommand(
+                    std::format( "Invalid rule at {}:{}", path, line ) );
+            }
+        }
+        else if ( arg == "--reply" )
+        {
+            const auto& spec = value( i );
+            const auto rule = btmockd::ParseReply( spec );
+
+            if ( !rule )
+            {
+                InvalidCommand( std::format(
+                    "Invalid command: invalid --reply: {}", spec ) );
+            }
+
+            fallback = *rule;
+        }
+        else if ( arg == "--latency" )
+        {
+            options.mLatency = ParseDuration( arg, value( i ) );
+        }
+        else if ( arg == "--jitter" )
+        {
+            options.mJitter = ParseDuration( arg, value( i ) );
+        }
+        else if ( arg == "--fail" )
+        {
+            const auto& rate = value( i );
+
+            try
+            {
+                options.mFailRate = std::stod( rate );
+            }
+            catch ( const std::exception& )
+            {
+                options.mFailRate = -1;
+            }
+
+            if ( !( options.mFailRate >= 0 && options.mFailRate <= 1 ) )
+            {
+                InvalidCommand( std::format(
+                    "Invalid command: invalid --fail: {}", rate ) );
+            }
+        }
+        else if ( arg == "--fail-mode" )
+        {
+            const auto& mode = value( i );
+
+            if ( mode == "close" )
+            {
+                options.mFailure = btmockd::EFailure::Close;
+            }
+            else if ( mode == "truncate" )
+            {
+                options.mFailure = btmockd::EFailure::Truncate;
+            }
+            else if ( mode == "garbage" )
+            {
+                options.mFailure = btmockd::EFailure::Garbage;
+            }
+            else if ( mode == "hang" )
+            {
+                options.mFailure = btmockd::EFailure::Hang;
+            }
+            else
+            {
+                InvalidCommand( std::format(
+                    "Invalid command: invalid --fail-mode: {}", mode ) );
+            }
+        }
+        else if ( arg == "--close" )
+        {
+            options.mClose = true;
+        }
+        else if ( arg == "--threads" || arg == "--seed" )
+        {
+            const auto& number = value( i );
+            uint64_t parsed = 0;
+
+            try
+            {
+                parsed = std::stoull( number );
+            }
+            catch ( const std::exception& )
+            {
+                InvalidCommand( std::format( "Invalid command: invalid {}: {}",
+                                             arg, number ) );
+            }
+
+            if ( arg == "--seed" )
+            {
+                options.mSeed = parsed;
+            }
+            else if ( parsed != 0 )
+            {
+                options.mThreads = parsed;
+            }
+            else
+            {
+                InvalidCommand( std::format( "Invalid command: invalid {}: {}",
+                                             arg, number ) );
+            }
+        }
+        else
+        {
+            InvalidCommand( std::format( "Unknown argument: {}", arg ) );
+        }
+    }
+
+    // Topics that match no scripted rule.
+    script.Add( std::move( fallback ) );
+
+    return btmockd::CServer{ std::move( options ), std::move( script ) };
+}
+
+int main( const int argc, const char* argv[] )
+{
+    auto server = ParseArgs( argc, argv );
+
+    server.Listen();
+    server.Run();
+
+    return 0;
+}
@@ -0,0 +1,216 @@
+//-----------------------------------------------------------------------------
+// Copyright 2024 Igor Spichkin
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//-----------------------------------------------------------------------------
+
+#include "script.hpp"
+#include <algorithm>
+#include <array>
+#include <bit>
+#include <cstdint>
+#include <exception>
+
+namespace btmockd
+{
+
+namespace
+{
+
+/// The longest string that fits into a reply with its trailing NUL.
+inline constexpr size_t max_string_size_v = UINT16_MAX - 2;
+
+[[nodiscard]] std::string_view Trim( std::string_view text ) noexcept
+{
+    const auto begin = text.find_first_not_of( " \t\r" );
+
+    if ( begin == std::string_view::npos )
+    {
+        return {};
+    }
+
+    const auto end = text.find_last_not_of( " \t\r" );
+
+    return text.substr( begin, end - begin + 1 );
+}
+
+void AppendString( std::vector<char>& out, const std::string_view text )
+{
+    std::vector<char> body( text.begin(), text.end() );
+    body.push_back( '\0' );
+
+    AppendReply( out, bt::EReplyType::String, body );
+}
+
+} // namespace
+
+bool Rule::Matches( const std::string_view topic ) const noexcept
+{
+    if ( mTopic.ends_with( '*' ) )
+    {
+        return topic.starts_with(
+            std::string_view{ mTopic }.substr( 0, mTopic.size() - 1 ) );
+    }
+
+    return topic == mTopic;
+}
+
+std::optional<Rule> ParseReply( std::string_view spec ) noexcept
+{
+    spec = Trim( spec );
+
+    const auto del = spec.find_first_of( " \t" );
+    const auto type = spec.substr( 0, del );
+    const auto value =
+        del == std::string_view::npos ? std::string_view{}
+                                      : Trim( spec.substr( del + 1 ) );
+
+    Rule rule;
+
+    if ( type == "echo" && value.empty() )
+    {
+        rule.mReply = EReply::Echo;
+    }
+    else if ( type == "null" && value.empty() )
+    {
+        rule.mReply = EReply::Null;
+    }
+    else if ( type == "string" && value.size() <= max_string_size_v )
+    {
+        rule.mReply = EReply::String;
+        rule.mString = value;
+    }
+    else if ( type == "float" )
+    {
+        rule.mReply = EReply::Float;
+
+        try
+        {
+            size_t end;
+            rule.mFloat = std::stof( std::string{ value }, &end );
+
+            if ( end != value.size() )
+            {
+                return std::nullopt;
+            }
+        }
+        catch ( const std::exception& )
+        {
+            return std::nullopt;
+        }
+    }
+    else
+    {
+        return std::nullopt;
+    }
+
+    return rule;
+}
+
+void AppendReply( std::vector<char>& out, const bt::EReplyType type,
+                  const std::span<const char> body ) noexcept
+{
+    // The length includes the type byte.
+    const auto length = static_cast<uint16_t>( body.size() + 1 );
+
+    out.push_back( '\x00' );
+    out.push_back( '\x83' );
+    out.push_back( static_cast<char>( length >> 8 ) );
+    out.push_back( static_cast<char>( length ) );
+    out.push_back( static_cast<char>( type ) );
+    out.insert( out.end(), body.begin(), body.end() );
+}
+
+size_t CScript::Load( std::istream& input ) noexcept
+{
+    std::string line;
+    size_t number = 0;
+
+    while ( std::getline( input, line ) )
+    {
+        number++;
+
+        const auto text = Trim( std::string_view{ line } );
+
+        if ( text.empty() || text.starts_with( '#' ) )
+        {
+            continue;
+        }
+
+        const auto del = text.find_first_of( " \t" );
+
+        if ( del == std::string_view::npos )
+        {
+            return number;
+        }
+
+        auto rule = ParseReply( text.substr( del + 1 ) );
+
+        if ( !rule )
+        {
+            return number;
+        }
+
+        rule->mTopic = text.substr( 0, del );
+
+        Add( std::move( *rule ) );
+    }
+
+    return 0;
+}
+
+void CScript::Add( Rule rule ) noexcept
+{
+    mRules.push_back( std::move( rule ) );
+}
+
+void CScript::Reply( const std::string_view topic,
+                     std::vector<char>& out ) const noexcept
+{
+    const auto rule = std::find_if( mRules.begin(), mRules.end(),
+                                    [&]( const Rule& rule )
+                                    { return rule.Matches( topic ); } );
+
+    if ( rule == mRules.end() )
+    {
+        AppendString( out, topic );
+
+        return;
+    }
+
+    switch ( rule->mReply )
+    {
+    case EReply::Null:
+        AppendReply( out, bt::EReplyType::Null, {} );
+        break;
+    case EReply::String:
+        AppendString( out, rule->mString );
+        break;
+    case EReply::Float:
+    {
+        // Floats are little-endian on the wire.
+        const auto bits = std::bit_cast<uint32_t>( rule->mFloat );
+        const std::array body{ static_cast<char>( bits ),
+                               static_cast<char>( bits >> 8 ),
+                               static_cast<char>( bits >> 16 ),
+                               static_cast<char>( bits >> 24 ) };
+
+        AppendReply( out, bt::EReplyType::Float, body );
+        break;
+    }
+    case EReply::Echo:
+        AppendString( out, topic );
+        break;
+    }
+}
+
+} // namespace btmockd
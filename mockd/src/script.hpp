@@ -0,0 +1,76 @@
+//-----------------------------------------------------------------------------
+// Copyright 2024 Igor Spichkin
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//-----------------------------------------------------------------------------
+
+#pragma once
+
+#include "bt/bt.hpp"
+#include <istream>
+#include <optional>
+#include <span>
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace btmockd
+{
+
+enum class EReply
+{
+    Null,
+    String,
+    Float,
+    /// A string with the topic itself.
+    Echo
+};
+
+struct Rule final
+{
+    /// The topic to match, a trailing '*' matches any suffix.
+    std::string mTopic = "*";
+    EReply mReply = EReply::Echo;
+    std::string mString;
+    float mFloat = 0;
+
+    [[nodiscard]] bool Matches( std::string_view topic ) const noexcept;
+};
+
+/// Parses a reply: "string <TEXT>", "float <NUMBER>", "null" or "echo".
+/// \returns std::nullopt if the reply is invalid.
+[[nodiscard]] std::optional<Rule> ParseReply( std::string_view spec ) noexcept;
+
+/// Appends a reply packet as a BYOND server sends it.
+void AppendReply( std::vector<char>& out, bt::EReplyType type,
+                  std::span<const char> body ) noexcept;
+
+/// Replies to topics by the first matching rule.
+class CScript final
+{
+  public:
+    /// Reads "<TOPIC> <REPLY>" lines, '#' starts a comment.
+    /// \returns the number of the first invalid line, 0 if all are valid.
+    size_t Load( std::istream& input ) noexcept;
+
+    void Add( Rule rule ) noexcept;
+
+    /// Appends the encoded reply to the topic, topics that match no rule are
+    /// echoed.
+    void Reply( std::string_view topic,
+                std::vector<char>& out ) const noexcept;
+
+  private:
+    std::vector<Rule> mRules;
+};
+
+} // namespace btmockd
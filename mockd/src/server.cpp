@@ -0,0 +1,645 @@
+//-----------------------------------------------------------------------------
+// Copyright 2024 Igor Spichkin
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//-----------------------------------------------------------------------------
+
+#include "server.hpp"
+#include <algorithm>
+#include <array>
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <format>
+#include <iostream>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <queue>
+#include <random>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <thread>
+#include <unistd.h>
+#include <unordered_map>
+
+namespace btmockd
+{
+
+namespace
+{
+
+using Clock = std::chrono::steady_clock;
+
+/// A topic packet: the magic, the length, 5 bytes of padding, the message and
+/// a trailing NUL.
+inline constexpr size_t request_header_size_v = 4;
+inline constexpr size_t request_padding_v = 5;
+
+[[noreturn]] void Fail( const std::string& message ) noexcept
+{
+    std::cout << std::format( "{}: error {}\n", message, errno );
+
+    std::exit( -1 );
+}
+
+void SetNonBlocking( const int socket ) noexcept
+{
+    const auto flags = fcntl( socket, F_GETFL );
+
+    if ( flags == -1 || fcntl( socket, F_SETFL, flags | O_NONBLOCK ) == -1 )
+    {
+        Fail( "Can't make a socket non-blocking" );
+    }
+}
+
+//-----------------------------------------------------------------------------
+// CWorker
+//-----------------------------------------------------------------------------
+
+class CWorker final
+{
+  public:
+    CWorker( const ServerOptions& options, const CScript& script,
+             const std::vector<int>& listeners, const uint64_t seed ) noexcept
+        : mOptions( options ), mScript( script ), mListeners( listeners ),
+          mRandom( seed ), mNextId( listeners.size() )
+    {
+    }
+
+    ~CWorker()
+    {
+        for ( const auto& [id, connection] : mConnections )
+        {
+            close( connection.mSocket );
+        }
+
+        if ( mEpoll != -1 )
+        {
+            close( mEpoll );
+        }
+    }
+
+    void Run() noexcept
+    {
+        mEpoll = epoll_create1( EPOLL_CLOEXEC );
+
+        if ( mEpoll == -1 )
+        {
+            Fail( "epoll_create1" );
+        }
+
+        // Listeners are identified by their index, connections by an id past
+        // them. EPOLLEXCLUSIVE wakes only one of the workers per connection.
+        for ( size_t i = 0; i < mListeners.size(); i++ )
+        {
+            epoll_event event{ .events = EPOLLIN | EPOLLEXCLUSIVE,
+                               .data = { .u64 = i } };
+
+            if ( epoll_ctl( mEpoll, EPOLL_CTL_ADD, mListeners[i], &event ) ==
+                 -1 )
+            {
+                Fail( "epoll_ctl" );
+            }
+        }
+
+        std::array<epoll_event, 64> events;
+
+        while ( true )
+        {
+            const auto count = epoll_wait( mEpoll, events.data(),
+                                           events.size(), Timeout() );
+
+            if ( count == -1 && errno != EINTR )
+            {
+                Fail( "epoll_wait" );
+            }
+
+            for ( int i = 0; i < count; i++ )
+            {
+                const auto id = events[i].data.u64;
+
+                if ( id < mListeners.size() )
+                {
+                    Accept( mListeners[id] );
+                }
+                else
+                {
+                    OnEvent( id, events[i].events );
+                }
+            }
+
+            DeliverDue();
+        }
+    }
+
+  private:
+    struct Connection final
+    {
+        int mSocket = -1;
+        std::vector<char> mInput;
+        std::vector<char> mOutput;
+        size_t mSent = 0;
+        /// Replies are sent in the order of topics even with jitter.
+        Clock::time_point mLastDue;
+        /// Close once the output is sent.
+        bool mClosing = false;
+        bool mWaitingWritable = false;
+    };
+
+    struct Delayed final
+    {
+        Clock::time_point mDue;
+        /// Breaks ties so equal deadlines keep their order.
+        uint64_t mSequence;
+        uint64_t mId;
+        std::vector<char> mBytes;
+        bool mClose;
+
+        bool operator>( const Delayed& other ) const noexcept
+        {
+            return mDue != other.mDue ? mDue > other.mDue
+                                      : mSequence > other.mSequence;
+        }
+    };
+
+    /// \returns the epoll timeout until the nearest delayed reply.
+    [[nodiscard]] int Timeout() const noexcept
+    {
+        if ( mDelayed.empty() )
+        {
+            return -1;
+        }
+
+        const auto left = mDelayed.top().mDue - Clock::now();
+
+        if ( left <= Clock::duration::zero() )
+        {
+            return 0;
+        }
+
+        return static_cast<int>(
+            std::chrono::ceil<std::chrono::milliseconds>( left ).count() );
+    }
+
+    void Accept( const int listener ) noexcept
+    {
+        while ( true )
+        {
+            const auto socket =
+                accept4( listener, nullptr, nullptr,
+                         SOCK_NONBLOCK | SOCK_CLOEXEC );
+
+            if ( socket == -1 )
+            {
+                // EAGAIN, or the connection was reset before it was accepted.
+                return;
+            }
+
+            // Fails harmlessly on Unix sockets.
+            const int one = 1;
+            setsockopt( socket, IPPROTO_TCP, TCP_NODELAY, &one, sizeof( one ) );
+
+            const auto id = mNextId++;
+            epoll_event event{ .events = EPOLLIN | EPOLLRDHUP,
+                               .data = { .u64 = id } };
+
+            if ( epoll_ctl( mEpoll, EPOLL_CTL_ADD, socket, &event ) == -1 )
+            {
+                close( socket );
+
+                continue;
+            }
+
+            mConnections.emplace( id, Connection{ .mSocket = socket } );
+        }
+    }
+
+    void OnEvent( const uint64_t id, const uint32_t events ) noexcept
+    {
+        const auto it = mConnections.find( id );
+
+        if ( it == mConnections.end() )
+        {
+            return;
+        }
+
+        if ( ( events & EPOLLOUT ) != 0 && !Flush( id, it->second ) )
+        {
+            return;
+        }
+
+        if ( ( events & ( EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR ) ) != 0 )
+        {
+            Read( id, it->second );
+        }
+    }
+
+    void Read( const uint64_t id, Connection& connection ) noexcept
+    {
+        std::array<char, 16 * 1024> chunk;
+
+        while ( true )
+        {
+            const auto read =
+                recv( connection.mSocket, chunk.data(), chunk.size(), 0 );
+
+            if ( read > 0 )
+            {
+                connection.mInput.insert( connection.mInput.end(),
+                                          chunk.data(), chunk.data() + read );
+
+                continue;
+            }
+
+            if ( read == -1 && ( errno == EAGAIN || errno == EWOULDBLOCK ) )
+            {
+                break;
+            }
+
+            if ( read == -1 && errno == EINTR )
+            {
+                continue;
+            }
+
+            // The client is gone, there is nobody to reply to.
+            Close( id );
+
+            return;
+        }
+
+        size_t offset = 0;
+        const auto& input = connection.mInput;
+
+        while ( input.size() - offset >= request_header_size_v )
+        {
+            const auto* packet = input.data() + offset;
+
+            if ( packet[0] != '\x00' || packet[1] != '\x83' )
+            {
+                Close( id );
+
+                return;
+            }
+
+            const auto length = static_cast<size_t>(
+                ( static_cast<uint8_t>( packet[2] ) << 8 ) |
+                static_cast<uint8_t>( packet[3] ) );
+
+            if ( length < request_padding_v )
+            {
+                Close( id );
+
+                return;
+            }
+
+            if ( input.size() - offset < request_header_size_v + length )
+            {
+                break;
+            }
+
+            std::string_view topic{
+                packet + request_header_size_v + request_padding_v,
+                length - request_padding_v };
+
+            if ( const auto nul = topic.find( '\0' );
+                 nul != std::string_view::npos )
+            {
+                topic = topic.substr( 0, nul );
+            }
+
+            offset += request_header_size_v + length;
+
+            if ( !OnTopic( id, connection, topic ) )
+            {
+                return;
+            }
+        }
+
+        connection.mInput.erase( connection.mInput.begin(),
+                                 connection.mInput.begin() + offset );
+    }
+
+    /// \returns false if the connection was closed.
+    bool OnTopic( const uint64_t id, Connection& connection,
+                  const std::string_view topic ) noexcept
+    {
+        std::vector<char> reply;
+        mScript.Reply( topic, reply );
+
+        auto close = mOptions.mClose;
+
+        if ( mOptions.mFailRate > 0 &&
+             std::bernoulli_distribution{ mOptions.mFailRate }( mRandom ) )
+        {
+            switch ( mOptions.mFailure )
+            {
+            case EFailure::Close:
+                reply.clear();
+                close = true;
+                break;
+            case EFailure::Truncate:
+                reply.resize( reply.size() / 2 );
+                close = true;
+                break;
+            case EFailure::Garbage:
+                reply[0] = '\x01';
+                reply[1] = '\x02';
+                break;
+            case EFailure::Hang:
+                return true;
+            }
+        }
+
+        auto delay = std::chrono::duration_cast<Clock::duration>(
+            mOptions.mLatency );
+
+        if ( mOptions.mJitter.count() > 0 )
+        {
+            delay += std::chrono::duration_cast<Clock::duration>(
+                std::chrono::microseconds{
+                    std::uniform_int_distribution<int64_t>{
+                        0, mOptions.mJitter.count() }( mRandom ) } );
+        }
+
+        if ( delay == Clock::duration::zero() &&
+             connection.mLastDue <= Clock::now() )
+        {
+            return Deliver( id, connection, reply, close );
+        }
+
+        const auto due = std::max( Clock::now() + delay, connection.mLastDue );
+        connection.mLastDue = due;
+
+        mDelayed.push( Delayed{ .mDue = due,
+                                .mSequence = mSequence++,
+                                .mId = id,
+                                .mBytes = std::move( reply ),
+                                .mClose = close } );
+
+        return true;
+    }
+
+    void DeliverDue() noexcept
+    {
+        const auto now = Clock::now();
+
+        while ( !mDelayed.empty() && mDelayed.top().mDue <= now )
+        {
+            // The queue only gives const access to the top.
+            auto delayed = std::move( const_cast<Delayed&>( mDelayed.top() ) );
+            mDelayed.pop();
+
+            if ( const auto it = mConnections.find( delayed.mId );
+                 it != mConnections.end() )
+            {
+                Deliver( delayed.mId, it->second, delayed.mBytes,
+                         delayed.mClose );
+            }
+        }
+    }
+
+    /// \returns false if the connection was closed.
+    bool Deliver( const uint64_t id, Connection& connection,
+                  const std::vector<char>& bytes, const bool close ) noexcept
+    {
+        connection.mOutput.insert( connection.mOutput.end(), bytes.begin(),
+                                   bytes.end() );
+        connection.mClosing |= close;
+
+        return Flush( id, connection );
+    }
+
+    /// \returns false if the connection was closed.
+    bool Flush( const uint64_t id, Connection& connection ) noexcept
+    {
+        while ( connection.mSent < connection.mOutput.size() )
+        {
+            const auto sent =
+                send( connection.mSocket,
+                      connection.mOutput.data() + connection.mSent,
+                      connection.mOutput.size() - connection.mSent,
+                      MSG_NOSIGNAL );
+
+            if ( sent == -1 && errno == EINTR )
+            {
+                continue;
+            }
+
+            if ( sent == -1 && ( errno == EAGAIN || errno == EWOULDBLOCK ) )
+            {
+                return WaitWritable( id, connection, true );
+            }
+
+            if ( sent == -1 )
+            {
+                Close( id );
+
+                return false;
+            }
+
+            connection.mSent += sent;
+        }
+
+        connection.mOutput.clear();
+        connection.mSent = 0;
+
+        if ( connection.mClosing )
+        {
+            Close( id );
+
+            return false;
+        }
+
+        return WaitWritable( id, connection, false );
+    }
+
+    /// \returns false if the connection was closed.
+    bool WaitWritable( const uint64_t id, Connection& connection,
+                       const bool wait ) noexcept
+    {
+        if ( connection.mWaitingWritable == wait )
+        {
+            return true;
+        }
+
+        epoll_event event{ .events = EPOLLIN | EPOLLRDHUP |
+                                     ( wait ? EPOLLOUT : 0u ),
+                           .data = { .u64 = id } };
+
+        if ( epoll_ctl( mEpoll, EPOLL_CTL_MOD, connection.mSocket, &event ) ==
+             -1 )
+        {
+            Close( id );
+
+            return false;
+        }
+
+        connection.mWaitingWritable = wait;
+
+        return true;
+    }
+
+    void Close( const uint64_t id ) noexcept
+    {
+        const auto it = mConnections.find( id );
+
+        // Closing the socket also removes it from the epoll set.
+        close( it->second.mSocket );
+        mConnections.erase( it );
+    }
+
+    const ServerOptions& mOptions;
+    const CScript& mScript;
+    const std::vector<int>& mListeners;
+    std::mt19937_64 mRandom;
+    int mEpoll = -1;
+    uint64_t mNextId;
+    uint64_t mSequence = 0;
+    std::unordered_map<uint64_t, Connection> mConnections;
+    std::priority_queue<Delayed, std::vector<Delayed>, std::greater<>>
+        mDelayed;
+};
+
+} // namespace
+
+//-----------------------------------------------------------------------------
+// CServer
+//-----------------------------------------------------------------------------
+
+CServer::CServer( ServerOptions options, CScript script ) noexcept
+    : mOptions( std::move( options ) ), mScript( std::move( script ) )
+{
+}
+
+CServer::~CServer()
+{
+    for ( const auto listener : mListeners )
+    {
+        close( listener );
+    }
+
+    if ( !mOptions.mUnixPath.empty() )
+    {
+        unlink( mOptions.mUnixPath.c_str() );
+    }
+}
+
+void CServer::Listen() noexcept
+{
+    addrinfo hints{ .ai_flags = AI_PASSIVE,
+                    .ai_family = AF_UNSPEC,
+                    .ai_socktype = SOCK_STREAM };
+    addrinfo* addrInfo = nullptr;
+
+    if ( const auto error = getaddrinfo( mOptions.mNode.c_str(),
+                                         mOptions.mPort.c_str(), &hints,
+                                         &addrInfo );
+         error != 0 )
+    {
+        std::cout << std::format( "getaddrinfo error: {}\n", error );
+
+        std::exit( -1 );
+    }
+
+    const auto tcp = socket( addrInfo->ai_family,
+                             addrInfo->ai_socktype | SOCK_CLOEXEC,
+                             addrInfo->ai_protocol );
+
+    if ( tcp == -1 )
+    {
+        Fail( "Can't create a socket" );
+    }
+
+    const int one = 1;
+    setsockopt( tcp, SOL_SOCKET, SO_REUSEADDR, &one, sizeof( one ) );
+
+    if ( bind( tcp, addrInfo->ai_addr, addrInfo->ai_addrlen ) == -1 )
+    {
+        Fail( std::format( "Can't bind {}:{}", mOptions.mNode,
+                           mOptions.mPort ) );
+    }
+
+    freeaddrinfo( addrInfo );
+    mListeners.push_back( tcp );
+
+    if ( !mOptions.mUnixPath.empty() )
+    {
+        sockaddr_un address{ .sun_family = AF_UNIX };
+
+        if ( mOptions.mUnixPath.size() >= sizeof( address.sun_path ) )
+        {
+            std::cout << std::format( "The socket path is too long: {}\n",
+                                      mOptions.mUnixPath );
+
+            std::exit( -1 );
+        }
+
+        std::memcpy( address.sun_path, mOptions.mUnixPath.c_str(),
+                     mOptions.mUnixPath.size() );
+
+        const auto local = socket( AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0 );
+
+        if ( local == -1 )
+        {
+            Fail( "Can't create a socket" );
+        }
+
+        // A stale socket from a previous run.
+        unlink( mOptions.mUnixPath.c_str() );
+
+        if ( bind( local, reinterpret_cast<const sockaddr*>( &address ),
+                   sizeof( address ) ) == -1 )
+        {
+            Fail( std::format( "Can't bind {}", mOptions.mUnixPath ) );
+        }
+
+        mListeners.push_back( local );
+    }
+
+    for ( const auto listener : mListeners )
+    {
+        SetNonBlocking( listener );
+
+        if ( listen( listener, SOMAXCONN ) == -1 )
+        {
+            Fail( "listen" );
+        }
+    }
+}
+
+void CServer::Run() noexcept
+{
+    const auto seed =
+        mOptions.mSeed != 0 ? mOptions.mSeed : std::random_device{}();
+
+    std::vector<std::thread> threads;
+    threads.reserve( mOptions.mThreads );
+
+    for ( size_t i = 0; i < std::max<size_t>( mOptions.mThreads, 1 ); i++ )
+    {
+        threads.emplace_back(
+            [this, seed, i]
+            {
+                CWorker worker{ mOptions, mScript, mListeners, seed + i };
+                worker.Run();
+            } );
+    }
+
+    for ( auto& thread : threads )
+    {
+        thread.join();
+    }
+}
+
+} // namespace btmockd
@@ -0,0 +1,83 @@
+//-----------------------------------------------------------------------------
+// Copyright 2024 Igor Spichkin
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//-----------------------------------------------------------------------------
+
+#pragma once
+
+#include "script.hpp"
+#include <chrono>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+namespace btmockd
+{
+
+/// What a failed topic does instead of replying.
+enum class EFailure
+{
+    /// Closes the connection.
+    Close,
+    /// Sends half of the reply and closes the connection.
+    Truncate,
+    /// Sends a reply with an invalid magic.
+    Garbage,
+    /// Never replies.
+    Hang
+};
+
+struct ServerOptions final
+{
+    std::string mNode = "127.0.0.1";
+    std::string mPort = "2506";
+    /// Also listen on this Unix socket if it is not empty.
+    std::string mUnixPath;
+    size_t mThreads = 1;
+    /// Every reply is delayed by `mLatency` plus a random part of `mJitter`.
+    std::chrono::microseconds mLatency{ 0 };
+    std::chrono::microseconds mJitter{ 0 };
+    /// The share of topics that fail, from 0 to 1.
+    double mFailRate = 0;
+    EFailure mFailure = EFailure::Close;
+    /// Close the connection after each reply instead of keeping it alive.
+    bool mClose = false;
+    /// Seeds the latency and failure generators, 0 for a random seed.
+    uint64_t mSeed = 0;
+};
+
+/// A BYOND topic server that answers from a script. Each thread runs its own
+/// epoll loop and accepts from the shared listening sockets.
+class CServer final
+{
+  public:
+    CServer( ServerOptions options, CScript script ) noexcept;
+
+    ~CServer();
+
+    CServer( const CServer& ) = delete;
+    CServer& operator=( const CServer& ) = delete;
+
+    /// Binds the listening sockets, exits on error.
+    void Listen() noexcept;
+
+    /// Serves until the process is stopped.
+    void Run() noexcept;
+
+  private:
+    ServerOptions mOptions;
+    CScript mScript;
+    std::vector<int> mListeners;
+};
+
+} // namespace btmockd
@@ -0,0 +1,288 @@
+//-----------------------------------------------------------------------------
+// Copyright 2024 Igor Spichkin
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//-----------------------------------------------------------------------------
+
+#include "proxy.hpp"
+#include <chrono>
+#include <format>
+#include <iostream>
+#include <string>
+#include <string_view>
+#include <vector>
+
+void PrintHelp( std::ostream& out ) noexcept
+{
+    out << "Usage: bt-proxy --route <NODE>:<PORT>=<NODE>:<PORT> "
+           "[--route ...]\n"
+           "                [--connections <N>] [--queue <N>] "
+           "[--timeout <T>]\n"
+           "                [--cache <TOPIC>=<T>] [--cache-size <N>[K|M|G]]\n"
+           "\n"
+           "Forwards topics from local clients to game servers over a few "
+           "shared\n"
+           "connections, so a server handles a steady stream of topics "
+           "instead of bursts.\n"
+           "\n"
+           "  --route        accept topics on the first address and forward "
+           "them to the\n"
+           "                 second, routes to the same server share its "
+           "connections\n"
+           "  --connections  connections per server, the topics it handles at "
+           "once, 4 by\n"
+           "                 default\n"
+           "  --queue        topics waiting for a connection per server, 1024 "
+           "by default\n"
+           "  --timeout      how long a topic may wait, connect and wait for "
+           "the reply\n"
+           "                 (\"500ms\", \"2s\", seconds by default), 10s by "
+           "default\n"
+           "  --cache        reuse the reply to the topic for <T>, and send "
+           "identical topics\n"
+           "                 that arrive meanwhile only once; a trailing '*' "
+           "matches any\n"
+           "                 suffix, the first match wins, 0 only coalesces. "
+           "Only for topics\n"
+           "                 that don't change anything on the server\n"
+           "  --cache-size   the memory the cached replies may take, 16M by "
+           "default\n"
+           "\n"
+           "Replies are sent in the order of the topics on each client "
+           "connection. A topic\n"
+           "that can't be queued, times out or fails upstream closes its "
+           "client connection\n"
+           "once the replies before it are sent.\n"
+           "\n"
+           "Example: bt-proxy --route 127.0.0.1:3506=play.example.com:2506\n";
+}
+
+[[noreturn]] void InvalidCommand( const std::string& message ) noexcept
+{
+    std::cerr << message << '\n';
+
+    PrintHelp( std::cerr );
+
+    std::exit( -1 );
+}
+
+/// Parses "<NUMBER>[ms|s]", seconds if there is no unit.
+[[nodiscard]] std::chrono::milliseconds
+ParseDuration( const std::string& option, const std::string& value ) noexcept
+{
+    double number = -1;
+    size_t end = 0;
+
+    try
+    {
+        number = std::stod( value, &end );
+    }
+    catch ( const std::exception& )
+    {
+    }
+
+    const auto unit = std::string_view{ value }.substr( end );
+    double scale = -1;
+
+    if ( unit == "ms" )
+    {
+        scale = 1;
+    }
+    else if ( unit.empty() || unit == "s" )
+    {
+        scale = 1000;
+    }
+
+    if ( !( number >= 0 ) || scale < 0 )
+    {
+        InvalidCommand(
+            std::format( "Invalid command: invalid {}: {}", option, value ) );
+    }
+
+    return std::chrono::milliseconds{
+        static_cast<std::chrono::milliseconds::rep>( number * scale ) };
+}
+
+/// Parses "<NUMBER>[K|M|G]", bytes if there is no unit.
+[[nodiscard]] size_t ParseSize( const std::string& option,
+                                const std::string& value ) noexcept
+{
+    size_t number = 0;
+    size_t end = 0;
+
+    try
+    {
+        number = std::stoull( value, &end );
+    }
+    catch ( const std::exception& )
+    {
+        InvalidCommand(
+            std::format( "Invalid command: invalid {}: {}", option, value ) );
+    }
+
+    const auto unit = std::string_view{ value }.substr( end );
+    constexpr std::string_view units = "KMG";
+
+    if ( unit.empty() )
+    {
+        return number;
+    }
+
+    if ( unit.size() != 1 || units.find( unit[0] ) == std::string_view::npos )
+    {
+        InvalidCommand(
+            std::format( "Invalid command: invalid {}: {}", option, value ) );
+    }
+
+    return number << ( 10 * ( units.find( unit[0] ) + 1 ) );
+}
+
+/// Splits "<NODE>:<PORT>".
+/// \returns false if there is no port.
+[[nodiscard]] bool SplitAddress( const std::string_view address,
+                                 std::string& node, std::string& port )
+{
+    const auto del = address.find_last_of( ':' );
+
+    if ( del == std::string_view::npos || del + 1 == address.size() )
+    {
+        return false;
+    }
+
+    node = address.substr( 0, del );
+    port = address.substr( del + 1 );
+
+    return true;
+}
+
+[[nodiscard]] btproxy::ProxyOptions ParseArgs( const int argc,
+                                               const char* argv[] ) noexcept
+{
+    btproxy::ProxyOptions options;
+
+    std::vector<std::string> args( argv + 1, argv + argc );
+
+    const auto value = [&]( size_t& i ) -> const std::string&
+    {
+        if ( i + 1 == args.size() )
+        {
+            InvalidCommand( std::format( "Invalid command: {} requires a value",
+                                         args[i] ) );
+        }
+
+        return args[++i];
+    };
+
+    for ( size_t i = 0; i < args.size(); i++ )
+    {
+        const auto& arg = args[i];
+
+        if ( arg == "--help" )
+        {
+            PrintHelp( std::cout );
+
+            std::exit( 0 );
+        }
+        else if ( arg == "--route" )
+        {
+            const auto& spec = value( i );
+            const auto del = spec.find( '=' );
+            btproxy::Route route;
+
+            if ( del == std::string::npos ||
+                 !SplitAddress( std::string_view{ spec }.substr( 0, del ),
+                                route.mListenNode, route.mListenPort ) ||
+                 !SplitAddress( std::string_view{ spec }.substr( del + 1 ),
+                                route.mUpstreamNode, route.mUpstreamPort ) )
+            {
+                InvalidCommand(
+                    std::format( "Invalid command: invalid --route: {}",
+                                 spec ) );
+            }
+
+            options.mRoutes.push_back( std::move( route ) );
+        }
+        else if ( arg == "--connections" || arg == "--queue" )
+        {
+            const auto& number = value( i );
+            size_t parsed = 0;
+
+            try
+            {
+                parsed = std::stoull( number );
+            }
+            catch ( const std::exception& )
+            {
+            }
+
+            if ( parsed == 0 )
+            {
+                InvalidCommand( std::format( "Invalid command: invalid {}: {}",
+                                             arg, number ) );
+            }
+
+            ( arg == "--queue" ? options.mQueue : options.mConnections ) =
+                parsed;
+        }
+        else if ( arg == "--timeout" )
+        {
+            options.mTimeout = ParseDuration( arg, value( i ) );
+
+            if ( options.mTimeout.count() == 0 )
+            {
+                InvalidCommand( std::format(
+                    "Invalid command: invalid --timeout: {}", args[i] ) );
+            }
+        }
+        else if ( arg == "--cache" )
+        {
+            const auto& rule = value( i );
+            const auto del = rule.find_last_of( '=' );
+
+            if ( del == std::string::npos )
+            {
+                InvalidCommand( std::format(
+                    "Invalid command: invalid --cache: {}", rule ) );
+            }
+
+            const auto ttl = ParseDuration( arg, rule.substr( del + 1 ) );
+            options.mCachePolicy.add( rule.substr( 0, del ), ttl );
+        }
+        else if ( arg == "--cache-size" )
+        {
+            options.mCacheSize = ParseSize( arg, value( i ) );
+        }
+        else
+        {
+            InvalidCommand( std::format( "Unknown argument: {}", arg ) );
+        }
+    }
+
+    if ( options.mRoutes.empty() )
+    {
+        InvalidCommand( "Invalid command: at least one --route required" );
+    }
+
+    return options;
+}
+
+int main( const int argc, const char* argv[] )
+{
+    btproxy::CProxy proxy{ ParseArgs( argc, argv ) };
+
+    if ( !proxy.Listen() || !proxy.Run() )
+    {
+        return -1;
+    }
+
+    return 0;
+}
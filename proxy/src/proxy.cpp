@@ -0,0 +1,1369 @@
+//-----------------------------------------------------------------------------
+// Copyright 2024 Igor Spichkin
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//-----------------------------------------------------------------------------
+
+#include "proxy.hpp"
+#include "bt/bt.hpp"
+#include "bt/cache.hpp"
+#include "socket.hpp"
+#include <algorithm>
+#include <array>
+#include <cerrno>
+#include <deque>
+#include <fcntl.h>
+#include <format>
+#include <iostream>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <span>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <unordered_map>
+
+namespace btproxy
+{
+
+namespace
+{
+
+using Clock = std::chrono::steady_clock;
+
+/// A topic packet: the magic, the length, 5 bytes of padding, the message and
+/// a trailing NUL.
+inline constexpr size_t request_header_size_v = 4;
+inline constexpr size_t request_padding_v = 5;
+
+/// Set in the epoll ids of the upstream connections, the rest is the index of
+/// the connection.
+inline constexpr uint64_t link_bit_v = uint64_t{ 1 } << 63;
+
+/// Reports the failed call with errno.
+/// \returns false, to return it from the caller.
+bool Fail( const std::string& message ) noexcept
+{
+    std::cerr << std::format( "{}: error {}\n", message, errno );
+
+    return false;
+}
+
+//-----------------------------------------------------------------------------
+// CLoop
+//-----------------------------------------------------------------------------
+
+class CLoop final
+{
+  public:
+    /// \param routeUpstreams the upstream of each route, routes to the same
+    /// server share it.
+    /// \param names "<NODE>:<PORT>" of each upstream.
+    CLoop( const ProxyOptions& options, const std::vector<int>& listeners,
+           std::vector<size_t> routeUpstreams, std::vector<std::string> names,
+           std::vector<btcmd::Resolution> upstreams ) noexcept
+        : mOptions( options ), mListeners( listeners ),
+          mRouteUpstreams( std::move( routeUpstreams ) ),
+          mNames( std::move( names ) ), mAddresses( std::move( upstreams ) ),
+          mPreferred( mAddresses.size() ), mQueues( mAddresses.size() ),
+          mLinks( mAddresses.size() * options.mConnections ),
+          mNextClient( listeners.size() ), mCache( options.mCacheSize )
+    {
+        for ( size_t i = 0; i < mLinks.size(); i++ )
+        {
+            mLinks[i].mUpstream = i / options.mConnections;
+        }
+    }
+
+    ~CLoop()
+    {
+        for ( const auto& [id, client] : mClients )
+        {
+            close( client.mSocket );
+        }
+
+        for ( const auto& link : mLinks )
+        {
+            if ( link.mSocket != -1 )
+            {
+                close( link.mSocket );
+            }
+        }
+
+        if ( mEpoll != -1 )
+        {
+            close( mEpoll );
+        }
+
+        if ( mReserve != -1 )
+        {
+            close( mReserve );
+        }
+    }
+
+    /// \returns false if the event loop can't go on.
+    bool Run() noexcept
+    {
+        mEpoll = epoll_create1( EPOLL_CLOEXEC );
+
+        if ( mEpoll == -1 )
+        {
+            return Fail( "epoll_create1" );
+        }
+
+        mReserve = open( "/dev/null", O_RDONLY | O_CLOEXEC );
+
+        for ( size_t i = 0; i < mListeners.size(); i++ )
+        {
+            epoll_event event{ .events = EPOLLIN, .data = { .u64 = i } };
+
+            if ( epoll_ctl( mEpoll, EPOLL_CTL_ADD, mListeners[i], &event ) ==
+                 -1 )
+            {
+                return Fail( "epoll_ctl" );
+            }
+        }
+
+        std::array<epoll_event, 64> events;
+
+        while ( true )
+        {
+            const auto count = epoll_wait( mEpoll, events.data(),
+                                           events.size(), Timeout() );
+
+            if ( count == -1 && errno != EINTR )
+            {
+                return Fail( "epoll_wait" );
+            }
+
+            for ( int i = 0; i < count; i++ )
+            {
+                const auto id = events[i].data.u64;
+
+                if ( ( id & link_bit_v ) != 0 )
+                {
+                    OnLinkEvent( id & ~link_bit_v, events[i].events );
+                }
+                else if ( id < mListeners.size() )
+                {
+                    Accept( id );
+                }
+                else
+                {
+                    OnClientEvent( id, events[i].events );
+                }
+            }
+
+            Expire( Clock::now() );
+        }
+    }
+
+  private:
+    enum class ETopicState
+    {
+        /// Waits for an identical topic in flight.
+        Following,
+        Queued,
+        /// Assigned to an upstream connection.
+        InFlight,
+        Done,
+        Failed
+    };
+
+    struct Topic final
+    {
+        uint64_t mClient;
+        size_t mUpstream;
+        std::vector<char> mPacket;
+        std::vector<char> mReply;
+        Clock::time_point mDeadline;
+        ETopicState mState = ETopicState::Queued;
+        /// The client is gone, the reply is dropped.
+        bool mOrphan = false;
+        /// Sent again once after a reused connection turned out closed.
+        bool mRetried = false;
+        /// Set for a cached topic that went upstream: the key of the flight
+        /// identical topics follow, and how long the reply is kept.
+        std::string mKey;
+        bt::CachePolicy::duration mTtl{};
+        std::vector<uint64_t> mFollowers;
+    };
+
+    enum class ELinkState
+    {
+        Closed,
+        Connecting,
+        Idle,
+        Busy
+    };
+
+    /// A connection to an upstream.
+    struct Link final
+    {
+        size_t mUpstream = 0;
+        int mSocket = -1;
+        ELinkState mState = ELinkState::Closed;
+        uint64_t mTopic = 0;
+        /// Bytes of the topic packet sent so far.
+        size_t mSent = 0;
+        /// The reply so far, the decoder has consumed `mParsed` bytes of it.
+        std::vector<char> mInput;
+        size_t mParsed = 0;
+        bt::Decoder mDecoder;
+        /// When connecting to the current address gives up, and to all of
+        /// them.
+        Clock::time_point mDeadline;
+        Clock::time_point mConnectDeadline;
+        /// The address connecting started with, and how many were tried.
+        size_t mFirstAddress = 0;
+        size_t mAttempts = 0;
+        size_t mAddress = 0;
+        /// Carried a topic before, the server may have closed it since.
+        bool mReused = false;
+        bool mWaitingWritable = false;
+    };
+
+    struct Client final
+    {
+        int mSocket = -1;
+        size_t mRoute = 0;
+        std::vector<char> mInput;
+        std::vector<char> mOutput;
+        size_t mSent = 0;
+        /// The topics in the order they arrived, replies go in that order.
+        std::deque<uint64_t> mPending;
+        /// Close once the output is sent.
+        bool mClosing = false;
+        /// The client shut down its side, close once the replies to its
+        /// topics are sent.
+        bool mEof = false;
+        bool mWaitingWritable = false;
+    };
+
+    /// \returns the epoll timeout until the nearest deadline.
+    [[nodiscard]] int Timeout() const noexcept
+    {
+        auto nearest = Clock::time_point::max();
+
+        for ( const auto& queue : mQueues )
+        {
+            for ( const auto id : queue )
+            {
+                if ( const auto it = mTopics.find( id ); it != mTopics.end() )
+                {
+                    nearest = std::min( nearest, it->second.mDeadline );
+
+                    break;
+                }
+            }
+        }
+
+        for ( const auto& link : mLinks )
+        {
+            if ( link.mState == ELinkState::Connecting )
+            {
+                nearest = std::min( nearest, link.mDeadline );
+            }
+            else if ( link.mState == ELinkState::Busy )
+            {
+                nearest =
+                    std::min( nearest, mTopics.at( link.mTopic ).mDeadline );
+            }
+        }
+
+        if ( nearest == Clock::time_point::max() )
+        {
+            return -1;
+        }
+
+        const auto left = nearest - Clock::now();
+
+        if ( left <= Clock::duration::zero() )
+        {
+            return 0;
+        }
+
+        return static_cast<int>(
+            std::chrono::ceil<std::chrono::milliseconds>( left ).count() );
+    }
+
+    void Expire( const Clock::time_point now ) noexcept
+    {
+        for ( auto& queue : mQueues )
+        {
+            // Topics are queued in the order of their deadlines, except for
+            // the ones sent again, which only come earlier.
+            while ( !queue.empty() )
+            {
+                const auto it = mTopics.find( queue.front() );
+
+                if ( it != mTopics.end() && it->second.mDeadline > now )
+                {
+                    break;
+                }
+
+                queue.pop_front();
+
+                if ( it != mTopics.end() )
+                {
+                    Finish( it->first, ETopicState::Failed );
+                }
+            }
+        }
+
+        for ( size_t i = 0; i < mLinks.size(); i++ )
+        {
+            auto& link = mLinks[i];
+
+            if ( link.mState == ELinkState::Connecting &&
+                 link.mDeadline <= now )
+            {
+                CloseLink( link );
+                ConnectNext( i );
+                Dispatch( link.mUpstream );
+            }
+            else if ( link.mState == ELinkState::Busy &&
+                      mTopics.at( link.mTopic ).mDeadline <= now )
+            {
+                const auto topic = link.mTopic;
+
+                CloseLink( link );
+                Finish( topic, ETopicState::Failed );
+                Dispatch( link.mUpstream );
+            }
+        }
+    }
+
+    //-------------------------------------------------------------------------
+    // Clients
+    //-------------------------------------------------------------------------
+
+    void Accept( const size_t route ) noexcept
+    {
+        size_t dropped = 0;
+
+        while ( true )
+        {
+            const auto socket =
+                accept4( mListeners[route], nullptr, nullptr,
+                         SOCK_NONBLOCK | SOCK_CLOEXEC );
+
+            if ( socket == -1 && errno == ECONNABORTED )
+            {
+                continue;
+            }
+
+            // The listener stays readable while a connection waits, so it is
+            // accepted on the reserve descriptor and closed. accept fails
+            // before it looks at the queue, only this tells it is empty.
+            if ( socket == -1 && ( errno == EMFILE || errno == ENFILE ) &&
+                 mReserve != -1 )
+            {
+                close( mReserve );
+
+                const auto refused =
+                    accept( mListeners[route], nullptr, nullptr );
+
+                if ( refused != -1 )
+                {
+                    close( refused );
+                    dropped++;
+                }
+
+                mReserve = open( "/dev/null", O_RDONLY | O_CLOEXEC );
+
+                if ( refused != -1 )
+                {
+                    continue;
+                }
+            }
+
+            if ( socket == -1 )
+            {
+                if ( dropped != 0 )
+                {
+                    std::cerr << std::format(
+                        "Dropped {} connections: out of file descriptors\n",
+                        dropped );
+                }
+
+                // EAGAIN, or nothing can be done about it but waiting.
+                return;
+            }
+
+            const int one = 1;
+            setsockopt( socket, IPPROTO_TCP, TCP_NODELAY, &one, sizeof( one ) );
+
+            const auto id = mNextClient++;
+            epoll_event event{ .events = EPOLLIN | EPOLLRDHUP,
+                               .data = { .u64 = id } };
+
+            if ( epoll_ctl( mEpoll, EPOLL_CTL_ADD, socket, &event ) == -1 )
+            {
+                close( socket );
+
+                continue;
+            }
+
+            mClients.emplace( id,
+                              Client{ .mSocket = socket, .mRoute = route } );
+        }
+    }
+
+    void OnClientEvent( const uint64_t id, const uint32_t events ) noexcept
+    {
+        const auto it = mClients.find( id );
+
+        if ( it == mClients.end() )
+        {
+            return;
+        }
+
+        if ( ( events & EPOLLOUT ) != 0 && !FlushClient( id, it->second ) )
+        {
+            return;
+        }
+
+        if ( ( events & ( EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR ) ) != 0 )
+        {
+            ReadClient( id, it->second );
+        }
+    }
+
+    void ReadClient( const uint64_t id, Client& client ) noexcept
+    {
+        const auto open = Receive( client.mSocket, client.mInput );
+
+        // Nothing comes after eof, but a reset does.
+        if ( !open && client.mEof )
+        {
+            CloseClient( id );
+
+            return;
+        }
+
+        const auto upstream = mRouteUpstreams[client.mRoute];
+        const auto& input = client.mInput;
+        size_t offset = 0;
+
+        while ( input.size() - offset >= request_header_size_v )
+        {
+            const auto* packet = input.data() + offset;
+
+            if ( packet[0] != '\x00' || packet[1] != '\x83' )
+            {
+                CloseClient( id );
+
+                return;
+            }
+
+            const auto length = static_cast<size_t>(
+                ( static_cast<uint8_t>( packet[2] ) << 8 ) |
+                static_cast<uint8_t>( packet[3] ) );
+
+            if ( length < request_padding_v )
+            {
+                CloseClient( id );
+
+                return;
+            }
+
+            if ( input.size() - offset < request_header_size_v + length )
+            {
+                break;
+            }
+
+            Submit( id, client, upstream,
+                    { packet, request_header_size_v + length } );
+
+            offset += request_header_size_v + length;
+        }
+
+        client.mInput.erase( client.mInput.begin(),
+                             client.mInput.begin() + offset );
+
+        // A client may send its topics and shut down its side, then wait for
+        // the replies. A topic cut short is dropped.
+        if ( !open )
+        {
+            client.mEof = true;
+
+            if ( !WaitWritable( id, client.mSocket, client.mWaitingWritable,
+                                client.mWaitingWritable, false ) )
+            {
+                CloseClient( id );
+
+                return;
+            }
+        }
+
+        // Either can close the client.
+        Dispatch( upstream );
+        Deliver( id );
+    }
+
+    /// Answers the topic from the cache, attaches it to an identical topic
+    /// in flight, or queues it. Fails it if the queue is full.
+    void Submit( const uint64_t id, Client& client, const size_t upstream,
+                 const std::span<const char> packet ) noexcept
+    {
+        const auto topic = mNextTopic++;
+        auto& pending =
+            mTopics
+                .emplace( topic,
+                          Topic{ .mClient = id,
+                                 .mUpstream = upstream,
+                                 .mPacket = { packet.begin(), packet.end() },
+                                 .mDeadline =
+                                     Clock::now() + mOptions.mTimeout } )
+                .first->second;
+
+        client.mPending.push_back( topic );
+
+        if ( const auto ttl = mOptions.mCachePolicy.ttl( TopicOf( packet ) ) )
+        {
+            if ( const auto cached = mCache.find( mNames[upstream], packet ) )
+            {
+                pending.mReply.assign( cached->bytes().begin(),
+                                       cached->bytes().end() );
+                pending.mState = ETopicState::Done;
+
+                return;
+            }
+
+            auto key = mNames[upstream];
+            key += '\0';
+            key.append( packet.data(), packet.size() );
+
+            if ( const auto it = mFlights.find( key ); it != mFlights.end() )
+            {
+                if ( const auto leader = mTopics.find( it->second );
+                     leader != mTopics.end() )
+                {
+                    leader->second.mFollowers.push_back( topic );
+                    pending.mState = ETopicState::Following;
+
+                    return;
+                }
+
+                // The leader is gone, this topic takes its place.
+                mFlights.erase( it );
+            }
+
+            mFlights.emplace( key, topic );
+            pending.mKey = std::move( key );
+            pending.mTtl = *ttl;
+        }
+
+        auto& queue = mQueues[upstream];
+
+        if ( queue.size() >= mOptions.mQueue )
+        {
+            // Nothing follows it yet.
+            mFlights.erase( pending.mKey );
+            pending.mKey.clear();
+            pending.mState = ETopicState::Failed;
+
+            return;
+        }
+
+        queue.push_back( topic );
+    }
+
+    /// \returns the message of a topic packet.
+    [[nodiscard]] static std::string_view
+    TopicOf( const std::span<const char> packet ) noexcept
+    {
+        const auto header = request_header_size_v + request_padding_v;
+        const auto message =
+            packet.size() > header
+                ? std::string_view{ packet.data() + header,
+                                    packet.size() - header }
+                : std::string_view{};
+
+        return message.substr( 0, message.find( '\0' ) );
+    }
+
+    /// Forgets a topic, and the flight it leads so that the next topic with
+    /// the same key doesn't follow it.
+    void
+    EraseTopic(
+        const std::unordered_map<uint64_t, Topic>::iterator it ) noexcept
+    {
+        if ( const auto& key = it->second.mKey; !key.empty() )
+        {
+            if ( const auto flight = mFlights.find( key );
+                 flight != mFlights.end() && flight->second == it->first )
+            {
+                mFlights.erase( flight );
+            }
+        }
+
+        mTopics.erase( it );
+    }
+
+    /// Completes a topic and the ones that follow it, and sends the replies
+    /// that are next in order.
+    void Finish( const uint64_t id, const ETopicState state ) noexcept
+    {
+        auto& topic = mTopics.at( id );
+        topic.mState = state;
+
+        if ( !topic.mKey.empty() )
+        {
+            mFlights.erase( topic.mKey );
+
+            if ( state == ETopicState::Done )
+            {
+                mCache.insert( mNames[topic.mUpstream], topic.mPacket,
+                               bt::CachedReply::from_bytes( topic.mReply ),
+                               topic.mTtl );
+            }
+
+            // Delivering to the followers may deliver this topic too, if
+            // they share the client.
+            const auto reply = topic.mReply;
+            const auto followers = std::move( topic.mFollowers );
+
+            for ( const auto follower : followers )
+            {
+                if ( const auto it = mTopics.find( follower );
+                     it != mTopics.end() )
+                {
+                    it->second.mReply = reply;
+                    Finish( follower, state );
+                }
+            }
+        }
+
+        const auto it = mTopics.find( id );
+
+        if ( it == mTopics.end() )
+        {
+            return;
+        }
+
+        if ( it->second.mOrphan )
+        {
+            EraseTopic( it );
+
+            return;
+        }
+
+        Deliver( it->second.mClient );
+    }
+
+    /// Sends the replies of the finished topics at the front. A failed topic
+    /// closes the connection, the only way to tell the client.
+    void Deliver( const uint64_t id ) noexcept
+    {
+        const auto it = mClients.find( id );
+
+        if ( it == mClients.end() )
+        {
+            return;
+        }
+
+        auto& client = it->second;
+
+        while ( !client.mPending.empty() && !client.mClosing )
+        {
+            const auto topic = mTopics.find( client.mPending.front() );
+
+            if ( topic->second.mState == ETopicState::Done )
+            {
+                const auto& reply = topic->second.mReply;
+                client.mOutput.insert( client.mOutput.end(), reply.begin(),
+                                       reply.end() );
+            }
+            else if ( topic->second.mState == ETopicState::Failed )
+            {
+                client.mClosing = true;
+            }
+            else
+            {
+                break;
+            }
+
+            EraseTopic( topic );
+            client.mPending.pop_front();
+        }
+
+        FlushClient( id, client );
+    }
+
+    /// \returns false if the client was closed.
+    bool FlushClient( const uint64_t id, Client& client ) noexcept
+    {
+        if ( !Send( client.mSocket, client.mOutput, client.mSent ) )
+        {
+            CloseClient( id );
+
+            return false;
+        }
+
+        const auto pending = client.mSent != client.mOutput.size();
+
+        if ( !pending )
+        {
+            client.mOutput.clear();
+            client.mSent = 0;
+        }
+
+        const auto done =
+            client.mClosing || ( client.mEof && client.mPending.empty() );
+
+        if ( ( !pending && done ) ||
+             !WaitWritable( id, client.mSocket, client.mWaitingWritable,
+                            pending, !client.mEof ) )
+        {
+            CloseClient( id );
+
+            return false;
+        }
+
+        return true;
+    }
+
+    void CloseClient( const uint64_t id ) noexcept
+    {
+        const auto it = mClients.find( id );
+
+        for ( const auto topic : it->second.mPending )
+        {
+            const auto found = mTopics.find( topic );
+            auto& pending = found->second;
+
+            // Queued topics are skipped once they are gone, unless others
+            // follow them.
+            if ( pending.mState == ETopicState::InFlight ||
+                 ( pending.mState == ETopicState::Queued &&
+                   !pending.mFollowers.empty() ) )
+            {
+                pending.mOrphan = true;
+            }
+            else
+            {
+                EraseTopic( found );
+            }
+        }
+
+        // Closing the socket also removes it from the epoll set.
+        close( it->second.mSocket );
+        mClients.erase( it );
+    }
+
+    //-------------------------------------------------------------------------
+    // Upstreams
+    //-------------------------------------------------------------------------
+
+    /// Hands the queued topics to the idle connections and opens more
+    /// connections, up to the limit, for the topics left.
+    void Dispatch( const size_t upstream ) noexcept
+    {
+        auto& queue = mQueues[upstream];
+        const auto first = upstream * mOptions.mConnections;
+        const auto last = first + mOptions.mConnections;
+        size_t connecting = 0;
+
+        for ( size_t i = first; i < last; i++ )
+        {
+            // Topics of the clients that are gone.
+            while ( !queue.empty() && !mTopics.contains( queue.front() ) )
+            {
+                queue.pop_front();
+            }
+
+            if ( queue.empty() )
+            {
+                return;
+            }
+
+            if ( mLinks[i].mState == ELinkState::Idle )
+            {
+                const auto topic = queue.front();
+                queue.pop_front();
+
+                Assign( i, topic );
+            }
+            else if ( mLinks[i].mState == ELinkState::Connecting )
+            {
+                connecting++;
+            }
+        }
+
+        for ( size_t i = first; i < last && queue.size() > connecting; i++ )
+        {
+            if ( mLinks[i].mState == ELinkState::Closed && Connect( i ) )
+            {
+                connecting++;
+            }
+        }
+    }
+
+    /// Opens a new connection, starting with the address the last one was
+    /// made to.
+    /// \returns false if all the addresses failed right away.
+    bool Connect( const size_t index ) noexcept
+    {
+        auto& link = mLinks[index];
+
+        link.mFirstAddress = mPreferred[link.mUpstream];
+        link.mAttempts = 0;
+        link.mConnectDeadline = Clock::now() + mOptions.mTimeout;
+
+        return ConnectNext( index );
+    }
+
+    /// Starts connecting to the next address that doesn't fail right away,
+    /// each of them getting an equal share of the time left. Fails the first
+    /// queued topic once none is left.
+    /// \returns false if none was left.
+    bool ConnectNext( const size_t index ) noexcept
+    {
+        auto& link = mLinks[index];
+        const auto& addresses = mAddresses[link.mUpstream].mEndpoints;
+
+        while ( link.mAttempts < addresses.size() )
+        {
+            const auto left = addresses.size() - link.mAttempts;
+
+            link.mAddress =
+                ( link.mFirstAddress + link.mAttempts ) % addresses.size();
+            link.mAttempts++;
+
+            if ( StartConnect( index, addresses[link.mAddress] ) )
+            {
+                const auto now = Clock::now();
+
+                link.mDeadline =
+                    now + std::max( link.mConnectDeadline - now,
+                                    Clock::duration::zero() ) /
+                              static_cast<Clock::rep>( left );
+
+                return true;
+            }
+        }
+
+        ConnectFailed( index );
+
+        return false;
+    }
+
+    /// \returns false if connecting failed right away.
+    bool StartConnect( const size_t index,
+                       const btcmd::Endpoint& address ) noexcept
+    {
+        auto& link = mLinks[index];
+
+        link.mSocket = socket( address.mFamily,
+                               SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0 );
+
+        if ( link.mSocket == -1 )
+        {
+            return false;
+        }
+
+        const int one = 1;
+        setsockopt( link.mSocket, IPPROTO_TCP, TCP_NODELAY, &one,
+                    sizeof( one ) );
+
+        // Completion, or the failure, is reported as writable either way.
+        if ( connect( link.mSocket,
+                      reinterpret_cast<const sockaddr*>(
+                          address.mAddress.data() ),
+                      static_cast<socklen_t>( address.mSize ) ) == -1 &&
+             errno != EINPROGRESS )
+        {
+            CloseLink( link );
+
+            return false;
+        }
+
+        epoll_event event{ .events = EPOLLOUT,
+                           .data = { .u64 = link_bit_v | index } };
+
+        if ( epoll_ctl( mEpoll, EPOLL_CTL_ADD, link.mSocket, &event ) == -1 )
+        {
+            CloseLink( link );
+
+            return false;
+        }
+
+        link.mState = ELinkState::Connecting;
+        link.mWaitingWritable = true;
+
+        return true;
+    }
+
+    /// Fails the first queued topic, so an upstream that is down empties its
+    /// queue instead of being reconnected to in a loop.
+    void ConnectFailed( const size_t index ) noexcept
+    {
+        auto& link = mLinks[index];
+        auto& queue = mQueues[link.mUpstream];
+
+        CloseLink( link );
+
+        while ( !queue.empty() )
+        {
+            const auto topic = queue.front();
+            queue.pop_front();
+
+            if ( mTopics.contains( topic ) )
+            {
+                Finish( topic, ETopicState::Failed );
+
+                break;
+            }
+        }
+    }
+
+    void OnLinkEvent( const size_t index, const uint32_t events ) noexcept
+    {
+        auto& link = mLinks[index];
+
+        switch ( link.mState )
+        {
+        case ELinkState::Closed:
+            return;
+        case ELinkState::Connecting:
+        {
+            int error = 0;
+            socklen_t size = sizeof( error );
+
+            if ( getsockopt( link.mSocket, SOL_SOCKET, SO_ERROR, &error,
+                             &size ) == -1 ||
+                 error != 0 ||
+                 !WaitWritable( link_bit_v | index, link.mSocket,
+                                link.mWaitingWritable, false ) )
+            {
+                CloseLink( link );
+                ConnectNext( index );
+                Dispatch( link.mUpstream );
+
+                return;
+            }
+
+            // An unreachable address, say IPv6, is skipped from now on.
+            mPreferred[link.mUpstream] = link.mAddress;
+            link.mState = ELinkState::Idle;
+            Dispatch( link.mUpstream );
+
+            return;
+        }
+        case ELinkState::Idle:
+            // The server closed the connection, or sent what nobody asked
+            // for.
+            CloseLink( link );
+
+            return;
+        case ELinkState::Busy:
+            if ( ( events & EPOLLOUT ) != 0 && !SendTopic( index ) )
+            {
+                return;
+            }
+
+            if ( ( events & ( EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR ) ) !=
+                 0 )
+            {
+                ReadReply( index );
+            }
+
+            return;
+        }
+    }
+
+    void Assign( const size_t index, const uint64_t topic ) noexcept
+    {
+        auto& link = mLinks[index];
+
+        link.mState = ELinkState::Busy;
+        link.mTopic = topic;
+        link.mSent = 0;
+        link.mInput.clear();
+        link.mParsed = 0;
+        link.mDecoder.reset();
+
+        mTopics.at( topic ).mState = ETopicState::InFlight;
+
+        SendTopic( index );
+    }
+
+    /// \returns false if the connection broke.
+    bool SendTopic( const size_t index ) noexcept
+    {
+        auto& link = mLinks[index];
+        const auto& packet = mTopics.at( link.mTopic ).mPacket;
+
+        if ( !Send( link.mSocket, packet, link.mSent ) ||
+             !WaitWritable( link_bit_v | index, link.mSocket,
+                            link.mWaitingWritable,
+                            link.mSent != packet.size() ) )
+        {
+            LinkBroken( index );
+
+            return false;
+        }
+
+        return true;
+    }
+
+    void ReadReply( const size_t index ) noexcept
+    {
+        auto& link = mLinks[index];
+
+        // The server may close the connection right after the reply.
+        const auto open = Receive( link.mSocket, link.mInput );
+
+        const auto [status, consumed] = link.mDecoder.feed(
+            std::span{ link.mInput }.subspan( link.mParsed ) );
+
+        link.mParsed += consumed;
+
+        if ( status == bt::EDecodeStatus::NeedMore )
+        {
+            if ( !open )
+            {
+                LinkBroken( index );
+            }
+
+            return;
+        }
+
+        const auto topic = link.mTopic;
+
+        if ( status != bt::EDecodeStatus::Done ||
+             link.mParsed != link.mInput.size() )
+        {
+            // Not a reply, or more than one: the connection can't be trusted.
+            CloseLink( link );
+            Finish( topic, ETopicState::Failed );
+            Dispatch( link.mUpstream );
+
+            return;
+        }
+
+        mTopics.at( topic ).mReply.swap( link.mInput );
+        link.mInput.clear();
+        link.mParsed = 0;
+
+        if ( open )
+        {
+            link.mState = ELinkState::Idle;
+            link.mReused = true;
+        }
+        else
+        {
+            CloseLink( link );
+        }
+
+        Finish( topic, ETopicState::Done );
+        Dispatch( link.mUpstream );
+    }
+
+    /// Closes the connection of a topic in flight. The topic is sent again
+    /// once as `btcmd::ShouldResend` describes.
+    void LinkBroken( const size_t index ) noexcept
+    {
+        auto& link = mLinks[index];
+        const auto topic = link.mTopic;
+        const auto retry =
+            btcmd::ShouldResend( link.mReused, !link.mInput.empty() );
+
+        CloseLink( link );
+
+        if ( auto& pending = mTopics.at( topic );
+             retry && !pending.mRetried && !pending.mOrphan )
+        {
+            pending.mRetried = true;
+            pending.mState = ETopicState::Queued;
+            mQueues[link.mUpstream].push_front( topic );
+        }
+        else
+        {
+            Finish( topic, ETopicState::Failed );
+        }
+
+        Dispatch( link.mUpstream );
+    }
+
+    void CloseLink( Link& link ) noexcept
+    {
+        if ( link.mSocket != -1 )
+        {
+            close( link.mSocket );
+        }
+
+        link.mSocket = -1;
+        link.mState = ELinkState::Closed;
+        link.mReused = false;
+        link.mWaitingWritable = false;
+        link.mInput.clear();
+        link.mParsed = 0;
+        link.mDecoder.reset();
+    }
+
+    //-------------------------------------------------------------------------
+    // Sockets
+    //-------------------------------------------------------------------------
+
+    /// Reads everything available.
+    /// \returns false on eof or error.
+    [[nodiscard]] static bool Receive( const int socket,
+                                       std::vector<char>& input ) noexcept
+    {
+        std::array<char, 16 * 1024> chunk;
+
+        while ( true )
+        {
+            const auto read = recv( socket, chunk.data(), chunk.size(), 0 );
+
+            if ( read > 0 )
+            {
+                input.insert( input.end(), chunk.data(), chunk.data() + read );
+
+                continue;
+            }
+
+            if ( read == -1 && ( errno == EAGAIN || errno == EWOULDBLOCK ) )
+            {
+                return true;
+            }
+
+            if ( read == -1 && errno == EINTR )
+            {
+                continue;
+            }
+
+            return false;
+        }
+    }
+
+    /// Sends as much of `output` past `sent` as the socket takes.
+    /// \returns false on error.
+    [[nodiscard]] static bool Send( const int socket,
+                                    const std::vector<char>& output,
+                                    size_t& sent ) noexcept
+    {
+        while ( sent < output.size() )
+        {
+            const auto result = send( socket, output.data() + sent,
+                                      output.size() - sent, MSG_NOSIGNAL );
+
+            if ( result == -1 && errno == EINTR )
+            {
+                continue;
+            }
+
+            if ( result == -1 && ( errno == EAGAIN || errno == EWOULDBLOCK ) )
+            {
+                return true;
+            }
+
+            if ( result == -1 )
+            {
+                return false;
+            }
+
+            sent += result;
+        }
+
+        return true;
+    }
+
+    /// Polls the socket for writability or stops, and for reading unless
+    /// `read` is false, which always updates the events.
+    /// \returns false on error.
+    [[nodiscard]] bool WaitWritable( const uint64_t id, const int socket,
+                                     bool& waiting, const bool wait,
+                                     const bool read = true ) noexcept
+    {
+        if ( waiting == wait && read )
+        {
+            return true;
+        }
+
+        epoll_event event{ .events = ( read ? EPOLLIN | EPOLLRDHUP : 0u ) |
+                                     ( wait ? EPOLLOUT : 0u ),
+                           .data = { .u64 = id } };
+
+        if ( epoll_ctl( mEpoll, EPOLL_CTL_MOD, socket, &event ) == -1 )
+        {
+            return false;
+        }
+
+        waiting = wait;
+
+        return true;
+    }
+
+    const ProxyOptions& mOptions;
+    const std::vector<int>& mListeners;
+    std::vector<size_t> mRouteUpstreams;
+    std::vector<std::string> mNames;
+    std::vector<btcmd::Resolution> mAddresses;
+    /// The address of each upstream the last connection was made to.
+    std::vector<size_t> mPreferred;
+    /// The topics waiting for a connection, per upstream.
+    std::vector<std::deque<uint64_t>> mQueues;
+    /// `mConnections` per upstream, one after another.
+    std::vector<Link> mLinks;
+    int mEpoll = -1;
+    /// Given up to accept and drop a connection when out of descriptors.
+    int mReserve = -1;
+    uint64_t mNextClient;
+    uint64_t mNextTopic = 0;
+    std::unordered_map<uint64_t, Client> mClients;
+    std::unordered_map<uint64_t, Topic> mTopics;
+    bt::ReplyCache mCache;
+    /// The topics that went upstream, by the key of the cache.
+    std::unordered_map<std::string, uint64_t> mFlights;
+};
+
+} // namespace
+
+//-----------------------------------------------------------------------------
+// CProxy
+//-----------------------------------------------------------------------------
+
+CProxy::CProxy( ProxyOptions options ) noexcept
+    : mOptions( std::move( options ) )
+{
+}
+
+CProxy::~CProxy()
+{
+    for ( const auto listener : mListeners )
+    {
+        close( listener );
+    }
+}
+
+bool CProxy::Listen() noexcept
+{
+    for ( const auto& route : mOptions.mRoutes )
+    {
+        addrinfo hints{ .ai_flags = AI_PASSIVE,
+                        .ai_family = AF_UNSPEC,
+                        .ai_socktype = SOCK_STREAM };
+        addrinfo* addrInfo = nullptr;
+
+        if ( const auto error = getaddrinfo( route.mListenNode.c_str(),
+                                             route.mListenPort.c_str(),
+                                             &hints, &addrInfo );
+             error != 0 )
+        {
+            std::cerr << std::format( "Can't resolve {}:{}: getaddrinfo "
+                                      "error {}\n",
+                                      route.mListenNode, route.mListenPort,
+                                      error );
+
+            return false;
+        }
+
+        const auto listener =
+            socket( addrInfo->ai_family,
+                    addrInfo->ai_socktype | SOCK_NONBLOCK | SOCK_CLOEXEC,
+                    addrInfo->ai_protocol );
+
+        if ( listener == -1 )
+        {
+            freeaddrinfo( addrInfo );
+
+            return Fail( "Can't create a socket" );
+        }
+
+        // Closed with the rest by the destructor.
+        mListeners.push_back( listener );
+
+        const int one = 1;
+        setsockopt( listener, SOL_SOCKET, SO_REUSEADDR, &one, sizeof( one ) );
+
+        const bool bound =
+            bind( listener, addrInfo->ai_addr, addrInfo->ai_addrlen ) == 0;
+
+        freeaddrinfo( addrInfo );
+
+        if ( !bound )
+        {
+            return Fail( std::format( "Can't bind {}:{}", route.mListenNode,
+                                      route.mListenPort ) );
+        }
+
+        if ( listen( listener, SOMAXCONN ) == -1 )
+        {
+            return Fail( "listen" );
+        }
+    }
+
+    return true;
+}
+
+bool CProxy::Run() noexcept
+{
+    std::vector<size_t> routeUpstreams;
+    std::vector<btcmd::Resolution> upstreams;
+    std::vector<const Route*> routes;
+
+    for ( const auto& route : mOptions.mRoutes )
+    {
+        const auto same = [&]( const Route* other )
+        {
+            return other->mUpstreamNode == route.mUpstreamNode &&
+                   other->mUpstreamPort == route.mUpstreamPort;
+        };
+
+        if ( const auto it = std::ranges::find_if( routes, same );
+             it != routes.end() )
+        {
+            routeUpstreams.push_back( it - routes.begin() );
+
+            continue;
+        }
+
+        auto resolution =
+            btcmd::GetAddrInfo( route.mUpstreamNode, route.mUpstreamPort );
+
+        if ( resolution.mError != 0 || resolution.mEndpoints.empty() )
+        {
+            std::cerr << std::format(
+                "Can't resolve {}:{}: {}\n", route.mUpstreamNode,
+                route.mUpstreamPort,
+                resolution.mError != 0
+                    ? std::format( "getaddrinfo error {}", resolution.mError )
+                    : std::string{ "no addresses" } );
+
+            return false;
+        }
+
+        routeUpstreams.push_back( routes.size() );
+        routes.push_back( &route );
+        upstreams.push_back( std::move( resolution ) );
+    }
+
+    std::vector<std::string> names;
+
+    for ( const auto* route : routes )
+    {
+        names.push_back( std::format( "{}:{}", route->mUpstreamNode,
+                                      route->mUpstreamPort ) );
+    }
+
+    CLoop loop{ mOptions, mListeners, std::move( routeUpstreams ),
+                std::move( names ), std::move( upstreams ) };
+
+    return loop.Run();
+}
+
+} // namespace btproxy
@@ -0,0 +1,79 @@
+//-----------------------------------------------------------------------------
+// Copyright 2024 Igor Spichkin
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//-----------------------------------------------------------------------------
+
+#pragma once
+
+#include "bt/cache.hpp"
+#include <chrono>
+#include <string>
+#include <vector>
+
+namespace btproxy
+{
+
+/// Topics accepted on `mListen*` are forwarded to `mUpstream*`.
+struct Route final
+{
+    std::string mListenNode;
+    std::string mListenPort;
+    std::string mUpstreamNode;
+    std::string mUpstreamPort;
+};
+
+struct ProxyOptions final
+{
+    std::vector<Route> mRoutes;
+    /// Connections to each upstream, and so the topics it handles at once.
+    size_t mConnections = 4;
+    /// Topics waiting for a connection to each upstream, more are refused.
+    size_t mQueue = 1024;
+    /// How long a topic may wait in the queue, connect and wait for the reply.
+    std::chrono::milliseconds mTimeout{ 10000 };
+    /// The topics whose replies are reused and shared by identical topics in
+    /// flight, none by default.
+    bt::CachePolicy mCachePolicy;
+    size_t mCacheSize = 16 * 1024 * 1024;
+};
+
+/// Forwards topics from local clients over a small pool of connections per
+/// upstream, so the game server sees at most `mConnections` topics at once no
+/// matter how many clients there are. Runs a single epoll loop: forwarding is
+/// bound by the upstreams, not by the CPU.
+class CProxy final
+{
+  public:
+    explicit CProxy( ProxyOptions options ) noexcept;
+
+    ~CProxy();
+
+    CProxy( const CProxy& ) = delete;
+    CProxy& operator=( const CProxy& ) = delete;
+
+    /// Binds the listening sockets.
+    /// \returns false on error, once it is reported.
+    bool Listen() noexcept;
+
+    /// Resolves the upstreams and serves until the process is stopped.
+    /// \returns false if an upstream can't be resolved or the event loop
+    /// fails, once it is reported.
+    bool Run() noexcept;
+
+  private:
+    ProxyOptions mOptions;
+    /// One per route.
+    std::vector<int> mListeners;
+};
+
+} // namespace btproxy
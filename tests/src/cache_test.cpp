@@ -0,0 +1,250 @@
+//-----------------------------------------------------------------------------
+// Copyright 2024 Igor Spichkin
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//-----------------------------------------------------------------------------
+
+#include "bt/cache.hpp"
+#include "check.hpp"
+#include <atomic>
+#include <chrono>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+using namespace std::chrono_literals;
+
+namespace
+{
+
+[[nodiscard]] bt::ReplyCache::value_type Cached( const std::string_view text )
+{
+    return bt::CachedReply::from_reply(
+        bt::Reply{ .mType = bt::EReplyType::String,
+                   .mString = text,
+                   .mBytes = {} } );
+}
+
+/// \returns what an entry costs against the cap.
+[[nodiscard]] size_t Cost( const std::string_view target,
+                           const std::string_view topic,
+                           const bt::ReplyCache::value_type& reply )
+{
+    return target.size() + 1 + topic.size() + reply->bytes().size() +
+           bt::ReplyCache::entry_overhead_v;
+}
+
+void TestCachedReply()
+{
+    const auto cached = Cached( "hello" );
+
+    BT_CHECK( cached != nullptr );
+    BT_CHECK( cached->reply().mString == "hello" );
+
+    // The string points into the owned bytes.
+    BT_CHECK( cached->reply().mString.data() > cached->bytes().data() );
+    BT_CHECK( cached->reply().mString.data() <
+              cached->bytes().data() + cached->bytes().size() );
+
+    const auto copy = bt::CachedReply::from_bytes( cached->bytes() );
+
+    BT_CHECK( copy != nullptr && copy->reply().mString == "hello" );
+
+    // Trailing bytes and a truncated reply are both refused.
+    std::vector<char> bytes{ cached->bytes().begin(), cached->bytes().end() };
+    bytes.push_back( '\0' );
+
+    BT_CHECK( bt::CachedReply::from_bytes( bytes ) == nullptr );
+    BT_CHECK( bt::CachedReply::from_bytes( cached->bytes().first(
+                  cached->bytes().size() - 1 ) ) == nullptr );
+
+    const std::string large( UINT16_MAX, 'x' );
+
+    BT_CHECK( Cached( large ) == nullptr );
+}
+
+void TestEviction()
+{
+    const auto reply = Cached( "reply" );
+    const auto cost = Cost( "target", "topic0", reply );
+
+    // Room for three entries, not four.
+    bt::ReplyCache cache{ cost * 3 + cost / 2 };
+
+    cache.insert( "target", std::string_view{ "topic0" }, reply, 1h );
+    cache.insert( "target", std::string_view{ "topic1" }, reply, 1h );
+    cache.insert( "target", std::string_view{ "topic2" }, reply, 1h );
+
+    BT_CHECK( cache.size() == 3 );
+    BT_CHECK( cache.size_bytes() == cost * 3 );
+
+    // A hit makes topic0 the most recently used, so topic1 goes first.
+    BT_CHECK( cache.find( "target", std::string_view{ "topic0" } ) == reply );
+
+    cache.insert( "target", std::string_view{ "topic3" }, reply, 1h );
+
+    BT_CHECK( cache.size() == 3 );
+    BT_CHECK( cache.size_bytes() == cost * 3 );
+    BT_CHECK( cache.find( "target", std::string_view{ "topic1" } ) == nullptr );
+    BT_CHECK( cache.find( "target", std::string_view{ "topic0" } ) != nullptr );
+    BT_CHECK( cache.find( "target", std::string_view{ "topic2" } ) != nullptr );
+    BT_CHECK( cache.find( "target", std::string_view{ "topic3" } ) != nullptr );
+
+    // Replacing an entry doesn't count it twice.
+    cache.insert( "target", std::string_view{ "topic3" }, reply, 1h );
+
+    BT_CHECK( cache.size() == 3 );
+    BT_CHECK( cache.size_bytes() == cost * 3 );
+
+    // A larger reply pushes out as many entries as it needs.
+    const auto larger = Cached( std::string( cost * 2, 'x' ) );
+
+    cache.insert( "target", std::string_view{ "topic4" }, larger, 1h );
+
+    BT_CHECK( cache.size() == 1 );
+    BT_CHECK( cache.size_bytes() == Cost( "target", "topic4", larger ) );
+    BT_CHECK( cache.find( "target", std::string_view{ "topic4" } ) == larger );
+
+    // A reply larger than the whole cache is not cached and evicts nothing.
+    cache.insert( "target", std::string_view{ "topic5" },
+                  Cached( std::string( cost * 4, 'x' ) ), 1h );
+
+    BT_CHECK( cache.size() == 1 );
+    BT_CHECK( cache.find( "target", std::string_view{ "topic5" } ) == nullptr );
+}
+
+void TestKeys()
+{
+    bt::ReplyCache cache{ 1 << 20 };
+    const auto first = Cached( "first" );
+    const auto second = Cached( "second" );
+
+    // The same topic on two targets, and a target/topic boundary that would
+    // be ambiguous without the separator.
+    cache.insert( "a", std::string_view{ "bc" }, first, 1h );
+    cache.insert( "ab", std::string_view{ "c" }, second, 1h );
+
+    BT_CHECK( cache.size() == 2 );
+    BT_CHECK( cache.find( "a", std::string_view{ "bc" } ) == first );
+    BT_CHECK( cache.find( "ab", std::string_view{ "c" } ) == second );
+    BT_CHECK( cache.find( "b", std::string_view{ "bc" } ) == nullptr );
+}
+
+void TestExpiry()
+{
+    bt::ReplyCache cache{ 1 << 20 };
+    const auto reply = Cached( "reply" );
+
+    // Neither a zero TTL nor a null reply is cached.
+    cache.insert( "target", std::string_view{ "zero" }, reply, 0s );
+    cache.insert( "target", std::string_view{ "null" }, nullptr, 1h );
+
+    BT_CHECK( cache.size() == 0 );
+    BT_CHECK( cache.size_bytes() == 0 );
+
+    cache.insert( "target", std::string_view{ "short" }, reply, 50ms );
+    cache.insert( "target", std::string_view{ "long" }, reply, 1h );
+
+    BT_CHECK( cache.find( "target", std::string_view{ "short" } ) == reply );
+
+    std::this_thread::sleep_for( 100ms );
+
+    // An expired entry is dropped when it is looked up.
+    BT_CHECK( cache.find( "target", std::string_view{ "short" } ) == nullptr );
+    BT_CHECK( cache.find( "target", std::string_view{ "long" } ) == reply );
+    BT_CHECK( cache.size() == 1 );
+    BT_CHECK( cache.size_bytes() == Cost( "target", "long", reply ) );
+}
+
+void TestCoalescing()
+{
+    bt::ReplyCache cache{ 1 << 20 };
+    const auto reply = Cached( "fetched" );
+
+    constexpr size_t threadCount = 8;
+
+    std::atomic<size_t> fetches = 0;
+    std::atomic<size_t> waiting = 0;
+    std::vector<bt::ReplyCache::value_type> results( threadCount );
+    std::vector<std::thread> threads;
+
+    for ( size_t i = 0; i < threadCount; i++ )
+    {
+        threads.emplace_back(
+            [&, i]
+            {
+                waiting++;
+
+                results[i] = cache.get_or_fetch(
+                    "target", std::string_view{ "topic" }, 1h,
+                    [&]
+                    {
+                        fetches++;
+
+                        // Holds the flight open until every thread asked.
+                        while ( waiting != threadCount )
+                        {
+                            std::this_thread::yield();
+                        }
+
+                        std::this_thread::sleep_for( 50ms );
+
+                        return reply;
+                    } );
+            } );
+    }
+
+    for ( auto& thread : threads )
+    {
+        thread.join();
+    }
+
+    BT_CHECK( fetches == 1 );
+
+    for ( const auto& result : results )
+    {
+        BT_CHECK( result == reply );
+    }
+
+    // The fetched reply is cached, so no more fetches.
+    BT_CHECK( cache.get_or_fetch( "target", std::string_view{ "topic" }, 1h,
+                                  [&]
+                                  {
+                                      fetches++;
+
+                                      return reply;
+                                  } ) == reply );
+    BT_CHECK( fetches == 1 );
+
+    // A failed fetch is shared but not cached, the next call fetches again.
+    BT_CHECK( cache.get_or_fetch( "target", std::string_view{ "failed" }, 1h,
+                                  []
+                                  {
+                                      return bt::ReplyCache::value_type{};
+                                  } ) == nullptr );
+    BT_CHECK( cache.get_or_fetch( "target", std::string_view{ "failed" }, 1h,
+                                  [&] { return reply; } ) == reply );
+}
+
+} // namespace
+
+int main()
+{
+    TestCachedReply();
+    TestEviction();
+    TestKeys();
+    TestExpiry();
+    TestCoalescing();
+
+    return bttest::Finish();
+}
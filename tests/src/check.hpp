@@ -0,0 +1,59 @@
+//-----------------------------------------------------------------------------
+// Copyright 2024 Igor Spichkin
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//-----------------------------------------------------------------------------
+
+#pragma once
+
+#include <cstddef>
+#include <iostream>
+#include <string_view>
+
+namespace bttest
+{
+
+/// The number of checks that failed so far.
+inline size_t failures = 0;
+
+inline void Fail( const std::string_view expression, const char* file,
+                  const int line ) noexcept
+{
+    failures++;
+
+    // Enough to find the check, the rest would be noise in a loop.
+    if ( failures <= 20 )
+    {
+        std::cerr << file << ':' << line << ": check failed: " << expression
+                  << '\n';
+    }
+}
+
+/// \returns the exit code of the test: 0 if every check passed.
+[[nodiscard]] inline int Finish() noexcept
+{
+    if ( failures != 0 )
+    {
+        std::cerr << failures << " check(s) failed\n";
+
+        return 1;
+    }
+
+    return 0;
+}
+
+} // namespace bttest
+
+/// Records a failure and goes on, so one run reports every broken case.
+#define BT_CHECK( expression )                                                 \
+    ( ( expression ) ? static_cast<void>( 0 )                                  \
+                     : bttest::Fail( #expression, __FILE__, __LINE__ ) )
@@ -0,0 +1,270 @@
+//-----------------------------------------------------------------------------
+// Copyright 2024 Igor Spichkin
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//-----------------------------------------------------------------------------
+
+#include "bt/bt.hpp"
+#include "check.hpp"
+#include <bit>
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace
+{
+
+/// \returns a reply as a server sends it.
+[[nodiscard]] std::string Wire( const uint8_t type, const std::string& body )
+{
+    const auto length = body.size() + 1;
+
+    std::string wire{ '\x00', '\x83', static_cast<char>( length >> 8 ),
+                      static_cast<char>( length ), static_cast<char>( type ) };
+
+    return wire + body;
+}
+
+[[nodiscard]] std::string StringReply( const std::string& text )
+{
+    return Wire( 0x06, text + '\0' );
+}
+
+[[nodiscard]] std::string FloatReply( const float number )
+{
+    const auto bits = std::bit_cast<uint32_t>( number );
+    std::string body;
+
+    for ( size_t i = 0; i < 4; i++ )
+    {
+        body.push_back( static_cast<char>( bits >> ( i * 8 ) ) );
+    }
+
+    return Wire( 0x2A, body );
+}
+
+struct Expected final
+{
+    bt::EReplyType mType;
+    std::string mString;
+    float mFloat = 0;
+    std::string mBytes;
+};
+
+void CheckReply( const bt::Reply& reply, const Expected& expected )
+{
+    BT_CHECK( reply.mType == expected.mType );
+    BT_CHECK( reply.mString == expected.mString );
+    BT_CHECK( reply.mFloat == expected.mFloat );
+    BT_CHECK( reply.mBytes == expected.mBytes );
+}
+
+/// Feeds the wire bytes as a caller reading from a socket would: the chunks
+/// end at `splits`, and the bytes the decoder leaves unconsumed are fed again
+/// with the next chunk.
+[[nodiscard]] bt::EDecodeStatus FeedSplit( bt::Decoder& decoder,
+                                           const std::string& wire,
+                                           const std::vector<size_t>& splits,
+                                           std::string& buffer )
+{
+    buffer.clear();
+
+    size_t received = 0;
+    size_t consumed = 0;
+
+    for ( size_t i = 0; i <= splits.size(); i++ )
+    {
+        const auto end = i < splits.size() ? splits[i] : wire.size();
+
+        buffer.append( wire, received, end - received );
+        received = end;
+
+        const auto [status, used] = decoder.feed(
+            std::string_view{ buffer }.substr( consumed ) );
+
+        consumed += used;
+
+        if ( status != bt::EDecodeStatus::NeedMore )
+        {
+            BT_CHECK( consumed == received || status != bt::EDecodeStatus::Done );
+
+            return status;
+        }
+    }
+
+    return bt::EDecodeStatus::NeedMore;
+}
+
+void TestSplitAtEveryByte( const std::string& wire, const Expected& expected )
+{
+    std::string buffer;
+
+    for ( size_t split = 0; split <= wire.size(); split++ )
+    {
+        bt::Decoder decoder;
+
+        BT_CHECK( FeedSplit( decoder, wire, { split }, buffer ) ==
+                  bt::EDecodeStatus::Done );
+        CheckReply( decoder.reply(), expected );
+    }
+
+    // Every pair of splits of short replies, which covers a header split
+    // twice.
+    if ( wire.size() <= 64 )
+    {
+        for ( size_t first = 0; first <= wire.size(); first++ )
+        {
+            for ( size_t second = first; second <= wire.size(); second++ )
+            {
+                bt::Decoder decoder;
+
+                BT_CHECK( FeedSplit( decoder, wire, { first, second },
+                                     buffer ) == bt::EDecodeStatus::Done );
+                CheckReply( decoder.reply(), expected );
+            }
+        }
+    }
+
+    // One byte at a time.
+    std::vector<size_t> bytes;
+
+    for ( size_t i = 1; i < wire.size(); i++ )
+    {
+        bytes.push_back( i );
+    }
+
+    bt::Decoder decoder;
+
+    BT_CHECK( FeedSplit( decoder, wire, bytes, buffer ) ==
+              bt::EDecodeStatus::Done );
+    CheckReply( decoder.reply(), expected );
+}
+
+void TestReplies()
+{
+    TestSplitAtEveryByte( StringReply( "hello" ),
+                          Expected{ .mType = bt::EReplyType::String,
+                                    .mString = "hello",
+                                    .mBytes = std::string{ "hello" } + '\0' } );
+
+    TestSplitAtEveryByte( StringReply( "" ),
+                          Expected{ .mType = bt::EReplyType::String,
+                                    .mString = "",
+                                    .mBytes = std::string( 1, '\0' ) } );
+
+    // Without the trailing NUL the whole body is the string.
+    TestSplitAtEveryByte( Wire( 0x06, "abc" ),
+                          Expected{ .mType = bt::EReplyType::String,
+                                    .mString = "abc",
+                                    .mBytes = "abc" } );
+
+    TestSplitAtEveryByte( FloatReply( 1.5f ),
+                          Expected{ .mType = bt::EReplyType::Float,
+                                    .mFloat = 1.5f,
+                                    .mBytes = FloatReply( 1.5f ).substr( 5 ) } );
+
+    TestSplitAtEveryByte( Wire( 0x00, "" ),
+                          Expected{ .mType = bt::EReplyType::Null } );
+
+    // A type the decoder doesn't know keeps its body.
+    TestSplitAtEveryByte( Wire( 0x42, "raw" ),
+                          Expected{ .mType = static_cast<bt::EReplyType>( 0x42 ),
+                                    .mBytes = "raw" } );
+
+    const std::string large( 40000, 'x' );
+
+    TestSplitAtEveryByte( StringReply( large ),
+                          Expected{ .mType = bt::EReplyType::String,
+                                    .mString = large,
+                                    .mBytes = large + '\0' } );
+}
+
+void TestInvalid()
+{
+    std::string buffer;
+
+    // The magic is checked as soon as its two bytes are in.
+    for ( const auto& wire : { std::string{ "\x01\x83\x00\x01\x00", 5 },
+                               std::string{ "\x00\x84\x00\x01\x00", 5 } } )
+    {
+        for ( size_t split = 0; split <= wire.size(); split++ )
+        {
+            bt::Decoder decoder;
+
+            BT_CHECK( FeedSplit( decoder, wire, { split }, buffer ) ==
+                      bt::EDecodeStatus::InvalidMagic );
+        }
+    }
+
+    const std::string zeroLength{ "\x00\x83\x00\x00\x06", 5 };
+    const std::string shortFloat{ "\x00\x83\x00\x03\x2A\x00\x00", 7 };
+
+    for ( const auto& wire : { zeroLength, shortFloat } )
+    {
+        for ( size_t split = 0; split <= wire.size(); split++ )
+        {
+            bt::Decoder decoder;
+
+            BT_CHECK( FeedSplit( decoder, wire, { split }, buffer ) ==
+                      bt::EDecodeStatus::InvalidLength );
+        }
+    }
+
+    // A truncated reply is never done.
+    const auto wire = StringReply( "truncated" );
+
+    for ( size_t size = 0; size < wire.size(); size++ )
+    {
+        bt::Decoder decoder;
+
+        BT_CHECK( decoder.feed( std::string_view{ wire }.substr( 0, size ) )
+                      .mStatus == bt::EDecodeStatus::NeedMore );
+        BT_CHECK( decoder.in_progress() == ( size != 0 ) );
+    }
+}
+
+void TestBackToBack()
+{
+    // Replies on a reused connection arrive in one stream, the decoder
+    // starts over after each of them.
+    const auto stream =
+        StringReply( "one" ) + FloatReply( 2 ) + Wire( 0x00, "" );
+
+    bt::Decoder decoder;
+    std::string_view rest{ stream };
+
+    BT_CHECK( decoder.feed( rest ).mStatus == bt::EDecodeStatus::Done );
+    BT_CHECK( decoder.reply().mString == "one" );
+    rest.remove_prefix( StringReply( "one" ).size() );
+
+    BT_CHECK( decoder.feed( rest ).mStatus == bt::EDecodeStatus::Done );
+    BT_CHECK( decoder.reply().mFloat == 2 );
+    rest.remove_prefix( FloatReply( 2 ).size() );
+
+    const auto [status, consumed] = decoder.feed( rest );
+
+    BT_CHECK( status == bt::EDecodeStatus::Done );
+    BT_CHECK( consumed == rest.size() );
+    BT_CHECK( decoder.reply().mType == bt::EReplyType::Null );
+}
+
+} // namespace
+
+int main()
+{
+    TestReplies();
+    TestInvalid();
+    TestBackToBack();
+
+    return bttest::Finish();
+}
@@ -0,0 +1,336 @@
+//-----------------------------------------------------------------------------
+// Copyright 2024 Igor Spichkin
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//-----------------------------------------------------------------------------
+
+// Runs bt-mockd, the path is the first argument, and talks to it over its
+// Unix socket: scripted replies, kept-alive and closed connections, and the
+// failure modes.
+
+#include "bt/bt.hpp"
+#include "check.hpp"
+#include "process.hpp"
+#include <array>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <optional>
+#include <poll.h>
+#include <string>
+#include <string_view>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+using namespace std::chrono_literals;
+
+namespace
+{
+
+/// A client connection to the Unix socket.
+class CClient final
+{
+  public:
+    explicit CClient( const std::string& path ) noexcept
+    {
+        sockaddr_un address{ .sun_family = AF_UNIX };
+        std::memcpy( address.sun_path, path.c_str(), path.size() );
+
+        // The server may still be starting up.
+        for ( int attempt = 0; attempt < 500; attempt++ )
+        {
+            mSocket = socket( AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0 );
+
+            if ( connect( mSocket, reinterpret_cast<sockaddr*>( &address ),
+                          sizeof( address ) ) == 0 )
+            {
+                return;
+            }
+
+            close( mSocket );
+            mSocket = -1;
+
+            std::this_thread::sleep_for( 10ms );
+        }
+    }
+
+    ~CClient()
+    {
+        if ( mSocket != -1 )
+        {
+            close( mSocket );
+        }
+    }
+
+    CClient( const CClient& ) = delete;
+    CClient& operator=( const CClient& ) = delete;
+
+    [[nodiscard]] bool Connected() const noexcept
+    {
+        return mSocket != -1;
+    }
+
+    [[nodiscard]] bool Send( const std::string_view topic ) const noexcept
+    {
+        const auto [result, packet] = bt::encode( topic );
+
+        return result == bt::EResult::Ok &&
+               send( mSocket, packet.data(), packet.size(), MSG_NOSIGNAL ) ==
+                   static_cast<ssize_t>( packet.size() );
+    }
+
+    /// Reads until the decoder is done, fails or the connection closes.
+    /// \returns the status of the decoder, NeedMore if the connection closed
+    /// or nothing came in time.
+    [[nodiscard]] bt::EDecodeStatus Receive( bt::Decoder& decoder ) noexcept
+    {
+        while ( true )
+        {
+            if ( mConsumed != mBuffer.size() )
+            {
+                const auto [status, used] = decoder.feed(
+                    std::string_view{ mBuffer }.substr( mConsumed ) );
+
+                mConsumed += used;
+
+                if ( status != bt::EDecodeStatus::NeedMore )
+                {
+                    return status;
+                }
+            }
+
+            if ( !Read() )
+            {
+                return bt::EDecodeStatus::NeedMore;
+            }
+        }
+    }
+
+    /// \returns true if the server closed the connection with no more bytes.
+    [[nodiscard]] bool Closed() noexcept
+    {
+        return mConsumed == mBuffer.size() && !Read();
+    }
+
+  private:
+    /// Appends what is received, the decoder needs the unconsumed bytes of
+    /// the reply in one piece.
+    [[nodiscard]] bool Read() noexcept
+    {
+        pollfd fd{ .fd = mSocket, .events = POLLIN };
+
+        if ( poll( &fd, 1, 5000 ) != 1 )
+        {
+            return false;
+        }
+
+        std::array<char, 4096> chunk;
+        const auto received = recv( mSocket, chunk.data(), chunk.size(), 0 );
+
+        if ( received <= 0 )
+        {
+            return false;
+        }
+
+        mBuffer.erase( 0, mConsumed );
+        mConsumed = 0;
+        mBuffer.append( chunk.data(), static_cast<size_t>( received ) );
+
+        return true;
+    }
+
+    int mSocket = -1;
+    std::string mBuffer;
+    size_t mConsumed = 0;
+};
+
+/// \returns the decoded reply to the topic, nullopt if it didn't come.
+[[nodiscard]] std::optional<bt::Reply> Query( CClient& client,
+                                              const std::string_view topic,
+                                              bt::Decoder& decoder )
+{
+    if ( !client.Send( topic ) ||
+         client.Receive( decoder ) != bt::EDecodeStatus::Done )
+    {
+        return std::nullopt;
+    }
+
+    return decoder.reply();
+}
+
+void TestScript( const std::string& mockd, const std::string& directory )
+{
+    const auto script = directory + "/script";
+    const auto socket = directory + "/script.sock";
+
+    std::ofstream{ script } << "# Scripted replies\n"
+                               "?ping      float 1.5\n"
+                               "?status*   string version=1&players=0\n"
+                               "?shutdown  null\n";
+
+    const bttest::CProcess server{ mockd,
+                         { "--listen", "127.0.0.1:0", "--unix", socket,
+                           "--script", script, "--threads", "2" } };
+
+    BT_CHECK( server.Started() );
+
+    CClient client{ socket };
+
+    BT_CHECK( client.Connected() );
+
+    if ( !client.Connected() )
+    {
+        return;
+    }
+
+    // All of them on one kept-alive connection.
+    bt::Decoder decoder;
+
+    const auto ping = Query( client, "?ping", decoder );
+
+    BT_CHECK( ping && ping->mType == bt::EReplyType::Float &&
+              ping->mFloat == 1.5f );
+
+    const auto status = Query( client, "?status&verbose", decoder );
+
+    BT_CHECK( status && status->mType == bt::EReplyType::String &&
+              status->mString == "version=1&players=0" );
+
+    const auto shutdown = Query( client, "?shutdown", decoder );
+
+    BT_CHECK( shutdown && shutdown->mType == bt::EReplyType::Null );
+
+    // Topics that match no rule are echoed.
+    const auto echo = Query( client, "?unscripted", decoder );
+
+    BT_CHECK( echo && echo->mType == bt::EReplyType::String &&
+              echo->mString == "?unscripted" );
+
+    // Pipelined topics are answered in order.
+    const std::array topics{ "?ping", "?a", "?b", "?shutdown" };
+
+    for ( const auto* topic : topics )
+    {
+        BT_CHECK( client.Send( topic ) );
+    }
+
+    for ( const auto* topic : topics )
+    {
+        BT_CHECK( client.Receive( decoder ) == bt::EDecodeStatus::Done );
+
+        if ( topic == std::string_view{ "?ping" } )
+        {
+            BT_CHECK( decoder.reply().mType == bt::EReplyType::Float );
+        }
+        else if ( topic == std::string_view{ "?shutdown" } )
+        {
+            BT_CHECK( decoder.reply().mType == bt::EReplyType::Null );
+        }
+        else
+        {
+            BT_CHECK( decoder.reply().mString == topic );
+        }
+    }
+
+    // A large reply, past the size of one read.
+    const std::string large = "?" + std::string( 30000, 'x' );
+    const auto echoed = Query( client, large, decoder );
+
+    BT_CHECK( echoed && echoed->mString == large );
+}
+
+void TestClose( const std::string& mockd, const std::string& directory )
+{
+    const auto socket = directory + "/close.sock";
+    const bttest::CProcess server{ mockd,
+                         { "--listen", "127.0.0.1:0", "--unix", socket,
+                           "--reply", "string closing", "--close",
+                           "--threads", "1" } };
+
+    BT_CHECK( server.Started() );
+
+    CClient client{ socket };
+    bt::Decoder decoder;
+
+    const auto reply = Query( client, "?anything", decoder );
+
+    BT_CHECK( reply && reply->mString == "closing" );
+    BT_CHECK( client.Closed() );
+}
+
+void TestFailures( const std::string& mockd, const std::string& directory )
+{
+    struct Case final
+    {
+        const char* mMode;
+        bt::EDecodeStatus mStatus;
+    };
+
+    // Closed and truncated replies never finish.
+    const std::array cases{
+        Case{ "close", bt::EDecodeStatus::NeedMore },
+        Case{ "truncate", bt::EDecodeStatus::NeedMore },
+        Case{ "garbage", bt::EDecodeStatus::InvalidMagic },
+    };
+
+    for ( const auto& [mode, expected] : cases )
+    {
+        const auto socket = directory + "/" + mode + ".sock";
+        const bttest::CProcess server{ mockd,
+                             { "--listen", "127.0.0.1:0", "--unix", socket,
+                               "--fail", "1", "--fail-mode", mode,
+                               "--threads", "1" } };
+
+        BT_CHECK( server.Started() );
+
+        CClient client{ socket };
+        bt::Decoder decoder;
+
+        BT_CHECK( client.Send( "?fails" ) );
+        BT_CHECK( client.Receive( decoder ) == expected );
+    }
+}
+
+} // namespace
+
+int main( const int argc, const char* argv[] )
+{
+    if ( argc != 2 )
+    {
+        std::cerr << "Usage: mockd_test <BT-MOCKD>\n";
+
+        return 2;
+    }
+
+    std::string directory = "/tmp/bt-mockd-test-XXXXXX";
+
+    if ( mkdtemp( directory.data() ) == nullptr )
+    {
+        std::cerr << "Can't create a temporary directory\n";
+
+        return 2;
+    }
+
+    TestScript( argv[1], directory );
+    TestClose( argv[1], directory );
+    TestFailures( argv[1], directory );
+
+    std::filesystem::remove_all( directory );
+
+    return bttest::Finish();
+}
@@ -0,0 +1,170 @@
+//-----------------------------------------------------------------------------
+// Copyright 2024 Igor Spichkin
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//-----------------------------------------------------------------------------
+
+// Built twice: as it is, with the SIMD code where the target has it, and with
+// BT_NO_SIMD. Both builds compare against the same byte-by-byte reference.
+
+#include "bt/bt.hpp"
+#include "check.hpp"
+#include <array>
+#include <cstdint>
+#include <random>
+#include <string>
+#include <string_view>
+
+namespace
+{
+
+/// Percent-encodes one byte at a time, as RFC 3986 describes it.
+[[nodiscard]] std::string Reference( const std::string_view text )
+{
+    constexpr std::string_view digits = "0123456789ABCDEF";
+    std::string encoded;
+
+    for ( const char c : text )
+    {
+        const auto byte = static_cast<uint8_t>( c );
+
+        if ( ( c >= 'a' && c <= 'z' ) || ( c >= 'A' && c <= 'Z' ) ||
+             ( c >= '0' && c <= '9' ) || c == '-' || c == '.' || c == '_' ||
+             c == '~' )
+        {
+            encoded += c;
+        }
+        else
+        {
+            encoded += '%';
+            encoded += digits[byte >> 4];
+            encoded += digits[byte & 0x0F];
+        }
+    }
+
+    return encoded;
+}
+
+/// Encodes at compile time, which always takes the scalar code.
+template <size_t Size>
+[[nodiscard]] constexpr std::array<char, Size * 3>
+EncodeConstant( const char ( &text )[Size] )
+{
+    std::array<char, Size * 3> dst{};
+    static_cast<void>( bt::percent_encode_into(
+        dst, std::string_view{ text, Size - 1 } ) );
+
+    return dst;
+}
+
+static_assert( std::string_view{ EncodeConstant( "a b/c~" ).data() } ==
+               "a%20b%2Fc~" );
+
+void Check( const std::string& text )
+{
+    const auto expected = Reference( text );
+    std::string dst( expected.size() + 64, '\xFF' );
+
+    const auto [result, size] = bt::percent_encode_into( dst, text );
+
+    BT_CHECK( result == bt::EResult::Ok );
+    BT_CHECK( std::string_view{ dst }.substr( 0, size ) == expected );
+
+    // Exactly enough room, and one byte less at every size below it.
+    std::string exact( expected.size(), '\0' );
+
+    BT_CHECK( bt::percent_encode_into( exact, text ) ==
+              std::make_pair( bt::EResult::Ok, expected.size() ) );
+    BT_CHECK( exact == expected );
+
+    for ( size_t room = 0; room < expected.size(); room++ )
+    {
+        std::string small( room, '\0' );
+
+        BT_CHECK( bt::percent_encode_into( small, text ).first ==
+                  bt::EResult::BufferTooSmall );
+    }
+
+    // Decoding gives the text back.
+    std::string decoded( expected.size(), '\0' );
+    const auto [decodeResult, decodedSize] =
+        bt::percent_decode_into( decoded, expected );
+
+    BT_CHECK( decodeResult == bt::EResult::Ok );
+    BT_CHECK( std::string_view{ decoded }.substr( 0, decodedSize ) == text );
+}
+
+void TestEdges()
+{
+    Check( "" );
+    Check( "a" );
+    Check( " " );
+    Check( "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789-._~" );
+    Check( "?ban&ckey=Some Player&reason=100% \"grief\"" );
+
+    // Every byte alone, and at every position of a block of every width.
+    for ( int byte = 0; byte < 256; byte++ )
+    {
+        Check( std::string( 1, static_cast<char>( byte ) ) );
+
+        for ( size_t position = 0; position < 64; position++ )
+        {
+            std::string text( 64, 'a' );
+            text[position] = static_cast<char>( byte );
+
+            Check( text );
+        }
+    }
+}
+
+void TestRandom()
+{
+    std::mt19937 random{ 2506 };
+    constexpr std::string_view unreserved = "abcXYZ019-._~";
+
+    for ( int i = 0; i < 5000; i++ )
+    {
+        const auto length = std::uniform_int_distribution<size_t>{ 0, 200 }(
+            random );
+        // From all bytes to none needing an escape.
+        const auto escapeRate =
+            std::uniform_real_distribution<double>{ 0, 1 }( random );
+
+        std::string text;
+
+        for ( size_t j = 0; j < length; j++ )
+        {
+            if ( std::bernoulli_distribution{ escapeRate }( random ) )
+            {
+                text += static_cast<char>(
+                    std::uniform_int_distribution<int>{ 0, 255 }( random ) );
+            }
+            else
+            {
+                text += unreserved[std::uniform_int_distribution<size_t>{
+                    0, unreserved.size() - 1 }( random )];
+            }
+        }
+
+        Check( text );
+    }
+}
+
+} // namespace
+
+int main()
+{
+    TestEdges();
+    TestRandom();
+
+    return bttest::Finish();
+}
@@ -0,0 +1,181 @@
+//-----------------------------------------------------------------------------
+// Copyright 2024 Igor Spichkin
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//-----------------------------------------------------------------------------
+
+#pragma once
+
+#include <array>
+#include <csignal>
+#include <fcntl.h>
+#include <spawn.h>
+#include <string>
+#include <string_view>
+#include <sys/wait.h>
+#include <thread>
+#include <unistd.h>
+#include <utility>
+#include <vector>
+
+namespace bttest
+{
+
+/// A child process, killed with the object unless it was waited for.
+class CProcess final
+{
+  public:
+    /// \param pipes connect the stdin and the stdout of the process to
+    /// `Communicate`.
+    CProcess( const std::string& path, std::vector<std::string> args,
+              const bool pipes = false )
+    {
+        std::vector<char*> argv{ const_cast<char*>( path.c_str() ) };
+
+        for ( auto& arg : args )
+        {
+            argv.push_back( arg.data() );
+        }
+
+        argv.push_back( nullptr );
+
+        std::array<int, 2> input{ -1, -1 };
+        std::array<int, 2> output{ -1, -1 };
+
+        if ( pipes &&
+             ( pipe2( input.data(), O_CLOEXEC ) != 0 ||
+               pipe2( output.data(), O_CLOEXEC ) != 0 ) )
+        {
+            return;
+        }
+
+        posix_spawn_file_actions_t actions;
+        posix_spawn_file_actions_init( &actions );
+
+        if ( pipes )
+        {
+            posix_spawn_file_actions_adddup2( &actions, input[0], 0 );
+            posix_spawn_file_actions_adddup2( &actions, output[1], 1 );
+        }
+
+        if ( posix_spawn( &mPid, path.c_str(), &actions, nullptr, argv.data(),
+                          environ ) != 0 )
+        {
+            mPid = -1;
+        }
+
+        posix_spawn_file_actions_destroy( &actions );
+
+        if ( pipes )
+        {
+            close( input[0] );
+            close( output[1] );
+
+            mInput = input[1];
+            mOutput = output[0];
+        }
+    }
+
+    ~CProcess()
+    {
+        CloseInput();
+
+        if ( mOutput != -1 )
+        {
+            close( mOutput );
+        }
+
+        if ( mPid > 0 )
+        {
+            kill( mPid, SIGKILL );
+            waitpid( mPid, nullptr, 0 );
+        }
+    }
+
+    CProcess( const CProcess& ) = delete;
+    CProcess& operator=( const CProcess& ) = delete;
+
+    [[nodiscard]] bool Started() const noexcept
+    {
+        return mPid > 0;
+    }
+
+    /// Writes the input to stdin and closes it, reads stdout until eof and
+    /// waits for the process to exit.
+    /// \returns the exit code, -1 if the process didn't exit by itself.
+    [[nodiscard]] int Communicate( const std::string_view input,
+                                   std::string& output )
+    {
+        if ( mPid <= 0 || mOutput == -1 )
+        {
+            return -1;
+        }
+
+        // Both at once, or a process that answers line by line would fill
+        // the stdout pipe while the input is still being written.
+        std::thread writer{ [&]
+                            {
+                                size_t written = 0;
+
+                                while ( written != input.size() )
+                                {
+                                    const auto bytes = write(
+                                        mInput, input.data() + written,
+                                        input.size() - written );
+
+                                    if ( bytes <= 0 )
+                                    {
+                                        break;
+                                    }
+
+                                    written += static_cast<size_t>( bytes );
+                                }
+
+                                CloseInput();
+                            } };
+
+        std::array<char, 4096> chunk;
+        ssize_t bytes = 0;
+
+        while ( ( bytes = read( mOutput, chunk.data(), chunk.size() ) ) > 0 )
+        {
+            output.append( chunk.data(), static_cast<size_t>( bytes ) );
+        }
+
+        writer.join();
+
+        int status = 0;
+        const auto pid = std::exchange( mPid, -1 );
+
+        if ( waitpid( pid, &status, 0 ) != pid || !WIFEXITED( status ) )
+        {
+            return -1;
+        }
+
+        return WEXITSTATUS( status );
+    }
+
+  private:
+    void CloseInput() noexcept
+    {
+        if ( mInput != -1 )
+        {
+            close( std::exchange( mInput, -1 ) );
+        }
+    }
+
+    pid_t mPid = -1;
+    int mInput = -1;
+    int mOutput = -1;
+};
+
+} // namespace bttest
@@ -0,0 +1,225 @@
+//-----------------------------------------------------------------------------
+// Copyright 2024 Igor Spichkin
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//-----------------------------------------------------------------------------
+
+#include "check.hpp"
+#include "mpsc_queue.hpp"
+#include "work_queue.hpp"
+#include <atomic>
+#include <cstddef>
+#include <memory>
+#include <thread>
+#include <utility>
+#include <vector>
+
+namespace
+{
+
+void TestMpscSingleThread()
+{
+    btcmd::CMpscQueue<int> queue;
+
+    BT_CHECK( !queue.TryPop() );
+
+    queue.Push( 1 );
+    queue.Push( 2 );
+
+    BT_CHECK( queue.TryPop() == 1 );
+
+    queue.Push( 3 );
+
+    BT_CHECK( queue.TryPop() == 2 );
+    BT_CHECK( queue.TryPop() == 3 );
+    BT_CHECK( !queue.TryPop() );
+
+    // The values left in the queue are destroyed with it.
+    btcmd::CMpscQueue<std::unique_ptr<int>> owning;
+    owning.Push( std::make_unique<int>( 1 ) );
+    owning.Push( std::make_unique<int>( 2 ) );
+}
+
+void TestMpscStress()
+{
+    constexpr size_t producerCount = 8;
+    constexpr size_t valueCount = 100000;
+
+    btcmd::CMpscQueue<std::pair<size_t, size_t>> queue;
+    std::atomic<size_t> running = producerCount;
+    std::vector<std::thread> producers;
+
+    for ( size_t producer = 0; producer < producerCount; producer++ )
+    {
+        producers.emplace_back(
+            [&, producer]
+            {
+                for ( size_t value = 0; value < valueCount; value++ )
+                {
+                    queue.Push( { producer, value } );
+                }
+
+                if ( --running == 0 )
+                {
+                    queue.Close();
+                }
+            } );
+    }
+
+    // Every value arrives once, and in the order its producer pushed it.
+    std::vector<size_t> next( producerCount, 0 );
+    size_t popped = 0;
+
+    while ( const auto item = queue.Pop() )
+    {
+        const auto [producer, value] = *item;
+
+        BT_CHECK( producer < producerCount );
+
+        if ( producer < producerCount )
+        {
+            BT_CHECK( value == next[producer] );
+            next[producer] = value + 1;
+        }
+
+        popped++;
+    }
+
+    for ( auto& producer : producers )
+    {
+        producer.join();
+    }
+
+    BT_CHECK( popped == producerCount * valueCount );
+
+    for ( const auto count : next )
+    {
+        BT_CHECK( count == valueCount );
+    }
+
+    // Closed and empty stays empty.
+    BT_CHECK( !queue.Pop() );
+}
+
+void TestWorkQueue( const size_t count, const size_t workerCount )
+{
+    btcmd::CWorkQueue queue{ count, workerCount };
+    std::unique_ptr<std::atomic<size_t>[]> taken{
+        new std::atomic<size_t>[count]{} };
+    std::atomic<size_t> outOfRange = 0;
+    std::vector<std::thread> workers;
+
+    for ( size_t worker = 0; worker < workerCount; worker++ )
+    {
+        workers.emplace_back(
+            [&, worker]
+            {
+                size_t index = 0;
+
+                while ( queue.Pop( worker, index ) )
+                {
+                    if ( index < count )
+                    {
+                        taken[index]++;
+                    }
+                    else
+                    {
+                        outOfRange++;
+                    }
+                }
+            } );
+    }
+
+    for ( auto& worker : workers )
+    {
+        worker.join();
+    }
+
+    // Every index is handed out exactly once, whoever ends up taking it.
+    BT_CHECK( outOfRange == 0 );
+
+    for ( size_t index = 0; index < count; index++ )
+    {
+        BT_CHECK( taken[index] == 1 );
+    }
+}
+
+void TestWorkQueueUneven()
+{
+    // Worker 0 takes nothing until the others have stolen its shard dry, so
+    // all of it goes through Steal().
+    constexpr size_t count = 10000;
+    constexpr size_t workerCount = 4;
+
+    btcmd::CWorkQueue queue{ count, workerCount };
+    std::vector<size_t> taken( count, 0 );
+    std::vector<std::vector<size_t>> perWorker( workerCount );
+    std::vector<std::thread> workers;
+
+    for ( size_t worker = 1; worker < workerCount; worker++ )
+    {
+        workers.emplace_back(
+            [&, worker]
+            {
+                size_t index = 0;
+
+                while ( queue.Pop( worker, index ) )
+                {
+                    perWorker[worker].push_back( index );
+                }
+            } );
+    }
+
+    for ( auto& worker : workers )
+    {
+        worker.join();
+    }
+
+    size_t index = 0;
+
+    BT_CHECK( !queue.Pop( 0, index ) );
+
+    for ( const auto& indices : perWorker )
+    {
+        for ( const auto takenIndex : indices )
+        {
+            BT_CHECK( takenIndex < count );
+
+            if ( takenIndex < count )
+            {
+                taken[takenIndex]++;
+            }
+        }
+    }
+
+    for ( const auto times : taken )
+    {
+        BT_CHECK( times == 1 );
+    }
+}
+
+} // namespace
+
+int main()
+{
+    TestMpscSingleThread();
+    TestMpscStress();
+
+    TestWorkQueue( 0, 4 );
+    TestWorkQueue( 1, 4 );
+    TestWorkQueue( 3, 8 );
+    TestWorkQueue( 100000, 1 );
+    TestWorkQueue( 100000, 8 );
+    TestWorkQueueUneven();
+
+    return bttest::Finish();
+}
@@ -0,0 +1,154 @@
+//-----------------------------------------------------------------------------
+// Copyright 2024 Igor Spichkin
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//-----------------------------------------------------------------------------
+
+// Pipes topics into `bt --stdin`, the path is the first argument, against
+// bt-mockd, the second one, with and without kept-alive connections.
+
+#include "check.hpp"
+#include "process.hpp"
+#include <chrono>
+#include <csignal>
+#include <cstdint>
+#include <iostream>
+#include <netinet/in.h>
+#include <string>
+#include <sys/socket.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+using namespace std::chrono_literals;
+
+namespace
+{
+
+[[nodiscard]] sockaddr_in Loopback( const uint16_t port ) noexcept
+{
+    sockaddr_in address{};
+    address.sin_family = AF_INET;
+    address.sin_port = htons( port );
+    address.sin_addr.s_addr = htonl( INADDR_LOOPBACK );
+
+    return address;
+}
+
+/// \returns a port nothing listens on right now, 0 on error.
+[[nodiscard]] uint16_t FreePort() noexcept
+{
+    const auto listener = socket( AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0 );
+    auto address = Loopback( 0 );
+    socklen_t length = sizeof( address );
+
+    const bool bound =
+        bind( listener, reinterpret_cast<sockaddr*>( &address ),
+              sizeof( address ) ) == 0 &&
+        getsockname( listener, reinterpret_cast<sockaddr*>( &address ),
+                     &length ) == 0;
+
+    close( listener );
+
+    return bound ? ntohs( address.sin_port ) : 0;
+}
+
+/// Waits for the server to start up.
+/// \returns false if it doesn't accept connections in 5s.
+[[nodiscard]] bool WaitListening( const uint16_t port ) noexcept
+{
+    const auto address = Loopback( port );
+
+    for ( int attempt = 0; attempt < 500; attempt++ )
+    {
+        const auto probe = socket( AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0 );
+        const bool connected =
+            connect( probe, reinterpret_cast<const sockaddr*>( &address ),
+                     sizeof( address ) ) == 0;
+
+        close( probe );
+
+        if ( connected )
+        {
+            return true;
+        }
+
+        std::this_thread::sleep_for( 10ms );
+    }
+
+    return false;
+}
+
+void TestStdin( const std::string& bt, const std::string& mockd,
+                const bool closing )
+{
+    const auto port = FreePort();
+
+    BT_CHECK( port != 0 );
+
+    const auto address = "127.0.0.1:" + std::to_string( port );
+
+    std::vector<std::string> args{ "--listen", address, "--threads", "1" };
+
+    if ( closing )
+    {
+        args.emplace_back( "--close" );
+    }
+
+    const bttest::CProcess server{ mockd, std::move( args ) };
+
+    BT_CHECK( server.Started() );
+
+    if ( !WaitListening( port ) )
+    {
+        BT_CHECK( !"bt-mockd is not listening" );
+
+        return;
+    }
+
+    // All at once, so each topic goes out right after the previous reply:
+    // against --close that is before its FIN arrives.
+    std::string input;
+
+    for ( size_t i = 0; i < 500; i++ )
+    {
+        input += "?topic=" + std::to_string( i ) + '\n';
+    }
+
+    bttest::CProcess client{ bt, { address, "--stdin" }, true };
+    std::string output;
+
+    BT_CHECK( client.Communicate( input, output ) == 0 );
+
+    // Every topic is echoed, in order, none failed.
+    BT_CHECK( output == input );
+}
+
+} // namespace
+
+int main( const int argc, const char* argv[] )
+{
+    if ( argc != 3 )
+    {
+        std::cerr << "Usage: session_test <BT> <BT-MOCKD>\n";
+
+        return 2;
+    }
+
+    // A client that exits early must not take the test down with it.
+    std::signal( SIGPIPE, SIG_IGN );
+
+    TestStdin( argv[1], argv[2], false );
+    TestStdin( argv[1], argv[2], true );
+
+    return bttest::Finish();
+}